@@ -6,7 +6,9 @@
 #ifndef PPLUA_OUTPUT_BUFFER_HPP
 #define PPLUA_OUTPUT_BUFFER_HPP
 
+#include <algorithm>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <vector>
 #include <map>
@@ -22,28 +24,59 @@ public:
     OutputBuffer() = default;
 
     /// Append raw text (no trailing newline).
-    void write(const std::string& text) { buf_ << text; }
+    void write(std::string_view text) {
+        buf_.append(text);
+        if (!text.empty()) {
+            lines_ += static_cast<std::size_t>(
+                std::count(text.begin(), text.end(), '\n'));
+            at_bol_ = text.back() == '\n';
+        }
+    }
 
     /// Append raw text followed by exactly one newline.
-    void writeln(const std::string& text) { buf_ << text << '\n'; }
+    void writeln(std::string_view text) {
+        write(text);
+        blank_line();
+    }
 
     /// Append a bare newline (blank line = paragraph break in groff).
-    void blank_line() { buf_ << '\n'; }
+    void blank_line() { buf_ += '\n'; ++lines_; at_bol_ = true; }
 
     /// Return everything accumulated so far.
-    std::string contents() const { return buf_.str(); }
+    std::string contents() const { return buf_; }
 
-    /// Discard all accumulated text.
-    void clear() {
-        buf_.str("");
-        buf_.clear();           // clear error flags too
+    /// Return everything accumulated so far and discard it.
+    std::string take() {
+        std::string text;
+        text.swap(buf_);
+        return text;
     }
 
-    bool  empty() const { return buf_.str().empty(); }
-    std::size_t size() const { return buf_.str().size(); }
+    /// Move everything accumulated so far into `out`, dropping what
+    /// `out` held.  The buffers trade storage, so a caller that
+    /// keeps `out` for the next call settles into reusing two
+    /// buffers instead of allocating.
+    void take_into(std::string& out) {
+        out.clear();
+        out.swap(buf_);
+    }
+
+    /// Discard all accumulated text.
+    void clear() { buf_.clear(); }
+
+    bool  empty() const { return buf_.empty(); }
+    std::size_t size() const { return buf_.size(); }
+
+    /// Newlines written since construction (clear() does not reset
+    /// this), and whether the last write ended a line.  The engine
+    /// uses them to keep .lf in step without looking at the text.
+    std::size_t lines()  const { return lines_; }
+    bool        at_bol() const { return at_bol_; }
 
 private:
-    std::ostringstream buf_;
+    std::string buf_;
+    std::size_t lines_  = 0;
+    bool        at_bol_ = true;
 };
 
 // =====================================================================
@@ -108,6 +141,12 @@ public:
         divs_.erase(name);
     }
 
+    /// Drop every diversion and the diversion stack.
+    void reset() {
+        stack_.clear();
+        divs_.clear();
+    }
+
     bool        is_diverting()  const { return !stack_.empty(); }
     std::string current_name()  const {
         return stack_.empty() ? "" : stack_.back();
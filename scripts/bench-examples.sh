@@ -0,0 +1,98 @@
+#!/usr/bin/env bash
+# =========================================================================
+#  bench-examples.sh — Time one or more pplua binaries over the
+#                      examples corpus.
+#
+#  Usage:
+#      ./bench-examples.sh [OPTIONS] [file ...]
+#
+#  Options:
+#      -P PPLUA     pplua binary to measure (repeatable; default: pplua)
+#      -r RUNS      Runs per file and binary (default: 20)
+#      -h           Print help and exit
+#
+#  If no files are given, all examples/*.lroff next to this script
+#  are used.  Each binary is reported under the Lua runtime it was
+#  built against, so a Lua 5.4 and a LuaJIT build (-DPPLUA_LUAJIT=ON)
+#  can be compared side by side:
+#
+#      ./bench-examples.sh -P build/pplua -P build-jit/pplua
+# =========================================================================
+
+set -euo pipefail
+
+RUNS=20
+declare -a BINARIES=()
+
+usage() {
+    cat <<'EOF'
+Usage: bench-examples.sh [OPTIONS] [file ...]
+
+Options:
+    -P PPLUA     pplua binary to measure (repeatable; default: pplua)
+    -r RUNS      Runs per file and binary (default: 20)
+    -h           Print help and exit
+
+If no files are given, all examples/*.lroff are used.
+EOF
+}
+
+while getopts ":P:r:h" opt; do
+    case "$opt" in
+        P) BINARIES+=("$OPTARG") ;;
+        r) RUNS="$OPTARG" ;;
+        h) usage; exit 0 ;;
+        :) echo "Option -$OPTARG requires an argument." >&2; exit 1 ;;
+        *) echo "Unknown option: -$OPTARG" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+[[ ${#BINARIES[@]} -gt 0 ]] || BINARIES=("pplua")
+
+declare -a FILES=()
+if [[ $# -gt 0 ]]; then
+    FILES=("$@")
+else
+    here="$(cd "$(dirname "$0")" && pwd)"
+    FILES=("$here"/../examples/*.lroff)
+fi
+
+now_ns() { date +%s%N; }
+ms()     { awk -v ns="$1" -v n="$RUNS" 'BEGIN { printf "%19.2f ms", ns / n / 1e6 }'; }
+
+# Column heading: the Lua runtime the binary was built against.
+runtime_of() {
+    printf '.lua\nreturn jit and jit.version or _VERSION\n.endlua\n' \
+        | "$1" -n 2>/dev/null || echo "?"
+}
+
+printf '%-28s' "file"
+for bin in "${BINARIES[@]}"; do
+    printf '%22s' "$(runtime_of "$bin")"
+done
+printf '\n'
+
+declare -a TOTALS=()
+for f in "${FILES[@]}"; do
+    printf '%-28s' "$(basename "$f")"
+    for i in "${!BINARIES[@]}"; do
+        bin="${BINARIES[$i]}"
+        dir="$(dirname "$f")"
+        start=$(now_ns)
+        for ((r = 0; r < RUNS; r++)); do
+            (cd "$dir" && "$bin" -D SEED=42 "$(basename "$f")") \
+                > /dev/null 2>&1 || true
+        done
+        elapsed=$(( $(now_ns) - start ))
+        TOTALS[$i]=$(( ${TOTALS[$i]:-0} + elapsed ))
+        ms "$elapsed"
+    done
+    printf '\n'
+done
+
+printf '%-28s' "total"
+for i in "${!BINARIES[@]}"; do
+    ms "${TOTALS[$i]}"
+done
+printf '\n'
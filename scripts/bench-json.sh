@@ -0,0 +1,177 @@
+#!/usr/bin/env bash
+# =========================================================================
+#  bench-json.sh — Compare lroff.json with a pure-Lua JSON decoder.
+#
+#  Usage:
+#      ./bench-json.sh [OPTIONS]
+#
+#  Options:
+#      -P PPLUA     pplua binary to measure (default: pplua)
+#      -n RECORDS   Records in the generated document (default: 200000)
+#      -r RUNS      Runs per case (default: 3)
+#      -h           Print help and exit
+#
+#  The document is an array of small objects.  Each case loads it and
+#  reads one field from the last record:
+#
+#      pure-lua  a straightforward recursive-descent decoder in Lua,
+#                the kind of library users load with require()
+#      eager     lroff.json.load(path, { eager = true })
+#      lazy      lroff.json.load(path)
+# =========================================================================
+
+set -euo pipefail
+
+PPLUA="pplua"
+RECORDS=200000
+RUNS=3
+
+usage() {
+    cat <<'EOF'
+Usage: bench-json.sh [OPTIONS]
+
+Options:
+    -P PPLUA     pplua binary to measure (default: pplua)
+    -n RECORDS   Records in the generated document (default: 200000)
+    -r RUNS      Runs per case (default: 3)
+    -h           Print help and exit
+EOF
+}
+
+while getopts ":P:n:r:h" opt; do
+    case "$opt" in
+        P) PPLUA="$OPTARG" ;;
+        n) RECORDS="$OPTARG" ;;
+        r) RUNS="$OPTARG" ;;
+        h) usage; exit 0 ;;
+        :) echo "Option -$OPTARG requires an argument." >&2; exit 1 ;;
+        *) echo "Unknown option: -$OPTARG" >&2; exit 1 ;;
+    esac
+done
+
+command -v "$PPLUA" >/dev/null 2>&1 || { echo "pplua not found at '$PPLUA'" >&2; exit 1; }
+
+WORK="$(mktemp -d)"
+trap 'rm -rf "$WORK"' EXIT
+
+awk -v n="$RECORDS" 'BEGIN {
+    printf "[\n"
+    for (i = 0; i < n; i++) {
+        printf "  {\"id\": %d, \"name\": \"item \\\"%d\\\"\", \"price\": %d.%02d, " \
+               "\"tags\": [\"alpha\", \"beta\"], \"active\": %s, \"note\": null}%s\n",
+               i, i, i % 1000, i % 100, (i % 2 ? "true" : "false"),
+               (i + 1 < n ? "," : "")
+    }
+    printf "]\n"
+}' > "$WORK/data.json"
+
+cat > "$WORK/purejson.lua" <<'EOF'
+-- Minimal recursive-descent JSON decoder (the baseline).
+local M = {}
+local sub, find = string.sub, string.find
+local escapes = { b = "\b", f = "\f", n = "\n", r = "\r", t = "\t" }
+
+local function ws(s, i) return find(s, "[^ \t\r\n]", i) or #s + 1 end
+
+local value
+
+local function str(s, i)
+    local out, j = {}, i + 1
+    while true do
+        local k = find(s, '["\\]', j)
+        out[#out + 1] = sub(s, j, k - 1)
+        if sub(s, k, k) == '"' then return table.concat(out), k + 1 end
+        local e = sub(s, k + 1, k + 1)
+        if e == "u" then
+            out[#out + 1] = utf8.char(tonumber(sub(s, k + 2, k + 5), 16))
+            j = k + 6
+        else
+            out[#out + 1] = escapes[e] or e
+            j = k + 2
+        end
+    end
+end
+
+function value(s, i)
+    i = ws(s, i)
+    local c = sub(s, i, i)
+    if c == "{" then
+        local t = {}
+        i = ws(s, i + 1)
+        if sub(s, i, i) == "}" then return t, i + 1 end
+        while true do
+            local k
+            k, i = str(s, ws(s, i))
+            t[k], i = value(s, ws(s, i) + 1)
+            i = ws(s, i)
+            c = sub(s, i, i)
+            i = i + 1
+            if c == "}" then return t, i end
+        end
+    elseif c == "[" then
+        local t = {}
+        i = ws(s, i + 1)
+        if sub(s, i, i) == "]" then return t, i + 1 end
+        while true do
+            t[#t + 1], i = value(s, i)
+            i = ws(s, i)
+            c = sub(s, i, i)
+            i = i + 1
+            if c == "]" then return t, i end
+        end
+    elseif c == '"' then
+        return str(s, i)
+    elseif sub(s, i, i + 3) == "true" then return true, i + 4
+    elseif sub(s, i, i + 4) == "false" then return false, i + 5
+    elseif sub(s, i, i + 3) == "null" then return nil, i + 4
+    end
+    local num = s:match("^-?%d+%.?%d*[eE]?[-+]?%d*", i)
+    return tonumber(num), i + #num
+end
+
+function M.decode(s) return (value(s, 1)) end
+return M
+EOF
+
+cat > "$WORK/pure.lroff" <<EOF
+.lua
+local f = io.open("$WORK/data.json")
+local data = require("purejson").decode(f:read("*a"))
+f:close()
+lroff.emitln(data[#data].name)
+.endlua
+EOF
+cat > "$WORK/eager.lroff" <<EOF
+.lua
+local data = lroff.json.load("$WORK/data.json", { eager = true })
+lroff.emitln(data[#data].name)
+.endlua
+EOF
+cat > "$WORK/lazy.lroff" <<EOF
+.lua
+local data = lroff.json.load("$WORK/data.json")
+lroff.emitln(data[#data].name)
+.endlua
+EOF
+
+now_ns() { date +%s%N; }
+
+BYTES=$(wc -c < "$WORK/data.json")
+
+bench() {
+    local name="$1"; shift
+    local start elapsed
+    start=$(now_ns)
+    for ((r = 0; r < RUNS; r++)); do
+        "$PPLUA" -I "$WORK" "$@" > /dev/null
+    done
+    elapsed=$(( $(now_ns) - start ))
+    awk -v n="$name" -v ns="$elapsed" -v r="$RUNS" -v b="$BYTES" \
+        'BEGIN { t = ns / r / 1e9
+                 printf "%-10s %9.3f s %9.1f MB/s\n", n, t, b / t / 1e6 }'
+}
+
+printf '%d records, %d bytes\n' "$RECORDS" "$BYTES"
+bench pure-lua "$WORK/pure.lroff"
+bench eager    "$WORK/eager.lroff"
+bench lazy     "$WORK/lazy.lroff"
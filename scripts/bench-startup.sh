@@ -0,0 +1,77 @@
+#!/usr/bin/env bash
+# =========================================================================
+#  bench-startup.sh — Measure pplua start-up latency.
+#
+#  Usage:
+#      ./bench-startup.sh [OPTIONS]
+#
+#  Options:
+#      -P PPLUA     pplua binary to measure (default: pplua)
+#      -r RUNS      Runs per case (default: 200)
+#      -h           Print help and exit
+#
+#  Each case is a tiny document, so the time is dominated by what
+#  pplua does before and around the first line of Lua:
+#
+#      plain     no Lua at all (the Lua state is never created)
+#      inline    one \lua'…' expression
+#      block     one .lua block
+#      io        one block touching io (lazily opened library)
+#      forced    plain text, but -e forces a full start
+# =========================================================================
+
+set -euo pipefail
+
+PPLUA="pplua"
+RUNS=200
+
+usage() {
+    cat <<'EOF'
+Usage: bench-startup.sh [OPTIONS]
+
+Options:
+    -P PPLUA     pplua binary to measure (default: pplua)
+    -r RUNS      Runs per case (default: 200)
+    -h           Print help and exit
+EOF
+}
+
+while getopts ":P:r:h" opt; do
+    case "$opt" in
+        P) PPLUA="$OPTARG" ;;
+        r) RUNS="$OPTARG" ;;
+        h) usage; exit 0 ;;
+        :) echo "Option -$OPTARG requires an argument." >&2; exit 1 ;;
+        *) echo "Unknown option: -$OPTARG" >&2; exit 1 ;;
+    esac
+done
+
+command -v "$PPLUA" >/dev/null 2>&1 || { echo "pplua not found at '$PPLUA'" >&2; exit 1; }
+
+WORK="$(mktemp -d)"
+trap 'rm -rf "$WORK"' EXIT
+
+printf '.TL\nStart-up\n.PP\nNo Lua here.\n' > "$WORK/plain.lroff"
+printf '.PP\nTwo is \\lua'"'"'1 + 1'"'"'.\n' > "$WORK/inline.lroff"
+printf '.lua\nlroff.emitln("x")\n.endlua\n' > "$WORK/block.lroff"
+printf '.lua\nio.stderr:write("")\n.endlua\n' > "$WORK/io.lroff"
+
+now_ns() { date +%s%N; }
+
+bench() {
+    local name="$1"; shift
+    local start elapsed
+    start=$(now_ns)
+    for ((r = 0; r < RUNS; r++)); do
+        "$PPLUA" "$@" > /dev/null
+    done
+    elapsed=$(( $(now_ns) - start ))
+    awk -v n="$name" -v ns="$elapsed" -v r="$RUNS" \
+        'BEGIN { printf "%-10s %10.3f ms\n", n, ns / r / 1e6 }'
+}
+
+bench plain  "$WORK/plain.lroff"
+bench inline "$WORK/inline.lroff"
+bench block  "$WORK/block.lroff"
+bench io     "$WORK/io.lroff"
+bench forced -e '' "$WORK/plain.lroff"
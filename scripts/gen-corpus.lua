@@ -0,0 +1,161 @@
+-- =========================================================================
+--  gen-corpus.lua — Generate a synthetic pplua document of a given size.
+--
+--  Runs inside pplua as a preamble, so no separate Lua is needed:
+--
+--      pplua -n -D OUT=corpus.lroff -D SIZE=100M -l gen-corpus.lua /dev/null
+--
+--  Globals (set with -D):
+--      OUT     Output file (required)
+--      SIZE    Target size in bytes; K, M and G suffixes (default 10M)
+--      SEED    Seed for the word generator (default 1)
+--
+--  The document is a sequence of sections.  By bytes of input the mix
+--  is roughly:
+--
+--      ~80%  passthrough text and ms requests, one line in eight
+--            with a \lua'...' inline expression
+--       ~7%  small .lua blocks (one per section)
+--       ~3%  tbl tables via lroff.table and diversions built and
+--            emitted (every 4th and 8th section)
+--      ~10%  large data blocks: ~15 KB of Lua table constructors
+--            every 32nd section, the way generated reports embed
+--            their data
+--
+--  Output is deterministic for a given SIZE and SEED.
+-- =========================================================================
+
+local out_path = assert(OUT, "gen-corpus: set -D OUT=path")
+
+local function parse_size(s)
+    local n, unit = tostring(s or "10M"):match("^(%d+)([KkMmGg]?)$")
+    assert(n, "gen-corpus: bad SIZE '" .. tostring(s) .. "'")
+    local scale = ({ k = 2^10, m = 2^20, g = 2^30 })[unit:lower()] or 1
+    return math.floor(tonumber(n) * scale)
+end
+
+local target = parse_size(SIZE)
+
+-- A small LCG, so that the corpus does not depend on the Lua
+-- runtime's math.random.
+local state = tonumber(SEED or "1") % 2147483647
+if state <= 0 then state = 1 end
+local function rand(n)
+    state = (state * 48271) % 2147483647
+    return state % n + 1
+end
+
+local words = {
+    "the", "groff", "macro", "table", "value", "report", "section", "data",
+    "quarterly", "revenue", "module", "release", "engine", "output", "line",
+    "request", "register", "font", "paragraph", "document", "summary",
+    "preprocessor", "pipeline", "render", "margin", "figure", "index",
+    "a", "of", "and", "to", "in", "for", "with", "is", "on", "by", "as",
+}
+
+local function sentence(n)
+    local t = {}
+    for i = 1, n do t[i] = words[rand(#words)] end
+    t[1] = t[1]:sub(1, 1):upper() .. t[1]:sub(2)
+    return table.concat(t, " ") .. "."
+end
+
+local inline_forms = {
+    [[The total is \lua'string.format("%.2f", %d * 1.07)' units.]],
+    [[See \lua'lroff.bold("section %d")' for details.]],
+    [[There are \lua'%d + 17' entries in this part.]],
+    [[Version \lua'"%d." .. 2 .. "." .. 1' is current.]],
+}
+
+local function inline_line()
+    local form = inline_forms[rand(#inline_forms)]
+    return (form:gsub("%%d", tostring(rand(9999)), 1))
+end
+
+local function small_block(buf, n)
+    buf[#buf + 1] = ".lua"
+    buf[#buf + 1] = "local acc = {}"
+    buf[#buf + 1] = "for i = 1, " .. (20 + rand(80)) .. " do"
+    buf[#buf + 1] = "    acc[#acc + 1] = (i * " .. rand(97) .. ") % 13"
+    buf[#buf + 1] = "end"
+    buf[#buf + 1] = "lroff.emitln(\"Checksum \" .. table.concat(acc, \"\"):len() .. \" for part " .. n .. ".\")"
+    buf[#buf + 1] = ".endlua"
+end
+
+local function table_block(buf)
+    buf[#buf + 1] = ".lua"
+    buf[#buf + 1] = "local rows = {}"
+    buf[#buf + 1] = "for i = 1, 20 do"
+    buf[#buf + 1] = "    rows[i] = { \"item \" .. i, tostring(i * " .. rand(50) .. "), string.format(\"%.1f\", i / 3) }"
+    buf[#buf + 1] = "end"
+    buf[#buf + 1] = "lroff.table({ \"Name\", \"Count\", \"Ratio\" }, rows, \"center box;\")"
+    buf[#buf + 1] = ".endlua"
+end
+
+local function diversion_block(buf, n)
+    buf[#buf + 1] = ".lua"
+    buf[#buf + 1] = "lroff.divert_begin(\"note" .. n .. "\")"
+    buf[#buf + 1] = "lroff.emitln(\".NH 2\")"
+    buf[#buf + 1] = "lroff.emitln(\"Note " .. n .. "\")"
+    buf[#buf + 1] = "lroff.emitln(\"" .. sentence(12) .. "\")"
+    buf[#buf + 1] = "lroff.divert_end()"
+    buf[#buf + 1] = "lroff.divert_emit(\"note" .. n .. "\")"
+    buf[#buf + 1] = ".endlua"
+end
+
+local function large_block(buf)
+    buf[#buf + 1] = ".lua"
+    buf[#buf + 1] = "local data = {"
+    for i = 1, 250 do
+        buf[#buf + 1] = string.format(
+            "    { id = %d, name = %q, qty = %d, price = %d.%02d },",
+            i, words[rand(#words)] .. " " .. words[rand(#words)],
+            rand(500), rand(999), rand(99))
+    end
+    buf[#buf + 1] = "}"
+    buf[#buf + 1] = "local sum = 0"
+    buf[#buf + 1] = "for _, r in ipairs(data) do sum = sum + r.qty * r.price end"
+    buf[#buf + 1] = "lroff.emitln(string.format(\"Grand total %.2f over %d records.\", sum, #data))"
+    buf[#buf + 1] = ".endlua"
+end
+
+local f = assert(io.open(out_path, "wb"))
+local written = 0
+local section = 0
+
+local function put(buf)
+    buf[#buf + 1] = ""
+    local text = table.concat(buf, "\n")
+    f:write(text)
+    written = written + #text
+end
+
+put({ ".TL", "Synthetic Corpus", ".AU", "gen-corpus.lua", ".AB",
+      "Generated for pplua performance runs.", ".AE" })
+
+while written < target do
+    section = section + 1
+    local buf = { ".NH", "Section " .. section, ".PP" }
+
+    for p = 1, 6 do
+        for l = 1, 8 do
+            if rand(8) == 1 then
+                buf[#buf + 1] = inline_line()
+            else
+                buf[#buf + 1] = sentence(8 + rand(6))
+            end
+        end
+        if p < 6 then buf[#buf + 1] = ".PP" end
+    end
+
+    small_block(buf, section)
+    if section % 4 == 0 then table_block(buf) end
+    if section % 8 == 0 then diversion_block(buf, section) end
+    if section % 32 == 0 then large_block(buf) end
+
+    put(buf)
+end
+
+f:close()
+io.stderr:write(string.format("gen-corpus: %s: %d bytes, %d sections\n",
+                              out_path, written, section))
@@ -0,0 +1,165 @@
+#!/usr/bin/env bash
+# =========================================================================
+#  perf-suite.sh — End-to-end performance regression run over a scaled
+#                  synthetic corpus.
+#
+#  Usage:
+#      ./perf-suite.sh [OPTIONS]
+#
+#  Options:
+#      -P PPLUA     pplua binary to measure (default: pplua)
+#      -s SIZES     Corpus sizes, comma-separated (default: 10M,100M,1G)
+#      -b FILE      Baseline file (default: perf-baseline.tsv)
+#      -t PERCENT   Allowed regression before failing (default: 10)
+#      -u           Write the results as the new baseline and exit 0
+#      -k DIR       Keep generated corpora in DIR and reuse them
+#      -h           Print help and exit
+#
+#  For every size a document is generated with gen-corpus.lua (run by
+#  pplua itself) and rendered once with output to a pipe.  Recorded:
+#
+#      throughput   input MB per second of wall time
+#      rss          peak resident set size in KiB (needs GNU time)
+#      ttfb         milliseconds until the first output byte
+#
+#  Results are compared with the baseline: throughput may not drop,
+#  and rss and ttfb may not grow, by more than the tolerance.  The
+#  exit status is 1 if anything regressed, so the suite can gate CI,
+#  and 77 (skipped, to ctest) if there is no baseline to compare with.
+#  A baseline only means something on the machine that recorded it.
+# =========================================================================
+
+set -euo pipefail
+
+PPLUA="pplua"
+SIZES="10M,100M,1G"
+BASELINE="perf-baseline.tsv"
+TOLERANCE=10
+UPDATE=0
+KEEP=""
+
+usage() {
+    cat <<'EOF'
+Usage: perf-suite.sh [OPTIONS]
+
+Options:
+    -P PPLUA     pplua binary to measure (default: pplua)
+    -s SIZES     Corpus sizes, comma-separated (default: 10M,100M,1G)
+    -b FILE      Baseline file (default: perf-baseline.tsv)
+    -t PERCENT   Allowed regression before failing (default: 10)
+    -u           Write the results as the new baseline and exit 0
+    -k DIR       Keep generated corpora in DIR and reuse them
+    -h           Print help and exit
+EOF
+}
+
+while getopts ":P:s:b:t:uk:h" opt; do
+    case "$opt" in
+        P) PPLUA="$OPTARG" ;;
+        s) SIZES="$OPTARG" ;;
+        b) BASELINE="$OPTARG" ;;
+        t) TOLERANCE="$OPTARG" ;;
+        u) UPDATE=1 ;;
+        k) KEEP="$OPTARG" ;;
+        h) usage; exit 0 ;;
+        :) echo "Option -$OPTARG requires an argument." >&2; exit 1 ;;
+        *) echo "Unknown option: -$OPTARG" >&2; exit 1 ;;
+    esac
+done
+
+command -v "$PPLUA" >/dev/null 2>&1 || { echo "pplua not found at '$PPLUA'" >&2; exit 1; }
+
+here="$(cd "$(dirname "$0")" && pwd)"
+WORK="$(mktemp -d)"
+trap 'rm -rf "$WORK"' EXIT
+CORPUS_DIR="${KEEP:-$WORK}"
+mkdir -p "$CORPUS_DIR"
+
+GNU_TIME=""
+if /usr/bin/time -f %M true >/dev/null 2>&1; then
+    GNU_TIME=/usr/bin/time
+else
+    echo "perf-suite: GNU time not found; rss is not recorded" >&2
+fi
+
+now_ns() { date +%s%N; }
+
+RESULTS="$WORK/results.tsv"
+: > "$RESULTS"
+
+printf '%-8s %14s %12s %12s\n' "size" "throughput" "rss" "ttfb"
+
+IFS=',' read -r -a SIZE_LIST <<< "$SIZES"
+for size in "${SIZE_LIST[@]}"; do
+    corpus="$CORPUS_DIR/corpus-$size.lroff"
+    if [[ ! -s "$corpus" ]]; then
+        "$PPLUA" -n -D OUT="$corpus" -D SIZE="$size" \
+            -l "$here/gen-corpus.lua" /dev/null > /dev/null
+    fi
+    bytes=$(wc -c < "$corpus")
+
+    # The reader notes when the first byte arrives, then drains the
+    # rest so that pplua never blocks on a full pipe.
+    start=$(now_ns)
+    if [[ -n "$GNU_TIME" ]]; then
+        "$GNU_TIME" -f %M -o "$WORK/rss" "$PPLUA" "$corpus"
+    else
+        "$PPLUA" "$corpus"
+    fi 2> "$WORK/stderr" | {
+        head -c 1 > /dev/null
+        now_ns > "$WORK/first"
+        cat > /dev/null
+    }
+    end=$(now_ns)
+
+    if [[ -s "$WORK/stderr" ]]; then
+        echo "perf-suite: $size: pplua reported errors:" >&2
+        head -n 5 "$WORK/stderr" >&2
+    fi
+
+    tput=$(awk -v b="$bytes" -v ns="$((end - start))" \
+           'BEGIN { printf "%.2f", b / 1e6 / (ns / 1e9) }')
+    ttfb=$(awk -v ns="$(( $(cat "$WORK/first") - start ))" \
+           'BEGIN { printf "%.2f", ns / 1e6 }')
+    rss="-"
+    [[ -n "$GNU_TIME" ]] && rss=$(tail -n 1 "$WORK/rss")
+
+    printf '%-8s %9s MB/s %8s KiB %9s ms\n' "$size" "$tput" "$rss" "$ttfb"
+    printf '%s\tthroughput\t%s\n%s\trss\t%s\n%s\tttfb\t%s\n' \
+        "$size" "$tput" "$size" "$rss" "$size" "$ttfb" >> "$RESULTS"
+done
+
+if [[ "$UPDATE" -eq 1 ]]; then
+    cp "$RESULTS" "$BASELINE"
+    echo "perf-suite: baseline written to $BASELINE"
+    exit 0
+fi
+
+if [[ ! -f "$BASELINE" ]]; then
+    echo "perf-suite: no baseline at $BASELINE (record one with -u)"
+    exit 77
+fi
+
+# Throughput is better when higher; rss and ttfb when lower.  Sizes
+# or metrics missing from either side are skipped, and ttfb changes
+# under 2 ms are scheduling noise, not regressions.
+awk -F '\t' -v tol="$TOLERANCE" '
+    NR == FNR { base[$1 FS $2] = $3; next }
+    {
+        key = $1 FS $2
+        if (!(key in base) || base[key] == "-" || $3 == "-" || base[key] == 0)
+            next
+        change = ($3 - base[key]) / base[key] * 100
+        worse  = ($2 == "throughput") ? -change : change
+        if ($2 == "ttfb" && $3 - base[key] < 2)
+            worse = 0
+        status = worse > tol ? "REGRESSED" : "ok"
+        printf "%-8s %-10s %12s -> %-12s %+7.1f%%  %s\n",
+               $1, $2, base[key], $3, change, status
+        if (worse > tol) failed = 1
+    }
+    END { exit failed }
+' "$BASELINE" "$RESULTS" || {
+    echo "perf-suite: regression beyond ${TOLERANCE}% of $BASELINE" >&2
+    exit 1
+}
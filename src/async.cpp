@@ -0,0 +1,247 @@
+// src/async.cpp
+//
+// lroff.async: background subprocesses and file reads.
+
+#include "async.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <new>
+#include <stdexcept>
+
+namespace pplua {
+
+namespace {
+
+const char* const TASK_META  = "pplua.async.task";
+const char* const BLOCKS_KEY = "pplua.async.blocks";
+
+using TaskRef = std::shared_ptr<AsyncTask>;
+
+AsyncTask::Result run_command(const std::string& cmd)
+{
+    AsyncTask::Result r;
+    FILE* p = ::popen(cmd.c_str(), "r");
+    if (!p) {
+        r.error = "cannot run '" + cmd + "'";
+        return r;
+    }
+    char buf[65536];
+    std::size_t n;
+    while ((n = std::fread(buf, 1, sizeof buf, p)) > 0)
+        r.text.append(buf, n);
+    ::pclose(p);
+    return r;
+}
+
+AsyncTask::Result read_file(const std::string& path)
+{
+    AsyncTask::Result r;
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) {
+        r.error = "cannot open '" + path + "'";
+        return r;
+    }
+    char buf[65536];
+    while (in.read(buf, sizeof buf) || in.gcount() > 0)
+        r.text.append(buf, static_cast<std::size_t>(in.gcount()));
+    return r;
+}
+
+void push_task(lua_State* L, TaskRef task)
+{
+    void* mem = lua_newuserdata(L, sizeof(TaskRef));
+    new (mem) TaskRef(std::move(task));
+    luaL_setmetatable(L, TASK_META);
+}
+
+// Run `body`, turning a C++ exception into a Lua error once the
+// exception object is gone.
+template <class F>
+int guarded(lua_State* L, F&& body)
+{
+    try {
+        return body();
+    } catch (const std::exception& e) {
+        lua_pushstring(L, e.what());
+    }
+    return lua_error(L);
+}
+
+// lroff.async.run(cmd)
+int async_run(lua_State* L)
+{
+    push_task(L, AsyncTask::run(luaL_checkstring(L, 1)));
+    return 1;
+}
+
+// lroff.async.read(path)
+int async_read(lua_State* L)
+{
+    push_task(L, AsyncTask::read(luaL_checkstring(L, 1)));
+    return 1;
+}
+
+// lroff.async.ready(...): have all the tasks among the arguments
+// finished?
+int async_ready(lua_State* L)
+{
+    bool all = true;
+    for (int i = 1, n = lua_gettop(L); i <= n && all; ++i)
+        if (TaskRef t = to_async_task(L, i))
+            all = t->ready();
+    lua_pushboolean(L, all);
+    return 1;
+}
+
+// lroff.async.result(...): the arguments, with each task replaced
+// by its text.  Blocks until they have finished; a failed task
+// raises its error.
+int async_result(lua_State* L)
+{
+    return guarded(L, [&]{
+        int n = lua_gettop(L);
+        luaL_checkstack(L, n, "too many tasks");
+        for (int i = 1; i <= n; ++i) {
+            TaskRef t = to_async_task(L, i);
+            if (!t) {
+                lua_pushvalue(L, i);
+                continue;
+            }
+            const AsyncTask::Result& r = t->result();
+            if (!r.error.empty())
+                throw std::runtime_error(r.error);
+            lua_pushlstring(L, r.text.data(), r.text.size());
+        }
+        return n;
+    });
+}
+
+// lroff.async.suspendable(): may lroff.await yield here?  Only in
+// a block the engine runs as a coroutine, and not across a C call.
+int async_suspendable(lua_State* L)
+{
+    bool yes = true;
+#if LUA_VERSION_NUM >= 503
+    yes = lua_isyieldable(L) != 0;
+#endif
+    if (yes) {
+        lua_getfield(L, LUA_REGISTRYINDEX, BLOCKS_KEY);
+        yes = false;
+        if (lua_istable(L, -1)) {
+            lua_pushthread(L);
+            lua_rawget(L, -2);
+            yes = lua_toboolean(L, -1) != 0;
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pushboolean(L, yes);
+    return 1;
+}
+
+int task_tostring(lua_State* L)
+{
+    lua_pushfstring(L, "async task: %p", lua_touserdata(L, 1));
+    return 1;
+}
+
+int task_gc(lua_State* L)
+{
+    if (auto* p = static_cast<TaskRef*>(luaL_testudata(L, 1, TASK_META)))
+        p->~TaskRef();
+    return 0;
+}
+
+} // namespace
+
+// =================================================================
+//  AsyncTask
+// =================================================================
+
+std::shared_ptr<AsyncTask> AsyncTask::run(std::string cmd)
+{
+    return std::shared_ptr<AsyncTask>(new AsyncTask(std::async(
+        std::launch::async, [cmd = std::move(cmd)]{ return run_command(cmd); })));
+}
+
+std::shared_ptr<AsyncTask> AsyncTask::read(std::string path)
+{
+    return std::shared_ptr<AsyncTask>(new AsyncTask(std::async(
+        std::launch::async, [path = std::move(path)]{ return read_file(path); })));
+}
+
+bool AsyncTask::ready()
+{
+    return result_
+        || future_.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+void AsyncTask::wait()
+{
+    if (!result_)
+        future_.wait();
+}
+
+const AsyncTask::Result& AsyncTask::result()
+{
+    if (!result_)
+        result_ = future_.get();
+    return *result_;
+}
+
+// =================================================================
+//  Lua side
+// =================================================================
+
+std::shared_ptr<AsyncTask> to_async_task(lua_State* L, int idx)
+{
+    auto* p = static_cast<TaskRef*>(luaL_testudata(L, idx, TASK_META));
+    return p ? *p : nullptr;
+}
+
+void mark_suspendable(lua_State* co)
+{
+    lua_getfield(co, LUA_REGISTRYINDEX, BLOCKS_KEY);
+    if (lua_isnil(co, -1)) {
+        // Weak keys: a finished block's thread is not kept alive.
+        lua_pop(co, 1);
+        lua_newtable(co);
+        lua_newtable(co);
+        lua_pushstring(co, "k");
+        lua_setfield(co, -2, "__mode");
+        lua_setmetatable(co, -2);
+        lua_pushvalue(co, -1);
+        lua_setfield(co, LUA_REGISTRYINDEX, BLOCKS_KEY);
+    }
+    lua_pushthread(co);
+    lua_pushboolean(co, 1);
+    lua_rawset(co, -3);
+    lua_pop(co, 1);
+}
+
+void register_async(sol::state& lua, sol::table& lroff)
+{
+    lua_State* L = lua.lua_state();
+
+    if (luaL_newmetatable(L, TASK_META)) {
+        static const luaL_Reg meta[] = {
+            { "__tostring", task_tostring },
+            { "__gc",       task_gc       },
+            { nullptr,      nullptr       },
+        };
+        luaL_setfuncs(L, meta, 0);
+    }
+    lua_pop(L, 1);
+
+    sol::table async = lua.create_table();
+    async["run"]         = async_run;
+    async["read"]        = async_read;
+    async["ready"]       = async_ready;
+    async["result"]      = async_result;
+    async["suspendable"] = async_suspendable;
+    lroff["async"]       = async;
+}
+
+} // namespace pplua
@@ -0,0 +1,70 @@
+// src/async.hpp
+//
+// lroff.async — subprocesses and file reads that run in the
+// background while the document goes on.  lroff.await (prelude.lua)
+// waits for them; inside a .lua block it suspends the block instead,
+// and the engine resumes it once the work is done.
+
+#ifndef PPLUA_ASYNC_HPP
+#define PPLUA_ASYNC_HPP
+
+#define SOL_ALL_SAFETIES_ON 1
+#include <sol/sol.hpp>
+
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+
+namespace pplua {
+
+// =====================================================================
+//  AsyncTask — one piece of background work and its outcome
+//
+//  Each task runs on a thread of its own.  Only the thread that owns
+//  the Lua state looks at a task.  A task that is never awaited is
+//  still waited for when it is collected.
+// =====================================================================
+class AsyncTask {
+public:
+    struct Result {
+        std::string text;       // the command's output, the file's bytes
+        std::string error;      // empty on success
+    };
+
+    /// Run `cmd` with the shell and capture its standard output.
+    static std::shared_ptr<AsyncTask> run(std::string cmd);
+
+    /// Read the whole of the file at `path`.
+    static std::shared_ptr<AsyncTask> read(std::string path);
+
+    /// True once the work has finished.  Does not block.
+    bool ready();
+
+    /// Block until the work has finished.
+    void wait();
+
+    /// The outcome (waits if need be).
+    const Result& result();
+
+private:
+    explicit AsyncTask(std::future<Result> f) : future_(std::move(f)) {}
+
+    std::future<Result>   future_;
+    std::optional<Result> result_;
+};
+
+/// The task at stack index `idx`, or nullptr if that is not a task.
+std::shared_ptr<AsyncTask> to_async_task(lua_State* L, int idx);
+
+/// Let lroff.await suspend the coroutine `co` rather than block in
+/// it.  The engine marks the threads it runs .lua blocks on.
+void mark_suspendable(lua_State* co);
+
+/// Install lroff.async (run, read, ready, result, suspendable) into
+/// `lroff`.
+void register_async(sol::state& lua, sol::table& lroff);
+
+} // namespace pplua
+
+#endif // PPLUA_ASYNC_HPP
@@ -0,0 +1,518 @@
+// src/cache.cpp
+//
+// Dependency tracking and the on-disk output cache.
+
+#include "cache.hpp"
+#include "hash.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace pplua {
+
+namespace fs = std::filesystem;
+
+// =================================================================
+//  InputTracker
+// =================================================================
+
+void InputTracker::note_file(const std::string& path) {
+    if (!path.empty())
+        files_.insert(path);
+}
+
+void InputTracker::note_env(const std::string& name) {
+    env_.insert(name);
+}
+
+void InputTracker::mark_uncacheable(const std::string& reason) {
+    if (reason_.empty())
+        reason_ = reason;
+}
+
+void InputTracker::attach(sol::state& lua)
+{
+    sol::table hooks = lua.create_table();
+    hooks.set_function("file",
+        [this](const std::string& p){ note_file(p); });
+    hooks.set_function("env",
+        [this](const std::string& n){ note_env(n); });
+    hooks.set_function("taint",
+        [this](const std::string& r){ mark_uncacheable(r); });
+
+    // The wrappers are plain Lua so that they sit exactly where a
+    // document would look the functions up.  They keep the originals
+    // as upvalues and never change what the caller sees.
+    sol::protected_function install = lua.load(R"lua(
+        local hooks = ...
+        local note, env, taint = hooks.file, hooks.env, hooks.taint
+
+        local io_open, io_lines, io_popen = io.open, io.lines, io.popen
+        local io_input, io_output = io.input, io.output
+        io.open = function(path, mode, ...)
+            -- Anything else is io_open's to reject.
+            if type(path) == "string"
+               and (mode == nil or type(mode) == "string") then
+                if mode and mode:find("[wa+]") then
+                    taint("io.open for writing")
+                else
+                    note(path)
+                end
+            end
+            return io_open(path, mode, ...)
+        end
+        io.lines = function(path, ...)
+            if type(path) == "string" then note(path) end
+            return io_lines(path, ...)
+        end
+        io.popen = function(...)
+            taint("io.popen")
+            return io_popen(...)
+        end
+        -- io.input(path) opens the default input, which io.read and
+        -- io.lines() then read; io.output(path) opens one for writing.
+        io.input = function(file, ...)
+            if type(file) == "string" then note(file) end
+            return io_input(file, ...)
+        end
+        io.output = function(file, ...)
+            if type(file) == "string" then taint("io.output to a file") end
+            return io_output(file, ...)
+        end
+
+        local async = lroff and lroff.async
+        if async then
+            local async_run, async_read = async.run, async.read
+            async.run = function(...)
+                taint("lroff.async.run")
+                return async_run(...)
+            end
+            async.read = function(path, ...)
+                if type(path) == "string" then note(path) end
+                return async_read(path, ...)
+            end
+        end
+
+        -- lroff.shell declares what its command depends on: those
+        -- are the run's inputs, and the output is taken to follow
+        -- from them.
+        local shell = lroff and lroff.shell
+        if shell then
+            lroff.shell = function(cmd, opts)
+                if type(opts) == "table" then
+                    local function each(v, f)
+                        if type(v) == "string" then f(v)
+                        elseif type(v) == "table" then
+                            for _, x in ipairs(v) do
+                                if type(x) == "string" then f(x) end
+                            end
+                        end
+                    end
+                    each(opts.deps, note)
+                    each(opts.env, env)
+                end
+                return shell(cmd, opts)
+            end
+        end
+
+        local syntax = lroff and lroff.syntax
+        if syntax then
+            lroff.syntax = function(path, ...)
+                if type(path) == "string" then note(path) end
+                return syntax(path, ...)
+            end
+        end
+
+        -- lroff.table_csv and lroff.json.load read their files in C++.
+        local table_csv = lroff and lroff.table_csv
+        if table_csv then
+            lroff.table_csv = function(path, ...)
+                if type(path) == "string" then note(path) end
+                return table_csv(path, ...)
+            end
+        end
+
+        local json = lroff and lroff.json
+        if json and json.load then
+            local json_load = json.load
+            json.load = function(path, ...)
+                if type(path) == "string" then note(path) end
+                return json_load(path, ...)
+            end
+        end
+
+        local dofile_, loadfile_ = dofile, loadfile
+        dofile = function(path, ...)
+            if type(path) == "string" then note(path) end
+            return dofile_(path, ...)
+        end
+        loadfile = function(path, ...)
+            if type(path) == "string" then note(path) end
+            return loadfile_(path, ...)
+        end
+
+        -- require: every searcher reports the file it resolved
+        for i, searcher in ipairs(package.searchers) do
+            package.searchers[i] = function(name, ...)
+                local loader, where = searcher(name, ...)
+                if type(loader) == "function" and type(where) == "string"
+                   and where:sub(1, 1) ~= ":" then
+                    note(where)
+                end
+                return loader, where
+            end
+        end
+
+        local os_time, os_date, os_clock = os.time, os.date, os.clock
+        local os_execute, os_getenv = os.execute, os.getenv
+        os.time = function(t, ...)
+            if t == nil then taint("os.time") end
+            return os_time(t, ...)
+        end
+        os.date = function(fmt, t, ...)
+            if t == nil then taint("os.date") end
+            return os_date(fmt, t, ...)
+        end
+        os.clock = function(...)
+            taint("os.clock")
+            return os_clock(...)
+        end
+        os.execute = function(...)
+            taint("os.execute")
+            return os_execute(...)
+        end
+        os.getenv = function(name, ...)
+            if type(name) == "string" then env(name) end
+            return os_getenv(name, ...)
+        end
+
+        local random, randomseed = math.random, math.randomseed
+        local seeded = false
+        math.randomseed = function(x, ...)
+            if x ~= nil then seeded = true end
+            return randomseed(x, ...)
+        end
+        math.random = function(...)
+            if not seeded then taint("math.random without a seed") end
+            return random(...)
+        end
+    )lua", "=pplua-tracker");
+
+    auto result = install(hooks);
+    if (!result.valid()) {
+        sol::error err = result;
+        std::cerr << "pplua: cannot install input tracker: "
+                  << err.what() << '\n';
+        mark_uncacheable("tracker unavailable");
+    }
+}
+
+// =================================================================
+//  OutputCache
+// =================================================================
+
+namespace {
+
+const char* const MANIFEST_MAGIC = "pplua-manifest 1";
+
+// Digest of a file, or "-" if it no longer exists.
+std::string file_digest(const std::string& path) {
+    std::string hex;
+    return sha256_file(path, hex) ? hex : "-";
+}
+
+// Digest of an environment variable's value, or "-" if unset.
+std::string env_digest(const std::string& name) {
+    const char* v = std::getenv(name.c_str());
+    return v ? sha256_hex(v) : "-";
+}
+
+bool read_file(const std::string& path, std::string& out) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f.is_open())
+        return false;
+    std::ostringstream ss;
+    ss << f.rdbuf();
+    out = ss.str();
+    return true;
+}
+
+// Write via a temporary and rename, so that concurrent runs sharing
+// a cache directory never observe a half-written entry.
+bool write_atomically(const std::string& path, const std::string& data) {
+    std::error_code ec;
+    fs::create_directories(fs::path(path).parent_path(), ec);
+
+    // Unique per process and per call: threads may store the same
+    // key at once.
+    static std::atomic<unsigned> seq{0};
+    std::string tmp = path + ".tmp." + std::to_string(::getpid())
+                    + "." + std::to_string(++seq);
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f.is_open())
+            return false;
+        f << data;
+        if (!f.good())
+            return false;
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+OutputCache::OutputCache(std::string dir) : dir_(std::move(dir)) {}
+
+std::string OutputCache::path_for(const std::string& key,
+                                  const std::string& suffix) const {
+    return dir_ + "/" + key.substr(0, 2) + "/" + key + suffix;
+}
+
+bool OutputCache::lookup(const std::string& base_key,
+                         std::string& output) const
+{
+    std::ifstream mf(path_for(base_key, ".manifest"));
+    if (!mf.is_open())
+        return false;
+
+    std::string line;
+    if (!std::getline(mf, line) || line != MANIFEST_MAGIC)
+        return false;
+
+    // Recompute the result key from the *current* digests; any
+    // change in a dependency simply leads to a different key.
+    Sha256 result;
+    result.field(base_key);
+    while (std::getline(mf, line)) {
+        std::istringstream ls(line);
+        std::string kind, digest, name;
+        ls >> kind >> digest;
+        std::getline(ls >> std::ws, name);
+
+        std::string now;
+        if      (kind == "file") now = file_digest(name);
+        else if (kind == "env")  now = env_digest(name);
+        else                     return false;
+        if (now != digest)
+            return false;
+
+        result.field(kind);
+        result.field(name);
+        result.field(now);
+    }
+
+    return read_file(path_for(result.hex_digest(), ".out"), output);
+}
+
+bool OutputCache::store(const std::string& base_key,
+                        const InputTracker& tracker,
+                        const std::string& output) const
+{
+    if (!tracker.cacheable()) {
+        std::cerr << "pplua: cache: not storing output ("
+                  << tracker.reason() << " makes it nondeterministic)\n";
+        return false;
+    }
+
+    std::string manifest = std::string(MANIFEST_MAGIC) + '\n';
+    Sha256 result;
+    result.field(base_key);
+
+    auto add = [&](const char* kind, const std::string& name,
+                   const std::string& digest) {
+        manifest += kind;
+        manifest += ' ' + digest + ' ' + name + '\n';
+        result.field(kind);
+        result.field(name);
+        result.field(digest);
+    };
+    for (auto& f : tracker.files()) add("file", f, file_digest(f));
+    for (auto& e : tracker.env())   add("env",  e, env_digest(e));
+
+    // Output first: a manifest must never point at a missing result.
+    if (!write_atomically(path_for(result.hex_digest(), ".out"), output)
+        || !write_atomically(path_for(base_key, ".manifest"), manifest))
+    {
+        std::cerr << "pplua: cache: cannot write to '" << dir_ << "'\n";
+        return false;
+    }
+    return true;
+}
+
+// =================================================================
+//  ShellCache
+// =================================================================
+
+namespace {
+
+const char* const SHELL_MAGIC = "pplua-shell 1";
+
+std::string run_shell(const std::string& cmd, int& status)
+{
+    FILE* p = ::popen(cmd.c_str(), "r");
+    if (!p)
+        throw std::runtime_error("shell: cannot run '" + cmd + "'");
+    std::string out;
+    char buf[65536];
+    std::size_t n;
+    while ((n = std::fread(buf, 1, sizeof buf, p)) > 0)
+        out.append(buf, n);
+    int ws = ::pclose(p);
+    status = ws == -1          ? -1
+           : WIFEXITED(ws)     ? WEXITSTATUS(ws)
+           : WIFSIGNALED(ws)   ? 128 + WTERMSIG(ws)
+           : -1;
+    return out;
+}
+
+// A list of strings from an lroff.shell option: a table of them, or
+// just one.
+std::vector<std::string> string_list(const sol::object& v, const char* what)
+{
+    std::vector<std::string> out;
+    if (v.get_type() == sol::type::lua_nil)
+        return out;
+    if (v.get_type() == sol::type::string) {
+        out.push_back(v.as<std::string>());
+        return out;
+    }
+    if (v.get_type() != sol::type::table)
+        throw std::runtime_error(std::string("shell: ") + what
+                                 + " must be a list of strings");
+    sol::table t = v.as<sol::table>();
+    for (std::size_t i = 1, n = t.size(); i <= n; ++i) {
+        sol::object item = t[i];
+        if (item.get_type() != sol::type::string)
+            throw std::runtime_error(std::string("shell: ") + what
+                                     + " must be a list of strings");
+        out.push_back(item.as<std::string>());
+    }
+    return out;
+}
+
+} // namespace
+
+std::string ShellCache::run(const Command& c, int& status) const
+{
+    if (dir_.empty())
+        return run_shell(c.cmd, status);
+
+    Sha256 h;
+    h.field(SHELL_MAGIC);
+    h.field(c.cmd);
+    std::error_code ec;
+    h.field(fs::current_path(ec).string());
+    for (auto& name : c.env) {
+        h.field("env");
+        h.field(name);
+        h.field(env_digest(name));
+    }
+    for (auto& path : c.deps) {
+        h.field("dep");
+        h.field(path);
+        h.field(file_digest(path));
+    }
+    h.field("key");
+    h.field(c.key);
+
+    const std::string key  = h.hex_digest();
+    const std::string path = dir_ + "/" + key.substr(0, 2) + "/" + key + ".out";
+    std::string out;
+    if (read_file(path, out)) {
+        status = 0;
+        return out;
+    }
+
+    out = run_shell(c.cmd, status);
+    if (status == 0 && !write_atomically(path, out))
+        std::cerr << "pplua: shell: cannot write to '" << dir_ << "'\n";
+    return out;
+}
+
+void register_shell(sol::state& lua, const std::string& dir)
+{
+    auto cache = std::make_shared<ShellCache>(dir);
+    sol::table lroff = lua["lroff"];
+
+    // lroff.shell(cmd [, {deps = {...}, env = {...}, key = ...}])
+    //   -> output, status
+    lroff.set_function("shell",
+        [cache](const std::string& cmd, sol::optional<sol::table> opts) {
+            ShellCache::Command c;
+            c.cmd = cmd;
+            if (opts) {
+                c.deps = string_list((*opts)["deps"], "deps");
+                c.env  = string_list((*opts)["env"], "env");
+                sol::object key = (*opts)["key"];
+                if (key.get_type() == sol::type::string
+                    || key.get_type() == sol::type::number)
+                    c.key = key.as<std::string>();
+                else if (key.get_type() != sol::type::lua_nil)
+                    throw std::runtime_error(
+                        "shell: key must be a string or a number");
+            }
+            int status = 0;
+            std::string out = cache->run(c, status);
+            return std::make_tuple(std::move(out), status);
+        });
+}
+
+// =================================================================
+//  ChunkCache
+// =================================================================
+
+namespace {
+
+int append_bytecode(lua_State*, const void* p, std::size_t n, void* ud)
+{
+    static_cast<std::string*>(ud)->append(static_cast<const char*>(p), n);
+    return 0;
+}
+
+} // namespace
+
+int ChunkCache::load(lua_State* L, const std::string& code,
+                     const std::string& chunk_name)
+{
+    std::string key = chunk_name;
+    key += '\0';
+    key += code;
+
+    const std::string* found = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = bytecode_.find(key);
+        if (it != bytecode_.end())
+            found = &it->second;        // entries are never removed
+    }
+    if (found)
+        return luaL_loadbuffer(L, found->data(), found->size(),
+                               chunk_name.c_str());
+
+    int status = luaL_loadbuffer(L, code.data(), code.size(),
+                                 chunk_name.c_str());
+    if (status != LUA_OK)
+        return status;
+
+    // Two threads may compile the same chunk at once; either copy
+    // will do.
+    std::string bytecode;
+    if (lua_dump(L, append_bytecode, &bytecode, 0) == 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        bytecode_.emplace(std::move(key), std::move(bytecode));
+    }
+    return status;
+}
+
+} // namespace pplua
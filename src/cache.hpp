@@ -0,0 +1,148 @@
+// src/cache.hpp
+//
+// Content-addressed whole-output cache (--cache-dir), in the
+// spirit of ccache's "direct mode".
+//
+// A run is keyed in two steps.  The *base key* covers everything
+// known before any Lua executes: input bytes, preamble sources,
+// -D/-e/-I arguments and the pplua and Lua versions.  It names a
+// manifest listing every file (and environment variable) the
+// previous run read, with their digests.  If all of those still
+// match, the *result key* — base key plus dependency digests —
+// names the stored output, which is written out without running
+// any Lua at all.
+
+#ifndef PPLUA_CACHE_HPP
+#define PPLUA_CACHE_HPP
+
+#define SOL_ALL_SAFETIES_ON 1
+#include <sol/sol.hpp>
+
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace pplua {
+
+// =====================================================================
+//  InputTracker — what a run read, and whether it was deterministic
+//
+//  attach() wraps the Lua library entry points that read files
+//  (io.open, io.lines, dofile, loadfile, require, lroff.async.read)
+//  so that every path is recorded, and the ones whose result changes
+//  from run to run (os.time, os.date, os.clock, unseeded math.random,
+//  io.popen, os.execute, lroff.async.run) so that the run is marked
+//  uncacheable.
+// =====================================================================
+class InputTracker {
+public:
+    /// Install the wrappers into a Lua state.  Must run before
+    /// any user code (preambles included).
+    void attach(sol::state& lua);
+
+    void note_file(const std::string& path);
+    void note_env (const std::string& name);
+    void mark_uncacheable(const std::string& reason);
+
+    const std::set<std::string>& files() const { return files_; }
+    const std::set<std::string>& env()   const { return env_; }
+    bool               cacheable() const { return reason_.empty(); }
+    const std::string& reason()    const { return reason_; }
+
+private:
+    std::set<std::string> files_;
+    std::set<std::string> env_;
+    std::string           reason_;     // first reason, empty if clean
+};
+
+// =====================================================================
+//  OutputCache — on-disk store below a cache directory
+//
+//  Layout:  DIR/ab/abcdef….manifest   (keyed by base key)
+//           DIR/12/123456….out        (keyed by result key)
+// =====================================================================
+class OutputCache {
+public:
+    explicit OutputCache(std::string dir);
+
+    /// Look up a base key.  On a hit, fills `output` and returns true.
+    bool lookup(const std::string& base_key, std::string& output) const;
+
+    /// Record the output of a run that has just finished.
+    /// Returns false (and says why on stderr) if it couldn't be stored.
+    bool store(const std::string& base_key,
+               const InputTracker& tracker,
+               const std::string& output) const;
+
+private:
+    std::string dir_;
+
+    std::string path_for(const std::string& key,
+                         const std::string& suffix) const;
+};
+
+// =====================================================================
+//  ShellCache — lroff.shell: command output kept on disk
+//
+//  A run is keyed by the command, the working directory, the values
+//  of the environment variables it names, the contents of the files
+//  it says it depends on, and an optional key of the caller's.  A
+//  later run with the same key gets the stored output without
+//  starting anything.  Only runs that exit with status 0 are stored.
+//
+//  Layout:  DIR/ab/abcdef….out
+// =====================================================================
+class ShellCache {
+public:
+    struct Command {
+        std::string              cmd;
+        std::vector<std::string> deps;  // files the output depends on
+        std::vector<std::string> env;   // environment variables it reads
+        std::string              key;   // anything else it depends on
+    };
+
+    /// An empty `dir` turns the cache off: every call runs.
+    explicit ShellCache(std::string dir) : dir_(std::move(dir)) {}
+
+    /// The command's standard output, and its exit status in
+    /// `status`.  Throws std::runtime_error if it cannot be started.
+    std::string run(const Command& c, int& status) const;
+
+private:
+    std::string dir_;
+};
+
+/// Install lroff.shell into the lroff table of `lua`, caching in
+/// `dir` (see ShellCache).
+void register_shell(sol::state& lua, const std::string& dir);
+
+// =====================================================================
+//  ChunkCache — compiled Lua blocks shared between states
+//
+//  Functions cannot move from one Lua state to another, but their
+//  bytecode can.  Preprocessors rendering the same input in separate
+//  states (--variants) share one of these: the first to load a block
+//  compiles it and keeps the bytecode, and the rest load that
+//  instead of parsing the source again.  Safe to use from several
+//  threads at once.
+// =====================================================================
+class ChunkCache {
+public:
+    /// Load `code` as `chunk_name` onto the stack of `L`, from the
+    /// bytecode of an earlier load of the same chunk if there was
+    /// one.  Returns the lua_load status, leaving the function or
+    /// the error message on the stack, as luaL_loadbuffer does.
+    int load(lua_State* L, const std::string& code,
+             const std::string& chunk_name);
+
+private:
+    std::mutex                                   mutex_;
+    std::unordered_map<std::string, std::string> bytecode_;
+};
+
+} // namespace pplua
+
+#endif // PPLUA_CACHE_HPP
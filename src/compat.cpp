@@ -0,0 +1,191 @@
+// src/compat.cpp
+//
+// Lua 5.4 / LuaJIT compatibility shims.
+
+#include "compat.hpp"
+
+#include <cmath>
+
+namespace pplua {
+
+void open_compat(sol::state& lua)
+{
+#ifdef PPLUA_LUAJIT
+    // Pure-Lua stand-ins, written to the 5.1 subset so LuaJIT can
+    // trace them.  Semantics follow the 5.4 reference manual,
+    // including the rejection of overlong forms and surrogates.
+    lua.script(R"lua(
+        package.searchers = package.searchers or package.loaders
+        table.unpack = table.unpack or unpack
+        table.pack = table.pack or function(...)
+            return { n = select("#", ...), ... }
+        end
+
+        if utf8 ~= nil then return end
+
+        local char, byte, floor = string.char, string.byte, math.floor
+        local unpack = table.unpack
+        utf8 = { charpattern = "[\0-\x7F\xC2-\xFD][\x80-\xBF]*" }
+
+        local function encode(c)
+            if c < 0x80 then
+                return char(c)
+            elseif c < 0x800 then
+                return char(0xC0 + floor(c / 0x40), 0x80 + c % 0x40)
+            elseif c < 0x10000 then
+                return char(0xE0 + floor(c / 0x1000),
+                            0x80 + floor(c / 0x40) % 0x40,
+                            0x80 + c % 0x40)
+            end
+            return char(0xF0 + floor(c / 0x40000),
+                        0x80 + floor(c / 0x1000) % 0x40,
+                        0x80 + floor(c / 0x40) % 0x40,
+                        0x80 + c % 0x40)
+        end
+
+        -- decode the sequence at byte i: code point and next index
+        local function decode(s, i)
+            local c = byte(s, i)
+            if c == nil then return nil end
+            if c < 0x80 then return c, i + 1 end
+            local n, cp
+            if c < 0xC2 or c > 0xF4 then return nil
+            elseif c >= 0xF0 then n, cp = 3, c - 0xF0
+            elseif c >= 0xE0 then n, cp = 2, c - 0xE0
+            else                  n, cp = 1, c - 0xC0 end
+            for k = 1, n do
+                local cc = byte(s, i + k)
+                if cc == nil or cc < 0x80 or cc > 0xBF then return nil end
+                cp = cp * 0x40 + (cc - 0x80)
+            end
+            if (n == 2 and cp < 0x800) or (n == 3 and cp < 0x10000)
+               or cp > 0x10FFFF or (cp >= 0xD800 and cp <= 0xDFFF) then
+                return nil
+            end
+            return cp, i + n + 1
+        end
+
+        local function posrel(p, len)
+            if p >= 0 then return p
+            elseif -p > len then return 0 end
+            return len + p + 1
+        end
+
+        local function iscont(s, p)
+            local c = byte(s, p)
+            return c ~= nil and c >= 0x80 and c < 0xC0
+        end
+
+        function utf8.char(...)
+            local t = { ... }
+            for k = 1, select("#", ...) do t[k] = encode(t[k]) end
+            return table.concat(t)
+        end
+
+        function utf8.codepoint(s, i, j)
+            i = posrel(i or 1, #s)
+            j = posrel(j or i, #s)
+            local out, n = {}, 0
+            while i <= j do
+                local cp, nx = decode(s, i)
+                if cp == nil then error("invalid UTF-8 code", 2) end
+                n = n + 1
+                out[n] = cp
+                i = nx
+            end
+            return unpack(out, 1, n)
+        end
+
+        function utf8.len(s, i, j)
+            i = posrel(i or 1, #s)
+            j = posrel(j or -1, #s)
+            local n = 0
+            while i <= j do
+                local cp, nx = decode(s, i)
+                if cp == nil then return nil, i end
+                n = n + 1
+                i = nx
+            end
+            return n
+        end
+
+        function utf8.codes(s)
+            local i = 1
+            return function()
+                if i > #s then return nil end
+                local cp, nx = decode(s, i)
+                if cp == nil then error("invalid UTF-8 code", 2) end
+                local p = i
+                i = nx
+                return p, cp
+            end
+        end
+
+        function utf8.offset(s, n, i)
+            local len = #s
+            i = posrel(i or (n >= 0 and 1 or len + 1), len)
+            if n == 0 then
+                while i > 1 and iscont(s, i) do i = i - 1 end
+                return i
+            end
+            if iscont(s, i) then
+                error("initial position is a continuation byte", 2)
+            end
+            if n > 0 then
+                n = n - 1
+                while n > 0 and i <= len do
+                    repeat i = i + 1 until not iscont(s, i)
+                    n = n - 1
+                end
+            else
+                while n < 0 and i > 1 do
+                    repeat i = i - 1 until i <= 1 or not iscont(s, i)
+                    n = n + 1
+                end
+            end
+            if n == 0 then return i end
+            return nil
+        end
+    )lua", "=pplua-compat");
+#else
+    (void)lua;
+#endif
+}
+
+bool as_integer(const sol::object& obj, long long& out)
+{
+    if (obj.get_type() != sol::type::number)
+        return false;
+
+    lua_State* L = obj.lua_state();
+    obj.push();
+    bool ok = false;
+#ifdef PPLUA_LUAJIT
+    // 5.1 has only doubles: treat integral values below 2^53 as
+    // integers, which is what tostring() does for them as well.
+    double d = lua_tonumber(L, -1);
+    if (std::isfinite(d) && std::floor(d) == d
+        && std::fabs(d) <= 9007199254740992.0) {
+        out = static_cast<long long>(d);
+        ok = true;
+    }
+#else
+    if (lua_isinteger(L, -1)) {
+        out = static_cast<long long>(lua_tointeger(L, -1));
+        ok = true;
+    }
+#endif
+    lua_pop(L, 1);
+    return ok;
+}
+
+const char* lua_runtime_name()
+{
+#ifdef PPLUA_LUAJIT
+    return LUAJIT_VERSION;
+#else
+    return LUA_RELEASE;
+#endif
+}
+
+} // namespace pplua
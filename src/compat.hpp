@@ -0,0 +1,30 @@
+// src/compat.hpp
+//
+// Shims that let pplua run on LuaJIT (Lua 5.1 semantics) as well
+// as on Lua 5.4.  On a 5.4 build they reduce to the plain calls.
+
+#ifndef PPLUA_COMPAT_HPP
+#define PPLUA_COMPAT_HPP
+
+#define SOL_ALL_SAFETIES_ON 1
+#include <sol/sol.hpp>
+
+namespace pplua {
+
+/// Install the 5.4 library pieces LuaJIT lacks: the utf8 library,
+/// package.searchers, table.pack and table.unpack.
+/// Call after the standard libraries are open.
+void open_compat(sol::state& lua);
+
+/// If `obj` is an integer — the integer subtype on Lua 5.4, or on
+/// LuaJIT an integral double small enough to be exact — store it
+/// in `out` and return true.
+bool as_integer(const sol::object& obj, long long& out);
+
+/// The Lua runtime pplua was built against, e.g. "Lua 5.4.6" or
+/// "LuaJIT 2.1.0-beta3".
+const char* lua_runtime_name();
+
+} // namespace pplua
+
+#endif // PPLUA_COMPAT_HPP
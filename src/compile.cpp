@@ -0,0 +1,494 @@
+// src/compile.cpp
+//
+// Translating a document into one Lua chunk (--compile), and the
+// document syntax the translator shares with the interpreter.
+
+#include "compile.hpp"
+#include "pplua.hpp"
+#include "compat.hpp"
+#include "utf8.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#ifndef PPLUA_VERSION
+#define PPLUA_VERSION "0.1.0"
+#endif
+
+namespace pplua {
+
+// =================================================================
+//  Document syntax
+// =================================================================
+
+bool is_delimiter(const std::string& line, const std::string& delim,
+                  std::string* rest)
+{
+    std::size_t first = line.find_first_not_of(" \t");
+    if (first == std::string::npos)
+        first = line.size();
+    if (line.compare(first, delim.size(), delim) != 0)
+        return false;
+    std::size_t after = first + delim.size();
+    if (after < line.size() && line[after] != ' ' && line[after] != '\t')
+        return false;
+    if (rest)
+        *rest = after < line.size() ? line.substr(after + 1) : std::string();
+    return true;
+}
+
+bool is_pure(const std::string& rest, std::vector<std::string>& pass)
+{
+    std::vector<std::string> words;
+    std::size_t i = 0;
+    while ((i = rest.find_first_not_of(" \t", i)) != std::string::npos) {
+        std::size_t end = std::min(rest.find_first_of(" \t", i), rest.size());
+        words.push_back(rest.substr(i, end - i));
+        i = end;
+    }
+    if (words.empty() || words[0] != "pure")
+        return false;
+    for (std::size_t w = 1; w < words.size(); ++w) {
+        const std::string& name = words[w];
+        if (!std::isalpha(static_cast<unsigned char>(name[0])) && name[0] != '_')
+            return false;
+        for (char c : name)
+            if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_')
+                return false;
+    }
+    pass.assign(words.begin() + 1, words.end());
+    return true;
+}
+
+std::size_t find_inline_end(const std::string& line, std::size_t from,
+                            char close)
+{
+    for (std::size_t i = from; i < line.size(); ++i) {
+        if (line[i] == '\\' && i + 1 < line.size()) {
+            ++i;  // skip escaped character
+            continue;
+        }
+        if (line[i] == close)
+            return i;
+    }
+    return std::string::npos;
+}
+
+std::string chunk_name_for(const std::string& source_name,
+                           std::uint64_t source_line)
+{
+    return "@" + source_name + ":" + std::to_string(source_line);
+}
+
+void check_utf8(const std::string& line, const std::string& file,
+                std::uint64_t line_no)
+{
+    std::size_t bad = find_invalid_utf8(line);
+    if (bad == std::string::npos)
+        return;
+    char byte[8];
+    std::snprintf(byte, sizeof byte, "0x%02X",
+                  static_cast<unsigned char>(line[bad]));
+    std::cerr << "pplua: " << file << ":" << line_no
+              << ":" << utf8_column(line, bad)
+              << ": warning: invalid UTF-8 (byte " << byte << ")\n";
+}
+
+// =================================================================
+//  Translation
+// =================================================================
+
+namespace {
+
+const char* const HEADER_MAGIC = "pplua-compiled 1";
+
+// The chunk's parameters, the callbacks Preprocessor::run_compiled
+// passes.  They are locals of the chunk and so shadow globals of the
+// same name in the document's own code: the names are reserved.
+const char* const TEXT   = "__pplua_text";
+const char* const INLINE = "__pplua_inline";
+const char* const BLOCK  = "__pplua_block";
+const char* const PURE   = "__pplua_pure";
+
+std::string build_name()
+{
+    return std::string("pplua " PPLUA_VERSION " / ") + lua_runtime_name();
+}
+
+// Appends the chunk, one generated line per document line.
+class Translator {
+public:
+    Translator(lua_State* L, const Config& cfg, const std::string& filename)
+        : L_(L), cfg_(cfg), file_(filename)
+    {
+        out_ = "local ";
+        out_ += TEXT;
+        out_ += ", ";
+        out_ += INLINE;
+        out_ += ", ";
+        out_ += BLOCK;
+        out_ += ", ";
+        out_ += PURE;
+        out_ += " = ...; ";
+    }
+
+    /// Translate the document; false if it has errors.
+    bool run(std::istream& in);
+
+    const std::string& source() const { return out_; }
+
+private:
+    lua_State*         L_;
+    const Config&      cfg_;
+    const std::string& file_;
+    std::string        out_;
+    std::string        pending_;    // goes before the next line's code
+    bool               in_text_ = false;
+    bool               ok_      = true;
+
+    void begin_line() {
+        out_ += pending_;
+        pending_.clear();
+    }
+
+    void number(std::uint64_t n) {
+        char buf[24];
+        auto r = std::to_chars(buf, buf + sizeof buf, n);
+        out_.append(buf, r.ptr);
+    }
+
+    /// Append `s` as the inside of a "…" string.  A leading blank is
+    /// escaped so that a \z before it cannot swallow it.
+    void quote(const std::string& s, std::size_t pos = 0,
+               std::size_t len = std::string::npos);
+
+    void text(std::uint64_t n, const std::string& line);
+    void end_text();
+    void inline_line(std::uint64_t n, const std::string& line);
+    bool block(std::istream& in, std::uint64_t& n, const std::string& rest);
+
+    /// Compile `code` on its own, as processing the document would,
+    /// and report it the same way if it does not.
+    void check(const std::string& code, const std::string& chunk_name,
+               std::uint64_t n, const char* what);
+};
+
+void Translator::quote(const std::string& s, std::size_t pos, std::size_t len)
+{
+    std::size_t end = len == std::string::npos ? s.size()
+                    : std::min(s.size(), pos + len);
+    for (std::size_t i = pos; i < end; ++i) {
+        unsigned char c = static_cast<unsigned char>(s[i]);
+        if (c == '\\' || c == '"') {
+            out_ += '\\';
+            out_ += static_cast<char>(c);
+        } else if (c < 0x20 || c == 0x7F || (c == ' ' && i == 0)) {
+            char esc[8];
+            std::snprintf(esc, sizeof esc, "\\%03u", static_cast<unsigned>(c));
+            out_ += esc;
+        } else {
+            out_ += static_cast<char>(c);
+        }
+    }
+}
+
+void Translator::check(const std::string& code, const std::string& chunk_name,
+                       std::uint64_t n, const char* what)
+{
+    if (luaL_loadbuffer(L_, code.data(), code.size(), chunk_name.c_str())
+        != LUA_OK) {
+        std::cerr << "pplua: " << file_ << ":" << n << ": " << what << ": "
+                  << lua_tostring(L_, -1) << '\n';
+        ok_ = false;
+    }
+    lua_pop(L_, 1);
+}
+
+// Consecutive text lines are one TEXT call: a string constant that
+// continues from line to line with \z, which skips the newline.
+void Translator::text(std::uint64_t n, const std::string& line)
+{
+    if (in_text_) {
+        out_ += "\\z\n";
+    } else {
+        begin_line();
+        out_ += TEXT;
+        out_ += '(';
+        number(n);
+        out_ += ",\"";
+        in_text_ = true;
+    }
+    quote(line);
+    out_ += "\\n";
+}
+
+void Translator::end_text()
+{
+    if (in_text_) {
+        out_ += "\")\n";
+        in_text_ = false;
+    }
+}
+
+// As Preprocessor::expand_inline splits it.
+void Translator::inline_line(std::uint64_t n, const std::string& line)
+{
+    const std::string& open  = cfg_.inline_open;
+    const char         close = cfg_.inline_close;
+
+    begin_line();
+    out_ += INLINE;
+    out_ += '(';
+    number(n);
+    if (!line.empty() && (line[0] == '.' || line[0] == '\'')) {
+        out_ += ",\"";
+        quote(line);
+        out_ += '"';
+    } else {
+        out_ += ",false";
+    }
+
+    std::size_t pos = 0;
+    while (pos < line.size()) {
+        std::size_t start = line.find(open, pos);
+        if (start == std::string::npos) {
+            out_ += ",\"";
+            quote(line, pos);
+            out_ += '"';
+            break;
+        }
+        if (start > pos) {
+            out_ += ",\"";
+            quote(line, pos, start - pos);
+            out_ += '"';
+        }
+
+        std::size_t expr_start = start + open.size();
+        std::size_t expr_end   = find_inline_end(line, expr_start, close);
+        if (expr_end == std::string::npos) {
+            std::cerr << "pplua: " << file_ << ":" << n
+                      << ": warning: unterminated \\lua expression\n";
+            out_ += ",\"";
+            quote(line, start);
+            out_ += '"';
+            break;
+        }
+
+        std::string code = "return tostring(";
+        code.append(line, expr_start, expr_end - expr_start);
+        code += ')';
+        check(code, chunk_name_for(file_, n) + ":inline", n,
+              "inline lua error");
+        out_ += ",function() ";
+        out_ += code;
+        out_ += " end";
+
+        pos = expr_end + 1;
+    }
+    out_ += ")\n";
+}
+
+// A .lua block, from its opening line (number `n`, `rest` after the
+// delimiter) through its closing one, which `n` is left at.
+bool Translator::block(std::istream& in, std::uint64_t& n,
+                       const std::string& rest)
+{
+    begin_line();
+
+    // Code and the closing delimiter on the opening line: the
+    // function's end goes before the next line's code.
+    auto ec = rest.find(cfg_.block_close);
+    if (ec != std::string::npos) {
+        std::string code = rest.substr(0, ec);
+        check(code, chunk_name_for(file_, n), n, "lua error");
+        out_ += BLOCK;
+        out_ += '(';
+        number(n);
+        out_ += ',';
+        number(n);
+        out_ += ",function(...) ";
+        out_ += code;
+        out_ += '\n';
+        pending_ = "end) ";
+        return true;
+    }
+
+    std::vector<std::string> pass;
+    const bool pure = is_pure(rest, pass);
+    const std::uint64_t start = n + 1;
+
+    std::vector<std::string> lines;
+    std::string line;
+    bool closed = false;
+    while (std::getline(in, line)) {
+        ++n;
+        if (is_delimiter(line, cfg_.block_close)) {
+            closed = true;
+            break;
+        }
+        if (cfg_.check_utf8)
+            check_utf8(line, file_, n);
+        lines.push_back(std::move(line));
+    }
+    if (!closed) {
+        std::cerr << "pplua: " << file_ << ":" << start
+                  << ": error: unterminated .lua block\n";
+        return false;
+    }
+
+    std::string code;
+    if (!pure && !rest.empty())
+        code += rest + '\n';
+    for (auto& l : lines)
+        code += l + '\n';
+
+    if (pure) {
+        // The code goes to a worker as text; the string runs from
+        // line to line as text does.
+        check(code, chunk_name_for(file_, start), start, "lua error");
+        out_ += PURE;
+        out_ += '(';
+        number(start);
+        out_ += ',';
+        number(n);
+        out_ += ",\"\\z\n";
+        for (auto& l : lines) {
+            quote(l);
+            out_ += "\\n\\z\n";
+        }
+        out_ += '"';
+        for (auto& name : pass) {
+            out_ += ",\"";
+            out_ += name;
+            out_ += '"';
+        }
+        out_ += ")\n";
+        return true;
+    }
+
+    check(code, chunk_name_for(file_, start), start, "lua error");
+    out_ += BLOCK;
+    out_ += '(';
+    number(start);
+    out_ += ',';
+    number(n);
+    out_ += ",function(...) ";
+    out_ += rest;
+    out_ += '\n';
+    for (auto& l : lines) {
+        out_ += l;
+        out_ += '\n';
+    }
+    out_ += "end)\n";
+    return true;
+}
+
+bool Translator::run(std::istream& in)
+{
+    std::string line;
+    std::string rest;
+    std::uint64_t n = 0;
+    while (std::getline(in, line)) {
+        ++n;
+        if (cfg_.check_utf8)
+            check_utf8(line, file_, n);
+
+        if (!is_delimiter(line, cfg_.block_open, &rest)) {
+            if (line.find(cfg_.inline_open) == std::string::npos) {
+                text(n, line);
+            } else {
+                end_text();
+                inline_line(n, line);
+            }
+            continue;
+        }
+
+        end_text();
+        if (!block(in, n, rest))
+            return false;
+    }
+    end_text();
+    out_ += pending_;
+    return ok_;
+}
+
+int write_dump(lua_State*, const void* p, std::size_t n, void* ud)
+{
+    static_cast<std::string*>(ud)->append(static_cast<const char*>(p), n);
+    return 0;
+}
+
+} // namespace
+
+// =================================================================
+//  Entry points
+// =================================================================
+
+int compile_document(const Config& cfg, std::istream& in,
+                     const std::string& filename, std::ostream& out)
+{
+    sol::state lua;
+    lua_State* L = lua.lua_state();
+
+    Translator tr(L, cfg, filename);
+    if (!tr.run(in))
+        return 1;
+
+    const std::string& source = tr.source();
+    std::string name = "@" + filename;
+    if (luaL_loadbuffer(L, source.data(), source.size(), name.c_str())
+        != LUA_OK) {
+        std::cerr << "pplua: " << filename << ": cannot compile: "
+                  << lua_tostring(L, -1) << '\n';
+        return 1;
+    }
+
+    std::string bytes = HEADER_MAGIC;
+    bytes += '\n';
+    bytes += build_name();
+    bytes += '\n';
+    bytes += filename;
+    bytes += '\n';
+    if (lua_dump(L, write_dump, &bytes, 0) != 0) {
+        std::cerr << "pplua: " << filename << ": cannot dump bytecode\n";
+        return 1;
+    }
+    lua_pop(L, 1);
+
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    out.flush();
+    return out ? 0 : 1;
+}
+
+bool read_compiled_header(const std::string& bytes, std::string& filename,
+                          std::size_t& offset, std::string& error)
+{
+    std::string fields[3];
+    std::size_t pos = 0;
+    for (auto& field : fields) {
+        std::size_t nl = bytes.find('\n', pos);
+        if (nl == std::string::npos || nl - pos > 4096) {
+            error = "not a compiled pplua document";
+            return false;
+        }
+        field.assign(bytes, pos, nl - pos);
+        pos = nl + 1;
+    }
+    if (fields[0] != HEADER_MAGIC) {
+        error = "not a compiled pplua document";
+        return false;
+    }
+    if (fields[1] != build_name()) {
+        error = "compiled by " + fields[1] + "; compile it again";
+        return false;
+    }
+    filename = fields[2];
+    offset   = pos;
+    return true;
+}
+
+} // namespace pplua
@@ -0,0 +1,92 @@
+// src/compile.hpp
+//
+// --compile: a whole document translated ahead of time into one Lua
+// chunk, which --run renders without scanning or compiling anything.
+// Also the pieces of document syntax that the compiler and the
+// interpreter (Preprocessor::process) share.
+
+#ifndef PPLUA_COMPILE_HPP
+#define PPLUA_COMPILE_HPP
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace pplua {
+
+struct Config;
+
+// =====================================================================
+//  Document syntax
+// =====================================================================
+
+/// Is `line` the delimiter `delim` (after leading blanks, and
+/// followed by nothing or a blank)?  If so, `rest` gets what follows
+/// it.
+bool is_delimiter(const std::string& line, const std::string& delim,
+                  std::string* rest = nullptr);
+
+/// Is the text after ".lua" a `pure` annotation: the word pure and
+/// then only names, which go to `pass`?  (As Lua code it would not
+/// compile.)
+bool is_pure(const std::string& rest, std::vector<std::string>& pass);
+
+/// The end of the inline expression starting at `from`: the next
+/// `close` not escaped with a backslash, or npos.
+std::size_t find_inline_end(const std::string& line, std::size_t from,
+                            char close);
+
+/// The name a block starting at `source_line` is compiled under, in
+/// the @filename:line convention, so that Lua error messages refer to
+/// the original source location.
+std::string chunk_name_for(const std::string& source_name,
+                           std::uint64_t source_line);
+
+/// Warn about the first ill-formed UTF-8 sequence on an input line,
+/// before it turns into a troff error far from here.
+void check_utf8(const std::string& line, const std::string& file,
+                std::uint64_t line_no);
+
+// =====================================================================
+//  Compiled documents
+//
+//  The chunk keeps every line of the document on its own line, so
+//  that Lua's line numbers are the document's: runs of text become
+//  string constants, lines with inline expressions a call with one
+//  small function per expression, and blocks functions written in
+//  place.  It takes the engine's entry points as its arguments:
+//
+//    __pplua_text(line, text)   text lines, from `line` on
+//    __pplua_inline(line, raw, s, f, s, ...)
+//                               a line with inline expressions; raw
+//                               is the line itself if it could be a
+//                               request bound with define_request
+//    __pplua_block(first, last, f)
+//                               a .lua block
+//    __pplua_pure(first, last, code, ...)
+//                               a .lua pure block and the names it
+//                               is passed
+//
+//  The names are locals of the chunk, reserved so that they shadow
+//  no global of the document.
+//
+//  A compiled file is a short text header — format, the pplua and
+//  Lua that wrote it, the document's name — and the bytecode.
+// =====================================================================
+
+/// Compile the document read from `in`, reporting errors on stderr
+/// as processing it would, and write the result to `out`.  Returns
+/// 0 on success, 1 if the document has errors or `out` fails.
+int compile_document(const Config& cfg, std::istream& in,
+                     const std::string& filename, std::ostream& out);
+
+/// Check the header of a compiled file.  On success, set the
+/// document's name and the offset of the bytecode; otherwise say
+/// why in `error`.
+bool read_compiled_header(const std::string& bytes, std::string& filename,
+                          std::size_t& offset, std::string& error);
+
+} // namespace pplua
+
+#endif // PPLUA_COMPILE_HPP
@@ -0,0 +1,166 @@
+// src/csv.cpp
+//
+// MappedFile and CsvReader.
+
+#include "csv.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace pplua {
+
+// =================================================================
+//  MappedFile
+// =================================================================
+
+MappedFile::~MappedFile()
+{
+    if (mapped_)
+        ::munmap(const_cast<char*>(data_), size_);
+}
+
+bool MappedFile::open(const std::string& path, std::string& error)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error = "cannot open '" + path + "': " + std::strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* p = ::mmap(nullptr, static_cast<std::size_t>(st.st_size),
+                         PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            ::madvise(p, static_cast<std::size_t>(st.st_size),
+                      MADV_SEQUENTIAL);
+            data_   = static_cast<const char*>(p);
+            size_   = static_cast<std::size_t>(st.st_size);
+            mapped_ = true;
+            ::close(fd);
+            return true;
+        }
+    }
+    ::close(fd);
+
+    // Not mappable: read it.
+    std::ifstream f(path, std::ios::binary);
+    std::ostringstream ss;
+    ss << f.rdbuf();
+    fallback_ = ss.str();
+    data_ = fallback_.data();
+    size_ = fallback_.size();
+    return true;
+}
+
+void MappedFile::release(std::size_t upto)
+{
+    if (!mapped_)
+        return;
+    static const std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    std::size_t end = upto / page * page;
+    if (end > dropped_) {
+        ::madvise(const_cast<char*>(data_) + dropped_, end - dropped_,
+                  MADV_DONTNEED);
+        dropped_ = end;
+    }
+}
+
+// =================================================================
+//  CsvReader
+// =================================================================
+
+CsvReader::CsvReader(const char* data, std::size_t size, char sep)
+    : data_(data), size_(size), sep_(sep)
+{
+    if (size_ >= 3 && std::memcmp(data_, "\xEF\xBB\xBF", 3) == 0)
+        pos_ = 3;
+}
+
+bool CsvReader::next(std::vector<std::string_view>& fields)
+{
+    fields.clear();
+    owned_used_ = 0;
+
+    // Skip blank lines between records.
+    while (pos_ < size_ && (data_[pos_] == '\n' || data_[pos_] == '\r')) {
+        if (data_[pos_] == '\n')
+            ++line_;
+        ++pos_;
+    }
+    if (pos_ >= size_)
+        return false;
+    record_line_ = line_;
+
+    for (;;) {
+        if (pos_ < size_ && data_[pos_] == '"') {
+            // Quoted field: scan to the closing quote.
+            std::size_t start = ++pos_;
+            bool doubled = false;
+            for (;;) {
+                const void* q = std::memchr(data_ + pos_, '"', size_ - pos_);
+                std::size_t end = q ? static_cast<const char*>(q) - data_
+                                    : size_;
+                for (std::size_t i = pos_; i < end; ++i)
+                    if (data_[i] == '\n') ++line_;
+                pos_ = end;
+                if (pos_ + 1 < size_ && data_[pos_ + 1] == '"') {
+                    doubled = true;
+                    pos_ += 2;
+                    continue;
+                }
+                break;
+            }
+            std::string_view raw(data_ + start, pos_ - start);
+            if (pos_ < size_)
+                ++pos_;                     // closing quote
+
+            if (doubled) {
+                if (owned_used_ == owned_.size())
+                    owned_.emplace_back();
+                std::string& s = owned_[owned_used_++];
+                s.clear();
+                for (std::size_t i = 0; i < raw.size(); ++i) {
+                    s += raw[i];
+                    if (raw[i] == '"')
+                        ++i;
+                }
+                fields.emplace_back(s);
+            } else {
+                fields.push_back(raw);
+            }
+
+            // Anything between the closing quote and the separator
+            // is malformed; skip it as most readers do.
+            while (pos_ < size_ && data_[pos_] != sep_
+                   && data_[pos_] != '\n')
+                ++pos_;
+        } else {
+            std::size_t start = pos_;
+            while (pos_ < size_ && data_[pos_] != sep_
+                   && data_[pos_] != '\n')
+                ++pos_;
+            std::size_t end = pos_;
+            if (end > start && data_[end - 1] == '\r')
+                --end;
+            fields.emplace_back(data_ + start, end - start);
+        }
+
+        if (pos_ >= size_)
+            return true;
+        if (data_[pos_] == '\n') {
+            ++pos_;
+            ++line_;
+            return true;
+        }
+        ++pos_;                             // separator
+    }
+}
+
+} // namespace pplua
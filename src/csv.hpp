@@ -0,0 +1,86 @@
+// src/csv.hpp
+//
+// Memory-mapped CSV reading for lroff.table_csv.  Records are parsed
+// in place; fields are views into the mapping, so a file of any size
+// is read with memory proportional to one record.
+
+#ifndef PPLUA_CSV_HPP
+#define PPLUA_CSV_HPP
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pplua {
+
+// =====================================================================
+//  MappedFile — a read-only mapping of a whole file
+//
+//  Files that cannot be mapped (pipes, /dev/stdin) are read into
+//  memory instead.
+// =====================================================================
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /// Map `path`.  Returns false and sets `error` on failure.
+    bool open(const std::string& path, std::string& error);
+
+    const char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+    /// Tell the kernel that [0, upto) will not be read again, so the
+    /// pages behind the reader can be dropped.
+    void release(std::size_t upto);
+
+private:
+    const char* data_   = nullptr;
+    std::size_t size_   = 0;
+    std::size_t dropped_ = 0;
+    bool        mapped_ = false;
+    std::string fallback_;
+};
+
+// =====================================================================
+//  CsvReader — RFC 4180 records over a byte range
+//
+//  Quoted fields may contain the separator, doubled quotes and line
+//  breaks; both LF and CRLF end a record, and a leading UTF-8 BOM is
+//  skipped.
+// =====================================================================
+class CsvReader {
+public:
+    CsvReader(const char* data, std::size_t size, char sep = ',');
+
+    /// Parse the next record into `fields`.  The views stay valid
+    /// until the next call.  Returns false at end of input.
+    bool next(std::vector<std::string_view>& fields);
+
+    /// Bytes consumed so far.
+    std::size_t offset() const { return pos_; }
+
+    /// 1-based number of the line the last record started on.
+    std::size_t line() const { return record_line_; }
+
+private:
+    const char* data_;
+    std::size_t size_;
+    std::size_t pos_ = 0;
+    char        sep_;
+    std::size_t line_ = 1;
+    std::size_t record_line_ = 0;
+
+    // Unescaped copies of quoted fields that contained "".
+    std::deque<std::string> owned_;
+    std::size_t             owned_used_ = 0;
+};
+
+} // namespace pplua
+
+#endif // PPLUA_CSV_HPP
@@ -0,0 +1,643 @@
+// src/format.cpp
+//
+// lroff.fmt: numbers, percentages and padded columns.
+
+#include "format.hpp"
+#include "utf8.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <new>
+#include <stdexcept>
+
+namespace pplua {
+
+namespace {
+
+const char* const FORMATTER_META = "pplua.fmt.formatter";
+const char* const FORMATS_KEY    = "pplua.fmt.formats";
+
+// Room for the widest fixed-point double (309 integer digits) at
+// the largest precision a spec may ask for.
+constexpr int  MAX_PRECISION = 100;
+constexpr auto BUF_SIZE      = 512;
+
+[[noreturn]] void bad_spec(std::string_view spec, const char* why)
+{
+    throw std::runtime_error("fmt: bad format spec '" + std::string(spec)
+                             + "': " + why);
+}
+
+bool is_align(char c) { return c == '<' || c == '>' || c == '^' || c == '='; }
+
+void append_fill(std::string& out, const std::string& fill, std::size_t n)
+{
+    if (fill.size() == 1)
+        out.append(n, fill[0]);
+    else
+        while (n--)
+            out += fill;
+}
+
+// Write `body` padded to the spec's width.  `prefix` (a sign) goes
+// before any padding that `=` puts between it and the body.
+void pad(std::string_view prefix, std::string_view body, std::size_t width,
+         char align, const FormatSpec& spec, std::string& out)
+{
+    std::size_t gap = spec.width > width ? spec.width - width : 0;
+    std::size_t before = 0;
+    switch (align) {
+    case '>': before = gap;     break;
+    case '^': before = gap / 2; break;
+    case '=':
+        out.append(prefix);
+        append_fill(out, spec.fill, gap);
+        out.append(body);
+        return;
+    }
+    append_fill(out, spec.fill, before);
+    out.append(prefix);
+    out.append(body);
+    append_fill(out, spec.fill, gap - before);
+}
+
+// Write a number whose digits (of the magnitude) are in `digits`:
+// sign, grouping of the integer part, the decimal point, `suffix`,
+// then padding.
+void emit_number(bool negative, std::string_view digits,
+                 std::string_view suffix, const FormatSpec& spec,
+                 std::string& out)
+{
+    std::string_view sign = negative          ? "-"
+                          : spec.sign == '+'  ? "+"
+                          : spec.sign == ' '  ? " " : "";
+
+    std::size_t int_len = 0;
+    while (int_len < digits.size()
+           && digits[int_len] >= '0' && digits[int_len] <= '9')
+        ++int_len;
+    std::size_t groups = spec.group.empty() || int_len == 0
+                       ? 0 : (int_len - 1) / 3;
+
+    std::string_view rest = digits.substr(int_len);
+    bool point = !rest.empty() && rest[0] == '.';
+    if (point)
+        rest.remove_prefix(1);
+
+    // Everything but the group and point strings is ASCII.
+    std::size_t width = sign.size() + int_len + rest.size() + suffix.size();
+    if (groups)
+        width += groups * utf8_width(spec.group);
+    if (point)
+        width += utf8_width(spec.point);
+
+    // The body is put together in a scratch buffer, reused from call
+    // to call, so that padding can surround it.
+    thread_local std::string body;
+    body.clear();
+    for (std::size_t i = 0; i < int_len; ++i) {
+        if (i && groups && (int_len - i) % 3 == 0)
+            body += spec.group;
+        body += digits[i];
+    }
+    if (point)
+        body += spec.point;
+    body.append(rest);
+    body.append(suffix);
+
+    pad(sign, body, width, spec.align ? spec.align : '>', spec, out);
+}
+
+[[noreturn]] void wrong_type(char type, const char* value)
+{
+    throw std::runtime_error(std::string("fmt: format '") + type
+                             + "' cannot take " + value);
+}
+
+} // namespace
+
+// =================================================================
+//  FormatSpec
+// =================================================================
+
+FormatSpec FormatSpec::parse(std::string_view spec)
+{
+    FormatSpec f;
+    std::size_t i = 0;
+
+    // [[fill]align]: the fill may be any one character.
+    std::size_t first = 1;
+    while (first < spec.size()
+           && (static_cast<unsigned char>(spec[first]) & 0xC0) == 0x80)
+        ++first;
+    if (first < spec.size() && is_align(spec[first])) {
+        f.fill.assign(spec.substr(0, first));
+        f.align = spec[first];
+        i = first + 1;
+    } else if (!spec.empty() && is_align(spec[0])) {
+        f.align = spec[0];
+        i = 1;
+    }
+
+    if (i < spec.size() && (spec[i] == '+' || spec[i] == '-' || spec[i] == ' '))
+        f.sign = spec[i++];
+
+    if (i < spec.size() && spec[i] == '0') {
+        if (!f.align) {
+            f.fill  = "0";
+            f.align = '=';
+        }
+        ++i;
+    }
+
+    while (i < spec.size() && spec[i] >= '0' && spec[i] <= '9') {
+        f.width = f.width * 10 + static_cast<std::size_t>(spec[i++] - '0');
+        if (f.width > 4096)
+            bad_spec(spec, "width above 4096");
+    }
+
+    if (i < spec.size() && (spec[i] == ',' || spec[i] == '_'))
+        f.group.assign(1, spec[i++]);
+
+    if (i < spec.size() && spec[i] == '.') {
+        ++i;
+        if (i == spec.size() || spec[i] < '0' || spec[i] > '9')
+            bad_spec(spec, "no digits after '.'");
+        f.precision = 0;
+        while (i < spec.size() && spec[i] >= '0' && spec[i] <= '9') {
+            f.precision = f.precision * 10 + (spec[i++] - '0');
+            if (f.precision > MAX_PRECISION)
+                bad_spec(spec, "precision above 100");
+        }
+    }
+
+    if (i < spec.size()) {
+        switch (spec[i]) {
+        case 's': case 'd': case 'f': case 'e': case 'g': case '%':
+            f.type = spec[i++];
+            break;
+        }
+    }
+    if (i != spec.size())
+        bad_spec(spec, "unexpected characters");
+    if (f.type == 'd' && f.precision >= 0)
+        bad_spec(spec, "no precision with 'd'");
+    return f;
+}
+
+// =================================================================
+//  Values
+// =================================================================
+
+void format_integer(long long v, const FormatSpec& spec, std::string& out)
+{
+    switch (spec.type) {
+    case 0:
+    case 'd':
+        break;
+    case 's':
+        wrong_type(spec.type, "a number");
+    default:
+        format_number(static_cast<double>(v), spec, out);
+        return;
+    }
+
+    // The magnitude as unsigned, so that the most negative value
+    // has one too.
+    unsigned long long mag = v < 0 ? 0ull - static_cast<unsigned long long>(v)
+                                   : static_cast<unsigned long long>(v);
+    char buf[32];
+    auto r = std::to_chars(buf, buf + sizeof buf, mag);
+    emit_number(v < 0, std::string_view(buf, r.ptr - buf), "", spec, out);
+}
+
+void format_number(double v, const FormatSpec& spec, std::string& out)
+{
+    char buf[BUF_SIZE];
+    char* const end = buf + sizeof buf;
+    const double a = std::fabs(v);
+    const int p = spec.precision;
+    std::to_chars_result r;
+
+    switch (spec.type) {
+    case 'd':
+        r = std::to_chars(buf, end, std::nearbyint(a),
+                          std::chars_format::fixed, 0);
+        break;
+    case 'f':
+        r = std::to_chars(buf, end, a, std::chars_format::fixed, p < 0 ? 6 : p);
+        break;
+    case '%':
+        r = std::to_chars(buf, end, a * 100, std::chars_format::fixed,
+                          p < 0 ? 6 : p);
+        break;
+    case 'e':
+        r = std::to_chars(buf, end, a, std::chars_format::scientific,
+                          p < 0 ? 6 : p);
+        break;
+    case 'g':
+        r = std::to_chars(buf, end, a, std::chars_format::general,
+                          p < 0 ? 6 : p);
+        break;
+    case 's':
+        wrong_type(spec.type, "a number");
+    default:
+        r = std::to_chars(buf, end, a, std::chars_format::general,
+                          p < 0 ? 14 : p);
+        break;
+    }
+
+    // A value that rounds to zero keeps its sign, as in printf.
+    bool negative = std::signbit(v) && !std::isnan(v);
+    emit_number(negative, std::string_view(buf, r.ptr - buf),
+                spec.type == '%' ? "%" : "", spec, out);
+}
+
+void format_string(std::string_view s, const FormatSpec& spec, std::string& out)
+{
+    if (spec.type && spec.type != 's')
+        wrong_type(spec.type, "text");
+    if (spec.align == '=')
+        throw std::runtime_error("fmt: '=' alignment needs a number");
+
+    if (spec.precision >= 0)
+        s = s.substr(0, utf8_prefix(s, static_cast<std::size_t>(spec.precision)));
+    if (spec.width == 0) {
+        out.append(s);
+        return;
+    }
+    pad("", s, utf8_width(s), spec.align ? spec.align : '<', spec, out);
+}
+
+void append_number(double v, std::string& out)
+{
+    char buf[64];
+    auto r = std::to_chars(buf, buf + sizeof buf, v,
+                           std::chars_format::general, 14);
+    out.append(buf, r.ptr);
+}
+
+// =================================================================
+//  Formatter
+// =================================================================
+
+Formatter::Formatter(std::string_view pattern)
+    : pattern_(pattern)
+{
+    std::string text;
+    std::size_t i = 0;
+    while (i < pattern.size()) {
+        char c = pattern[i];
+        if (c == '}') {
+            if (i + 1 < pattern.size() && pattern[i + 1] == '}') {
+                text += '}';
+                i += 2;
+                continue;
+            }
+            throw std::runtime_error("fmt: single '}' in '"
+                                     + pattern_ + "'");
+        }
+        if (c != '{') {
+            text += c;
+            ++i;
+            continue;
+        }
+        if (i + 1 < pattern.size() && pattern[i + 1] == '{') {
+            text += '{';
+            i += 2;
+            continue;
+        }
+
+        std::size_t close = pattern.find('}', i);
+        if (close == std::string_view::npos)
+            throw std::runtime_error("fmt: unclosed '{' in '"
+                                     + pattern_ + "'");
+        std::string_view field = pattern.substr(i + 1, close - i - 1);
+        if (!field.empty() && field[0] != ':')
+            throw std::runtime_error("fmt: fields take no name or number: '{"
+                                     + std::string(field) + "}'");
+        specs_.push_back(field.empty() ? FormatSpec()
+                                       : FormatSpec::parse(field.substr(1)));
+        texts_.push_back(std::move(text));
+        text.clear();
+        i = close + 1;
+    }
+    texts_.push_back(std::move(text));
+}
+
+// =================================================================
+//  Lua side
+// =================================================================
+
+namespace {
+
+template <class F>
+int guarded(lua_State* L, F&& body)
+{
+    try {
+        return body();
+    } catch (const std::exception& e) {
+        lua_pushstring(L, e.what());
+    }
+    return lua_error(L);
+}
+
+std::string_view check_view(lua_State* L, int idx)
+{
+    std::size_t len;
+    const char* s = luaL_checklstring(L, idx, &len);
+    return std::string_view(s, len);
+}
+
+std::size_t check_width(lua_State* L, int idx)
+{
+    lua_Integer n = luaL_checkinteger(L, idx);
+    luaL_argcheck(L, n >= 0, idx, "negative width");
+    return static_cast<std::size_t>(n);
+}
+
+int check_decimals(lua_State* L, int idx, int def)
+{
+    lua_Integer n = luaL_optinteger(L, idx, def);
+    luaL_argcheck(L, n >= 0 && n <= MAX_PRECISION, idx,
+                  "decimals out of range");
+    return static_cast<int>(n);
+}
+
+void push_text(lua_State* L, const std::string& s)
+{
+    lua_pushlstring(L, s.data(), s.size());
+}
+
+// One value of any Lua type under `spec`.  A string that reads as a
+// number is taken as one when the spec asks for a number.
+void format_value(lua_State* L, int idx, const FormatSpec& spec,
+                  std::string& out)
+{
+    switch (lua_type(L, idx)) {
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, idx)) {
+            format_integer(static_cast<long long>(lua_tointeger(L, idx)),
+                           spec, out);
+            break;
+        }
+#endif
+        format_number(lua_tonumber(L, idx), spec, out);
+        break;
+    case LUA_TSTRING:
+        if (spec.type && spec.type != 's' && lua_isnumber(L, idx)) {
+            format_number(lua_tonumber(L, idx), spec, out);
+        } else {
+            std::size_t len;
+            const char* s = lua_tolstring(L, idx, &len);
+            format_string(std::string_view(s, len), spec, out);
+        }
+        break;
+    case LUA_TBOOLEAN:
+        format_string(lua_toboolean(L, idx) ? "true" : "false", spec, out);
+        break;
+    case LUA_TNIL:
+    case LUA_TNONE:
+        format_string("nil", spec, out);
+        break;
+    default:
+        throw std::runtime_error(std::string("fmt: cannot format a ")
+                                 + luaL_typename(L, idx));
+    }
+}
+
+// Format the values from stack index `first` on with `f` and push
+// the result.
+int apply(lua_State* L, const Formatter& f, int first)
+{
+    return guarded(L, [&]{
+        int given = lua_gettop(L) - first + 1;
+        if (given < static_cast<int>(f.fields()))
+            throw std::runtime_error("fmt: '" + f.pattern() + "' has "
+                + std::to_string(f.fields()) + " fields but "
+                + std::to_string(std::max(given, 0)) + " values");
+
+        thread_local std::string out;
+        out.clear();
+        for (std::size_t i = 0; i < f.fields(); ++i) {
+            out += f.text(i);
+            format_value(L, first + static_cast<int>(i), f.spec(i), out);
+        }
+        out += f.text(f.fields());
+        push_text(L, out);
+        return 1;
+    });
+}
+
+Formatter* to_formatter(lua_State* L, int idx)
+{
+    return static_cast<Formatter*>(luaL_testudata(L, idx, FORMATTER_META));
+}
+
+Formatter& push_formatter(lua_State* L, std::string_view pattern)
+{
+    void* mem = lua_newuserdata(L, sizeof(Formatter));
+    Formatter* f;
+    try {
+        f = new (mem) Formatter(pattern);
+    } catch (...) {
+        lua_pop(L, 1);          // no metatable yet: __gc never runs
+        throw;
+    }
+    luaL_setmetatable(L, FORMATTER_META);
+    return *f;
+}
+
+// lroff.fmt.compile(pattern): a callable formatter.
+int fmt_compile(lua_State* L)
+{
+    std::string_view pattern = check_view(L, 1);
+    return guarded(L, [&]{
+        push_formatter(L, pattern);
+        return 1;
+    });
+}
+
+// lroff.fmt.format(pattern, ...): patterns are compiled once and
+// kept while in use, in a table with weak values.
+int fmt_format(lua_State* L)
+{
+    std::string_view pattern = check_view(L, 1);
+    lua_getfield(L, LUA_REGISTRYINDEX, FORMATS_KEY);
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);
+    Formatter* f = to_formatter(L, -1);
+    if (!f) {
+        lua_pop(L, 1);
+        guarded(L, [&]{
+            f = &push_formatter(L, pattern);
+            return 0;
+        });
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+
+    // The formatter takes the pattern's place, which keeps it alive
+    // while it runs.
+    lua_replace(L, 1);
+    lua_pop(L, 1);
+    return apply(L, *f, 2);
+}
+
+int formatter_call(lua_State* L)
+{
+    return apply(L, *static_cast<Formatter*>(
+        luaL_checkudata(L, 1, FORMATTER_META)), 2);
+}
+
+int formatter_tostring(lua_State* L)
+{
+    auto* f = static_cast<Formatter*>(luaL_checkudata(L, 1, FORMATTER_META));
+    lua_pushfstring(L, "formatter: %s", f->pattern().c_str());
+    return 1;
+}
+
+int formatter_gc(lua_State* L)
+{
+    if (Formatter* f = to_formatter(L, 1))
+        f->~Formatter();
+    return 0;
+}
+
+// lroff.fmt.number(n, decimals, sep, point): 1234567.891 -> 1,234,568
+int fmt_number(lua_State* L)
+{
+    FormatSpec spec;
+    spec.type      = 'f';
+    spec.precision = check_decimals(L, 2, 0);
+    spec.group     = luaL_optstring(L, 3, ",");
+    spec.point     = luaL_optstring(L, 4, ".");
+    double v = luaL_checknumber(L, 1);
+    return guarded(L, [&]{
+        thread_local std::string out;
+        out.clear();
+        format_number(v, spec, out);
+        push_text(L, out);
+        return 1;
+    });
+}
+
+// lroff.fmt.percent(x, decimals): 0.1234 -> 12.3%
+int fmt_percent(lua_State* L)
+{
+    FormatSpec spec;
+    spec.type      = '%';
+    spec.precision = check_decimals(L, 2, 1);
+    double v = luaL_checknumber(L, 1);
+    std::string out;
+    format_number(v, spec, out);
+    push_text(L, out);
+    return 1;
+}
+
+// lroff.fmt.delta(now, before, decimals): the change in per cent,
+// always signed; nil when there is nothing to compare with.
+int fmt_delta(lua_State* L)
+{
+    double now = luaL_checknumber(L, 1);
+    if (lua_isnoneornil(L, 2) || luaL_checknumber(L, 2) == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    double before = lua_tonumber(L, 2);
+    FormatSpec spec;
+    spec.type      = '%';
+    spec.sign      = '+';
+    spec.precision = check_decimals(L, 3, 1);
+    std::string out;
+    format_number((now - before) / std::fabs(before), spec, out);
+    push_text(L, out);
+    return 1;
+}
+
+// lroff.fmt.pad(s, width, align, fill)
+int fmt_pad(lua_State* L)
+{
+    std::string_view s = check_view(L, 1);
+    FormatSpec spec;
+    spec.width = check_width(L, 2);
+    std::string_view align = luaL_optstring(L, 3, "<");
+    luaL_argcheck(L, align == "<" || align == ">" || align == "^", 3,
+                  "'<', '>' or '^' expected");
+    spec.align = align[0];
+    spec.fill  = luaL_optstring(L, 4, " ");
+    luaL_argcheck(L, !spec.fill.empty()
+                  && utf8_prefix(spec.fill, 1) == spec.fill.size(), 4,
+                  "one character expected");
+    std::string out;
+    format_string(s, spec, out);
+    push_text(L, out);
+    return 1;
+}
+
+// lroff.fmt.truncate(s, width, tail): at most `width` columns, the
+// tail ("...") included when something was cut.
+int fmt_truncate(lua_State* L)
+{
+    std::string_view s = check_view(L, 1);
+    std::size_t width = check_width(L, 2);
+    std::string_view tail = lua_isnoneornil(L, 3) ? std::string_view()
+                                                  : check_view(L, 3);
+    if (utf8_width(s) <= width) {
+        lua_pushvalue(L, 1);
+        return 1;
+    }
+    std::size_t room = width - std::min(width, utf8_width(tail));
+    std::string out(s.substr(0, utf8_prefix(s, room)));
+    out.append(tail);
+    push_text(L, out);
+    return 1;
+}
+
+// lroff.fmt.width(s): columns, not bytes.
+int fmt_width(lua_State* L)
+{
+    lua_pushinteger(L, static_cast<lua_Integer>(utf8_width(check_view(L, 1))));
+    return 1;
+}
+
+} // namespace
+
+void register_fmt(sol::state& lua, sol::table& lroff)
+{
+    lua_State* L = lua.lua_state();
+
+    if (luaL_newmetatable(L, FORMATTER_META)) {
+        static const luaL_Reg meta[] = {
+            { "__call",     formatter_call     },
+            { "__tostring", formatter_tostring },
+            { "__gc",       formatter_gc       },
+            { nullptr,      nullptr            },
+        };
+        luaL_setfuncs(L, meta, 0);
+    }
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, FORMATS_KEY);
+
+    sol::table fmt = lua.create_table();
+    fmt["format"]   = fmt_format;
+    fmt["compile"]  = fmt_compile;
+    fmt["number"]   = fmt_number;
+    fmt["percent"]  = fmt_percent;
+    fmt["delta"]    = fmt_delta;
+    fmt["pad"]      = fmt_pad;
+    fmt["truncate"] = fmt_truncate;
+    fmt["width"]    = fmt_width;
+    lroff["fmt"]    = fmt;
+}
+
+} // namespace pplua
@@ -0,0 +1,88 @@
+// src/format.hpp
+//
+// lroff.fmt — number and column formatting.  Numbers are written
+// with std::to_chars; widths are counted in UTF-8 columns, so that
+// padded and truncated cells line up whatever the script.
+
+#ifndef PPLUA_FORMAT_HPP
+#define PPLUA_FORMAT_HPP
+
+#define SOL_ALL_SAFETIES_ON 1
+#include <sol/sol.hpp>
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pplua {
+
+// =====================================================================
+//  FormatSpec — how to write one value
+//
+//  The text form is Python's format-spec mini-language:
+//
+//      [[fill]align][sign][0][width][grouping][.precision][type]
+//
+//  align is < > ^ or = (pad after the sign); sign is + - or space;
+//  grouping is , or _; type is s d f e g or %.  "{:>12,.2f}" right-
+//  aligns a number with two decimals and thousands separators in
+//  twelve columns.
+// =====================================================================
+struct FormatSpec {
+    std::string fill  = " ";    // one character, possibly multi-byte
+    char        align = 0;      // 0: right for numbers, left for text
+    char        sign  = '-';
+    std::size_t width = 0;      // in columns
+    std::string group;          // between groups of three digits
+    std::string point = ".";    // the decimal point
+    int         precision = -1; // -1: the type's default
+    char        type  = 0;      // 0: as the value comes
+
+    /// Parse the text form.  Throws std::runtime_error.
+    static FormatSpec parse(std::string_view spec);
+};
+
+/// Append `v` to `out` as `spec` says.  Each throws
+/// std::runtime_error if the spec's type does not suit the value.
+void format_integer(long long v,        const FormatSpec& spec, std::string& out);
+void format_number (double v,           const FormatSpec& spec, std::string& out);
+void format_string (std::string_view s, const FormatSpec& spec, std::string& out);
+
+/// Append `v` as Lua's tostring writes a float (%.14g), without
+/// going through printf.
+void append_number(double v, std::string& out);
+
+// =====================================================================
+//  Formatter — a compiled format string
+//
+//  Literal text with a field for each value: {} or {:spec}.  {{ and
+//  }} stand for braces.  Parsing happens once, in the constructor;
+//  formatting is then a walk over the pieces.
+// =====================================================================
+class Formatter {
+public:
+    /// Throws std::runtime_error on a malformed pattern.
+    explicit Formatter(std::string_view pattern);
+
+    const std::string& pattern() const { return pattern_; }
+    std::size_t        fields()  const { return specs_.size(); }
+
+    /// The literal text before field `i`; text(fields()) is what
+    /// follows the last one.
+    const std::string& text(std::size_t i) const { return texts_[i]; }
+    const FormatSpec&  spec(std::size_t i) const { return specs_[i]; }
+
+private:
+    std::string              pattern_;
+    std::vector<std::string> texts_;
+    std::vector<FormatSpec>  specs_;
+};
+
+/// Install lroff.fmt (format, compile, number, percent, delta, pad,
+/// truncate, width) into `lroff`.
+void register_fmt(sol::state& lua, sol::table& lroff);
+
+} // namespace pplua
+
+#endif // PPLUA_FORMAT_HPP
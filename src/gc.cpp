@@ -0,0 +1,175 @@
+// src/gc.cpp
+//
+// GcMonitor: collector options, the tracking allocator and the
+// cycle-counting sentinel.
+
+#include "gc.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <ostream>
+
+namespace pplua {
+
+bool parse_gc_mode(const std::string& s, GcOptions::Mode& out)
+{
+    if (s == "incremental")  { out = GcOptions::Mode::incremental;  return true; }
+    if (s == "generational") { out = GcOptions::Mode::generational; return true; }
+    return false;
+}
+
+bool parse_gc_between(const std::string& s, GcOptions::Between& out)
+{
+    if (s == "full") { out = GcOptions::Between::full; return true; }
+    if (s == "none") { out = GcOptions::Between::none; return true; }
+    return false;
+}
+
+// =================================================================
+//  Allocation
+// =================================================================
+
+void* GcMonitor::allocate(void* ud, void* ptr, std::size_t osize,
+                          std::size_t nsize)
+{
+    auto* self = static_cast<GcMonitor*>(ud);
+    // With ptr == nullptr, osize is a type tag, not a size.
+    std::size_t old = ptr ? osize : 0;
+
+    if (nsize == 0) {
+        std::free(ptr);
+        self->heap_ -= old;
+        return nullptr;
+    }
+    void* p = std::realloc(ptr, nsize);
+    if (p) {
+        self->heap_ += nsize - old;
+        self->peak_ = std::max(self->peak_, self->heap_);
+    }
+    return p;
+}
+
+void GcMonitor::sample_heap()
+{
+    if (!L_ || tracked_)
+        return;
+    heap_ = static_cast<std::size_t>(lua_gc(L_, LUA_GCCOUNT, 0)) * 1024
+          + static_cast<std::size_t>(lua_gc(L_, LUA_GCCOUNTB, 0));
+    peak_ = std::max(peak_, heap_);
+}
+
+// =================================================================
+//  Set-up
+// =================================================================
+
+void GcMonitor::attach(lua_State* L)
+{
+    L_ = L;
+    void* ud = nullptr;
+    tracked_ = lua_getallocf(L, &ud) == &GcMonitor::allocate;
+
+#ifdef LUA_GCGEN
+    if (opts_.mode == GcOptions::Mode::generational)
+        lua_gc(L, LUA_GCGEN, 0, 0);
+    else if (opts_.mode == GcOptions::Mode::incremental)
+        lua_gc(L, LUA_GCINC, 0, 0, 0);
+#endif
+    if (opts_.pause >= 0)
+        lua_gc(L, LUA_GCSETPAUSE, opts_.pause);
+    if (opts_.stepmul >= 0)
+        lua_gc(L, LUA_GCSETSTEPMUL, opts_.stepmul);
+    if (opts_.between == GcOptions::Between::none)
+        lua_gc(L, LUA_GCSTOP, 0);
+
+    if (opts_.stats) {
+        plant_sentinel();
+        sample_heap();
+        mark_ = total_;
+    }
+}
+
+// __gc of the sentinel.  Upvalue 1 is the GcMonitor.
+int GcMonitor::on_sentinel(lua_State* L)
+{
+    auto* self = static_cast<GcMonitor*>(lua_touserdata(L, lua_upvalueindex(1)));
+    ++self->total_.cycles;
+    if (self->L_)
+        self->plant_sentinel();
+    return 0;
+}
+
+void GcMonitor::plant_sentinel()
+{
+    lua_newuserdata(L_, 1);
+    if (luaL_newmetatable(L_, "pplua.gc.sentinel")) {
+        lua_pushlightuserdata(L_, this);
+        lua_pushcclosure(L_, &GcMonitor::on_sentinel, 1);
+        lua_setfield(L_, -2, "__gc");
+    }
+    lua_setmetatable(L_, -2);
+    lua_pop(L_, 1);                     // unreachable from now on
+}
+
+// =================================================================
+//  Per document
+// =================================================================
+
+void GcMonitor::collect()
+{
+    if (!L_)
+        return;
+    auto t0 = std::chrono::steady_clock::now();
+    lua_gc(L_, LUA_GCCOLLECT, 0);
+    total_.full_secs += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t0).count();
+    ++total_.full;
+}
+
+void GcMonitor::after_block()
+{
+    if (!L_)
+        return;
+    sample_heap();
+    if (opts_.between == GcOptions::Between::full)
+        collect();
+}
+
+void GcMonitor::begin_document()
+{
+    if (L_ && opts_.between == GcOptions::Between::full)
+        collect();
+    sample_heap();
+    mark_ = total_;
+    peak_ = heap_;
+}
+
+GcMonitor::Stats GcMonitor::document_stats()
+{
+    sample_heap();
+    Stats s;
+    s.cycles     = total_.cycles - mark_.cycles;
+    s.full       = total_.full - mark_.full;
+    s.full_secs  = total_.full_secs - mark_.full_secs;
+    s.peak_bytes = peak_;
+    s.heap_bytes = heap_;
+    return s;
+}
+
+void GcMonitor::report(std::ostream& out, const std::string& label)
+{
+    out << "pplua: stats: " << label << ": ";
+    if (!L_) {
+        out << "no Lua\n";
+        return;
+    }
+    Stats s = document_stats();
+    out << "gc " << s.cycles << " cycles";
+    if (s.full)
+        out << " (" << s.full << " full, "
+            << s.full_secs * 1e3 << " ms)";
+    out << ", heap peak " << (s.peak_bytes + 1023) / 1024 << " KiB"
+        << ", now " << (s.heap_bytes + 1023) / 1024 << " KiB\n";
+}
+
+} // namespace pplua
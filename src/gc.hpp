@@ -0,0 +1,111 @@
+// src/gc.hpp
+//
+// Garbage-collector control and telemetry: the --gc options and the
+// collector statistics that --stats reports per document.
+
+#ifndef PPLUA_GC_HPP
+#define PPLUA_GC_HPP
+
+#define SOL_ALL_SAFETIES_ON 1
+#include <sol/sol.hpp>
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+
+namespace pplua {
+
+// =====================================================================
+//  GcOptions — how the collector is run
+// =====================================================================
+struct GcOptions {
+    enum class Mode    { lua_default, incremental, generational };
+    enum class Between { lua_default, full, none };
+
+    Mode    mode    = Mode::lua_default;    // --gc
+    int     pause   = -1;                   // --gc-pause (-1: leave)
+    int     stepmul = -1;                   // --gc-stepmul (-1: leave)
+
+    // --gc-between: `full` collects after every block and between
+    // batch documents; `none` stops the collector for the whole run.
+    Between between = Between::lua_default;
+
+    // --stats: count cycles and track the heap.
+    bool    stats   = false;
+};
+
+/// Parse the value of --gc / --gc-between.  Returns false if unknown.
+bool parse_gc_mode(const std::string& s, GcOptions::Mode& out);
+bool parse_gc_between(const std::string& s, GcOptions::Between& out);
+
+// =====================================================================
+//  GcMonitor
+//
+//  With stats enabled the Lua state is created on allocate(), which
+//  tracks the live heap and its high-water mark.  Completed cycles
+//  are counted by a finalizer sentinel: an unreachable userdata whose
+//  __gc bumps the count and leaves a new sentinel behind, so every
+//  cycle that sweeps it is seen.  Lua has no hook into incremental
+//  steps, so the time reported is that of the full collections pplua
+//  runs itself (--gc-between full).  On LuaJIT, whose 64-bit builds
+//  may not take a custom allocator, the heap is sampled after each
+//  block instead.
+// =====================================================================
+class GcMonitor {
+public:
+    struct Stats {
+        std::size_t cycles      = 0;    // cycles completed
+        std::size_t full        = 0;    // collections pplua ran
+        double      full_secs   = 0;    // ... and their time
+        std::size_t peak_bytes  = 0;    // heap high-water mark
+        std::size_t heap_bytes  = 0;    // heap now
+    };
+
+    explicit GcMonitor(const GcOptions& opts) : opts_(opts) {}
+
+    GcMonitor(const GcMonitor&) = delete;
+    GcMonitor& operator=(const GcMonitor&) = delete;
+
+    /// A lua_Alloc for the state; `ud` is the GcMonitor.
+    static void* allocate(void* ud, void* ptr, std::size_t osize,
+                          std::size_t nsize);
+
+    /// Apply the options to a fresh state and plant the sentinel.
+    void attach(lua_State* L);
+
+    /// The state is about to close: stop replanting the sentinel.
+    void detach() { L_ = nullptr; }
+
+    /// Start a new document's statistics.
+    void begin_document();
+
+    /// A block has finished: collect if --gc-between full.
+    void after_block();
+
+    /// Run a full collection and time it.
+    void collect();
+
+    /// Statistics since begin_document().
+    Stats document_stats();
+
+    /// Write one "pplua: stats: LABEL: ..." line.
+    void report(std::ostream& out, const std::string& label);
+
+private:
+    GcOptions   opts_;
+    lua_State*  L_ = nullptr;
+    bool        tracked_ = false;   // allocate() is the state's allocator
+
+    std::size_t heap_ = 0;
+    std::size_t peak_ = 0;
+    Stats       total_;             // since the state was created
+    Stats       mark_;              // totals at begin_document()
+
+    static int  on_sentinel(lua_State* L);
+    void        plant_sentinel();
+    void        sample_heap();
+};
+
+} // namespace pplua
+
+#endif // PPLUA_GC_HPP
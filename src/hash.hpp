@@ -0,0 +1,52 @@
+// src/hash.hpp
+//
+// SHA-256 digests, used wherever pplua needs a content address
+// (the output cache, dependency manifests).
+
+#ifndef PPLUA_HASH_HPP
+#define PPLUA_HASH_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace pplua {
+
+// =====================================================================
+//  Sha256 — incremental FIPS 180-4 SHA-256
+// =====================================================================
+class Sha256 {
+public:
+    Sha256();
+
+    /// Feed raw bytes.
+    void update(const void* data, std::size_t len);
+    void update(const std::string& s) { update(s.data(), s.size()); }
+
+    /// Feed a length-prefixed field, so that consecutive fields
+    /// cannot run into each other ("ab","c" != "a","bc").
+    void field(const std::string& s);
+
+    /// Finish and return the digest as 64 lowercase hex digits.
+    /// The object must not be updated afterwards.
+    std::string hex_digest();
+
+private:
+    std::array<std::uint32_t, 8> h_;
+    std::array<unsigned char, 64> block_;
+    std::size_t   block_len_ = 0;
+    std::uint64_t total_len_ = 0;
+
+    void compress(const unsigned char* p);
+};
+
+/// Digest of an in-memory string.
+std::string sha256_hex(const std::string& data);
+
+/// Digest of a file's contents.  Returns false if it can't be read.
+bool sha256_file(const std::string& path, std::string& hex_out);
+
+} // namespace pplua
+
+#endif // PPLUA_HASH_HPP
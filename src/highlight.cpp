@@ -0,0 +1,2260 @@
+// src/highlight.cpp
+//
+// lroff.highlight: reading .sublime-syntax grammars, matching them
+// line by line, and writing the result as groff text.
+
+#include "highlight.hpp"
+
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifdef PPLUA_PCRE2
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#endif
+
+namespace pplua {
+
+namespace {
+
+constexpr std::size_t npos = std::string::npos;
+
+std::string_view trim(std::string_view s)
+{
+    std::size_t a = s.find_first_not_of(" \t");
+    if (a == npos)
+        return std::string_view();
+    std::size_t z = s.find_last_not_of(" \t");
+    return s.substr(a, z - a + 1);
+}
+
+void append_utf8(std::string& out, unsigned long cp)
+{
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+// =================================================================
+//  YAML — as much of it as grammars are written in
+// =================================================================
+
+struct YamlNode {
+    enum class Kind { null, scalar, map, seq };
+
+    Kind        kind = Kind::null;
+    std::string scalar;
+    std::vector<std::pair<std::string, YamlNode>> map;
+    std::vector<YamlNode> seq;
+
+    const YamlNode* get(const std::string& key) const {
+        for (auto& kv : map)
+            if (kv.first == key)
+                return &kv.second;
+        return nullptr;
+    }
+    std::string text(const std::string& key) const {
+        const YamlNode* n = get(key);
+        return n && n->kind == Kind::scalar ? n->scalar : std::string();
+    }
+};
+
+// The part of a line before its comment, trimmed.  A quote opens a
+// quoted scalar only where one can start.
+std::string_view strip_comment(std::string_view s)
+{
+    char quote = 0;
+    for (std::size_t i = 0; i < s.size(); ++i) {
+        char c = s[i];
+        char prev = i ? s[i - 1] : ' ';
+        if (quote) {
+            if (quote == '"' && c == '\\')
+                ++i;
+            else if (c == quote)
+                quote = 0;
+        } else if ((c == '\'' || c == '"')
+                   && (prev == ' ' || prev == '[' || prev == ',')) {
+            quote = c;
+        } else if (c == '#' && (prev == ' ' || prev == '\t')) {
+            return trim(s.substr(0, i));
+        }
+    }
+    return trim(s);
+}
+
+bool is_item(std::string_view t)
+{
+    return t == "-" || (t.size() > 1 && t[0] == '-' && t[1] == ' ');
+}
+
+// Where the ':' after a mapping key is, or npos.
+std::size_t key_colon(std::string_view t)
+{
+    if (!t.empty() && (t[0] == '\'' || t[0] == '"')) {
+        std::size_t i = 1;
+        for (; i < t.size(); ++i) {
+            if (t[0] == '"' && t[i] == '\\') {
+                ++i;
+            } else if (t[i] == t[0]) {
+                if (t[0] == '\'' && i + 1 < t.size() && t[i + 1] == '\'')
+                    ++i;
+                else
+                    break;
+            }
+        }
+        std::size_t c = i + 1;
+        return c < t.size() && t[c] == ':'
+            && (c + 1 == t.size() || t[c + 1] == ' ') ? c : npos;
+    }
+    for (std::size_t i = 0; i < t.size(); ++i)
+        if (t[i] == ':' && (i + 1 == t.size() || t[i + 1] == ' '))
+            return i;
+    return npos;
+}
+
+class YamlReader {
+public:
+    YamlReader(const std::string& text, std::string name);
+
+    YamlNode document();
+
+private:
+    struct Line {
+        int         indent;
+        std::string text;       // after the indentation
+        int         no;
+    };
+    std::vector<Line> lines_;
+    std::size_t       i_ = 0;
+    std::string       name_;
+
+    bool        next(int& indent);
+    YamlNode    block(int indent);
+    YamlNode    mapping(int indent);
+    YamlNode    sequence(int indent);
+    YamlNode    value(std::string_view rest, int indent, int no);
+    YamlNode    block_scalar(std::string_view header, int indent);
+    std::string scalar(std::string_view s, int no) const;
+    [[noreturn]] void fail(int no, const std::string& what) const;
+};
+
+YamlReader::YamlReader(const std::string& text, std::string name)
+    : name_(std::move(name))
+{
+    std::size_t pos = 0;
+    int no = 0;
+    while (pos <= text.size()) {
+        std::size_t nl = text.find('\n', pos);
+        if (nl == npos)
+            nl = text.size();
+        std::string line = text.substr(pos, nl - pos);
+        pos = nl + 1;
+        ++no;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.compare(0, 1, "%") == 0 || line.compare(0, 3, "---") == 0)
+            continue;
+        if (line.compare(0, 3, "...") == 0)
+            break;
+        std::size_t ind = line.find_first_not_of(' ');
+        if (ind == npos)
+            ind = line.size();
+        lines_.push_back({ static_cast<int>(ind), line.substr(ind), no });
+    }
+}
+
+void YamlReader::fail(int no, const std::string& what) const
+{
+    throw std::runtime_error("syntax: " + name_ + ":" + std::to_string(no)
+                             + ": " + what);
+}
+
+// Move to the next line with content; its indentation goes to `indent`.
+bool YamlReader::next(int& indent)
+{
+    for (; i_ < lines_.size(); ++i_) {
+        if (!strip_comment(lines_[i_].text).empty()) {
+            indent = lines_[i_].indent;
+            return true;
+        }
+    }
+    return false;
+}
+
+YamlNode YamlReader::document()
+{
+    int indent;
+    YamlNode doc = next(indent) ? block(indent) : YamlNode();
+    if (next(indent))
+        fail(lines_[i_].no, "unexpected indentation");
+    return doc;
+}
+
+YamlNode YamlReader::block(int indent)
+{
+    return is_item(strip_comment(lines_[i_].text)) ? sequence(indent)
+                                                    : mapping(indent);
+}
+
+YamlNode YamlReader::mapping(int indent)
+{
+    YamlNode node;
+    node.kind = YamlNode::Kind::map;
+    int ind;
+    while (next(ind) && ind == indent) {
+        std::string_view t = strip_comment(lines_[i_].text);
+        int no = lines_[i_].no;
+        if (is_item(t))
+            break;
+        std::size_t colon = key_colon(t);
+        if (colon == npos)
+            fail(no, "expected 'key: value'");
+        std::string key = scalar(trim(t.substr(0, colon)), no);
+        std::string rest(trim(t.substr(colon + 1)));
+        ++i_;
+        node.map.emplace_back(std::move(key), value(rest, indent, no));
+    }
+    if (next(ind) && ind > indent)
+        fail(lines_[i_].no, "unexpected indentation");
+    return node;
+}
+
+YamlNode YamlReader::sequence(int indent)
+{
+    YamlNode node;
+    node.kind = YamlNode::Kind::seq;
+    int ind;
+    while (next(ind) && ind == indent) {
+        Line& l = lines_[i_];
+        std::string_view t = strip_comment(l.text);
+        if (!is_item(t))
+            break;
+        std::string_view rest = trim(t.substr(1));
+        if (rest.empty()) {
+            ++i_;
+            int child;
+            node.seq.push_back(next(child) && child > indent ? block(child)
+                                                             : YamlNode());
+            continue;
+        }
+        // "- key: value" and "- - item" open a collection that lines
+        // up with what follows the dash.
+        if (is_item(rest) || (rest[0] != '[' && key_colon(rest) != npos)) {
+            std::size_t off = l.text.find_first_not_of(' ', 1);
+            l.indent += static_cast<int>(off);
+            l.text.erase(0, off);
+            node.seq.push_back(block(l.indent));
+            continue;
+        }
+        std::string item(rest);
+        int no = l.no;
+        ++i_;
+        node.seq.push_back(value(item, indent, no));
+    }
+    return node;
+}
+
+YamlNode YamlReader::value(std::string_view rest, int indent, int no)
+{
+    YamlNode node;
+    if (rest.empty()) {
+        int ind;
+        if (!next(ind))
+            return node;
+        if (ind > indent)
+            return block(ind);
+        if (ind == indent && is_item(strip_comment(lines_[i_].text)))
+            return sequence(indent);
+        return node;
+    }
+    if (rest[0] == '|' || rest[0] == '>')
+        return block_scalar(rest, indent);
+    if (rest[0] == '{') {
+        if (rest != "{}")
+            fail(no, "flow mappings are not supported");
+        node.kind = YamlNode::Kind::map;
+        return node;
+    }
+    if (rest[0] == '[') {
+        if (rest.back() != ']')
+            fail(no, "unterminated flow sequence");
+        node.kind = YamlNode::Kind::seq;
+        std::string_view body = trim(rest.substr(1, rest.size() - 2));
+        char quote = 0;
+        std::size_t start = 0;
+        for (std::size_t i = 0; i <= body.size(); ++i) {
+            char c = i < body.size() ? body[i] : ',';
+            if (quote) {
+                if (c == quote)
+                    quote = 0;
+            } else if (c == '\'' || c == '"') {
+                quote = c;
+            } else if (c == ',') {
+                std::string_view item = trim(body.substr(start, i - start));
+                if (!item.empty()) {
+                    YamlNode s;
+                    s.kind = YamlNode::Kind::scalar;
+                    s.scalar = scalar(item, no);
+                    node.seq.push_back(std::move(s));
+                }
+                start = i + 1;
+            }
+        }
+        return node;
+    }
+    node.kind = YamlNode::Kind::scalar;
+    node.scalar = scalar(rest, no);
+    return node;
+}
+
+// | and > scalars: the lines indented past the key.
+YamlNode YamlReader::block_scalar(std::string_view header, int indent)
+{
+    const bool folded = header[0] == '>';
+    const char chomp  = header.size() > 1 ? header[1] : 0;
+
+    std::vector<std::string> body;
+    int inner = -1;
+    for (; i_ < lines_.size(); ++i_) {
+        const Line& l = lines_[i_];
+        bool blank = trim(l.text).empty();
+        if (!blank && l.indent <= indent)
+            break;
+        if (!blank && inner < 0)
+            inner = l.indent;
+        body.push_back(blank ? std::string()
+                             : std::string(l.indent - inner, ' ') + l.text);
+    }
+
+    YamlNode node;
+    node.kind = YamlNode::Kind::scalar;
+    std::string& s = node.scalar;
+    for (std::size_t k = 0; k < body.size(); ++k) {
+        if (k && !(folded && !body[k].empty() && !body[k - 1].empty()))
+            s += '\n';
+        else if (k)
+            s += ' ';
+        s += body[k];
+    }
+    if (chomp != '-') {
+        while (!s.empty() && s.back() == '\n')
+            s.pop_back();
+        s += '\n';
+    }
+    while (chomp == '-' && !s.empty() && s.back() == '\n')
+        s.pop_back();
+    return node;
+}
+
+std::string YamlReader::scalar(std::string_view s, int no) const
+{
+    if (s.empty() || (s[0] != '\'' && s[0] != '"'))
+        return std::string(s);
+    const char quote = s[0];
+    if (s.size() < 2 || s.back() != quote)
+        fail(no, "unterminated quoted scalar");
+    s = s.substr(1, s.size() - 2);
+
+    std::string out;
+    out.reserve(s.size());
+    if (quote == '\'') {
+        for (std::size_t i = 0; i < s.size(); ++i) {
+            out += s[i];
+            if (s[i] == '\'' && i + 1 < s.size() && s[i + 1] == '\'')
+                ++i;
+        }
+        return out;
+    }
+    for (std::size_t i = 0; i < s.size(); ++i) {
+        if (s[i] != '\\' || i + 1 == s.size()) {
+            out += s[i];
+            continue;
+        }
+        char e = s[++i];
+        int digits = e == 'x' ? 2 : e == 'u' ? 4 : e == 'U' ? 8 : 0;
+        if (digits) {
+            if (i + digits >= s.size())
+                fail(no, "short escape in quoted scalar");
+            unsigned long cp = std::stoul(std::string(s.substr(i + 1, digits)),
+                                          nullptr, 16);
+            append_utf8(out, cp);
+            i += digits;
+            continue;
+        }
+        switch (e) {
+        case 'n':  out += '\n'; break;
+        case 't':  out += '\t'; break;
+        case 'r':  out += '\r'; break;
+        case '0':  out += '\0'; break;
+        case 'e':  out += '\x1b'; break;
+        case ' ': case '"': case '/': case '\\':
+            out += e;
+            break;
+        default:
+            fail(no, std::string("unknown escape \\") + e);
+        }
+    }
+    return out;
+}
+
+// =================================================================
+//  Patterns
+// =================================================================
+
+// Oniguruma as grammars write it, turned into ECMAScript for
+// std::regex.  Leading (?i) and (?x) become flags.
+std::string translate(std::string_view p, bool& icase)
+{
+    bool extended = false;
+    icase = false;
+    while (p.size() > 3 && p[0] == '(' && p[1] == '?') {
+        std::size_t close = p.find(')');
+        std::string_view flags = p.substr(2, close == npos ? 0 : close - 2);
+        if (flags.empty() || flags.find_first_not_of("ix") != npos)
+            break;
+        icase    |= flags.find('i') != npos;
+        extended |= flags.find('x') != npos;
+        p.remove_prefix(close + 1);
+    }
+
+    std::string out;
+    out.reserve(p.size());
+    bool in_class = false;
+    std::size_t class_body = 0;     // where the class's items begin
+    for (std::size_t i = 0; i < p.size(); ++i) {
+        char c = p[i];
+        if (c == '\\' && i + 1 < p.size()) {
+            char e = p[++i];
+            if (e == 'h')
+                out += in_class ? "0-9A-Fa-f" : "[0-9A-Fa-f]";
+            else if (e == 'H' && !in_class)
+                out += "[^0-9A-Fa-f]";
+            else if (e == 'A' && !in_class)
+                out += '^';
+            else if ((e == 'z' || e == 'Z') && !in_class)
+                out += '$';
+            else if (e == 'G' && !in_class)
+                ;
+            else
+                (out += '\\') += e;
+            continue;
+        }
+        if (in_class) {
+            if (c == '[' && i + 1 < p.size() && p[i + 1] == ':') {
+                std::size_t end = p.find(":]", i + 2);
+                if (end != npos) {
+                    out.append(p.substr(i, end + 2 - i));
+                    i = end + 1;
+                    continue;
+                }
+            }
+            if (c == ']' && i > class_body)
+                in_class = false;
+            out += c;
+            continue;
+        }
+        if (extended && (c == ' ' || c == '\t' || c == '\n')) {
+            continue;
+        }
+        if (extended && c == '#') {
+            while (i + 1 < p.size() && p[i + 1] != '\n')
+                ++i;
+            continue;
+        }
+        if (c == '[') {
+            in_class = true;
+            out += c;
+            if (i + 1 < p.size() && p[i + 1] == '^')
+                out += p[++i];
+            class_body = i + 1;
+            continue;
+        }
+        if (c == '(' && p.compare(i, 3, "(?>") == 0) {
+            out += "(?:";
+            i += 2;
+            continue;
+        }
+        if (c == '(' && (p.compare(i, 3, "(?<") == 0 || p.compare(i, 4, "(?P<") == 0)
+            && p.compare(i, 4, "(?<=") != 0 && p.compare(i, 4, "(?<!") != 0) {
+            std::size_t end = p.find('>', i);
+            if (end != npos) {
+                out += '(';
+                i = end;
+                continue;
+            }
+        }
+        out += c;
+        // Possessive quantifiers lose their possessiveness.
+        if ((c == '*' || c == '+' || c == '?' || c == '}')
+            && i + 1 < p.size() && p[i + 1] == '+')
+            ++i;
+    }
+    return out;
+}
+
+// What a match can start with, worked out from the pattern, so that
+// lines where it cannot match are not searched at all.
+struct FirstBytes {
+    std::bitset<256> set;
+    bool any        = true;     // could not be bounded
+    bool anchored   = false;    // matches only at the start of a line
+    bool word_start = false;    // \b, then a word character
+    bool eol        = false;    // the pattern is just $
+};
+
+bool is_word(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+        || (c >= '0' && c <= '9') || c == '_';
+}
+
+class FirstScan {
+public:
+    FirstScan(std::string_view p, bool icase) : p_(p), icase_(icase) {}
+
+    FirstBytes run()
+    {
+        FirstBytes fb;
+        fb.anchored = !p_.empty() && p_[0] == '^' && !top_level_bar();
+        fb.eol      = p_ == "$";
+        std::bitset<256> set;
+        if (alternation(set) && i_ == p_.size()) {
+            fb.set = set;
+            fb.any = false;
+            fb.word_start = p_.compare(0, 2, "\\b") == 0 && !top_level_bar();
+            for (int c = 0; c < 256 && fb.word_start; ++c)
+                if (set[c] && !is_word(static_cast<unsigned char>(c)))
+                    fb.word_start = false;
+        }
+        return fb;
+    }
+
+private:
+    std::string_view p_;
+    std::size_t      i_ = 0;
+    bool             icase_;
+
+    void add(std::bitset<256>& set, unsigned char c) const
+    {
+        set.set(c);
+        if (icase_ && std::isalpha(c)) {
+            set.set(static_cast<unsigned char>(std::tolower(c)));
+            set.set(static_cast<unsigned char>(std::toupper(c)));
+        }
+    }
+
+    void add_class(std::bitset<256>& set, char e) const
+    {
+        std::bitset<256> s;
+        for (int c = 0; c < 256; ++c) {
+            bool in = false;
+            switch (std::tolower(static_cast<unsigned char>(e))) {
+            case 'd': in = c < 128 && std::isdigit(c);             break;
+            case 'w': in = c < 128 && (std::isalnum(c) || c == '_'); break;
+            case 's': in = c < 128 && std::isspace(c);             break;
+            }
+            s.set(c, in);
+        }
+        if (std::isupper(static_cast<unsigned char>(e)))
+            s.flip();
+        set |= s;
+    }
+
+    bool top_level_bar() const
+    {
+        int depth = 0;
+        for (std::size_t i = 0; i < p_.size(); ++i) {
+            char c = p_[i];
+            if (c == '\\') {
+                ++i;
+            } else if (c == '[') {
+                i = class_end(i) - 1;
+            } else if (c == '(') {
+                ++depth;
+            } else if (c == ')') {
+                --depth;
+            } else if (c == '|' && depth == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // One past the ']' closing the class that opens at `i`.
+    std::size_t class_end(std::size_t i) const
+    {
+        ++i;
+        if (i < p_.size() && p_[i] == '^')
+            ++i;
+        std::size_t body = i;
+        for (; i < p_.size(); ++i) {
+            if (p_[i] == '\\')
+                ++i;
+            else if (p_[i] == '[' && i + 1 < p_.size() && p_[i + 1] == ':')
+                i = std::min(p_.find(":]", i), p_.size() - 1) + 1;
+            else if (p_[i] == ']' && i > body)
+                return i + 1;
+        }
+        return p_.size();
+    }
+
+    bool alternation(std::bitset<256>& set)
+    {
+        for (;;) {
+            if (!sequence(set))
+                return false;
+            skip_alternative();
+            if (i_ < p_.size() && p_[i_] == '|') {
+                ++i_;
+                continue;
+            }
+            return true;
+        }
+    }
+
+    bool sequence(std::bitset<256>& set)
+    {
+        for (;;) {
+            if (i_ >= p_.size() || p_[i_] == '|' || p_[i_] == ')')
+                return false;       // can match empty
+            if (p_[i_] == '^') {
+                ++i_;
+                continue;
+            }
+            if (p_[i_] == '\\' && i_ + 1 < p_.size()
+                && (p_[i_ + 1] == 'b' || p_[i_ + 1] == 'B')) {
+                i_ += 2;
+                continue;
+            }
+            std::bitset<256> atom;
+            if (!read_atom(atom))
+                return false;
+            if (i_ < p_.size()) {
+                char q = p_[i_];
+                if (q == '?' || q == '*')
+                    return false;
+                if (q == '{' && i_ + 1 < p_.size()
+                    && (p_[i_ + 1] == '0' || p_[i_ + 1] == ','))
+                    return false;
+            }
+            set |= atom;
+            return true;
+        }
+    }
+
+    bool read_atom(std::bitset<256>& atom)
+    {
+        char c = p_[i_];
+        switch (c) {
+        case '(':
+            if (p_.compare(i_, 3, "(?=") == 0 || p_.compare(i_, 3, "(?!") == 0
+                || p_.compare(i_, 3, "(?<") == 0)
+                return false;
+            i_ += p_.compare(i_, 3, "(?:") == 0 ? 3 : 1;
+            if (!alternation(atom) || i_ >= p_.size() || p_[i_] != ')')
+                return false;
+            ++i_;
+            return true;
+        case '[':
+            return klass(atom);
+        case '\\':
+            return escape(atom);
+        case '.': case '$': case '*': case '+': case '?': case '{':
+            return false;
+        default:
+            add(atom, static_cast<unsigned char>(c));
+            ++i_;
+            return true;
+        }
+    }
+
+    // The byte an escape outside a class stands for; 0 if it is not
+    // a single known byte.
+    static unsigned char escaped_byte(char e)
+    {
+        switch (e) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        }
+        return std::isalnum(static_cast<unsigned char>(e))
+             ? 0 : static_cast<unsigned char>(e);
+    }
+
+    bool escape(std::bitset<256>& atom)
+    {
+        if (i_ + 1 >= p_.size())
+            return false;
+        char e = p_[i_ + 1];
+        i_ += 2;
+        if (std::strchr("dwsDWS", e)) {
+            add_class(atom, e);
+            return true;
+        }
+        unsigned char b = escaped_byte(e);
+        if (!b)
+            return false;
+        add(atom, b);
+        return true;
+    }
+
+    bool klass(std::bitset<256>& atom)
+    {
+        std::size_t end = class_end(i_);
+        ++i_;
+        bool negate = false;
+        if (i_ < p_.size() && p_[i_] == '^') {
+            negate = true;
+            ++i_;
+        }
+        std::bitset<256> s;
+        std::size_t body = i_;
+        while (i_ < p_.size()) {
+            char c = p_[i_];
+            if (c == ']' && i_ > body) {
+                ++i_;
+                break;
+            }
+            if (c == '[' && i_ + 1 < p_.size() && p_[i_ + 1] == ':') {
+                std::size_t close = p_.find(":]", i_);
+                if (close == npos)
+                    return false;
+                std::string name(p_.substr(i_ + 2, close - i_ - 2));
+                for (int b = 0; b < 128; ++b) {
+                    bool in = name == "alpha" ? std::isalpha(b)
+                            : name == "digit" ? std::isdigit(b)
+                            : name == "alnum" ? std::isalnum(b)
+                            : name == "space" ? std::isspace(b)
+                            : name == "upper" ? std::isupper(b)
+                            : name == "lower" ? std::islower(b)
+                            : name == "punct" ? std::ispunct(b)
+                            : name == "xdigit" ? std::isxdigit(b)
+                            : true;
+                    if (in)
+                        s.set(b);
+                }
+                i_ = close + 2;
+                continue;
+            }
+            unsigned char lo;
+            if (!single(lo, s))
+                continue;               // a class escape, already added
+            if (i_ + 1 < p_.size() && p_[i_] == '-' && p_[i_ + 1] != ']') {
+                ++i_;
+                unsigned char hi;
+                if (!single(hi, s))
+                    return false;
+                for (unsigned c2 = lo; c2 <= hi; ++c2)
+                    add(s, static_cast<unsigned char>(c2));
+            } else {
+                add(s, lo);
+            }
+        }
+        if (i_ != end)
+            return false;
+        if (negate)
+            s.flip();
+        atom |= s;
+        return true;
+    }
+
+    // One class member: a byte (true), or \d-style (added to `s`).
+    bool single(unsigned char& b, std::bitset<256>& s)
+    {
+        char c = p_[i_++];
+        if (c != '\\' || i_ >= p_.size()) {
+            b = static_cast<unsigned char>(c);
+            return true;
+        }
+        char e = p_[i_++];
+        if (std::strchr("dwsDWS", e)) {
+            add_class(s, e);
+            return false;
+        }
+        b = escaped_byte(e);
+        if (!b) {
+            // Something this scan does not know: allow every byte.
+            s.set();
+            return false;
+        }
+        return true;
+    }
+
+    void skip_alternative()
+    {
+        int depth = 0;
+        while (i_ < p_.size()) {
+            char c = p_[i_];
+            if (c == '\\') {
+                i_ += 2;
+                continue;
+            }
+            if (c == '[') {
+                i_ = class_end(i_);
+                continue;
+            }
+            if (c == '(') {
+                ++depth;
+            } else if (c == ')') {
+                if (depth == 0)
+                    return;
+                --depth;
+            } else if (c == '|' && depth == 0) {
+                return;
+            }
+            ++i_;
+        }
+    }
+};
+
+// The words of a keyword list, \b(if|then|else)\b, sorted; empty
+// for any other pattern.  `group` says whether the list is captured.
+std::vector<std::string> keyword_list(std::string_view p, bool& group)
+{
+    std::vector<std::string> words;
+    if (p.size() < 6 || p.compare(0, 2, "\\b") != 0
+        || p.compare(p.size() - 2, 2, "\\b") != 0)
+        return words;
+    p = p.substr(2, p.size() - 4);
+    group = false;
+    if (p.size() > 2 && p.front() == '(' && p.back() == ')') {
+        p = p.substr(1, p.size() - 2);
+        group = true;
+        if (p.compare(0, 2, "?:") == 0) {
+            p.remove_prefix(2);
+            group = false;
+        }
+    }
+    std::size_t start = 0;
+    for (std::size_t i = 0; i <= p.size(); ++i) {
+        if (i < p.size() && is_word(static_cast<unsigned char>(p[i])))
+            continue;
+        if ((i < p.size() && p[i] != '|') || i == start) {
+            words.clear();
+            return words;
+        }
+        words.emplace_back(p.substr(start, i - start));
+        start = i + 1;
+    }
+    std::sort(words.begin(), words.end());
+    return words;
+}
+
+#ifndef PPLUA_PCRE2
+
+// A pattern std::regex is not needed for: bytes and classes with
+// quantifiers, groups (optional at most) holding alternatives,
+// single-pattern lookahead and the assertions ^ $ \b \B.  That is
+// the form of most token rules: escapes, numbers, strings, request
+// names.  The matcher backtracks through the same alternatives in
+// the same order as std::regex, so it finds the same match with the
+// same groups.  parse() refuses anything else, and anything whose
+// meaning it is not sure of, and std::regex runs those.
+class NativePattern {
+public:
+    using Spans = std::vector<std::pair<std::size_t, std::size_t>>;
+
+    /// Read the ECMAScript pattern `p`; false if it is not of this
+    /// form.
+    bool parse(std::string_view p);
+
+    /// Match at `at`; on success `spans` holds group 0 and every
+    /// group, npos for those not taking part.
+    bool match(std::string_view line, std::size_t at, Spans& spans) const;
+
+private:
+    struct Node;
+    using Seq = std::vector<Node>;
+
+    struct Node {
+        enum class Kind {
+            bytes, bol, eol, boundary, not_boundary, group, ahead, not_ahead
+        };
+        Kind             kind = Kind::bytes;
+        std::bitset<256> set;               // bytes
+        std::size_t      min  = 1;
+        std::size_t      max  = 1;
+        bool             lazy = false;
+        int              capture = -1;      // group: its number, or -1
+        std::vector<Seq> alts;              // group, ahead, not_ahead
+    };
+
+    // Where to go on when a group's alternative is done.
+    struct Frame {
+        const Seq*   seq;
+        std::size_t  idx;
+        int          capture;
+        std::size_t  start;
+        const Frame* next;
+    };
+
+    Node top_;
+    int  groups_ = 0;
+
+    bool alternatives(std::string_view p, std::size_t& i,
+                      std::vector<Seq>& alts, bool look);
+    bool sequence(std::string_view p, std::size_t& i, Seq& seq, bool look);
+    bool quantifier(std::string_view p, std::size_t& i, Node& n);
+    std::size_t run(std::string_view line, std::size_t pos, const Seq& seq,
+                    std::size_t idx, const Frame* k, Spans& spans) const;
+    std::size_t enter(std::string_view line, std::size_t pos, const Node& n,
+                      const Seq& seq, std::size_t idx, const Frame* k,
+                      Spans& spans) const;
+
+    static void add_class(std::bitset<256>& set, char e);
+    static bool escape(char e, std::bitset<256>& set);
+    static bool klass(std::string_view p, std::size_t& i,
+                      std::bitset<256>& set);
+};
+
+// \d \w \s and their complements, as std::regex has them in the C
+// locale.
+void NativePattern::add_class(std::bitset<256>& set, char e)
+{
+    std::bitset<256> s;
+    for (int c = 0; c < 128; ++c) {
+        switch (std::tolower(static_cast<unsigned char>(e))) {
+        case 'd': s.set(c, std::isdigit(c) != 0);              break;
+        case 'w': s.set(c, std::isalnum(c) != 0 || c == '_');  break;
+        case 's': s.set(c, std::isspace(c) != 0);              break;
+        }
+    }
+    if (std::isupper(static_cast<unsigned char>(e)))
+        s.flip();
+    set |= s;
+}
+
+// An escape standing for one byte or a class; false for the others
+// (\x41, \u, \c, back references).
+bool NativePattern::escape(char e, std::bitset<256>& set)
+{
+    if (std::strchr("dwsDWS", e)) {
+        add_class(set, e);
+        return true;
+    }
+    switch (e) {
+    case 'n': set.set('\n'); return true;
+    case 't': set.set('\t'); return true;
+    case 'r': set.set('\r'); return true;
+    case 'f': set.set('\f'); return true;
+    case 'v': set.set('\v'); return true;
+    }
+    if (std::isalnum(static_cast<unsigned char>(e)))
+        return false;
+    set.set(static_cast<unsigned char>(e));
+    return true;
+}
+
+bool NativePattern::klass(std::string_view p, std::size_t& i,
+                          std::bitset<256>& set)
+{
+    ++i;
+    bool negate = i < p.size() && p[i] == '^';
+    if (negate)
+        ++i;
+    if (i < p.size() && p[i] == ']')
+        return false;                   // [] and []a] differ by dialect
+
+    // One member: a byte, or (for \d and the like) none.
+    auto member = [&](std::bitset<256>& s, bool& is_byte,
+                      unsigned char& b) {
+        is_byte = true;
+        if (p[i] != '\\') {
+            b = static_cast<unsigned char>(p[i++]);
+            return true;
+        }
+        if (i + 1 >= p.size())
+            return false;
+        char e = p[i + 1];
+        i += 2;
+        if (std::strchr("dwsDWS", e)) {
+            add_class(s, e);
+            is_byte = false;
+            return true;
+        }
+        std::bitset<256> one;
+        if (!escape(e, one))
+            return false;
+        for (int c = 0; c < 256; ++c)
+            if (one[c])
+                b = static_cast<unsigned char>(c);
+        return true;
+    };
+
+    std::bitset<256> s;
+    for (;;) {
+        if (i >= p.size())
+            return false;
+        if (p[i] == ']') {
+            ++i;
+            break;
+        }
+        if (p[i] == '[' && i + 1 < p.size()
+            && (p[i + 1] == '.' || p[i + 1] == '='))
+            return false;
+        if (p[i] == '[' && i + 1 < p.size() && p[i + 1] == ':') {
+            std::size_t close = p.find(":]", i + 2);
+            if (close == npos)
+                return false;
+            static const struct {
+                const char* name;
+                int (*is)(int);
+            } named[] = {
+                { "alpha",  [](int c) { return std::isalpha(c);  } },
+                { "digit",  [](int c) { return std::isdigit(c);  } },
+                { "alnum",  [](int c) { return std::isalnum(c);  } },
+                { "space",  [](int c) { return std::isspace(c);  } },
+                { "upper",  [](int c) { return std::isupper(c);  } },
+                { "lower",  [](int c) { return std::islower(c);  } },
+                { "punct",  [](int c) { return std::ispunct(c);  } },
+                { "xdigit", [](int c) { return std::isxdigit(c); } },
+            };
+            std::string_view name = p.substr(i + 2, close - i - 2);
+            auto it = std::find_if(std::begin(named), std::end(named),
+                                   [&](auto& n) { return name == n.name; });
+            if (it == std::end(named))
+                return false;
+            for (int c = 0; c < 128; ++c)
+                if (it->is(c))
+                    s.set(c);
+            i = close + 2;
+            continue;
+        }
+
+        bool is_byte;
+        unsigned char lo = 0, hi = 0;
+        if (!member(s, is_byte, lo))
+            return false;
+        const bool range = i + 1 < p.size() && p[i] == '-' && p[i + 1] != ']';
+        if (!is_byte) {
+            if (range)
+                return false;
+            continue;
+        }
+        if (!range) {
+            s.set(lo);
+            continue;
+        }
+        // Ranges over bytes past ASCII compare as signed chars there.
+        ++i;
+        if (!member(s, is_byte, hi) || !is_byte || hi < lo || hi >= 0x80)
+            return false;
+        for (unsigned c = lo; c <= hi; ++c)
+            s.set(c);
+    }
+    if (negate)
+        s.flip();
+    set |= s;
+    return true;
+}
+
+// *, +, ?, {m,n} and their lazy forms.
+bool NativePattern::quantifier(std::string_view p, std::size_t& i, Node& n)
+{
+    if (i >= p.size())
+        return true;
+    const char q = p[i];
+    if (q == '*' || q == '+' || q == '?') {
+        n.min = q == '+' ? 1 : 0;
+        n.max = q == '?' ? 1 : npos;
+        ++i;
+    } else if (q == '{') {
+        std::size_t close = p.find('}', i);
+        if (close == npos)
+            return false;
+        std::string_view body = p.substr(i + 1, close - i - 1);
+        std::size_t comma = body.find(',');
+        std::string_view lo = body.substr(0, comma);
+        std::string_view hi = comma == npos ? lo : body.substr(comma + 1);
+        auto number = [](std::string_view d, std::size_t& v) {
+            if (d.empty() || d.size() > 6
+                || d.find_first_not_of("0123456789") != npos)
+                return false;
+            v = std::strtoul(std::string(d).c_str(), nullptr, 10);
+            return true;
+        };
+        if (!number(lo, n.min))
+            return false;
+        if (comma != npos && hi.empty())
+            n.max = npos;
+        else if (!number(hi, n.max) || n.max < n.min)
+            return false;
+        i = close + 1;
+    } else {
+        return true;
+    }
+    if (i < p.size() && p[i] == '?') {
+        n.lazy = true;
+        ++i;
+    }
+    return true;
+}
+
+bool NativePattern::alternatives(std::string_view p, std::size_t& i,
+                                 std::vector<Seq>& alts, bool look)
+{
+    for (;;) {
+        alts.emplace_back();
+        if (!sequence(p, i, alts.back(), look))
+            return false;
+        if (i < p.size() && p[i] == '|') {
+            ++i;
+            continue;
+        }
+        return true;
+    }
+}
+
+// Up to the end, a '|' or a ')'.  Inside lookahead (`look`) groups
+// may not capture.
+bool NativePattern::sequence(std::string_view p, std::size_t& i, Seq& seq,
+                             bool look)
+{
+    while (i < p.size() && p[i] != '|' && p[i] != ')') {
+        Node n;
+        const char c = p[i];
+        if (c == '^' || c == '$') {
+            n.kind = c == '^' ? Node::Kind::bol : Node::Kind::eol;
+            ++i;
+            seq.push_back(std::move(n));
+            continue;
+        }
+        if (c == '\\' && i + 1 < p.size() && (p[i + 1] == 'b' || p[i + 1] == 'B')) {
+            n.kind = p[i + 1] == 'b' ? Node::Kind::boundary
+                                     : Node::Kind::not_boundary;
+            i += 2;
+            seq.push_back(std::move(n));
+            continue;
+        }
+        if (c == '(') {
+            bool lookahead = p.compare(i, 3, "(?=") == 0
+                          || p.compare(i, 3, "(?!") == 0;
+            if (lookahead) {
+                n.kind = p[i + 2] == '=' ? Node::Kind::ahead
+                                         : Node::Kind::not_ahead;
+                i += 3;
+            } else if (p.compare(i, 3, "(?:") == 0) {
+                n.kind = Node::Kind::group;
+                i += 3;
+            } else if (i + 1 < p.size() && p[i + 1] == '?') {
+                return false;               // lookbehind and the like
+            } else {
+                if (look)
+                    return false;
+                n.kind = Node::Kind::group;
+                n.capture = ++groups_;
+                ++i;
+            }
+            if (!alternatives(p, i, n.alts, look || lookahead)
+                || i >= p.size() || p[i] != ')')
+                return false;
+            ++i;
+            if (lookahead) {
+                seq.push_back(std::move(n));
+                continue;
+            }
+            // A group may be optional, no more: a repeated one could
+            // match empty and would need std::regex's loop checks.
+            if (!quantifier(p, i, n) || n.min > 1 || n.max != 1)
+                return false;
+            seq.push_back(std::move(n));
+            continue;
+        }
+
+        if (c == '\\') {
+            if (i + 1 >= p.size() || !escape(p[i + 1], n.set))
+                return false;
+            i += 2;
+        } else if (c == '[') {
+            if (!klass(p, i, n.set))
+                return false;
+        } else if (c == '.') {
+            n.set.set();
+            n.set.reset('\n');
+            n.set.reset('\r');
+            ++i;
+        } else if (std::strchr("*+?{}]", c)) {
+            return false;
+        } else {
+            n.set.set(static_cast<unsigned char>(c));
+            ++i;
+        }
+        if (!quantifier(p, i, n))
+            return false;
+        seq.push_back(std::move(n));
+    }
+    return true;
+}
+
+bool NativePattern::parse(std::string_view p)
+{
+    top_ = Node();
+    top_.kind    = Node::Kind::group;
+    top_.capture = 0;
+    groups_ = 0;
+    std::size_t i = 0;
+    return alternatives(p, i, top_.alts, false) && i == p.size();
+}
+
+bool NativePattern::match(std::string_view line, std::size_t at,
+                          Spans& spans) const
+{
+    spans.assign(static_cast<std::size_t>(groups_) + 1, { npos, npos });
+    static const Seq none;
+    return enter(line, at, top_, none, 0, nullptr, spans) != npos;
+}
+
+// Try group `n`'s alternatives, then go on with seq[idx] and `k`.
+std::size_t NativePattern::enter(std::string_view line, std::size_t pos,
+                                 const Node& n, const Seq& seq,
+                                 std::size_t idx, const Frame* k,
+                                 Spans& spans) const
+{
+    const Frame f{ &seq, idx, n.capture, pos, k };
+    auto inside = [&]() {
+        for (auto& alt : n.alts)
+            if (std::size_t end = run(line, pos, alt, 0, &f, spans);
+                end != npos)
+                return end;
+        return npos;
+    };
+    if (n.min == 1)
+        return inside();
+    if (n.lazy) {
+        if (std::size_t end = run(line, pos, seq, idx, k, spans); end != npos)
+            return end;
+        return inside();
+    }
+    if (std::size_t end = inside(); end != npos)
+        return end;
+    return run(line, pos, seq, idx, k, spans);
+}
+
+// Match seq[idx...] at `pos`, then what `k` says comes after.  The
+// end of the whole match, or npos.
+std::size_t NativePattern::run(std::string_view line, std::size_t pos,
+                               const Seq& seq, std::size_t idx,
+                               const Frame* k, Spans& spans) const
+{
+    for (; idx < seq.size(); ++idx) {
+        const Node& n = seq[idx];
+        switch (n.kind) {
+        case Node::Kind::bol:
+            if (pos != 0)
+                return npos;
+            continue;
+        case Node::Kind::eol:
+            if (pos != line.size())
+                return npos;
+            continue;
+        case Node::Kind::boundary:
+        case Node::Kind::not_boundary: {
+            bool before = pos > 0
+                && is_word(static_cast<unsigned char>(line[pos - 1]));
+            bool after = pos < line.size()
+                && is_word(static_cast<unsigned char>(line[pos]));
+            if ((before != after) != (n.kind == Node::Kind::boundary))
+                return npos;
+            continue;
+        }
+        case Node::Kind::ahead:
+        case Node::Kind::not_ahead: {
+            bool found = false;
+            for (auto& alt : n.alts)
+                if ((found = run(line, pos, alt, 0, nullptr, spans) != npos))
+                    break;
+            if (found != (n.kind == Node::Kind::ahead))
+                return npos;
+            continue;
+        }
+        case Node::Kind::group:
+            return enter(line, pos, n, seq, idx + 1, k, spans);
+        case Node::Kind::bytes:
+            break;
+        }
+
+        std::size_t count = 0;
+        while (count < n.max && pos + count < line.size()
+               && n.set[static_cast<unsigned char>(line[pos + count])])
+            ++count;
+        if (count < n.min)
+            return npos;
+        if (n.min == n.max) {
+            pos += count;
+            continue;
+        }
+
+        // Greedy: the longest run first; lazy: the shortest.
+        if (n.lazy) {
+            for (std::size_t c = n.min; c <= count; ++c)
+                if (std::size_t end = run(line, pos + c, seq, idx + 1, k, spans);
+                    end != npos)
+                    return end;
+        } else {
+            for (std::size_t c = count + 1; c-- > n.min; )
+                if (std::size_t end = run(line, pos + c, seq, idx + 1, k, spans);
+                    end != npos)
+                    return end;
+        }
+        return npos;
+    }
+
+    // The end of a group's alternative: record it, go on after it.
+    if (!k)
+        return pos;
+    if (k->capture < 0)
+        return run(line, pos, *k->seq, k->idx, k->next, spans);
+    auto& span = spans[static_cast<std::size_t>(k->capture)];
+    const auto saved = span;
+    span = { k->start, pos };
+    std::size_t end = run(line, pos, *k->seq, k->idx, k->next, spans);
+    if (end == npos)
+        span = saved;
+    return end;
+}
+
+#else // PPLUA_PCRE2
+
+// A pattern on PCRE2, JIT-compiled where the platform allows.  It
+// takes what translate() makes for std::regex, lookbehind included,
+// and matches as std::regex_search does with match_prev_avail: the
+// whole line is the subject, so ^ and \b see what precedes `from`.
+class Pcre2Pattern {
+public:
+    /// Compile `p`; false, with `error` set, if PCRE2 cannot.
+    bool compile(const std::string& p, bool icase, std::string& error);
+
+    /// The leftmost match at or after `from`, its groups into
+    /// `groups` (npos for those that did not take part).
+    bool search(std::string_view line, std::size_t from,
+                std::vector<std::pair<std::size_t, std::size_t>>& groups)
+        const;
+
+private:
+    struct Free {
+        void operator()(pcre2_code* c) const { pcre2_code_free(c); }
+        void operator()(pcre2_match_data* d) const { pcre2_match_data_free(d); }
+    };
+    std::unique_ptr<pcre2_code, Free>       code_;
+    std::unique_ptr<pcre2_match_data, Free> data_;
+};
+
+bool Pcre2Pattern::compile(const std::string& p, bool icase,
+                           std::string& error)
+{
+    int code;
+    PCRE2_SIZE offset;
+    std::uint32_t options = PCRE2_DOLLAR_ENDONLY;
+    if (icase)
+        options |= PCRE2_CASELESS;
+    code_.reset(pcre2_compile(reinterpret_cast<PCRE2_SPTR>(p.data()),
+                              p.size(), options, &code, &offset, nullptr));
+    if (!code_) {
+        PCRE2_UCHAR message[256];
+        pcre2_get_error_message(code, message, sizeof message);
+        error = reinterpret_cast<const char*>(message);
+        return false;
+    }
+    pcre2_jit_compile(code_.get(), PCRE2_JIT_COMPLETE);    // else interpreted
+    data_.reset(pcre2_match_data_create_from_pattern(code_.get(), nullptr));
+    return true;
+}
+
+bool Pcre2Pattern::search(std::string_view line, std::size_t from,
+    std::vector<std::pair<std::size_t, std::size_t>>& groups) const
+{
+    int rc = pcre2_match(code_.get(),
+                         reinterpret_cast<PCRE2_SPTR>(line.data()),
+                         line.size(), from, 0, data_.get(), nullptr);
+    if (rc < 0)
+        return false;
+    const PCRE2_SIZE* ov = pcre2_get_ovector_pointer(data_.get());
+    const std::uint32_t n = pcre2_get_ovector_count(data_.get());
+    groups.clear();
+    for (std::uint32_t k = 0; k < n; ++k) {
+        if (ov[2 * k] == PCRE2_UNSET)
+            groups.emplace_back(npos, npos);
+        else
+            groups.emplace_back(ov[2 * k], ov[2 * k + 1]);
+    }
+    return true;
+}
+
+#endif // PPLUA_PCRE2
+
+// =================================================================
+//  Writing groff
+// =================================================================
+
+class Writer {
+public:
+    Writer(std::string& out, const HighlightTheme& theme)
+        : out_(out), theme_(theme) {}
+
+    void text(std::string_view s, int style)
+    {
+        if (s.empty())
+            return;
+        if (style != cur_) {
+            close();
+            open(style);
+        }
+        if (bol_ && (s[0] == '.' || s[0] == '\''))
+            out_ += "\\&";
+        bol_ = false;
+        for (std::size_t i = 0; i < s.size(); ) {
+            std::size_t bs = s.find('\\', i);
+            if (bs == npos)
+                bs = s.size();
+            out_.append(s.data() + i, bs - i);
+            if (bs < s.size())
+                out_ += "\\e";
+            i = bs + 1;
+        }
+    }
+
+    void end_line()
+    {
+        close();
+        out_ += '\n';
+        bol_ = true;
+    }
+
+private:
+    std::string&          out_;
+    const HighlightTheme& theme_;
+    int                   cur_ = -1;
+    bool                  bol_ = true;
+
+    void open(int style)
+    {
+        cur_ = style;
+        if (style < 0)
+            return;
+        const HighlightStyle& st = theme_[style].second;
+        if (!st.font.empty())
+            (out_ += "\\f[") += st.font + "]";
+        if (!st.color.empty())
+            (out_ += "\\m[") += st.color + "]";
+        if (!st.font.empty() || !st.color.empty())
+            bol_ = false;
+    }
+
+    void close()
+    {
+        if (cur_ >= 0) {
+            const HighlightStyle& st = theme_[cur_].second;
+            if (!st.color.empty())
+                out_ += "\\m[]";
+            if (!st.font.empty())
+                out_ += "\\f[P]";
+        }
+        cur_ = -1;
+    }
+};
+
+std::string slurp(const std::string& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open())
+        throw std::runtime_error("syntax: cannot open '" + path + "'");
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+} // namespace
+
+// =================================================================
+//  The default theme
+// =================================================================
+
+const HighlightTheme& default_highlight_theme()
+{
+    static const HighlightTheme theme = {
+        { "comment",     { "I", ""        } },
+        { "string",      { "",  "red"     } },
+        { "constant",    { "",  "magenta" } },
+        { "keyword",     { "B", ""        } },
+        { "storage",     { "B", "blue"    } },
+        { "entity.name", { "B", "blue"    } },
+        { "support",     { "",  "blue"    } },
+        { "variable",    { "",  "magenta" } },
+        { "invalid",     { "B", "red"     } },
+    };
+    return theme;
+}
+
+// =================================================================
+//  SyntaxSet::Impl
+// =================================================================
+
+struct SyntaxSet::Impl {
+    struct Pattern {
+        std::string source;     // variables substituted
+        std::string origin;     // the grammar file, for messages
+#ifdef PPLUA_PCRE2
+        Pcre2Pattern pcre2;
+#else
+        std::regex  re;         // unless `native` will do
+        NativePattern native;
+        bool        simple = false;
+#endif
+        FirstBytes  first;
+        int         only_byte = -1;     // first.set, if it is one byte
+        std::vector<std::string> keywords;     // matched without std::regex
+        bool        keyword_group = false;
+        bool        compiled = false;
+        bool        failed   = false;
+
+        // The last search, on line number `line`, from `from`.
+        std::uint64_t line  = 0;
+        std::size_t   from  = 0;
+        std::size_t   start = npos;
+        std::size_t   end   = 0;
+        std::vector<std::pair<std::size_t, std::size_t>> groups;
+    };
+
+    struct Ref {
+        std::string name;       // as written, until resolved
+        int         context = -1;
+    };
+
+    struct Rule {
+        std::size_t pattern = 0;
+        int         scope   = -1;
+        std::vector<std::pair<std::size_t, int>> captures;
+        enum class Op { none, push, set, pop } op = Op::none;
+        int              pops = 1;
+        std::vector<Ref> targets;
+    };
+
+    struct Item {
+        bool        include = false;
+        std::string ref;        // include
+        Rule        rule;       // match
+    };
+
+    struct Context {
+        std::size_t grammar = 0;
+        int  meta_scope         = -1;
+        int  meta_content_scope = -1;
+        bool prototype          = true;     // meta_include_prototype
+        std::vector<Item> items;
+        std::vector<Rule> own;      // items, includes expanded
+        std::vector<Rule> rules;    // the prototype's, then own
+        enum class State { raw, building, built } state = State::raw;
+    };
+
+    struct Grammar {
+        std::string path;
+        std::string name;
+        std::string scope;
+        std::vector<std::string>           extensions;
+        std::map<std::string, std::string> variables;
+        std::map<std::string, int>         contexts;
+    };
+
+    std::vector<Grammar>  grammars;
+    std::vector<Context>  contexts;
+    std::vector<Pattern>  patterns;
+    std::unordered_map<std::string, std::size_t> pattern_ids;
+    std::vector<std::string> scopes;
+    std::unordered_map<std::string, int> scope_ids;
+    std::uint64_t line_no = 0;      // across calls, for Pattern::line
+    std::bitset<256> present;       // the bytes on the current line
+
+    int         intern_scope(const std::string& s);
+    std::size_t intern_pattern(const Grammar& g, const std::string& src);
+    std::string substitute(const Grammar& g, std::string s) const;
+
+    void read_items(std::size_t g, int ctx, const YamlNode& list);
+    int  anonymous(std::size_t g, const YamlNode& list);
+    Rule read_rule(std::size_t g, const YamlNode& m);
+    void read_targets(std::size_t g, const YamlNode& n, Rule& r);
+
+    int  resolve(std::size_t g, const std::string& ref) const;
+    void build(int ctx);
+
+    bool search(Pattern& p, std::string_view line, std::size_t from);
+    int  find_grammar(const std::string& lang) const;
+};
+
+int SyntaxSet::Impl::intern_scope(const std::string& s)
+{
+    if (s.empty())
+        return -1;
+    auto [it, fresh] = scope_ids.try_emplace(s, static_cast<int>(scopes.size()));
+    if (fresh)
+        scopes.push_back(s);
+    return it->second;
+}
+
+std::string SyntaxSet::Impl::substitute(const Grammar& g, std::string s) const
+{
+    // Variables may use variables; give up on a cycle.
+    for (int round = 0; round < 16; ++round) {
+        std::size_t open = s.find("{{");
+        if (open == npos)
+            return s;
+        std::string out;
+        std::size_t pos = 0;
+        while (open != npos) {
+            std::size_t close = s.find("}}", open);
+            if (close == npos)
+                break;
+            std::string name = s.substr(open + 2, close - open - 2);
+            auto it = g.variables.find(name);
+            if (it == g.variables.end())
+                throw std::runtime_error("syntax: " + g.path
+                    + ": unknown variable '" + name + "'");
+            out.append(s, pos, open - pos);
+            out += it->second;
+            pos = close + 2;
+            open = s.find("{{", pos);
+        }
+        out.append(s, pos, npos);
+        s = std::move(out);
+    }
+    throw std::runtime_error("syntax: " + g.path + ": variables refer to"
+                             " each other");
+}
+
+std::size_t SyntaxSet::Impl::intern_pattern(const Grammar& g,
+                                            const std::string& src)
+{
+    std::string source = substitute(g, src);
+    auto [it, fresh] = pattern_ids.try_emplace(source, patterns.size());
+    if (fresh) {
+        Pattern p;
+        p.source = source;
+        p.origin = g.path;
+#ifndef PPLUA_PCRE2
+        // Said when the grammar is read, not when (or if) the rule is
+        // first tried.
+        if (source.find("(?<=") != npos || source.find("(?<!") != npos) {
+            p.compiled = p.failed = true;
+            std::cerr << "pplua: " << p.origin << ": cannot use pattern '"
+                      << source << "' (lookbehind needs a build with"
+                         " PCRE2); its rule is skipped\n";
+        }
+#endif
+        patterns.push_back(std::move(p));
+    }
+    return it->second;
+}
+
+void SyntaxSet::Impl::read_targets(std::size_t g, const YamlNode& n, Rule& r)
+{
+    if (n.kind == YamlNode::Kind::scalar) {
+        r.targets.push_back({ n.scalar, -1 });
+        return;
+    }
+    if (n.kind != YamlNode::Kind::seq)
+        return;
+    // A list of names, or the rules of an anonymous context.
+    if (!n.seq.empty() && n.seq[0].kind == YamlNode::Kind::map) {
+        r.targets.push_back({ std::string(), anonymous(g, n) });
+        return;
+    }
+    for (auto& x : n.seq) {
+        if (x.kind == YamlNode::Kind::scalar)
+            r.targets.push_back({ x.scalar, -1 });
+        else if (x.kind == YamlNode::Kind::seq)
+            r.targets.push_back({ std::string(), anonymous(g, x) });
+    }
+}
+
+SyntaxSet::Impl::Rule SyntaxSet::Impl::read_rule(std::size_t g,
+                                                 const YamlNode& m)
+{
+    Rule r;
+    r.pattern = intern_pattern(grammars[g], m.text("match"));
+    r.scope   = intern_scope(m.text("scope"));
+    if (const YamlNode* caps = m.get("captures"))
+        for (auto& [group, scope] : caps->map)
+            r.captures.emplace_back(std::strtoul(group.c_str(), nullptr, 10),
+                                    intern_scope(scope.scalar));
+
+    if (const YamlNode* push = m.get("push")) {
+        r.op = Rule::Op::push;
+        read_targets(g, *push, r);
+    } else if (const YamlNode* set = m.get("set")) {
+        r.op = Rule::Op::set;
+        read_targets(g, *set, r);
+    } else if (const YamlNode* embed = m.get("embed")) {
+        // embed + escape: push a context that ends at `escape` and
+        // otherwise is the embedded one.
+        int ctx = static_cast<int>(contexts.size());
+        contexts.emplace_back();
+        contexts[ctx].grammar = g;
+        contexts[ctx].prototype = false;
+        contexts[ctx].meta_content_scope = intern_scope(m.text("embed_scope"));
+        Item esc;
+        esc.rule.pattern = intern_pattern(grammars[g], m.text("escape"));
+        esc.rule.op = Rule::Op::pop;
+        if (const YamlNode* caps = m.get("escape_captures"))
+            for (auto& [group, scope] : caps->map)
+                esc.rule.captures.emplace_back(
+                    std::strtoul(group.c_str(), nullptr, 10),
+                    intern_scope(scope.scalar));
+        contexts[ctx].items.push_back(std::move(esc));
+        Item inc;
+        inc.include = true;
+        inc.ref = embed->scalar;
+        contexts[ctx].items.push_back(std::move(inc));
+        r.op = Rule::Op::push;
+        r.targets.push_back({ std::string(), ctx });
+    } else if (const YamlNode* pop = m.get("pop")) {
+        if (pop->scalar != "false") {
+            r.op = Rule::Op::pop;
+            r.pops = pop->scalar == "true" ? 1
+                   : std::max(1, std::atoi(pop->scalar.c_str()));
+        }
+    }
+    return r;
+}
+
+void SyntaxSet::Impl::read_items(std::size_t g, int ctx, const YamlNode& list)
+{
+    for (auto& m : list.seq) {
+        if (m.kind != YamlNode::Kind::map)
+            continue;
+        Context& c = contexts[ctx];
+        if (m.get("meta_scope"))
+            c.meta_scope = intern_scope(m.text("meta_scope"));
+        if (m.get("meta_content_scope"))
+            c.meta_content_scope = intern_scope(m.text("meta_content_scope"));
+        if (m.get("meta_include_prototype"))
+            c.prototype = m.text("meta_include_prototype") != "false";
+
+        if (m.get("include")) {
+            Item it;
+            it.include = true;
+            it.ref = m.text("include");
+            contexts[ctx].items.push_back(std::move(it));
+        } else if (m.get("match")) {
+            Item it;
+            it.rule = read_rule(g, m);      // may add contexts
+            contexts[ctx].items.push_back(std::move(it));
+        }
+    }
+}
+
+int SyntaxSet::Impl::anonymous(std::size_t g, const YamlNode& list)
+{
+    int ctx = static_cast<int>(contexts.size());
+    contexts.emplace_back();
+    contexts[ctx].grammar = g;
+    read_items(g, ctx, list);
+    return ctx;
+}
+
+int SyntaxSet::Impl::resolve(std::size_t g, const std::string& ref) const
+{
+    auto named = [&](std::size_t gi, const std::string& name) {
+        auto it = grammars[gi].contexts.find(name);
+        return it == grammars[gi].contexts.end() ? -1 : it->second;
+    };
+
+    if (ref == "$self" || ref == "$top_level_main" || ref == "$base")
+        return named(g, "main");
+
+    // scope:source.lua, scope:source.lua#context, Packages/…/X.sublime-syntax
+    std::string other = ref, ctx = "main";
+    bool by_scope = ref.compare(0, 6, "scope:") == 0;
+    bool by_file  = ref.size() > 15
+        && ref.compare(ref.size() - 15, 15, ".sublime-syntax") == 0;
+    if (!by_scope && !by_file)
+        return named(g, ref);
+    if (by_scope)
+        other = ref.substr(6);
+    std::size_t hash = other.find('#');
+    if (hash != npos) {
+        ctx = other.substr(hash + 1);
+        other.resize(hash);
+    }
+    for (std::size_t gi = 0; gi < grammars.size(); ++gi) {
+        const std::string& path = grammars[gi].path;
+        std::string base = other.substr(other.rfind('/') + 1);
+        bool match = by_scope ? grammars[gi].scope == other
+                   : path.size() >= base.size()
+                     && path.compare(path.size() - base.size(), npos, base) == 0;
+        if (match)
+            return named(gi, ctx);
+    }
+    return -1;
+}
+
+// Expand includes, resolve push targets, and put the prototype in
+// front.  Includes that lead back to a context being built are left
+// out.
+void SyntaxSet::Impl::build(int ctx)
+{
+    if (contexts[ctx].state != Context::State::raw)
+        return;
+    contexts[ctx].state = Context::State::building;
+    const std::size_t g = contexts[ctx].grammar;
+
+    std::vector<Rule> own;
+    for (std::size_t k = 0; k < contexts[ctx].items.size(); ++k) {
+        const Item& item = contexts[ctx].items[k];
+        if (item.include) {
+            int inc = resolve(g, item.ref);
+            if (inc < 0 || inc == ctx)
+                continue;
+            build(inc);
+            if (contexts[inc].state == Context::State::built)
+                own.insert(own.end(), contexts[inc].own.begin(),
+                           contexts[inc].own.end());
+            continue;
+        }
+        Rule r = item.rule;
+        for (auto& t : r.targets)
+            if (t.context < 0)
+                t.context = resolve(g, t.name);
+        r.targets.erase(std::remove_if(r.targets.begin(), r.targets.end(),
+                            [](const Ref& t){ return t.context < 0; }),
+                        r.targets.end());
+        if ((r.op == Rule::Op::push || r.op == Rule::Op::set)
+            && r.targets.empty())
+            r.op = Rule::Op::none;
+        own.push_back(std::move(r));
+    }
+
+    std::vector<Rule> rules;
+    int proto = resolve(g, "prototype");
+    if (proto >= 0 && proto != ctx && contexts[ctx].prototype) {
+        build(proto);
+        rules = contexts[proto].own;
+    }
+    rules.insert(rules.end(), own.begin(), own.end());
+
+    Context& c = contexts[ctx];
+    c.own   = std::move(own);
+    c.rules = std::move(rules);
+    c.state = Context::State::built;
+}
+
+// The leftmost match of `p` in `line` at or after `from`, into p's
+// start, end and groups.  Reuses the last search on this line while
+// it is still good: a match it found at or after `from` is still the
+// leftmost, and if it found none there is none.
+bool SyntaxSet::Impl::search(Pattern& p, std::string_view line,
+                             std::size_t from)
+{
+    if (p.line == line_no && p.from <= from
+        && (p.start == npos || p.start >= from))
+        return p.start != npos;
+
+    if (!p.compiled) {
+        p.compiled = true;
+        bool icase;
+        std::string ecma = translate(p.source, icase);
+        std::string error;
+#ifdef PPLUA_PCRE2
+        p.pcre2.compile(ecma, icase, error);
+#else
+        try {
+            auto flags = std::regex::ECMAScript | std::regex::optimize;
+            if (icase)
+                flags |= std::regex::icase;
+            p.simple = !icase && p.native.parse(ecma);
+            if (!p.simple)
+                p.re = std::regex(ecma, flags);
+        } catch (const std::regex_error& e) {
+            error = e.what();
+        }
+#endif
+        if (!error.empty()) {
+            p.failed = true;
+            std::cerr << "pplua: " << p.origin << ": cannot use pattern '"
+                      << p.source << "' (" << error
+                      << "); its rule is skipped\n";
+        } else {
+            p.first = FirstScan(ecma, icase).run();
+            if (!p.first.any && !p.first.word_start && p.first.set.count() == 1)
+                for (int c = 0; c < 256; ++c)
+                    if (p.first.set[c])
+                        p.only_byte = c;
+            if (!icase)
+                p.keywords = keyword_list(ecma, p.keyword_group);
+        }
+    }
+
+    p.line  = line_no;
+    p.from  = from;
+    p.start = npos;
+    if (p.failed || (p.first.anchored && from > 0))
+        return false;
+    if (p.first.eol) {
+        p.start = p.end = line.size();
+        p.groups.assign(1, { p.start, p.end });
+        return true;
+    }
+
+    if (!p.first.any && (p.first.set & present).none())
+        return false;
+    if (p.first.anchored && !p.first.any
+        && (line.empty() || !p.first.set[static_cast<unsigned char>(line[0])]))
+        return false;
+
+    // Keyword lists: look the words up.
+    if (!p.keywords.empty()) {
+        for (std::size_t at = from; at < line.size(); ) {
+            if (!is_word(static_cast<unsigned char>(line[at]))) {
+                ++at;
+                continue;
+            }
+            std::size_t end = at;
+            while (end < line.size() && is_word(static_cast<unsigned char>(line[end])))
+                ++end;
+            if (p.first.set[static_cast<unsigned char>(line[at])]
+                && (at == 0 || !is_word(static_cast<unsigned char>(line[at - 1])))
+                && std::binary_search(p.keywords.begin(), p.keywords.end(),
+                                      line.substr(at, end - at))) {
+                p.start = at;
+                p.end   = end;
+                p.groups.assign(p.keyword_group ? 2 : 1, { at, end });
+                return true;
+            }
+            at = end;
+        }
+        return false;
+    }
+
+    // With the first bytes known, try the pattern only where one of
+    // them is, and only there; otherwise let std::regex scan.
+    auto skip = [&](std::size_t& at) {
+        if (p.only_byte >= 0) {
+            const void* hit = at < line.size()
+                ? std::memchr(line.data() + at, p.only_byte, line.size() - at)
+                : nullptr;
+            at = hit ? static_cast<std::size_t>(
+                           static_cast<const char*>(hit) - line.data())
+                     : line.size();
+            return hit != nullptr;
+        }
+        while (at < line.size()
+               && (!p.first.set[static_cast<unsigned char>(line[at])]
+                   || (p.first.word_start && at > 0
+                       && is_word(static_cast<unsigned char>(line[at - 1])))))
+            ++at;
+        return at < line.size();
+    };
+
+#ifdef PPLUA_PCRE2
+    std::size_t at = from;
+    if (!p.first.any && !skip(at))
+        return false;
+    if (!p.pcre2.search(line, at, p.groups))
+        return false;
+    p.start = p.groups[0].first;
+    p.end   = p.groups[0].second;
+#else
+    if (p.simple) {
+        for (std::size_t at = from; ; ++at) {
+            if (!p.first.any && !skip(at))
+                return false;
+            if (p.native.match(line, at, p.groups)) {
+                p.start = p.groups[0].first;
+                p.end   = p.groups[0].second;
+                return true;
+            }
+            if (p.first.anchored || at >= line.size())
+                return false;
+        }
+    }
+
+    std::cmatch m;
+    std::size_t at = from;
+    for (;;) {
+        if (!p.first.any && !skip(at))
+            return false;
+        auto flags = std::regex_constants::match_default;
+        if (at > 0)
+            flags |= std::regex_constants::match_prev_avail;
+        if (p.first.anchored || !p.first.any)
+            flags |= std::regex_constants::match_continuous;
+        if (std::regex_search(line.data() + at, line.data() + line.size(),
+                              m, p.re, flags))
+            break;
+        if (p.first.anchored || p.first.any)
+            return false;
+        ++at;
+    }
+
+    p.start = at + static_cast<std::size_t>(m.position(0));
+    p.end   = p.start + static_cast<std::size_t>(m.length(0));
+    p.groups.clear();
+    for (std::size_t k = 0; k < m.size(); ++k)
+        p.groups.emplace_back(m[k].matched ? at + m.position(k) : npos,
+                              m[k].matched ? at + m.position(k) + m.length(k) : npos);
+#endif
+    return true;
+}
+
+int SyntaxSet::Impl::find_grammar(const std::string& lang) const
+{
+    for (std::size_t g = 0; g < grammars.size(); ++g) {
+        const Grammar& gr = grammars[g];
+        if (gr.name == lang || gr.scope == lang
+            || gr.scope == "source." + lang || gr.scope == "text." + lang
+            || std::find(gr.extensions.begin(), gr.extensions.end(), lang)
+               != gr.extensions.end())
+            return static_cast<int>(g);
+    }
+    return -1;
+}
+
+// =================================================================
+//  SyntaxSet
+// =================================================================
+
+SyntaxSet::SyntaxSet() : impl_(std::make_unique<Impl>()) {}
+SyntaxSet::~SyntaxSet() = default;
+
+std::string SyntaxSet::load(const std::string& path)
+{
+    Impl& s = *impl_;
+    for (auto& g : s.grammars)
+        if (g.path == path)
+            return g.name;
+
+    YamlNode doc = YamlReader(slurp(path), path).document();
+    const YamlNode* ctxs = doc.get("contexts");
+    if (!ctxs || ctxs->kind != YamlNode::Kind::map)
+        throw std::runtime_error("syntax: " + path + ": no contexts");
+
+    Impl::Grammar gr;
+    gr.path  = path;
+    gr.name  = doc.text("name");
+    gr.scope = doc.text("scope");
+    if (gr.name.empty()) {
+        gr.name = path.substr(path.rfind('/') + 1);
+        gr.name = gr.name.substr(0, gr.name.find('.'));
+    }
+    if (const YamlNode* ext = doc.get("file_extensions"))
+        for (auto& e : ext->seq)
+            gr.extensions.push_back(e.scalar);
+    if (const YamlNode* vars = doc.get("variables"))
+        for (auto& [name, value] : vars->map)
+            gr.variables[name] = value.scalar;
+
+    const std::size_t g = s.grammars.size();
+    for (auto& [name, body] : ctxs->map) {
+        gr.contexts[name] = static_cast<int>(s.contexts.size());
+        s.contexts.emplace_back();
+        s.contexts.back().grammar = g;
+    }
+    s.grammars.push_back(std::move(gr));
+    try {
+        for (auto& [name, body] : ctxs->map)
+            s.read_items(g, s.grammars[g].contexts[name], body);
+    } catch (...) {
+        s.grammars.pop_back();
+        throw;
+    }
+    return s.grammars[g].name;
+}
+
+std::size_t SyntaxSet::highlight(std::string_view code, const std::string& lang,
+                                 const HighlightTheme& theme, std::string& out)
+{
+    Impl& s = *impl_;
+    int g = s.find_grammar(lang);
+    if (g < 0)
+        throw std::runtime_error("highlight: no grammar for '" + lang
+                                 + "' (load one with lroff.syntax)");
+    int main = s.resolve(static_cast<std::size_t>(g), "main");
+    if (main < 0)
+        throw std::runtime_error("highlight: " + s.grammars[g].path
+                                 + ": no main context");
+
+    // Theme entry per scope, worked out as scopes come up.
+    std::vector<int> styles(s.scopes.size(), -2);
+    auto style_of = [&](int scope) -> int {
+        if (scope < 0)
+            return -1;
+        if (static_cast<std::size_t>(scope) >= styles.size())
+            styles.resize(s.scopes.size(), -2);
+        int& st = styles[scope];
+        if (st != -2)
+            return st;
+        st = -1;
+        // Of "a.b c.d", the last scope is the innermost.
+        std::string_view all = s.scopes[scope];
+        std::size_t best = 0;
+        for (std::size_t end = all.size(); st < 0 && end != npos && end > 0; ) {
+            std::size_t sp = all.rfind(' ', end - 1);
+            std::size_t from = sp == npos ? 0 : sp + 1;
+            std::string_view word = all.substr(from, end - from);
+            for (std::size_t k = 0; k < theme.size(); ++k) {
+                const std::string& sel = theme[k].first;
+                if (sel.size() > best && word.compare(0, sel.size(), sel) == 0
+                    && (word.size() == sel.size() || word[sel.size()] == '.')) {
+                    st = static_cast<int>(k);
+                    best = sel.size();
+                }
+            }
+            end = sp;
+        }
+        return st;
+    };
+
+    std::vector<int> stack{ main };
+    auto content_style = [&]() {
+        for (std::size_t k = stack.size(); k-- > 0; ) {
+            const Impl::Context& c = s.contexts[stack[k]];
+            int st = style_of(c.meta_content_scope);
+            if (st < 0)
+                st = style_of(c.meta_scope);
+            if (st >= 0)
+                return st;
+        }
+        return -1;
+    };
+
+    Writer w(out, theme);
+    std::vector<int> spans;                 // styles within a match
+    std::size_t lines = 0;
+
+    for (std::size_t pos = 0; pos < code.size(); ) {
+        std::size_t nl = code.find('\n', pos);
+        if (nl == npos)
+            nl = code.size();
+        std::string_view line = code.substr(pos, nl - pos);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        pos = nl + 1;
+        ++lines;
+        ++s.line_no;
+        s.present.reset();
+        for (char c : line)
+            s.present.set(static_cast<unsigned char>(c));
+
+        std::size_t at = 0;
+        int stuck = 0;                      // empty matches at `at`
+        for (;;) {
+            int top = stack.back();
+            s.build(top);
+            const Impl::Context& ctx = s.contexts[top];
+
+            const Impl::Rule* best = nullptr;
+            for (auto& r : ctx.rules) {
+                Impl::Pattern& p = s.patterns[r.pattern];
+                if (!s.search(p, line, at))
+                    continue;
+                if (!best || p.start < s.patterns[best->pattern].start) {
+                    best = &r;
+                    if (p.start == at)
+                        break;
+                }
+            }
+            if (!best) {
+                w.text(line.substr(at), content_style());
+                break;
+            }
+
+            const Impl::Pattern& p = s.patterns[best->pattern];
+            w.text(line.substr(at, p.start - at), content_style());
+
+            // A match that pushes or pops is part of the context it
+            // opens or closes.
+            int match_style = style_of(best->scope);
+            if (match_style < 0 && (best->op == Impl::Rule::Op::push
+                                    || best->op == Impl::Rule::Op::set))
+                match_style = style_of(
+                    s.contexts[best->targets.back().context].meta_scope);
+            if (match_style < 0 && best->op == Impl::Rule::Op::pop)
+                match_style = style_of(ctx.meta_scope);
+            if (match_style < 0)
+                match_style = content_style();
+            if (best->captures.empty()) {
+                w.text(line.substr(p.start, p.end - p.start), match_style);
+            } else {
+                spans.assign(p.end - p.start, match_style);
+                for (auto& [group, scope] : best->captures) {
+                    int st = style_of(scope);
+                    if (group >= p.groups.size() || p.groups[group].first == npos
+                        || st < 0)
+                        continue;
+                    std::fill(spans.begin() + (p.groups[group].first - p.start),
+                              spans.begin() + (p.groups[group].second - p.start),
+                              st);
+                }
+                for (std::size_t k = 0; k < spans.size(); ) {
+                    std::size_t e = k;
+                    while (e < spans.size() && spans[e] == spans[k])
+                        ++e;
+                    w.text(line.substr(p.start + k, e - k), spans[k]);
+                    k = e;
+                }
+            }
+
+            const bool empty = p.end == p.start;
+            const std::size_t end = p.end;
+            switch (best->op) {
+            case Impl::Rule::Op::none:
+                break;
+            case Impl::Rule::Op::pop:
+                for (int k = 0; k < best->pops && stack.size() > 1; ++k)
+                    stack.pop_back();
+                break;
+            case Impl::Rule::Op::set:
+                if (stack.size() > 1)
+                    stack.pop_back();
+                else
+                    stack.clear();
+                [[fallthrough]];
+            case Impl::Rule::Op::push:
+                for (auto& t : best->targets)
+                    stack.push_back(t.context);
+                break;
+            }
+
+            // An empty match that changes nothing, or that keeps
+            // coming back, would never get past this point.
+            if (empty && (best->op == Impl::Rule::Op::none || ++stuck > 32)) {
+                if (at >= line.size())
+                    break;
+                w.text(line.substr(at, 1), content_style());
+                ++at;
+                stuck = 0;
+                continue;
+            }
+            if (!empty)
+                stuck = 0;
+            at = end;
+        }
+        w.end_line();
+    }
+    return lines;
+}
+
+} // namespace pplua
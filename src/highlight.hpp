@@ -0,0 +1,86 @@
+// src/highlight.hpp
+//
+// lroff.highlight: a syntax highlighter driven by Sublime Text
+// .sublime-syntax grammars (contrib/lroff.sublime-syntax among
+// them).  Listings come out as groff text with font and colour
+// escapes, ready for a .nf display.
+
+#ifndef PPLUA_HIGHLIGHT_HPP
+#define PPLUA_HIGHLIGHT_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace pplua {
+
+// =====================================================================
+//  HighlightTheme — scope selectors and how to set them
+//
+//  A selector matches a scope it is a prefix of, at a dot:
+//  "keyword" matches "keyword.control.lroff".  Of the selectors that
+//  match the innermost styled scope, the longest wins.  `font` is a
+//  groff font or style (B, I, BI, CB), `color` a defined colour;
+//  either may be empty.
+// =====================================================================
+struct HighlightStyle {
+    std::string font;
+    std::string color;
+};
+
+using HighlightTheme = std::vector<std::pair<std::string, HighlightStyle>>;
+
+/// The theme used when lroff.highlight is given none: bold keywords,
+/// italic comments, and groff's predefined colours.
+const HighlightTheme& default_highlight_theme();
+
+// =====================================================================
+//  SyntaxSet — the grammars loaded in one Lua state
+//
+//  A grammar is read once per run.  Its contexts are put together
+//  and its regular expressions compiled on first use, then kept;
+//  includes of another grammar's scope (scope:source.lua) resolve
+//  against whatever grammars are loaded by then.
+//
+//  The YAML reader covers what grammars use: block mappings and
+//  sequences, plain, quoted and block scalars, and flow sequences.
+//  Patterns are translated from Oniguruma (\h, (?x), (?i),
+//  possessive and atomic forms).  Built with PPLUA_PCRE2 they all
+//  run on PCRE2.  Otherwise those made of bytes, classes, optional
+//  groups and lookahead, as token rules mostly are, are matched by a
+//  backtracking matcher of our own and the rest run on std::regex;
+//  lookbehind is reported when the grammar is read and its rule
+//  skipped.  A pattern that does not compile is reported once and
+//  its rule skipped.
+// =====================================================================
+class SyntaxSet {
+public:
+    SyntaxSet();
+    ~SyntaxSet();
+
+    SyntaxSet(const SyntaxSet&) = delete;
+    SyntaxSet& operator=(const SyntaxSet&) = delete;
+
+    /// Load the grammar in `path` unless it already is.  Returns
+    /// its name.  Throws std::runtime_error.
+    std::string load(const std::string& path);
+
+    /// Highlight `code` with the grammar named `lang` (its name, its
+    /// scope, or one of its file extensions), appending groff text
+    /// to `out`: one line per line of code, escaped so that none is
+    /// read as a request.  Returns the number of lines.  Throws
+    /// std::runtime_error if no grammar goes by `lang`.
+    std::size_t highlight(std::string_view code, const std::string& lang,
+                          const HighlightTheme& theme, std::string& out);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+};
+
+} // namespace pplua
+
+#endif // PPLUA_HIGHLIGHT_HPP
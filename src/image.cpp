@@ -0,0 +1,715 @@
+// src/image.cpp
+//
+// Saving and restoring the state the preambles build.
+
+#include "image.hpp"
+#include "compat.hpp"
+#include "hash.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <unordered_map>
+
+#ifndef PPLUA_VERSION
+#define PPLUA_VERSION "0.1.0"
+#endif
+
+namespace pplua {
+
+namespace {
+
+const char* const BASELINE_KEY = "pplua.image.baseline";
+const char        MAGIC[8]     = { 'P', 'P', 'L', 'U', 'A', 'I', 'M', 'G' };
+const std::uint32_t FORMAT     = 1;
+const int         MAX_DEPTH    = 200;
+
+// Value tags.
+enum Tag : unsigned char {
+    T_NIL, T_FALSE, T_TRUE, T_INTEGER, T_NUMBER, T_STRING,
+    T_REF,          // an object already in the image, by number
+    T_PATH,         // an object from the baseline, by path
+    T_TABLE,        // entries up to T_END, then the metatable
+    T_FUNCTION,     // bytecode, then the upvalues
+    T_SHARED,       // an upvalue that is another function's
+    T_END,
+};
+
+std::string build_name()
+{
+    return std::string("pplua " PPLUA_VERSION " / ") + lua_runtime_name();
+}
+
+// The baseline, and the difference from it, are worked out in Lua:
+// it is a walk over tables and much shorter there.
+const char* const BASELINE_LUA = R"lua(
+    local lazy = ...
+    for _, name in ipairs(lazy) do
+        if package.preload[name] then require(name) end
+    end
+
+    local paths, copies, queue = { [_G] = {} }, {}, { _G }
+    local i = 1
+    while queue[i] do
+        local t = queue[i]
+        local path, copy = paths[t], {}
+        for k, v in next, t do
+            copy[k] = v
+            local kind = type(v)
+            if type(k) == "string" and paths[v] == nil
+               and kind ~= "string" and kind ~= "number"
+               and kind ~= "boolean" then
+                local p = {}
+                for j = 1, #path do p[j] = path[j] end
+                p[#p + 1] = k
+                paths[v] = p
+                if kind == "table" then queue[#queue + 1] = v end
+            end
+        end
+        copies[t] = copy
+        i = i + 1
+    end
+    return { paths = paths, copies = copies }
+)lua";
+
+const char* const DIFF_LUA = R"lua(
+    local base = ...
+    local patches = {}
+    for t, copy in next, base.copies do
+        local path = base.paths[t]
+        for k, v in next, t do
+            if not rawequal(rawget(copy, k), v) then
+                patches[#patches + 1] = { path, k, v }
+            end
+        end
+        for k in next, copy do
+            if rawget(t, k) == nil then
+                patches[#patches + 1] = { path, k }
+            end
+        end
+    end
+    return patches
+)lua";
+
+// Run one of the chunks above with the value at the top of the
+// stack as its argument, replacing it with the result.
+void run_helper(lua_State* L, const char* code, const char* name)
+{
+    if (luaL_loadbuffer(L, code, std::strlen(code), name) != LUA_OK) {
+        std::string msg = lua_tostring(L, -1);
+        lua_pop(L, 2);
+        throw std::runtime_error("image: " + msg);
+    }
+    lua_insert(L, -2);
+    if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+        std::string msg = lua_tostring(L, -1);
+        lua_pop(L, 1);
+        throw std::runtime_error("image: " + msg);
+    }
+}
+
+// =================================================================
+//  Writing
+// =================================================================
+
+class Writer {
+public:
+    void u8(unsigned char c) { buf_ += static_cast<char>(c); }
+
+    void u32(std::uint32_t v) {
+        for (int i = 0; i < 4; ++i)
+            u8(static_cast<unsigned char>(v >> (8 * i)));
+    }
+
+    void u64(std::uint64_t v) {
+        for (int i = 0; i < 8; ++i)
+            u8(static_cast<unsigned char>(v >> (8 * i)));
+    }
+
+    void str(const char* s, std::size_t n) {
+        u64(n);
+        buf_.append(s, n);
+    }
+    void str(const std::string& s) { str(s.data(), s.size()); }
+
+    void raw(const void* p, std::size_t n) {
+        buf_.append(static_cast<const char*>(p), n);
+    }
+
+    const std::string& bytes() const { return buf_; }
+
+private:
+    std::string buf_;
+};
+
+int dump_writer(lua_State*, const void* p, std::size_t n, void* ud)
+{
+    static_cast<std::string*>(ud)->append(static_cast<const char*>(p), n);
+    return 0;
+}
+
+// Writes values, keeping track of the objects already written.
+class Encoder {
+public:
+    Encoder(lua_State* L, Writer& out, int paths, int seen)
+        : L_(L), out_(out), paths_(paths), seen_(seen) {}
+
+    /// Write the value at absolute index `idx`; `where` names it in
+    /// errors.
+    void value(int idx, const std::string& where, int depth = 0);
+
+private:
+    lua_State* L_;
+    Writer&    out_;
+    int        paths_;      // baseline object -> path
+    int        seen_;       // object -> number, in writing order
+    std::uint32_t objects_ = 0;
+    std::unordered_map<const void*, std::pair<std::uint32_t, int>> upvalues_;
+
+    std::uint32_t remember(int idx);
+    void table(int idx, const std::string& where, int depth);
+    void function(int idx, const std::string& where, int depth);
+};
+
+std::uint32_t Encoder::remember(int idx)
+{
+    lua_pushvalue(L_, idx);
+    lua_pushinteger(L_, static_cast<lua_Integer>(objects_));
+    lua_rawset(L_, seen_);
+    return objects_++;
+}
+
+void Encoder::value(int idx, const std::string& where, int depth)
+{
+    if (depth > MAX_DEPTH)
+        throw std::runtime_error("image: " + where + ": nested too deeply");
+    if (!lua_checkstack(L_, 8))
+        throw std::runtime_error("image: out of Lua stack");
+
+    switch (lua_type(L_, idx)) {
+    case LUA_TNIL:
+        out_.u8(T_NIL);
+        return;
+    case LUA_TBOOLEAN:
+        out_.u8(lua_toboolean(L_, idx) ? T_TRUE : T_FALSE);
+        return;
+    case LUA_TNUMBER:
+        if (lua_isinteger(L_, idx)) {
+            out_.u8(T_INTEGER);
+            out_.u64(static_cast<std::uint64_t>(lua_tointeger(L_, idx)));
+        } else {
+            double d = lua_tonumber(L_, idx);
+            std::uint64_t bits;
+            std::memcpy(&bits, &d, sizeof bits);
+            out_.u8(T_NUMBER);
+            out_.u64(bits);
+        }
+        return;
+    case LUA_TSTRING: {
+        std::size_t n;
+        const char* s = lua_tolstring(L_, idx, &n);
+        out_.u8(T_STRING);
+        out_.str(s, n);
+        return;
+    }
+    }
+
+    // An object: written before, there before the setup, or new.
+    lua_pushvalue(L_, idx);
+    lua_rawget(L_, seen_);
+    if (lua_type(L_, -1) == LUA_TNUMBER) {
+        out_.u8(T_REF);
+        out_.u32(static_cast<std::uint32_t>(lua_tointeger(L_, -1)));
+        lua_pop(L_, 1);
+        return;
+    }
+    lua_pop(L_, 1);
+
+    lua_pushvalue(L_, idx);
+    lua_rawget(L_, paths_);
+    if (lua_istable(L_, -1)) {
+        int path = lua_gettop(L_);
+        std::size_t n = lua_rawlen(L_, path);
+        out_.u8(T_PATH);
+        out_.u32(static_cast<std::uint32_t>(n));
+        for (std::size_t i = 1; i <= n; ++i) {
+            lua_rawgeti(L_, path, static_cast<lua_Integer>(i));
+            std::size_t len;
+            const char* s = lua_tolstring(L_, -1, &len);
+            out_.str(s, len);
+            lua_pop(L_, 1);
+        }
+        lua_pop(L_, 1);
+        return;
+    }
+    lua_pop(L_, 1);
+
+    if (lua_type(L_, idx) == LUA_TTABLE) {
+        table(idx, where, depth);
+    } else if (lua_type(L_, idx) == LUA_TFUNCTION && !lua_iscfunction(L_, idx)) {
+        function(idx, where, depth);
+    } else {
+        const char* what = lua_iscfunction(L_, idx) ? "C function"
+                                                    : luaL_typename(L_, idx);
+        throw std::runtime_error("image: cannot save " + where
+                                 + ": a " + what);
+    }
+}
+
+void Encoder::table(int idx, const std::string& where, int depth)
+{
+    remember(idx);
+    out_.u8(T_TABLE);
+    lua_pushnil(L_);
+    while (lua_next(L_, idx)) {
+        int top = lua_gettop(L_);
+        std::string inner = where;
+        if (lua_type(L_, top - 1) == LUA_TSTRING)
+            inner += std::string(".") + lua_tostring(L_, top - 1);
+        else
+            inner += "[...]";
+        value(top - 1, inner, depth + 1);
+        value(top, inner, depth + 1);
+        lua_pop(L_, 1);
+    }
+    out_.u8(T_END);
+
+    if (lua_getmetatable(L_, idx)) {
+        value(lua_gettop(L_), "the metatable of " + where, depth + 1);
+        lua_pop(L_, 1);
+    } else {
+        out_.u8(T_NIL);
+    }
+}
+
+void Encoder::function(int idx, const std::string& where, int depth)
+{
+    std::uint32_t id = remember(idx);
+    out_.u8(T_FUNCTION);
+
+    std::string code;
+    lua_pushvalue(L_, idx);
+    int rc = lua_dump(L_, dump_writer, &code, 0);
+    lua_pop(L_, 1);
+    if (rc != 0)
+        throw std::runtime_error("image: cannot save " + where
+                                 + ": lua_dump failed");
+    out_.str(code);
+
+    int n = 0;
+    while (lua_getupvalue(L_, idx, n + 1)) {
+        lua_pop(L_, 1);
+        ++n;
+    }
+    out_.u32(static_cast<std::uint32_t>(n));
+
+    for (int i = 1; i <= n; ++i) {
+        const void* uid = lua_upvalueid(L_, idx, i);
+        auto it = upvalues_.find(uid);
+        if (it != upvalues_.end()) {
+            out_.u8(T_SHARED);
+            out_.u32(it->second.first);
+            out_.u32(static_cast<std::uint32_t>(it->second.second));
+            continue;
+        }
+        upvalues_.emplace(uid, std::make_pair(id, i));
+        const char* name = lua_getupvalue(L_, idx, i);
+        value(lua_gettop(L_), "upvalue '" + std::string(name ? name : "?")
+                              + "' of " + where, depth + 1);
+        lua_pop(L_, 1);
+    }
+}
+
+// =================================================================
+//  Reading
+// =================================================================
+
+class Reader {
+public:
+    Reader(const std::string& bytes, const std::string& path)
+        : p_(bytes.data()), end_(bytes.data() + bytes.size()), path_(path) {}
+
+    unsigned char u8() {
+        need(1);
+        return static_cast<unsigned char>(*p_++);
+    }
+
+    std::uint32_t u32() {
+        std::uint32_t v = 0;
+        for (int i = 0; i < 4; ++i)
+            v |= static_cast<std::uint32_t>(u8()) << (8 * i);
+        return v;
+    }
+
+    std::uint64_t u64() {
+        std::uint64_t v = 0;
+        for (int i = 0; i < 8; ++i)
+            v |= static_cast<std::uint64_t>(u8()) << (8 * i);
+        return v;
+    }
+
+    std::string str() {
+        std::uint64_t n = u64();
+        need(n);
+        std::string s(p_, static_cast<std::size_t>(n));
+        p_ += n;
+        return s;
+    }
+
+    bool at_end() const { return p_ == end_; }
+
+    [[noreturn]] void corrupt() const {
+        throw std::runtime_error("image: " + path_ + ": not a valid image");
+    }
+
+private:
+    const char* p_;
+    const char* end_;
+    const std::string& path_;
+
+    void need(std::uint64_t n) const {
+        if (n > static_cast<std::uint64_t>(end_ - p_))
+            corrupt();
+    }
+};
+
+// Reads values back, in the order the encoder wrote them.
+class Decoder {
+public:
+    Decoder(lua_State* L, Reader& in, int objects)
+        : L_(L), in_(in), objects_(objects) {}
+
+    /// Push the next value.
+    void value(int depth = 0);
+
+    /// Push the baseline object at a path read from the input.
+    void path();
+
+private:
+    lua_State* L_;
+    Reader&    in_;
+    int        objects_;    // number -> object
+    lua_Integer count_ = 0;
+
+    void remember(int idx);
+    void value(unsigned char tag, int depth);
+};
+
+void Decoder::remember(int idx)
+{
+    lua_pushvalue(L_, idx);
+    lua_rawseti(L_, objects_, count_++);
+}
+
+void Decoder::path()
+{
+    std::uint32_t n = in_.u32();
+    std::string name;
+    lua_pushglobaltable(L_);
+    for (std::uint32_t i = 0; i < n; ++i) {
+        std::string key = in_.str();
+        name += (i ? "." : "") + key;
+        if (!lua_istable(L_, -1))
+            throw std::runtime_error("image: '" + name
+                                     + "' is not there in this pplua");
+        lua_getfield(L_, -1, key.c_str());
+        lua_remove(L_, -2);
+    }
+    if (lua_isnil(L_, -1))
+        throw std::runtime_error("image: '" + name
+                                 + "' is not there in this pplua");
+}
+
+void Decoder::value(int depth)
+{
+    value(in_.u8(), depth);
+}
+
+void Decoder::value(unsigned char tag, int depth)
+{
+    if (depth > MAX_DEPTH || !lua_checkstack(L_, 8))
+        in_.corrupt();
+
+    switch (tag) {
+    case T_NIL:     lua_pushnil(L_);          return;
+    case T_FALSE:   lua_pushboolean(L_, 0);   return;
+    case T_TRUE:    lua_pushboolean(L_, 1);   return;
+    case T_INTEGER:
+        lua_pushinteger(L_, static_cast<lua_Integer>(
+            static_cast<std::int64_t>(in_.u64())));
+        return;
+    case T_NUMBER: {
+        std::uint64_t bits = in_.u64();
+        double d;
+        std::memcpy(&d, &bits, sizeof d);
+        lua_pushnumber(L_, d);
+        return;
+    }
+    case T_STRING: {
+        std::string s = in_.str();
+        lua_pushlstring(L_, s.data(), s.size());
+        return;
+    }
+    case T_REF: {
+        lua_Integer id = in_.u32();
+        if (id >= count_)
+            in_.corrupt();
+        lua_rawgeti(L_, objects_, id);
+        return;
+    }
+    case T_PATH:
+        path();
+        return;
+    case T_TABLE: {
+        lua_newtable(L_);
+        int t = lua_gettop(L_);
+        remember(t);
+        for (unsigned char k; (k = in_.u8()) != T_END; ) {
+            value(k, depth + 1);
+            value(depth + 1);
+            if (lua_isnil(L_, -2))
+                in_.corrupt();
+            lua_rawset(L_, t);
+        }
+        value(depth + 1);
+        if (lua_istable(L_, -1))
+            lua_setmetatable(L_, t);
+        else
+            lua_pop(L_, 1);
+        return;
+    }
+    case T_FUNCTION: {
+        std::string code = in_.str();
+        if (luaL_loadbuffer(L_, code.data(), code.size(), "=image") != LUA_OK)
+            in_.corrupt();
+        int f = lua_gettop(L_);
+        remember(f);
+        std::uint32_t n = in_.u32();
+        for (std::uint32_t i = 1; i <= n; ++i) {
+            unsigned char u = in_.u8();
+            if (u == T_SHARED) {
+                lua_Integer owner = in_.u32();
+                int up = static_cast<int>(in_.u32());
+                if (owner >= count_)
+                    in_.corrupt();
+                lua_rawgeti(L_, objects_, owner);
+                if (!lua_isfunction(L_, -1) || lua_iscfunction(L_, -1)
+                    || !lua_getupvalue(L_, -1, up))
+                    in_.corrupt();
+                lua_pop(L_, 1);
+                lua_upvaluejoin(L_, f, static_cast<int>(i), -1, up);
+                lua_pop(L_, 1);
+                continue;
+            }
+            value(u, depth + 1);
+            if (!lua_setupvalue(L_, f, static_cast<int>(i))) {
+                lua_pop(L_, 1);
+                in_.corrupt();
+            }
+        }
+        return;
+    }
+    }
+    in_.corrupt();
+}
+
+} // namespace
+
+// =================================================================
+//  Entry points
+// =================================================================
+
+void take_image_baseline(lua_State* L)
+{
+    lua_newtable(L);
+    int i = 0;
+    for (const char* name : { "io", "os", "utf8", "coroutine" }) {
+        lua_pushstring(L, name);
+        lua_rawseti(L, -2, ++i);
+    }
+    run_helper(L, BASELINE_LUA, "=pplua-image");
+    lua_setfield(L, LUA_REGISTRYINDEX, BASELINE_KEY);
+}
+
+void write_image(lua_State* L, int requests, const ImageSetup& setup,
+                 const ImageExtras& extras, const std::string& path)
+{
+    requests = lua_absindex(L, requests);
+    const int base = lua_gettop(L);
+
+    Writer out;
+    out.raw(MAGIC, sizeof MAGIC);
+    out.u32(FORMAT);
+    out.str(build_name());
+
+    out.u32(static_cast<std::uint32_t>(setup.defines.size()));
+    for (auto& [name, value] : setup.defines) {
+        out.str(name);
+        out.str(value);
+    }
+    out.u32(static_cast<std::uint32_t>(setup.exec_chunks.size()));
+    for (auto& code : setup.exec_chunks)
+        out.str(code);
+    out.u32(static_cast<std::uint32_t>(setup.preamble_files.size()));
+    for (auto& pf : setup.preamble_files) {
+        std::string digest;
+        if (!sha256_file(pf, digest))
+            throw std::runtime_error("image: cannot read preamble '" + pf + "'");
+        out.str(pf);
+        out.str(digest);
+    }
+
+    out.str(extras.output);
+    out.u32(static_cast<std::uint32_t>(extras.number_registers.size()));
+    for (auto& [name, value] : extras.number_registers) {
+        out.str(name);
+        out.u64(static_cast<std::uint64_t>(static_cast<std::int64_t>(value)));
+    }
+    out.u32(static_cast<std::uint32_t>(extras.string_registers.size()));
+    for (auto& [name, value] : extras.string_registers) {
+        out.str(name);
+        out.str(value);
+    }
+
+    try {
+        lua_getfield(L, LUA_REGISTRYINDEX, BASELINE_KEY);
+        if (!lua_istable(L, -1))
+            throw std::runtime_error("image: no baseline was taken");
+        int baseline = lua_gettop(L);
+        lua_getfield(L, baseline, "paths");
+        int paths = lua_gettop(L);
+        lua_newtable(L);
+        int seen = lua_gettop(L);
+        Encoder enc(L, out, paths, seen);
+
+        lua_pushvalue(L, baseline);
+        run_helper(L, DIFF_LUA, "=pplua-image");
+        int patches = lua_gettop(L);
+        std::size_t n = lua_rawlen(L, patches);
+        out.u64(n);
+        for (std::size_t i = 1; i <= n; ++i) {
+            lua_rawgeti(L, patches, static_cast<lua_Integer>(i));
+            int patch = lua_gettop(L);
+
+            // The table's path, then the key and the new value.
+            lua_rawgeti(L, patch, 1);
+            int where = lua_gettop(L);
+            std::size_t len = lua_rawlen(L, where);
+            std::string name;
+            out.u32(static_cast<std::uint32_t>(len));
+            for (std::size_t k = 1; k <= len; ++k) {
+                lua_rawgeti(L, where, static_cast<lua_Integer>(k));
+                std::string key = lua_tostring(L, -1);
+                name += (k > 1 ? "." : "") + key;
+                out.str(key);
+                lua_pop(L, 1);
+            }
+            lua_rawgeti(L, patch, 2);
+            lua_rawgeti(L, patch, 3);
+            if (lua_type(L, -2) == LUA_TSTRING)
+                name += (name.empty() ? "" : ".")
+                      + std::string(lua_tostring(L, -2));
+            enc.value(lua_gettop(L) - 1, "'" + name + "'");
+            enc.value(lua_gettop(L), "'" + name + "'");
+            lua_settop(L, patch - 1);
+        }
+
+        enc.value(requests, "a request bound with lroff.define_request");
+    } catch (...) {
+        lua_settop(L, base);
+        throw;
+    }
+    lua_settop(L, base);
+
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    if (!f.is_open()
+        || !f.write(out.bytes().data(),
+                    static_cast<std::streamsize>(out.bytes().size())))
+        throw std::runtime_error("image: cannot write '" + path + "'");
+}
+
+bool read_image(lua_State* L, const std::string& path, ImageSetup& setup,
+                ImageExtras& extras, std::string& stale)
+{
+    std::ifstream f(path, std::ios::binary);
+    if (!f.is_open())
+        throw std::runtime_error("image: cannot open '" + path + "'");
+    std::string bytes((std::istreambuf_iterator<char>(f)),
+                      std::istreambuf_iterator<char>());
+
+    Reader in(bytes, path);
+    for (char c : MAGIC)
+        if (in.u8() != static_cast<unsigned char>(c))
+            in.corrupt();
+    if (in.u32() != FORMAT) {
+        stale = "written in another format";
+        return false;
+    }
+    std::string build = in.str();
+
+    setup = ImageSetup();
+    for (std::uint32_t n = in.u32(); n; --n) {
+        std::string name = in.str();
+        setup.defines.emplace_back(std::move(name), in.str());
+    }
+    for (std::uint32_t n = in.u32(); n; --n)
+        setup.exec_chunks.push_back(in.str());
+    std::vector<std::string> digests;
+    for (std::uint32_t n = in.u32(); n; --n) {
+        setup.preamble_files.push_back(in.str());
+        digests.push_back(in.str());
+    }
+
+    if (build != build_name()) {
+        stale = "written by " + build;
+        return false;
+    }
+    for (std::size_t i = 0; i < digests.size(); ++i) {
+        std::string now;
+        if (!sha256_file(setup.preamble_files[i], now) || now != digests[i]) {
+            stale = "'" + setup.preamble_files[i] + "' has changed";
+            return false;
+        }
+    }
+
+    extras = ImageExtras();
+    extras.output = in.str();
+    for (std::uint32_t n = in.u32(); n; --n) {
+        std::string name = in.str();
+        extras.number_registers[name] =
+            static_cast<int>(static_cast<std::int64_t>(in.u64()));
+    }
+    for (std::uint32_t n = in.u32(); n; --n) {
+        std::string name = in.str();
+        extras.string_registers[name] = in.str();
+    }
+
+    const int base = lua_gettop(L);
+    try {
+        lua_newtable(L);
+        Decoder dec(L, in, lua_gettop(L));
+        for (std::uint64_t n = in.u64(); n; --n) {
+            dec.path();
+            if (!lua_istable(L, -1))
+                in.corrupt();
+            dec.value();
+            dec.value();
+            if (lua_isnil(L, -2))
+                in.corrupt();
+            lua_rawset(L, -3);
+            lua_pop(L, 1);
+        }
+        dec.value();
+        if (!lua_istable(L, -1) || !in.at_end())
+            in.corrupt();
+    } catch (...) {
+        lua_settop(L, base);
+        throw;
+    }
+    lua_remove(L, base + 1);
+    return true;
+}
+
+} // namespace pplua
@@ -0,0 +1,75 @@
+// src/image.hpp
+//
+// --save-image and --image: what the preambles leave in the Lua
+// state, written to a file once and read back at start-up instead
+// of running them again.
+
+#ifndef PPLUA_IMAGE_HPP
+#define PPLUA_IMAGE_HPP
+
+#define SOL_ALL_SAFETIES_ON 1
+#include <sol/sol.hpp>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace pplua {
+
+/// What built an image, in the order it ran: -D globals, -e chunks
+/// and -l preambles.  A stale image is replaced by running these.
+struct ImageSetup {
+    std::vector<std::pair<std::string, std::string>> defines;
+    std::vector<std::string> exec_chunks;
+    std::vector<std::string> preamble_files;
+};
+
+/// What the setup left outside the Lua globals.
+struct ImageExtras {
+    std::string                        output;  // text it emitted
+    std::map<std::string, int>         number_registers;
+    std::map<std::string, std::string> string_registers;
+};
+
+// =====================================================================
+//  Images
+//
+//  An image holds the difference between the state as it was before
+//  the setup ran (the baseline) and as the setup left it: every
+//  entry it added to or changed in a table reachable from the
+//  globals.  New tables are written out whole, with their
+//  metatables; Lua functions as bytecode with their upvalues, shared
+//  upvalues staying shared.  Anything that existed before (library
+//  tables, C functions, lroff itself) is written as the path it is
+//  found at — "string.format" — and looked up again on loading.
+//  Userdata, threads and C functions of the setup's own cannot be
+//  saved.
+//
+//  The header names the pplua and Lua that wrote the image, and the
+//  setup with a digest of every preamble file.  An image from
+//  another build, or whose preambles have changed since, is stale.
+// =====================================================================
+
+/// Record the baseline: every table reachable from the globals by
+/// string keys, with a copy of its entries.  Lazily opened libraries
+/// are opened first.  Kept in the registry until the state closes.
+void take_image_baseline(lua_State* L);
+
+/// Write the image of `L` against its baseline to `path`.  The
+/// table at stack index `requests` maps request names to the
+/// functions bound to them.  Throws std::runtime_error.
+void write_image(lua_State* L, int requests, const ImageSetup& setup,
+                 const ImageExtras& extras, const std::string& path);
+
+/// Read the header of the image at `path` into `setup`.  If the
+/// image is current, apply it to `L`, fill `extras`, push the table
+/// of requests and return true.  If it is stale, say why in `stale`
+/// and return false, leaving `L` alone.  Throws std::runtime_error
+/// if the file cannot be read or is not a well-formed image.
+bool read_image(lua_State* L, const std::string& path, ImageSetup& setup,
+                ImageExtras& extras, std::string& stale);
+
+} // namespace pplua
+
+#endif // PPLUA_IMAGE_HPP
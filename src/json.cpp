@@ -0,0 +1,700 @@
+// src/json.cpp
+//
+// lroff.json: validation, lazy indexing, eager conversion and the
+// Lua bindings.  String and whitespace scanning use SSE2 where the
+// target has it, with a byte loop everywhere else.
+
+#include "json.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace pplua {
+
+namespace {
+
+const int         MAX_DEPTH  = 512;
+const char* const PROXY_META = "pplua.json";
+char              null_tag;           // its address is lroff.json.null
+
+inline bool is_ws(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+// First non-whitespace byte at or after i.
+std::size_t skip_ws(const char* p, std::size_t i, std::size_t n)
+{
+    // Most gaps are empty or a single space: look before going wide.
+    if (i < n && !is_ws(p[i]))
+        return i;
+#ifdef __SSE2__
+    const __m128i sp = _mm_set1_epi8(' '),  nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r'), ht = _mm_set1_epi8('\t');
+    while (i + 16 <= n) {
+        __m128i v  = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i ws = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, nl)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, ht)));
+        unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(ws)) & 0xFFFFu;
+        if (mask)
+            return i + static_cast<std::size_t>(__builtin_ctz(mask));
+        i += 16;
+    }
+#endif
+    while (i < n && is_ws(p[i]))
+        ++i;
+    return i;
+}
+
+// First '"', '\\' or control character at or after i.
+std::size_t scan_string(const char* p, std::size_t i, std::size_t n)
+{
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctl = _mm_set1_epi8(0x1F);
+    while (i + 16 <= n) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                 _mm_cmpeq_epi8(v, bslash));
+        // unsigned v <= 0x1F  <=>  min(v, 0x1F) == v
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, ctl), v));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(m));
+        if (mask)
+            return i + static_cast<std::size_t>(__builtin_ctz(mask));
+        i += 16;
+    }
+#endif
+    while (i < n && p[i] != '"' && p[i] != '\\'
+           && static_cast<unsigned char>(p[i]) >= 0x20)
+        ++i;
+    return i;
+}
+
+// First '"', '[', ']', '{' or '}' at or after i.
+std::size_t scan_structural(const char* p, std::size_t i, std::size_t n)
+{
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i lsq = _mm_set1_epi8('['), rsq = _mm_set1_epi8(']');
+    const __m128i lcu = _mm_set1_epi8('{'), rcu = _mm_set1_epi8('}');
+    while (i + 16 <= n) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i m = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, lsq), _mm_cmpeq_epi8(v, rsq)),
+            _mm_or_si128(_mm_cmpeq_epi8(v, lcu), _mm_cmpeq_epi8(v, rcu)));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quote));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(m));
+        if (mask)
+            return i + static_cast<std::size_t>(__builtin_ctz(mask));
+        i += 16;
+    }
+#endif
+    while (i < n && p[i] != '"' && p[i] != '[' && p[i] != ']'
+           && p[i] != '{' && p[i] != '}')
+        ++i;
+    return i;
+}
+
+int hex4(const char* p)
+{
+    int v = 0;
+    for (int k = 0; k < 4; ++k) {
+        char c = p[k];
+        v <<= 4;
+        if      (c >= '0' && c <= '9') v |= c - '0';
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else return -1;
+    }
+    return v;
+}
+
+void put_utf8(std::string& out, unsigned cp)
+{
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+// =================================================================
+//  Proxy userdata
+// =================================================================
+
+struct Proxy {
+    std::shared_ptr<JsonDocument> doc;
+    std::size_t                   pos;
+};
+
+Proxy* to_proxy(lua_State* L, int idx) {
+    return static_cast<Proxy*>(luaL_testudata(L, idx, PROXY_META));
+}
+
+void push_proxy(lua_State* L, const std::shared_ptr<JsonDocument>& doc,
+                std::size_t pos)
+{
+    void* mem = lua_newuserdata(L, sizeof(Proxy));
+    new (mem) Proxy{ doc, pos };
+    luaL_setmetatable(L, PROXY_META);
+}
+
+// Run `body`, turning a C++ exception into a Lua error once the
+// exception object is gone.
+template <class F>
+int guarded(lua_State* L, F&& body)
+{
+    try {
+        return body();
+    } catch (const std::exception& e) {
+        lua_pushstring(L, e.what());
+    }
+    return lua_error(L);
+}
+
+} // namespace
+
+// =================================================================
+//  JsonDocument — loading and validation
+// =================================================================
+
+std::shared_ptr<JsonDocument> JsonDocument::open(const std::string& path)
+{
+    auto doc = std::make_shared<JsonDocument>();
+    std::string error;
+    if (!doc->file_.open(path, error))
+        throw std::runtime_error("json.load: " + error);
+    doc->name_ = path;
+    doc->data_ = doc->file_.data();
+    doc->size_ = doc->file_.size();
+    doc->validate();
+    return doc;
+}
+
+std::shared_ptr<JsonDocument>
+JsonDocument::from_string(std::string text, std::string name)
+{
+    auto doc = std::make_shared<JsonDocument>();
+    doc->text_ = std::move(text);
+    doc->name_ = std::move(name);
+    doc->data_ = doc->text_.data();
+    doc->size_ = doc->text_.size();
+    doc->validate();
+    return doc;
+}
+
+void JsonDocument::fail(std::size_t pos, const std::string& what) const
+{
+    std::size_t line = 1, col = 1;
+    for (std::size_t k = 0; k < pos && k < size_; ++k) {
+        if (data_[k] == '\n') { ++line; col = 1; }
+        else                  { ++col; }
+    }
+    throw std::runtime_error("json: " + name_ + ":" + std::to_string(line)
+                             + ":" + std::to_string(col) + ": " + what);
+}
+
+void JsonDocument::validate()
+{
+    std::size_t i = 0;
+    if (size_ >= 3 && std::memcmp(data_, "\xEF\xBB\xBF", 3) == 0)
+        i = 3;
+    root_ = skip_ws(data_, i, size_);
+    std::size_t end = skip_ws(data_, parse(root_, 0, nullptr), size_);
+    if (end != size_)
+        fail(end, "trailing characters after the value");
+}
+
+// Validate the value at i and return the offset after it.  With a
+// Lua state, also push the value as plain Lua data (eager mode).
+std::size_t JsonDocument::parse(std::size_t i, int depth, lua_State* L)
+{
+    if (i >= size_)
+        fail(i, "unexpected end of input");
+
+    switch (data_[i]) {
+    case '{':
+    case '[': {
+        const bool object = data_[i] == '{';
+        const char close  = object ? '}' : ']';
+        if (depth >= MAX_DEPTH)
+            fail(i, "nesting deeper than " + std::to_string(MAX_DEPTH));
+        if (L) {
+            luaL_checkstack(L, 4, "json nesting");
+            lua_newtable(L);
+        }
+
+        i = skip_ws(data_, i + 1, size_);
+        if (i < size_ && data_[i] == close)
+            return i + 1;
+
+        std::string key;
+        for (lua_Integer n = 1; ; ++n) {
+            if (object) {
+                if (i >= size_ || data_[i] != '"')
+                    fail(i, "expected a string key");
+                i = parse_string(i, L ? &key : nullptr);
+                if (L)
+                    lua_pushlstring(L, key.data(), key.size());
+                i = skip_ws(data_, i, size_);
+                if (i >= size_ || data_[i] != ':')
+                    fail(i, "expected ':'");
+                i = skip_ws(data_, i + 1, size_);
+            }
+            i = skip_ws(data_, parse(i, depth + 1, L), size_);
+            if (L) {
+                if (object) lua_rawset(L, -3);
+                else        lua_rawseti(L, -2, n);
+            }
+            if (i < size_ && data_[i] == ',') {
+                i = skip_ws(data_, i + 1, size_);
+                continue;
+            }
+            if (i < size_ && data_[i] == close)
+                return i + 1;
+            fail(i, std::string("expected ',' or '") + close + "'");
+        }
+    }
+
+    case '"': {
+        std::string s;
+        std::size_t end = parse_string(i, L ? &s : nullptr);
+        if (L)
+            lua_pushlstring(L, s.data(), s.size());
+        return end;
+    }
+
+    case 't':
+    case 'f':
+    case 'n': {
+        static const char* const words[] = { "true", "false", "null" };
+        for (const char* w : words) {
+            std::size_t len = std::strlen(w);
+            if (size_ - i >= len && std::memcmp(data_ + i, w, len) == 0) {
+                if (L) {
+                    if (w[0] == 'n') lua_pushlightuserdata(L, &null_tag);
+                    else             lua_pushboolean(L, w[0] == 't');
+                }
+                return i + len;
+            }
+        }
+        fail(i, "invalid literal");
+    }
+
+    default: {
+        std::size_t end = parse_number(i);
+        if (L)
+            push_number(L, i, end);
+        return end;
+    }
+    }
+}
+
+// The string starting at the quote at i; returns the offset after
+// the closing quote.  Decodes into `out` if given.
+std::size_t JsonDocument::parse_string(std::size_t i, std::string* out) const
+{
+    if (out)
+        out->clear();
+    std::size_t j = i + 1;
+    for (;;) {
+        std::size_t k = scan_string(data_, j, size_);
+        if (out)
+            out->append(data_ + j, k - j);
+        if (k >= size_)
+            fail(i, "unterminated string");
+        char c = data_[k];
+        if (c == '"')
+            return k + 1;
+        if (c != '\\')
+            fail(k, "control character in string");
+
+        if (k + 1 >= size_)
+            fail(k, "unterminated string");
+        char e = data_[k + 1];
+        j = k + 2;
+        if (e == 'u') {
+            int cp = size_ - j >= 4 ? hex4(data_ + j) : -1;
+            if (cp < 0)
+                fail(k, "invalid \\u escape");
+            j += 4;
+            // Surrogate pair: \uD8xx\uDCxx.
+            if (cp >= 0xD800 && cp <= 0xDBFF && size_ - j >= 6
+                && data_[j] == '\\' && data_[j + 1] == 'u')
+            {
+                int lo = hex4(data_ + j + 2);
+                if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    j += 6;
+                }
+            }
+            if (cp >= 0xD800 && cp <= 0xDFFF)
+                cp = 0xFFFD;            // unpaired surrogate
+            if (out)
+                put_utf8(*out, static_cast<unsigned>(cp));
+            continue;
+        }
+
+        char decoded;
+        switch (e) {
+        case '"':  decoded = '"';  break;
+        case '\\': decoded = '\\'; break;
+        case '/':  decoded = '/';  break;
+        case 'b':  decoded = '\b'; break;
+        case 'f':  decoded = '\f'; break;
+        case 'n':  decoded = '\n'; break;
+        case 'r':  decoded = '\r'; break;
+        case 't':  decoded = '\t'; break;
+        default:   fail(k, "invalid escape");
+        }
+        if (out)
+            *out += decoded;
+    }
+}
+
+// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+std::size_t JsonDocument::parse_number(std::size_t i) const
+{
+    auto digit = [&](std::size_t k) {
+        return k < size_ && data_[k] >= '0' && data_[k] <= '9';
+    };
+    std::size_t j = i;
+    if (j < size_ && data_[j] == '-')
+        ++j;
+    if (!digit(j))
+        fail(i, "unexpected character");
+    if (data_[j] == '0') ++j;
+    else while (digit(j)) ++j;
+
+    if (j < size_ && data_[j] == '.') {
+        if (!digit(++j))
+            fail(j, "expected a digit");
+        while (digit(j)) ++j;
+    }
+    if (j < size_ && (data_[j] == 'e' || data_[j] == 'E')) {
+        ++j;
+        if (j < size_ && (data_[j] == '+' || data_[j] == '-'))
+            ++j;
+        if (!digit(j))
+            fail(j, "expected a digit");
+        while (digit(j)) ++j;
+    }
+    return j;
+}
+
+void JsonDocument::push_number(lua_State* L, std::size_t i,
+                               std::size_t end) const
+{
+    const char* b = data_ + i;
+    const char* e = data_ + end;
+    if (std::find_if(b, e, [](char c){
+            return c == '.' || c == 'e' || c == 'E'; }) == e)
+    {
+        long long v;
+        auto r = std::from_chars(b, e, v);
+        if (r.ec == std::errc() && r.ptr == e) {
+            lua_pushinteger(L, static_cast<lua_Integer>(v));
+            return;
+        }
+    }
+    double d = 0;
+    std::from_chars(b, e, d);
+    lua_pushnumber(L, d);
+}
+
+// =================================================================
+//  JsonDocument — lazy access (input already validated)
+// =================================================================
+
+std::size_t JsonDocument::end_of_string(std::size_t i) const
+{
+    std::size_t j = i + 1;
+    for (;;) {
+        j = scan_string(data_, j, size_);
+        if (data_[j] == '"')
+            return j + 1;
+        j += 2;                         // escape
+    }
+}
+
+std::size_t JsonDocument::skip_value(std::size_t i) const
+{
+    char c = data_[i];
+    if (c == '"')
+        return end_of_string(i);
+    if (c != '{' && c != '[') {
+        while (i < size_ && data_[i] != ',' && data_[i] != ']'
+               && data_[i] != '}' && !is_ws(data_[i]))
+            ++i;
+        return i;
+    }
+
+    int depth = 0;
+    for (;;) {
+        i = scan_structural(data_, i, size_);
+        c = data_[i];
+        if (c == '"') {
+            i = end_of_string(i);
+            continue;
+        }
+        if (c == '{' || c == '[') ++depth;
+        else if (--depth == 0)    return i + 1;
+        ++i;
+    }
+}
+
+const JsonDocument::Container& JsonDocument::children(std::size_t pos)
+{
+    auto it = cache_.find(pos);
+    if (it != cache_.end())
+        return it->second;
+
+    Container& c = cache_[pos];
+    const bool object = data_[pos] == '{';
+    std::size_t i = skip_ws(data_, pos + 1, size_);
+    if (data_[i] == '}' || data_[i] == ']')
+        return c;
+
+    std::string key;
+    for (;;) {
+        if (object) {
+            std::size_t end = end_of_string(i);
+            std::string_view k(data_ + i + 1, end - i - 2);
+            if (k.find('\\') != std::string_view::npos) {
+                parse_string(i, &key);
+                c.decoded.push_back(key);
+                k = c.decoded.back();
+            }
+            c.index[k] = c.keys.size();    // the last duplicate wins
+            c.keys.push_back(k);
+            i = skip_ws(data_, skip_ws(data_, end, size_) + 1, size_);
+        }
+        c.values.push_back(i);
+        i = skip_ws(data_, skip_value(i), size_);
+        if (data_[i] != ',')
+            break;
+        i = skip_ws(data_, i + 1, size_);
+    }
+    return c;
+}
+
+void JsonDocument::push(lua_State* L, std::size_t pos,
+                        const std::shared_ptr<JsonDocument>& self,
+                        bool eager)
+{
+    char c = data_[pos];
+    if (c == '{' || c == '[') {
+        if (eager) parse(pos, 0, L);
+        else       push_proxy(L, self, pos);
+        return;
+    }
+    parse(pos, 0, L);                   // scalars are cheap either way
+}
+
+// =================================================================
+//  Lua bindings
+// =================================================================
+
+namespace {
+
+int proxy_index(lua_State* L)
+{
+    return guarded(L, [&]{
+        Proxy* p = to_proxy(L, 1);
+        const auto& c = p->doc->children(p->pos);
+        std::size_t ordinal = static_cast<std::size_t>(-1);
+
+        if (p->doc->at(p->pos) == '[') {
+            int isnum = 0;
+            lua_Integer k = lua_tointegerx(L, 2, &isnum);
+            if (isnum && k >= 1 && static_cast<std::size_t>(k) <= c.values.size())
+                ordinal = static_cast<std::size_t>(k - 1);
+        } else if (lua_type(L, 2) == LUA_TSTRING) {
+            std::size_t len;
+            const char* s = lua_tolstring(L, 2, &len);
+            auto it = c.index.find(std::string_view(s, len));
+            if (it != c.index.end())
+                ordinal = it->second;
+        }
+
+        if (ordinal == static_cast<std::size_t>(-1))
+            lua_pushnil(L);
+        else
+            p->doc->push(L, c.values[ordinal], p->doc, false);
+        return 1;
+    });
+}
+
+int proxy_len(lua_State* L)
+{
+    return guarded(L, [&]{
+        Proxy* p = to_proxy(L, 1);
+        lua_Integer n = 0;
+        if (p->doc->at(p->pos) == '[')
+            n = static_cast<lua_Integer>(p->doc->children(p->pos).values.size());
+        lua_pushinteger(L, n);
+        return 1;
+    });
+}
+
+// Iterator closure: upvalue 1 is the proxy, upvalue 2 the next ordinal.
+int proxy_next(lua_State* L)
+{
+    return guarded(L, [&]{
+        Proxy* p = to_proxy(L, lua_upvalueindex(1));
+        const auto& c = p->doc->children(p->pos);
+        auto k = static_cast<std::size_t>(lua_tointeger(L, lua_upvalueindex(2)));
+        if (k >= c.values.size())
+            return 0;
+        lua_pushinteger(L, static_cast<lua_Integer>(k + 1));
+        lua_replace(L, lua_upvalueindex(2));
+
+        if (p->doc->at(p->pos) == '[')
+            lua_pushinteger(L, static_cast<lua_Integer>(k + 1));
+        else
+            lua_pushlstring(L, c.keys[k].data(), c.keys[k].size());
+        p->doc->push(L, c.values[k], p->doc, false);
+        return 2;
+    });
+}
+
+int proxy_pairs(lua_State* L)
+{
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 0);
+    lua_pushcclosure(L, proxy_next, 2);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+int proxy_eq(lua_State* L)
+{
+    Proxy* a = to_proxy(L, 1);
+    Proxy* b = to_proxy(L, 2);
+    lua_pushboolean(L, a && b && a->doc == b->doc && a->pos == b->pos);
+    return 1;
+}
+
+int proxy_tostring(lua_State* L)
+{
+    Proxy* p = to_proxy(L, 1);
+    lua_pushfstring(L, "json %s: %p",
+                    p->doc->at(p->pos) == '[' ? "array" : "object",
+                    static_cast<void*>(p));
+    return 1;
+}
+
+int proxy_gc(lua_State* L)
+{
+    if (Proxy* p = to_proxy(L, 1))
+        p->~Proxy();
+    return 0;
+}
+
+bool eager_option(lua_State* L, int idx)
+{
+    if (lua_type(L, idx) != LUA_TTABLE)
+        return false;
+    lua_getfield(L, idx, "eager");
+    bool eager = lua_toboolean(L, -1) != 0;
+    lua_pop(L, 1);
+    return eager;
+}
+
+// lroff.json.load(path [, {eager = true}])
+int json_load(lua_State* L)
+{
+    return guarded(L, [&]{
+        std::string path = luaL_checkstring(L, 1);
+        bool eager = eager_option(L, 2);
+        auto doc = JsonDocument::open(path);
+        doc->push(L, doc->root(), doc, eager);
+        return 1;
+    });
+}
+
+// lroff.json.parse(text [, {eager = true}])
+int json_parse(lua_State* L)
+{
+    return guarded(L, [&]{
+        std::size_t len;
+        const char* s = luaL_checklstring(L, 1, &len);
+        bool eager = eager_option(L, 2);
+        auto doc = JsonDocument::from_string(std::string(s, len), "<string>");
+        doc->push(L, doc->root(), doc, eager);
+        return 1;
+    });
+}
+
+// lroff.json.totable(v): a proxy's subtree as plain tables.
+int json_totable(lua_State* L)
+{
+    return guarded(L, [&]{
+        if (Proxy* p = to_proxy(L, 1))
+            p->doc->push(L, p->pos, p->doc, true);
+        else
+            lua_pushvalue(L, 1);
+        return 1;
+    });
+}
+
+// lroff.json.pairs(v): pairs() that also works where __pairs does not
+// (LuaJIT).
+int json_pairs(lua_State* L)
+{
+    if (to_proxy(L, 1))
+        return proxy_pairs(L);
+    lua_getglobal(L, "next");
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+} // namespace
+
+void register_json(sol::state& lua, sol::table& lroff)
+{
+    lua_State* L = lua.lua_state();
+
+    if (luaL_newmetatable(L, PROXY_META)) {
+        static const luaL_Reg meta[] = {
+            { "__index",    proxy_index    },
+            { "__len",      proxy_len      },
+            { "__pairs",    proxy_pairs    },
+            { "__eq",       proxy_eq       },
+            { "__tostring", proxy_tostring },
+            { "__gc",       proxy_gc       },
+            { nullptr,      nullptr        },
+        };
+        luaL_setfuncs(L, meta, 0);
+    }
+    lua_pop(L, 1);
+
+    sol::table json = lua.create_table();
+    json["load"]    = json_load;
+    json["parse"]   = json_parse;
+    json["totable"] = json_totable;
+    json["pairs"]   = json_pairs;
+    json["null"]    = static_cast<void*>(&null_tag);
+    lroff["json"]   = json;
+}
+
+} // namespace pplua
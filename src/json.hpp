@@ -0,0 +1,86 @@
+// src/json.hpp
+//
+// lroff.json — a native JSON loader.  Documents are memory-mapped
+// and validated in one pass; the values returned are lazy proxies
+// that decode only what is indexed, or, in eager mode, plain tables.
+
+#ifndef PPLUA_JSON_HPP
+#define PPLUA_JSON_HPP
+
+#define SOL_ALL_SAFETIES_ON 1
+#include <sol/sol.hpp>
+#include "csv.hpp"          // MappedFile
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace pplua {
+
+// =====================================================================
+//  JsonDocument — the bytes of one JSON text and an index over them
+//
+//  Nothing is decoded up front.  The first time a container is
+//  indexed, the offsets of its elements (and, for objects, a hash of
+//  its keys) are recorded; scalars are decoded each time they are
+//  read.
+// =====================================================================
+class JsonDocument {
+public:
+    struct Container {
+        std::vector<std::size_t>                          values;
+        std::vector<std::string_view>                     keys;
+        std::unordered_map<std::string_view, std::size_t> index;
+        std::deque<std::string>                           decoded;
+    };
+
+    /// Map and validate a file.  Throws std::runtime_error.
+    static std::shared_ptr<JsonDocument> open(const std::string& path);
+
+    /// Copy and validate a string.  Throws std::runtime_error.
+    static std::shared_ptr<JsonDocument> from_string(std::string text,
+                                                     std::string name);
+
+    /// Offset of the top-level value.
+    std::size_t root() const { return root_; }
+
+    char at(std::size_t pos) const { return data_[pos]; }
+
+    /// Elements of the array or object starting at `pos`.
+    const Container& children(std::size_t pos);
+
+    /// Push the value at `pos`: containers as proxies (lazy) or as
+    /// tables (eager).
+    void push(lua_State* L, std::size_t pos,
+              const std::shared_ptr<JsonDocument>& self, bool eager);
+
+private:
+    MappedFile  file_;
+    std::string text_;
+    std::string name_;
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+    std::size_t root_ = 0;
+
+    std::unordered_map<std::size_t, Container> cache_;
+
+    void        validate();
+    std::size_t parse(std::size_t i, int depth, lua_State* L);
+    std::size_t parse_string(std::size_t i, std::string* out) const;
+    std::size_t parse_number(std::size_t i) const;
+    std::size_t skip_value(std::size_t i) const;
+    std::size_t end_of_string(std::size_t i) const;
+    void        push_number(lua_State* L, std::size_t i, std::size_t end) const;
+    [[noreturn]] void fail(std::size_t pos, const std::string& what) const;
+};
+
+/// Install lroff.json (load, parse, totable, pairs, null) into `lroff`.
+void register_json(sol::state& lua, sol::table& lroff);
+
+} // namespace pplua
+
+#endif // PPLUA_JSON_HPP
@@ -3,11 +3,21 @@
 // Full implementation of every function in the lroff library.
 
 #include "lroff.hpp"
+#include "compat.hpp"
+#include "csv.hpp"
+#include "json.hpp"
+#include "async.hpp"
+#include "format.hpp"
+#include "highlight.hpp"
+#include "prelude_bc.hpp"      // generated: pplua_prelude_bc[]
 
 #include <sstream>
 #include <algorithm>
 #include <cassert>
+#include <cctype>
+#include <charconv>
 #include <cstring>
+#include <stdexcept>
 
 #ifndef PPLUA_VERSION
 #define PPLUA_VERSION "0.1.0"
@@ -105,8 +115,13 @@ void LroffLibrary::register_into(sol::state& lua)
             macro_define(n, b);
         });
     L.set_function("macro_define_lua",
-        [this](const std::string& n, const std::string& c){
-            macro_define_lua(n, c);
+        [this](sol::this_state ts, const std::string& n,
+               const std::string& c){
+            macro_define_lua(ts, n, c);
+        });
+    L.set_function("define_request",
+        [this](const std::string& n, const sol::object& fn){
+            define_request(n, fn);
         });
 
     // ---- inline styling (return strings) ----
@@ -181,6 +196,41 @@ void LroffLibrary::register_into(sol::state& lua)
         table_emit(hdr, rows, fmt.value_or(""));
     });
 
+    // table_csv reads the file itself: cells never become Lua values.
+    L.set_function("table_csv",
+        [this](const std::string& path, sol::optional<sol::table> opts)
+    {
+        CsvTableOptions o;
+        if (opts) {
+            sol::table t = *opts;
+            std::string sep = t.get_or("sep", std::string(","));
+            if (sep.size() != 1)
+                throw std::runtime_error(
+                    "table_csv: sep must be a single character");
+            o.sep    = sep[0];
+            o.header = t.get_or("header", true);
+            o.format = t.get_or("format", std::string());
+            o.align  = t.get_or("align", std::string());
+
+            auto key = [](const sol::object& k) {
+                return k.get_type() == sol::type::number
+                     ? std::to_string(k.as<long long>())
+                     : k.as<std::string>();
+            };
+            if (sol::optional<sol::table> cols = t["columns"])
+                for (auto& kv : *cols)
+                    o.columns.push_back(key(kv.second));
+
+            sol::object prec = t["precision"];
+            if (prec.get_type() == sol::type::number)
+                o.precision = prec.as<int>();
+            else if (prec.get_type() == sol::type::table)
+                for (auto& kv : prec.as<sol::table>())
+                    o.column_precision[key(kv.first)] = kv.second.as<int>();
+        }
+        return table_csv(path, o);
+    });
+
     L.set_function("bullet_list",
         [this](const sol::table& tbl) {
             std::vector<std::string> items;
@@ -211,6 +261,39 @@ void LroffLibrary::register_into(sol::state& lua)
             def_list(items);
         });
 
+    // ---- syntax highlighting ----
+    L.set_function("syntax",
+        [this](const std::string& path) -> std::string {
+            return syntax(path);
+        });
+
+    // A theme maps scope selectors to "font colour" strings ("B",
+    // "red", "BI blue"), over the default theme.
+    L.set_function("highlight",
+        [this](const std::string& code, const std::string& lang,
+               sol::optional<sol::table> theme)
+    {
+        if (!theme)
+            return highlight(code, lang, default_highlight_theme());
+
+        HighlightTheme t = default_highlight_theme();
+        for (auto& kv : *theme) {
+            std::string selector = kv.first.as<std::string>();
+            std::istringstream words(kv.second.as<std::string>());
+            HighlightStyle style;
+            for (std::string w; words >> w; )
+                (std::isupper(static_cast<unsigned char>(w[0]))
+                     ? style.font : style.color) = w;
+            auto it = std::find_if(t.begin(), t.end(),
+                [&](const auto& e){ return e.first == selector; });
+            if (it != t.end())
+                it->second = std::move(style);
+            else
+                t.emplace_back(std::move(selector), std::move(style));
+        }
+        return highlight(code, lang, t);
+    });
+
     // ---- utility ----
     L.set_function("unique",
         [this](sol::optional<std::string> pfx) -> std::string {
@@ -218,74 +301,50 @@ void LroffLibrary::register_into(sol::state& lua)
         });
     L.set_function("version",
         [this]() -> std::string { return version(); });
+    L.set_function("defer",
+        [this](const sol::protected_function& fn) -> std::string {
+            return defer(fn);
+        });
+
+    // ---- data ----
+    register_json(lua, L);
+
+    // ---- background work ----
+    register_async(lua, L);
+
+    // ---- formatting ----
+    register_fmt(lua, L);
 
     // ================================================================
-    //  Pure-Lua convenience wrappers (defined on top of C++ bindings)
+    //  Pure-Lua convenience wrappers (src/prelude.lua), embedded as
+    //  bytecode at build time so that start-up does not parse them.
     // ================================================================
 
-    lua.script(R"lua(
-        -- formatted emit  (like C printf, uses string.format)
-        function lroff.printf(fmt, ...)
-            lroff.emit(string.format(fmt, ...))
-        end
-
-        function lroff.printfln(fmt, ...)
-            lroff.emitln(string.format(fmt, ...))
-        end
-
-        -- apply fn(v) to every element; emit non-nil returns
-        function lroff.map(tbl, fn)
-            for _, v in ipairs(tbl) do
-                local r = fn(v)
-                if r ~= nil then lroff.emitln(tostring(r)) end
-            end
-        end
-
-        -- call fn(k,v) for each pair (no output)
-        function lroff.foreach(tbl, fn)
-            for k, v in pairs(tbl) do fn(k, v) end
-        end
-
-        -- scoped font change
-        function lroff.with_font(f, fn)
-            lroff.font(f);  fn();  lroff.font_previous()
-        end
-
-        -- scoped size change
-        function lroff.with_size(s, fn)
-            local old = lroff._state_ps or 10
-            lroff.size(s);  fn();  lroff.size(old)
-        end
-
-        -- emit a groff conditional:  .if cond \{ body \}
-        function lroff.groff_if(cond, body)
-            lroff.emitln(".if " .. cond .. " \\{")
-            lroff.emitln(body)
-            lroff.emitln(".\\}")
-        end
-
-        -- emit a groff .while loop
-        function lroff.groff_while(cond, body)
-            lroff.emitln(".while " .. cond .. " \\{")
-            lroff.emitln(body)
-            lroff.emitln(".\\}")
-        end
-
-        -- build a string from repeated calls (like table.concat)
-        function lroff.concat(tbl, sep)
-            sep = sep or ""
-            local parts = {}
-            for _, v in ipairs(tbl) do parts[#parts+1] = tostring(v) end
-            return table.concat(parts, sep)
-        end
-
-        -- indent helper: emit .RS / block / .RE
-        function lroff.indented(fn)
-            lroff.request("RS")
-            fn()
-            lroff.request("RE")
-        end
-    )lua");
+    lua_State* Ls = lua.lua_state();
+    int status = luaL_loadbuffer(Ls,
+        reinterpret_cast<const char*>(pplua_prelude_bc),
+        sizeof pplua_prelude_bc, "=lroff-prelude");
+    if (status == LUA_OK)
+        status = lua_pcall(Ls, 0, 0, 0);
+    if (status != LUA_OK) {
+        std::string msg = lua_tostring(Ls, -1);
+        lua_pop(Ls, 1);
+        throw std::runtime_error("cannot load lroff prelude: " + msg);
+    }
+}
+
+void LroffLibrary::reset()
+{
+    diverts_.reset();
+    state_ = DocumentState{};
+    deferred_.clear();
+
+    if (!shared_taken_) {
+        shared_requests_ = requests_;
+        shared_taken_ = true;
+    } else {
+        requests_ = shared_requests_;
+    }
 }
 
 // =================================================================
@@ -481,16 +540,37 @@ void LroffLibrary::macro_define(const std::string& name,
     diverts_.writeln("..");
 }
 
-void LroffLibrary::macro_define_lua(const std::string& name,
+// The body used to be written out as a .de holding a .lua block,
+// which groff cannot run.  It is now compiled once and bound as a
+// request: `.NAME a b` runs the code with ... = "a", "b".
+void LroffLibrary::macro_define_lua(sol::this_state ts,
+                                     const std::string& name,
                                      const std::string& lua_code)
 {
-    diverts_.writeln(".de " + name);
-    diverts_.writeln(".lua");
-    diverts_.write(lua_code);
-    if (!lua_code.empty() && lua_code.back() != '\n')
-        diverts_.write("\n");
-    diverts_.writeln(".endlua");
-    diverts_.writeln("..");
+    sol::state_view lua(ts);
+    sol::load_result chunk = lua.load(lua_code, "=" + name);
+    if (!chunk.valid()) {
+        sol::error err = chunk;
+        throw std::runtime_error("macro_define_lua: " + std::string(err.what()));
+    }
+    define_request(name, chunk.get<sol::object>());
+}
+
+void LroffLibrary::define_request(const std::string& name,
+                                  const sol::object& fn)
+{
+    if (name.empty()
+        || name.find_first_of(" \t\\") != std::string::npos)
+        throw std::runtime_error("define_request: invalid request name '"
+                                 + name + "'");
+    if (fn.get_type() == sol::type::lua_nil) {
+        requests_.erase(name);
+        return;
+    }
+    if (fn.get_type() != sol::type::function)
+        throw std::runtime_error("define_request: expected a function for '"
+                                 + name + "'");
+    requests_[name] = fn.as<sol::protected_function>();
 }
 
 // =================================================================
@@ -561,10 +641,8 @@ void LroffLibrary::display_end() {
 //  Compound structures
 // =================================================================
 
-void LroffLibrary::table_emit(
-    const std::vector<std::string>&               hdr,
-    const std::vector<std::vector<std::string>>&  rows,
-    const std::string& fmt)
+void LroffLibrary::table_begin(std::size_t ncols, const std::string& fmt,
+                               bool header, const std::string& align)
 {
     diverts_.writeln(".TS");
 
@@ -572,40 +650,183 @@ void LroffLibrary::table_emit(
     if (!fmt.empty())
         diverts_.writeln(fmt);
 
-    // auto-generate column format from header count
+    // auto-generate column format from the column count
     std::string hfmt, dfmt;
-    for (std::size_t i = 0; i < hdr.size(); ++i) {
+    for (std::size_t i = 0; i < ncols; ++i) {
         if (i) { hfmt += ' '; dfmt += ' '; }
         hfmt += "cb";       // center bold
-        dfmt += "l";        // left
+        dfmt += i < align.size() ? align[i] : 'l';
     }
-    diverts_.writeln(hfmt);
+    if (header)
+        diverts_.writeln(hfmt);
     diverts_.writeln(dfmt + ".");
+}
 
-    // header row
-    {
-        std::string line;
-        for (std::size_t i = 0; i < hdr.size(); ++i) {
-            if (i) line += '\t';
-            line += hdr[i];
-        }
-        diverts_.writeln(line);
+void LroffLibrary::table_row(const std::vector<std::string>& cells)
+{
+    std::string line;
+    for (std::size_t i = 0; i < cells.size(); ++i) {
+        if (i) line += '\t';
+        line += cells[i];
     }
+    diverts_.writeln(line);
+}
 
-    // horizontal rule
+void LroffLibrary::table_end()
+{
+    diverts_.writeln(".TE");
+}
+
+void LroffLibrary::table_emit(
+    const std::vector<std::string>&               hdr,
+    const std::vector<std::vector<std::string>>&  rows,
+    const std::string& fmt)
+{
+    table_begin(hdr.size(), fmt, true, "");
+
+    // header row, then a horizontal rule
+    table_row(hdr);
     diverts_.writeln("_");
 
     // data rows
-    for (auto& row : rows) {
+    for (auto& row : rows)
+        table_row(row);
+
+    table_end();
+}
+
+namespace {
+
+// Append a raw CSV cell as tbl data: no tabs or line breaks, no
+// control character at the start of the line, and nothing tbl would
+// take for a rule.
+void append_cell(std::string& line, std::string_view cell, bool first)
+{
+    if ((first && !cell.empty() && (cell[0] == '.' || cell[0] == '\''))
+        || cell == "_" || cell == "=")
+        line += "\\&";
+    for (char c : cell) {
+        switch (c) {
+        case '\\': line += "\\\\"; break;
+        case '\t':
+        case '\n':
+        case '\r':  line += ' ';    break;
+        default:    line += c;      break;
+        }
+    }
+}
+
+// Rewrite `cell` with `digits` decimals if the whole of it is a
+// number; otherwise leave it alone.
+std::string_view fixed(std::string_view cell, int digits, char* buf,
+                       std::size_t size)
+{
+    std::size_t a = cell.find_first_not_of(' ');
+    std::size_t z = cell.find_last_not_of(' ');
+    if (a == std::string_view::npos)
+        return cell;
+    double v;
+    auto [end, ec] = std::from_chars(cell.data() + a, cell.data() + z + 1, v);
+    if (ec != std::errc() || end != cell.data() + z + 1)
+        return cell;
+    auto r = std::to_chars(buf, buf + size, v, std::chars_format::fixed,
+                           digits);
+    return r.ec == std::errc() ? std::string_view(buf, r.ptr - buf) : cell;
+}
+
+} // namespace
+
+std::size_t LroffLibrary::table_csv(const std::string& path,
+                                    const CsvTableOptions& opts)
+{
+    MappedFile file;
+    std::string error;
+    if (!file.open(path, error))
+        throw std::runtime_error("table_csv: " + error);
+
+    CsvReader csv(file.data(), file.size(), opts.sep);
+    std::vector<std::string_view> fields;
+    bool have = csv.next(fields);
+
+    std::vector<std::string> names;
+    if (opts.header && have)
+        names.assign(fields.begin(), fields.end());
+
+    // Resolve the column selection to field indices.
+    std::vector<std::size_t> pick;
+    if (opts.columns.empty()) {
+        std::size_t n = opts.header ? names.size() : fields.size();
+        for (std::size_t i = 0; i < n; ++i)
+            pick.push_back(i);
+    }
+    for (auto& col : opts.columns) {
+        bool numeric = !col.empty() && std::all_of(col.begin(), col.end(),
+            [](unsigned char c){ return std::isdigit(c); });
+        if (numeric && std::stoul(col) > 0) {
+            pick.push_back(std::stoul(col) - 1);
+            continue;
+        }
+        auto it = std::find(names.begin(), names.end(), col);
+        if (it == names.end())
+            throw std::runtime_error("table_csv: " + path
+                + ": no column '" + col + "'");
+        pick.push_back(static_cast<std::size_t>(it - names.begin()));
+    }
+
+    // Decimals per emitted column.
+    std::vector<int> digits(pick.size(), opts.precision);
+    for (std::size_t k = 0; k < pick.size(); ++k) {
+        auto by_num = opts.column_precision.find(std::to_string(pick[k] + 1));
+        if (by_num != opts.column_precision.end())
+            digits[k] = by_num->second;
+        if (pick[k] < names.size()) {
+            auto by_name = opts.column_precision.find(names[pick[k]]);
+            if (by_name != opts.column_precision.end())
+                digits[k] = by_name->second;
+        }
+    }
+
+    table_begin(pick.size(), opts.format, opts.header, opts.align);
+    if (opts.header) {
         std::string line;
-        for (std::size_t i = 0; i < row.size(); ++i) {
-            if (i) line += '\t';
-            line += row[i];
+        for (std::size_t k = 0; k < pick.size(); ++k) {
+            if (k) line += '\t';
+            if (pick[k] < names.size())
+                append_cell(line, names[pick[k]], k == 0);
         }
         diverts_.writeln(line);
+        diverts_.writeln("_");
+        have = csv.next(fields);
     }
 
-    diverts_.writeln(".TE");
+    // Rows go straight from the mapping to the output; every few
+    // thousand rows the pages read so far are dropped and the output
+    // is handed on, so memory stays flat however long the file is.
+    std::size_t rows = 0;
+    std::string line;
+    char num[64];
+    for (; have; have = csv.next(fields)) {
+        line.clear();
+        for (std::size_t k = 0; k < pick.size(); ++k) {
+            if (k) line += '\t';
+            if (pick[k] >= fields.size())
+                continue;
+            std::string_view cell = fields[pick[k]];
+            if (digits[k] >= 0)
+                cell = fixed(cell, digits[k], num, sizeof num);
+            append_cell(line, cell, k == 0);
+        }
+        diverts_.writeln(line);
+
+        if (++rows % 4096 == 0) {
+            file.release(csv.offset());
+            if (flush_hook_ && !diverts_.is_diverting())
+                flush_hook_();
+        }
+    }
+
+    table_end();
+    return rows;
 }
 
 void LroffLibrary::bullet_list(const std::vector<std::string>& items) {
@@ -633,6 +854,28 @@ void LroffLibrary::def_list(
     }
 }
 
+// =================================================================
+//  Syntax highlighting
+// =================================================================
+
+std::string LroffLibrary::syntax(const std::string& path)
+{
+    return syntax_.load(path);
+}
+
+std::size_t LroffLibrary::highlight(const std::string& code,
+                                    const std::string& lang,
+                                    const HighlightTheme& theme)
+{
+    std::string text;
+    text.reserve(code.size() + code.size() / 2);
+    std::size_t lines = syntax_.highlight(code, lang, theme, text);
+    diverts_.write(text);
+    if (flush_hook_ && !diverts_.is_diverting())
+        flush_hook_();
+    return lines;
+}
+
 // =================================================================
 //  Utility
 // =================================================================
@@ -643,4 +886,75 @@ std::string LroffLibrary::unique(const std::string& prefix) {
 
 std::string LroffLibrary::version() { return PPLUA_VERSION; }
 
+std::string LroffLibrary::defer(const sol::protected_function& fn)
+{
+    if (!defer_ok_)
+        throw std::runtime_error("lroff.defer: not available in .lua pure blocks");
+    deferred_.push_back(fn);
+    return defer_marker(deferred_.size() - 1);
+}
+
+// =================================================================
+//  Deferred slots
+// =================================================================
+
+std::string defer_marker(std::size_t id)
+{
+    std::string m(1, '\0');
+    m += std::to_string(id);
+    m += '\0';
+    return m;
+}
+
+std::string fill_deferred(const std::string& text,
+                          const std::vector<std::string>& slots)
+{
+    std::size_t pos = text.find('\0');
+    if (pos == std::string::npos)
+        return text;
+
+    std::string out;
+    out.reserve(text.size());
+    std::size_t done = 0;
+    for (; pos != std::string::npos; pos = text.find('\0', pos)) {
+        // A marker is NUL, decimal digits, NUL; anything else is
+        // left as it is.
+        std::size_t end = pos + 1;
+        std::size_t id  = 0;
+        while (end < text.size()
+               && std::isdigit(static_cast<unsigned char>(text[end])))
+            id = id * 10 + static_cast<std::size_t>(text[end++] - '0');
+        if (end == pos + 1 || end >= text.size() || text[end] != '\0'
+            || id >= slots.size()) {
+            ++pos;
+            continue;
+        }
+        out.append(text, done, pos - done);
+        out += slots[id];
+        done = pos = end + 1;
+    }
+    out.append(text, done, std::string::npos);
+    return out;
+}
+
+void write_chunk_value(OutputBuffer& out, const sol::object& ret)
+{
+    long long iv;
+    if (ret.is<std::string>()) {
+        out.write(ret.as<std::string>());
+    } else if (as_integer(ret, iv)) {
+        out.write(std::to_string(iv));
+    } else if (ret.is<double>()) {
+        // As tostring() writes it (to_string would give six decimals).
+        std::string text;
+        append_number(ret.as<double>(), text);
+#if LUA_VERSION_NUM >= 503
+        if (text.find_first_not_of("-0123456789") == std::string::npos)
+            text += ".0";
+#endif
+        out.write(text);
+    }
+    // nil / table / function / etc. are silently ignored.
+}
+
 } // namespace pplua
@@ -9,11 +9,14 @@
 #define SOL_ALL_SAFETIES_ON 1
 #include <sol/sol.hpp>
 #include "output_buffer.hpp"
+#include "highlight.hpp"
 
 #include <string>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <optional>
+#include <functional>
 
 namespace pplua {
 
@@ -34,13 +37,34 @@ struct DocumentState {
     int         point_size   = 10;
     int         vert_spacing = 12;
 
-    // auto-increment counter for unique names
+    // auto-increment counter for unique names; the tag keeps the
+    // names of separately run (.lua pure) blocks apart
     int unique_counter = 0;
+    std::string unique_tag;
     std::string unique_name(const std::string& pfx = "_lua") {
-        return pfx + std::to_string(++unique_counter);
+        return pfx + unique_tag + std::to_string(++unique_counter);
     }
 };
 
+// =====================================================================
+//  CsvTableOptions — the opts table of lroff.table_csv
+// =====================================================================
+struct CsvTableOptions {
+    char        sep       = ',';
+    bool        header    = true;   // first record names the columns
+    std::string format;             // tbl global options, e.g. "box;"
+    std::string align;              // tbl key letter per column ("l")
+
+    // Columns to emit, in order: header names or 1-based numbers.
+    // Empty means all of them.
+    std::vector<std::string> columns;
+
+    // Fixed decimals for cells that are numbers: for every column
+    // (-1: leave as written) and per column, by name or number.
+    int                        precision = -1;
+    std::map<std::string, int> column_precision;
+};
+
 // =====================================================================
 //  LroffLibrary
 // =====================================================================
@@ -51,6 +75,42 @@ public:
     /// Register the "lroff" table into a Lua state.
     void register_into(sol::state& lua);
 
+    /// Forget all per-document state (registers, diversions, font
+    /// and size bookkeeping).  The Lua bindings stay registered, and
+    /// so do the requests defined before the first document; those
+    /// a document defines are dropped.
+    void reset();
+
+    /// The Lua function bound to request `name` by
+    /// lroff.define_request, or nullptr.
+    const sol::protected_function* find_request(const std::string& name) const {
+        auto it = requests_.find(name);
+        return it == requests_.end() ? nullptr : &it->second;
+    }
+
+    /// True once any request has been defined.
+    bool has_requests() const { return !requests_.empty(); }
+
+    /// Every lroff.define_request binding, by name (--save-image
+    /// writes them out, --image puts them back).
+    using RequestMap = std::unordered_map<std::string, sol::protected_function>;
+    RequestMap& requests() { return requests_; }
+
+    /// Called now and then during long output (lroff.table_csv)
+    /// while nothing is being diverted, so that the engine can write
+    /// out what has accumulated.
+    void set_flush_hook(std::function<void()> hook) {
+        flush_hook_ = std::move(hook);
+    }
+
+    /// Functions given to lroff.defer, in call order.  Slot i
+    /// stands in the output as defer_marker(i) until it is filled.
+    std::vector<sol::protected_function>& deferred() { return deferred_; }
+    bool has_deferred() const { return !deferred_.empty(); }
+
+    /// Refuse lroff.defer: a worker's slots could not be filled.
+    void allow_defer(bool on) { defer_ok_ = on; }
+
     /// Accessors used by the preprocessor engine.
     OutputBuffer&   output()      { return output_; }
     DivertManager&  diversions()  { return diverts_; }
@@ -60,6 +120,19 @@ private:
     OutputBuffer&   output_;
     DivertManager   diverts_;
     DocumentState   state_;
+    std::function<void()> flush_hook_;
+
+    // lroff.define_request bindings, and the set in force before the
+    // first reset() (preambles, -e), which every document starts from.
+    RequestMap requests_;
+    RequestMap shared_requests_;
+    bool       shared_taken_ = false;
+
+    std::vector<sol::protected_function> deferred_;
+    bool                                 defer_ok_ = true;
+
+    // grammars loaded by lroff.syntax; kept across documents
+    SyntaxSet syntax_;
 
     /* ---- helpers called from Lua ---- */
 
@@ -108,8 +181,11 @@ private:
     // macros
     void macro_define    (const std::string& name,
                           const std::string& body);
-    void macro_define_lua(const std::string& name,
+    void macro_define_lua(sol::this_state ts,
+                          const std::string& name,
                           const std::string& lua_code);
+    void define_request  (const std::string& name,
+                          const sol::object& fn);
 
     // inline styling (return strings, don't emit)
     std::string styled      (const std::string& fc,
@@ -133,16 +209,40 @@ private:
     void table_emit   (const std::vector<std::string>&              hdr,
                        const std::vector<std::vector<std::string>>& rows,
                        const std::string& fmt);
+    std::size_t table_csv(const std::string& path,
+                          const CsvTableOptions& opts);
+    void table_begin  (std::size_t ncols, const std::string& fmt,
+                       bool header, const std::string& align);
+    void table_row    (const std::vector<std::string>& cells);
+    void table_end    ();
     void bullet_list  (const std::vector<std::string>& items);
     void numbered_list(const std::vector<std::string>& items);
     void def_list     (const std::vector<std::pair<std::string,
                                                     std::string>>& items);
 
+    // syntax highlighting
+    std::string syntax   (const std::string& path);
+    std::size_t highlight(const std::string& code, const std::string& lang,
+                          const HighlightTheme& theme);
+
     // utility
     std::string unique (const std::string& prefix);
     std::string version();
+    std::string defer  (const sol::protected_function& fn);
 };
 
+/// Write the value a chunk returned: strings and numbers are
+/// emitted, anything else is ignored.
+void write_chunk_value(OutputBuffer& out, const sol::object& ret);
+
+/// The text lroff.defer returns for slot `id`: NUL, the number,
+/// NUL.  NUL cannot occur in groff input, so it is never ambiguous.
+std::string defer_marker(std::size_t id);
+
+/// `text` with every slot marker replaced by the slot's contents.
+std::string fill_deferred(const std::string& text,
+                          const std::vector<std::string>& slots);
+
 } // namespace pplua
 
 #endif // PPLUA_LROFF_HPP
@@ -13,19 +13,70 @@
 //   -l FILE        Execute a Lua preamble file before processing.
 //   -I PATH        Add PATH to Lua's package.path.
 //   -D NAME=VALUE  Set a Lua global variable (string).
+//   --save-image FILE
+//                  Save the state -D, -e and -l leave to FILE.
+//   --image FILE   Start from a state saved with --save-image.
 //   -n             Suppress .lf line directives.
+//   -O             Remove redundant requests from the output.
+//   --cache-dir DIR
+//                  Reuse the output of an identical earlier run.
+//   --shell-cache DIR
+//                  Keep the output of lroff.shell commands in DIR.
+//   --depfile FILE Write the files the run read as a Make rule.
+//   --whatis-db FILE
+//                  Index the manual pages written out in FILE.
+//   --batch MANIFEST
+//                  Process every document listed in MANIFEST.
+//   --pipe "CMD | CMD ..."
+//                  Feed the output to a pipeline of downstream stages.
+//   -o FILE        Write output to FILE; a % in FILE renders each
+//                  input file as its own document.
+//   --variants FILE
+//                  Render the input once per line of FILE, each with
+//                  its own -D settings, into the directory -o names.
+//   --compile      Translate the input into one Lua chunk (to -o).
+//   --run FILE     Render a document compiled with --compile.
+//   --gc incremental|generational, --gc-pause N, --gc-stepmul N,
+//   --gc-between full|none
+//                  Choose and tune the Lua garbage collector.
+//   --stats        Report collector statistics per document.
+//   --pure-jobs N  Run `.lua pure` blocks on N worker threads.
+//   --ascii-escape Write non-ASCII characters as groff escapes.
+//   --no-utf8-check
+//                  Do not warn about input that is not UTF-8.
 //   -V             Print version and exit.
 //   -h             Print help and exit.
 
 #define SOL_ALL_SAFETIES_ON 1
 
 #include "pplua.hpp"
+#include "cache.hpp"
+#include "hash.hpp"
+#include "compat.hpp"
+#include "pipeline.hpp"
+#include "compile.hpp"
+#include "whatis.hpp"
 
+#include <atomic>
+#include <functional>
+#include <thread>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
 #include <vector>
 #include <string>
+#include <csignal>
+#include <filesystem>
+#include <set>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef PPLUA_VERSION
+#define PPLUA_VERSION "0.1.0"
+#endif
 
 static void usage(const char* prog) {
     std::cerr
@@ -38,7 +89,60 @@ static void usage(const char* prog) {
         << "  -l FILE        Run a Lua preamble file.\n"
         << "  -I PATH        Add PATH to Lua package.path.\n"
         << "  -D NAME=VALUE  Define a Lua global variable (string).\n"
+        << "  --compile      Translate the input file into a single Lua\n"
+        << "                 chunk and write its bytecode (to -o FILE).\n"
+        << "  --run FILE     Render a document made with --compile.\n"
+        << "  --save-image FILE\n"
+        << "                 Run -D, -e and -l, save the Lua state they\n"
+        << "                 leave to FILE and exit.\n"
+        << "  --image FILE   Restore a state saved with --save-image\n"
+        << "                 instead of running its preambles again.\n"
         << "  -n             Suppress .lf line-number directives.\n"
+        << "  -O             Drop requests that cannot change the output\n"
+        << "                 (redundant .lf, .ft, .ps, blank requests).\n"
+        << "  --cache-dir DIR\n"
+        << "                 Cache whole outputs in DIR, keyed by input,\n"
+        << "                 arguments and every file the run reads.\n"
+        << "  --shell-cache DIR\n"
+        << "                 Keep lroff.shell output in DIR (default:\n"
+        << "                 $PPLUA_SHELL_CACHE or ~/.cache/pplua/shell;\n"
+        << "                 an empty DIR runs every command).\n"
+        << "  --depfile FILE Write a Make rule to FILE naming every file\n"
+        << "                 the run read as a prerequisite of -o FILE.\n"
+        << "  --whatis-db FILE\n"
+        << "                 Write a whatis index of the manual pages\n"
+        << "                 rendered (.TH and NAME) to FILE at the end.\n"
+        << "  --batch MANIFEST\n"
+        << "                 Render each \"INPUT [OUTPUT]\" line of MANIFEST\n"
+        << "                 as an isolated document in one process.\n"
+        << "  --pipe \"CMD | CMD ...\"\n"
+        << "                 Run the downstream stages (tbl, groff, ...)\n"
+        << "                 and feed them the output as it is produced.\n"
+        << "  -o FILE        Write output to FILE instead of stdout.  With\n"
+        << "                 a % in FILE, each input is a separate document\n"
+        << "                 written to FILE with % replaced by its name;\n"
+        << "                 with --pipe, these pipelines run in parallel.\n"
+        << "  --variants FILE\n"
+        << "                 Render the input once for every \"NAME\n"
+        << "                 VAR=VALUE ...\" line of FILE, in parallel,\n"
+        << "                 writing each to NAME in the directory -o gives.\n"
+        << "  --gc incremental|generational\n"
+        << "                 Lua collector mode (default: Lua's own).\n"
+        << "  --gc-pause N   Collector pause, in percent.\n"
+        << "  --gc-stepmul N Collector step multiplier, in percent.\n"
+        << "  --gc-between full|none\n"
+        << "                 Collect fully after every Lua block, or never.\n"
+        << "  --stats        Report collector cycles, time and heap peak\n"
+        << "                 per document on stderr.\n"
+        << "  --pure-jobs N  Worker threads for .lua pure blocks and\n"
+        << "                 lroff.parallel_map (default: one per CPU,\n"
+        << "                 shared by documents run at once;\n"
+        << "                 0 runs them on the main thread).\n"
+        << "  --ascii-escape Write non-ASCII characters as \\[name] or\n"
+        << "                 \\[uXXXX] escapes (for -Tascii, older groff).\n"
+        << "  --no-utf8-check\n"
+        << "                 Do not warn about input lines that are not\n"
+        << "                 well-formed UTF-8 (e.g. Latin-1 documents).\n"
         << "  -V             Print version and exit.\n"
         << "  -h             Print this help and exit.\n"
         << "\n"
@@ -49,14 +153,563 @@ static void usage(const char* prog) {
         << "Inline expressions use \\lua'expr' syntax.\n";
 }
 
+// Read a whole input ("-" is stdin) into memory.
+static bool slurp(const std::string& path, std::string& out) {
+    std::ostringstream ss;
+    if (path == "-") {
+        ss << std::cin.rdbuf();
+    } else {
+        std::ifstream f(path, std::ios::binary);
+        if (!f.is_open()) {
+            std::cerr << "pplua: cannot open '" << path << "'\n";
+            return false;
+        }
+        ss << f.rdbuf();
+    }
+    out = ss.str();
+    return true;
+}
+
+// Where lroff.shell keeps its output unless --shell-cache says.
+static std::string default_shell_cache() {
+    if (const char* d = std::getenv("PPLUA_SHELL_CACHE"))
+        return d;
+    if (const char* x = std::getenv("XDG_CACHE_HOME"); x && *x)
+        return std::string(x) + "/pplua/shell";
+    if (const char* h = std::getenv("HOME"); h && *h)
+        return std::string(h) + "/.cache/pplua/shell";
+    return {};
+}
+
+// A file name as Make reads it in a rule.
+static std::string make_escape(const std::string& path) {
+    std::string out;
+    for (char c : path) {
+        if (c == ' ' || c == '\t' || c == '#')
+            out += '\\';
+        else if (c == '$')
+            out += '$';
+        out += c;
+    }
+    return out;
+}
+
+// --depfile: "TARGET: DEPS" and, as gcc -MP does, an empty rule for
+// every dependency, so that deleting one does not break the build.
+static bool write_depfile(const std::string& path, const std::string& target,
+                          const std::set<std::string>& deps)
+{
+    std::ofstream f(path, std::ios::trunc);
+    f << make_escape(target) << ':';
+    for (auto& d : deps)
+        f << " \\\n " << make_escape(d);
+    f << '\n';
+    for (auto& d : deps)
+        f << '\n' << make_escape(d) << ":\n";
+    if (!f.flush()) {
+        std::cerr << "pplua: cannot write '" << path << "'\n";
+        return false;
+    }
+    return true;
+}
+
+// The part of a cache key that is known before any Lua runs.
+static std::string cache_base_key(
+    const pplua::Config& cfg,
+    const std::vector<std::pair<std::string, std::string>>& inputs)
+{
+    pplua::Sha256 h;
+    h.field("pplua " PPLUA_VERSION);
+    h.field(pplua::lua_runtime_name());
+    h.field(cfg.emit_lf ? "lf" : "nolf");
+    h.field(cfg.optimize ? "O" : "");
+    h.field(cfg.ascii_escape ? "ascii" : "");
+
+    for (auto& p : cfg.lua_paths)  { h.field("I"); h.field(p); }
+    for (auto& [n, v] : cfg.defines)   { h.field("D"); h.field(n); h.field(v); }
+    for (auto& code : cfg.exec_chunks) { h.field("e"); h.field(code); }
+
+    // The image's own preambles are checked as files it read.
+    if (!cfg.image.empty()) {
+        std::string img;
+        h.field("image");
+        h.field(slurp(cfg.image, img) ? img : std::string("\0missing"));
+    }
+
+    for (auto& pf : cfg.preamble_files) {
+        std::string src;
+        h.field("l");
+        h.field(pf);
+        h.field(slurp(pf, src) ? src : std::string("\0missing"));
+    }
+    for (auto& [name, text] : inputs) {
+        h.field("in");
+        h.field(name);
+        h.field(text);
+    }
+    return h.hex_digest();
+}
+
+// Default output name for a batch entry without one:
+// "page.1.lroff" -> "page.1", anything else -> "NAME.out".
+static std::string batch_output_name(const std::string& input) {
+    const std::string ext = ".lroff";
+    if (input.size() > ext.size()
+        && input.compare(input.size() - ext.size(), ext.size(), ext) == 0)
+        return input.substr(0, input.size() - ext.size());
+    return input + ".out";
+}
+
+// --batch: every manifest entry is rendered as its own document,
+// sharing one Lua state (standard libraries, lroff, preambles) but
+// with a fresh _ENV, DocumentState and OutputBuffer each.
+static int run_batch(pplua::Preprocessor& pp, const std::string& manifest)
+{
+    std::ifstream mf(manifest);
+    if (!mf.is_open()) {
+        std::cerr << "pplua: cannot open batch manifest '"
+                  << manifest << "'\n";
+        return 1;
+    }
+
+    int rc = 0;
+    std::size_t docs = 0, failed = 0;
+    auto t0 = std::chrono::steady_clock::now();
+
+    std::string line;
+    while (std::getline(mf, line)) {
+        std::istringstream ls(line);
+        std::string input, output;
+        if (!(ls >> input) || input[0] == '#')
+            continue;
+        if (!(ls >> output))
+            output = batch_output_name(input);
+
+        // An input that cannot be read leaves no output behind.
+        std::ifstream in(input);
+        if (!in.is_open()) {
+            std::cerr << "pplua: cannot open '" << input << "'\n";
+            ++docs;
+            ++failed;
+            rc = 1;
+            continue;
+        }
+
+        pp.begin_document();
+        int doc_rc = pp.process(in, input);
+        pp.report_stats(std::cerr, input);
+
+        std::ofstream out(output, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            std::cerr << "pplua: cannot write '" << output << "'\n";
+            doc_rc = 1;
+        } else {
+            pp.flush(out);
+        }
+
+        ++docs;
+        if (doc_rc) ++failed;
+        rc |= doc_rc;
+    }
+
+    double secs = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t0).count();
+    std::cerr << "pplua: batch: " << docs << " documents";
+    if (failed) std::cerr << " (" << failed << " failed)";
+    std::cerr << " in " << secs << " s";
+    if (secs > 0) std::cerr << ", " << docs / secs << " documents/s";
+    std::cerr << '\n';
+
+    return rc;
+}
+
+// -O: say how much the peephole pass saved.
+static void report_optimizer(std::size_t lines, std::size_t removed) {
+    if (lines == 0)
+        return;
+    std::cerr << "pplua: -O: removed " << removed
+              << " of " << lines << " lines\n";
+}
+
+static int open_output(const std::string& path) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0666);
+    if (fd < 0)
+        std::cerr << "pplua: cannot write '" << path << "'\n";
+    return fd;
+}
+
+// --pipe: run `produce` with the preprocessor's output streaming into
+// a fresh instance of `stages`, the last of which writes to `out_fd`.
+// The stages' exit codes and stderr are appended to `report`.
+static int through_pipeline(pplua::Preprocessor& pp,
+                            const std::vector<pplua::PipeStage>& stages,
+                            int out_fd, const std::string& label,
+                            std::ostream& report,
+                            const std::function<int()>& produce)
+{
+    pplua::Pipeline pipeline(stages);
+    if (!pipeline.start(out_fd)) {
+        pipeline.wait();
+        pipeline.report(report, label);
+        report << "pplua: " << label << ": cannot start the pipeline\n";
+        return 1;
+    }
+
+    int rc;
+    {
+        pplua::FdOutBuf buf(pipeline.input_fd());
+        std::ostream feed(&buf);
+        pp.stream_to(&feed);
+        rc = produce();
+        pp.flush(feed);
+        feed.flush();
+        pp.stream_to(nullptr);
+    }
+    rc |= pipeline.wait();
+    pipeline.report(report, label);
+    return rc;
+}
+
+// "-o out/%.pdf" and "ch1.lroff" -> "out/ch1.pdf".
+static std::string fill_template(const std::string& tmpl,
+                                 const std::string& input) {
+    std::string stem = input.substr(input.find_last_of('/') + 1);
+    auto dot = stem.rfind('.');
+    if (dot != std::string::npos && dot > 0)
+        stem.erase(dot);
+
+    std::string out;
+    for (char c : tmpl) {
+        if (c == '%') out += stem;
+        else          out += c;
+    }
+    return out;
+}
+
+// How many of `count` calls run_concurrently makes at once.
+static std::size_t concurrency(std::size_t count)
+{
+    std::size_t n = std::max(1u, std::thread::hardware_concurrency());
+    return std::min(n, count);
+}
+
+// Call fn(0) ... fn(count - 1), one call per hardware thread at a
+// time.
+static void run_concurrently(std::size_t count,
+                             const std::function<void(std::size_t)>& fn)
+{
+    std::atomic<std::size_t> next{0};
+    auto worker = [&]() {
+        for (std::size_t i; (i = next++) < count; )
+            fn(i);
+    };
+    std::size_t n = concurrency(count);
+    std::vector<std::thread> threads;
+    for (std::size_t t = 1; t < n; ++t)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads)
+        t.join();
+}
+
+// Documents run at once share the processors: unless --pure-jobs
+// says otherwise, each of `count` documents run concurrently gets its
+// share of them for its pure blocks and parallel_map, not a pool as
+// large as the machine.
+static void share_threads(pplua::Config& cfg, std::size_t count)
+{
+    if (cfg.pure_jobs >= 0)
+        return;
+    std::size_t h = std::max(1u, std::thread::hardware_concurrency());
+    cfg.pure_jobs = static_cast<int>(
+        std::max<std::size_t>(1, h / concurrency(count)));
+}
+
+// -o with a %: every input is its own document with its own
+// preprocessor (and Lua state), output file and, with --pipe, its own
+// pipeline.  Documents run concurrently, one per hardware thread.
+static int run_fan_out(const pplua::Config& base,
+                       const std::vector<std::string>& input_files,
+                       const std::string& tmpl,
+                       const std::vector<pplua::PipeStage>& stages,
+                       std::vector<pplua::WhatisEntry>& whatis)
+{
+    pplua::Config cfg = base;
+    share_threads(cfg, input_files.size());
+
+    struct Job {
+        std::string input, output;
+        std::string report;
+        int         rc = 0;
+        std::size_t lines = 0, removed = 0;
+        std::vector<pplua::WhatisEntry> whatis;
+    };
+    std::vector<Job> jobs(input_files.size());
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+        jobs[i].input  = input_files[i];
+        jobs[i].output = fill_template(tmpl, input_files[i]);
+    }
+
+    auto run_one = [&](Job& job) {
+        pplua::Preprocessor pp(cfg);
+        if (!cfg.exec_chunks.empty() || !cfg.preamble_files.empty()
+            || !cfg.image.empty()) {
+            if (!pp.start()) {
+                job.rc = 1;
+                return;
+            }
+        }
+        int fd = open_output(job.output);
+        if (fd < 0) {
+            job.rc = 1;
+            return;
+        }
+
+        std::ostringstream report;
+        if (stages.empty()) {
+            pplua::FdOutBuf buf(fd);
+            std::ostream out(&buf);
+            pp.stream_to(&out);
+            job.rc = pp.process_file(job.input);
+            pp.flush(out);
+            out.flush();
+            if (buf.failed()) {
+                report << "pplua: cannot write '" << job.output << "'\n";
+                job.rc = 1;
+            }
+        } else {
+            job.rc = through_pipeline(pp, stages, fd, job.input, report,
+                [&]{ return pp.process_file(job.input); });
+        }
+        ::close(fd);
+        pp.report_stats(report, job.input);
+
+        job.report  = report.str();
+        job.lines   = pp.lines_flushed();
+        job.removed = pp.lines_removed();
+        job.whatis  = pp.take_whatis();
+    };
+
+    run_concurrently(jobs.size(), [&](std::size_t i) { run_one(jobs[i]); });
+
+    // One report, in input order.
+    int rc = 0;
+    std::size_t failed = 0, lines = 0, removed = 0;
+    for (auto& job : jobs) {
+        std::cerr << job.report;
+        if (job.rc) ++failed;
+        rc |= job.rc;
+        lines   += job.lines;
+        removed += job.removed;
+        whatis.insert(whatis.end(), job.whatis.begin(), job.whatis.end());
+    }
+    if (!stages.empty() && jobs.size() > 1) {
+        std::cerr << "pplua: pipe: " << jobs.size() << " pipelines";
+        if (failed) std::cerr << " (" << failed << " failed)";
+        std::cerr << '\n';
+    }
+    report_optimizer(lines, removed);
+    return rc;
+}
+
+// One line of a --variants file: "NAME VAR=VALUE ...".  Without a
+// NAME, the values joined with "-" name the variant.
+struct Variant {
+    std::string name;
+    std::vector<std::pair<std::string, std::string>> defines;
+};
+
+static bool read_variants(const std::string& path,
+                          std::vector<Variant>& variants)
+{
+    std::ifstream vf(path);
+    if (!vf.is_open()) {
+        std::cerr << "pplua: cannot open variants file '" << path << "'\n";
+        return false;
+    }
+
+    std::set<std::string> names;
+    std::string line;
+    for (std::size_t line_no = 1; std::getline(vf, line); ++line_no) {
+        std::istringstream ls(line);
+        std::string word;
+        Variant v;
+        bool named = false;
+        while (ls >> word) {
+            if (word[0] == '#')
+                break;
+            auto eq = word.find('=');
+            if (eq == std::string::npos && v.defines.empty() && !named) {
+                v.name = word;
+                named = true;
+            } else if (eq == std::string::npos) {
+                v.defines.emplace_back(word, "1");
+            } else {
+                v.defines.emplace_back(word.substr(0, eq),
+                                       word.substr(eq + 1));
+                if (!named)
+                    v.name += (v.name.empty() ? "" : "-")
+                            + word.substr(eq + 1);
+            }
+        }
+        if (!named && v.defines.empty())
+            continue;
+        if (v.name.empty() || v.name.find('/') != std::string::npos
+            || v.name == "." || v.name == "..") {
+            std::cerr << "pplua: " << path << ":" << line_no
+                      << ": not a usable variant name '" << v.name << "'\n";
+            return false;
+        }
+        if (!names.insert(v.name).second) {
+            std::cerr << "pplua: " << path << ":" << line_no
+                      << ": variant '" << v.name << "' given twice\n";
+            return false;
+        }
+        variants.push_back(std::move(v));
+    }
+    return true;
+}
+
+// Reads text that outlives it, without a copy: the variants share
+// one copy of every input.
+class TextInBuf : public std::streambuf {
+public:
+    explicit TextInBuf(const std::string& text) {
+        char* p = const_cast<char*>(text.data());
+        setg(p, p, p + text.size());
+    }
+};
+
+// --variants: the inputs are read once and rendered once per variant,
+// each in its own preprocessor with the variant's globals set after
+// the -D ones.  Variants run concurrently; the blocks they share are
+// compiled by the first to reach them and loaded as bytecode by the
+// rest.
+static int run_variants(
+    const pplua::Config& base,
+    const std::vector<std::pair<std::string, std::string>>& inputs,
+    const std::vector<Variant>& variants, const std::string& dir,
+    const std::vector<pplua::PipeStage>& stages, bool compiled)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    if (ec) {
+        std::cerr << "pplua: cannot create '" << dir << "': "
+                  << ec.message() << '\n';
+        return 1;
+    }
+
+    pplua::Config cfg = base;
+    cfg.chunks = std::make_shared<pplua::ChunkCache>();
+    share_threads(cfg, variants.size());
+
+    struct Job {
+        std::string report;
+        int         rc = 0;
+        std::size_t lines = 0, removed = 0;
+    };
+    std::vector<Job> jobs(variants.size());
+    auto t0 = std::chrono::steady_clock::now();
+
+    run_concurrently(jobs.size(), [&](std::size_t i) {
+        const Variant& v = variants[i];
+        Job& job = jobs[i];
+        const std::string output = dir + "/" + v.name;
+
+        pplua::Config vcfg = cfg;
+        vcfg.defines.insert(vcfg.defines.end(),
+                            v.defines.begin(), v.defines.end());
+        pplua::Preprocessor pp(vcfg);
+        if (!vcfg.exec_chunks.empty() || !vcfg.preamble_files.empty()
+            || !vcfg.image.empty()) {
+            if (!pp.start()) {
+                job.rc = 1;
+                return;
+            }
+        }
+        int fd = open_output(output);
+        if (fd < 0) {
+            job.rc = 1;
+            return;
+        }
+
+        auto produce = [&]() {
+            int rc = 0;
+            for (auto& [name, text] : inputs) {
+                if (compiled) {
+                    rc |= pp.run_compiled(text, name);
+                    continue;
+                }
+                TextInBuf buf(text);
+                std::istream in(&buf);
+                rc |= pp.process(in, name);
+            }
+            return rc;
+        };
+
+        std::ostringstream report;
+        if (stages.empty()) {
+            pplua::FdOutBuf buf(fd);
+            std::ostream out(&buf);
+            pp.stream_to(&out);
+            job.rc = produce();
+            pp.flush(out);
+            out.flush();
+            if (buf.failed()) {
+                report << "pplua: cannot write '" << output << "'\n";
+                job.rc = 1;
+            }
+        } else {
+            job.rc = through_pipeline(pp, stages, fd, v.name, report,
+                                      produce);
+        }
+        ::close(fd);
+        pp.report_stats(report, v.name);
+
+        job.report  = report.str();
+        job.lines   = pp.lines_flushed();
+        job.removed = pp.lines_removed();
+    });
+
+    // One report, in the order of the variants file.
+    int rc = 0;
+    std::size_t failed = 0, lines = 0, removed = 0;
+    for (auto& job : jobs) {
+        std::cerr << job.report;
+        if (job.rc) ++failed;
+        rc |= job.rc;
+        lines   += job.lines;
+        removed += job.removed;
+    }
+
+    double secs = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t0).count();
+    std::cerr << "pplua: variants: " << jobs.size() << " documents";
+    if (failed) std::cerr << " (" << failed << " failed)";
+    std::cerr << " in " << secs << " s";
+    if (secs > 0) std::cerr << ", " << jobs.size() / secs << " documents/s";
+    std::cerr << '\n';
+
+    report_optimizer(lines, removed);
+    return rc;
+}
+
 int main(int argc, char* argv[])
 {
     pplua::Config cfg;
+    cfg.shell_cache = default_shell_cache();
 
     std::vector<std::string>               input_files;
-    std::vector<std::string>               exec_before;  // -e chunks
-    std::vector<std::pair<std::string,
-                          std::string>>    defines;      // -D pairs
+    std::string                            cache_dir;    // --cache-dir
+    std::string                            batch;        // --batch
+    std::string                            pipe_spec;    // --pipe
+    std::string                            output;       // -o
+    std::string                            variants_file; // --variants
+    std::string                            run_file;     // --run
+    std::string                            depfile;      // --depfile
+    std::string                            whatis_db;    // --whatis-db
+    bool                                   compile_only = false;
 
     // ---- parse arguments ----
     for (int i = 1; i < argc; ++i) {
@@ -67,13 +720,17 @@ int main(int argc, char* argv[])
             return 0;
         }
         if (arg == "-V" || arg == "--version") {
-            std::cout << "pplua 0.1.0\n";
+            std::cout << "pplua " PPLUA_VERSION "\n";
             return 0;
         }
         if (arg == "-n") {
             cfg.emit_lf = false;
             continue;
         }
+        if (arg == "-O") {
+            cfg.optimize = true;
+            continue;
+        }
 
         // Options that take a following argument.
         auto need_arg = [&](const char* name) -> std::string {
@@ -86,13 +743,33 @@ int main(int argc, char* argv[])
         };
 
         if (arg == "-e") {
-            exec_before.push_back(need_arg("-e"));
+            cfg.exec_chunks.push_back(need_arg("-e"));
             continue;
         }
         if (arg == "-l") {
             cfg.preamble_files.push_back(need_arg("-l"));
             continue;
         }
+        if (arg == "--compile") {
+            compile_only = true;
+            continue;
+        }
+        if (arg == "--run") {
+            run_file = need_arg("--run");
+            continue;
+        }
+        if (arg == "--variants") {
+            variants_file = need_arg("--variants");
+            continue;
+        }
+        if (arg == "--image") {
+            cfg.image = need_arg("--image");
+            continue;
+        }
+        if (arg == "--save-image") {
+            cfg.save_image = need_arg("--save-image");
+            continue;
+        }
         if (arg == "-I") {
             std::string p = need_arg("-I");
             // Append Lua path pattern.
@@ -105,14 +782,112 @@ int main(int argc, char* argv[])
             auto eq = d.find('=');
             if (eq == std::string::npos) {
                 // -D NAME  (no value, set to "1")
-                defines.emplace_back(d, "1");
+                cfg.defines.emplace_back(d, "1");
             } else {
-                defines.emplace_back(d.substr(0, eq),
+                cfg.defines.emplace_back(d.substr(0, eq),
                                      d.substr(eq + 1));
             }
             continue;
         }
 
+        if (arg == "--cache-dir") {
+            cache_dir = need_arg("--cache-dir");
+            cfg.track_inputs = true;
+            continue;
+        }
+        if (arg == "--shell-cache") {
+            cfg.shell_cache = need_arg("--shell-cache");
+            continue;
+        }
+        if (arg == "--whatis-db") {
+            whatis_db = need_arg("--whatis-db");
+            cfg.whatis = true;
+            continue;
+        }
+        if (arg == "--depfile") {
+            depfile = need_arg("--depfile");
+            cfg.track_inputs = true;
+            continue;
+        }
+
+        if (arg == "--batch") {
+            batch = need_arg("--batch");
+            continue;
+        }
+
+        if (arg == "--pipe") {
+            pipe_spec = need_arg("--pipe");
+            continue;
+        }
+
+        if (arg == "-o") {
+            output = need_arg("-o");
+            continue;
+        }
+
+        if (arg == "--gc") {
+            std::string mode = need_arg("--gc");
+            if (!pplua::parse_gc_mode(mode, cfg.gc.mode)) {
+                std::cerr << "pplua: --gc: unknown mode '" << mode
+                          << "' (incremental, generational)\n";
+                return 1;
+            }
+#ifndef LUA_GCGEN
+            if (cfg.gc.mode == pplua::GcOptions::Mode::generational) {
+                std::cerr << "pplua: --gc generational needs Lua 5.4 (this"
+                             " is " << pplua::lua_runtime_name() << ")\n";
+                return 1;
+            }
+#endif
+            continue;
+        }
+        if (arg == "--gc-pause" || arg == "--gc-stepmul") {
+            std::string v = need_arg(arg.c_str());
+            char* end = nullptr;
+            long n = std::strtol(v.c_str(), &end, 10);
+            if (v.empty() || *end || n < 0 || n > 1000000) {
+                std::cerr << "pplua: " << arg << ": expected a percentage,"
+                             " not '" << v << "'\n";
+                return 1;
+            }
+            (arg == "--gc-pause" ? cfg.gc.pause : cfg.gc.stepmul)
+                = static_cast<int>(n);
+            continue;
+        }
+        if (arg == "--gc-between") {
+            std::string v = need_arg("--gc-between");
+            if (!pplua::parse_gc_between(v, cfg.gc.between)) {
+                std::cerr << "pplua: --gc-between: expected full or none,"
+                             " not '" << v << "'\n";
+                return 1;
+            }
+            continue;
+        }
+        if (arg == "--stats") {
+            cfg.gc.stats = true;
+            continue;
+        }
+        if (arg == "--pure-jobs") {
+            std::string v = need_arg("--pure-jobs");
+            char* end = nullptr;
+            long n = std::strtol(v.c_str(), &end, 10);
+            if (v.empty() || *end || n < 0 || n > 1024) {
+                std::cerr << "pplua: --pure-jobs: expected a number of"
+                             " threads, not '" << v << "'\n";
+                return 1;
+            }
+            cfg.pure_jobs = static_cast<int>(n);
+            continue;
+        }
+        if (arg == "--ascii-escape") {
+            cfg.ascii_escape = true;
+            continue;
+        }
+        if (arg == "--no-utf8-check") {
+            cfg.check_utf8 = false;
+            continue;
+        }
+
         if (arg == "--") {
             // Everything after -- is a filename.
             for (++i; i < argc; ++i)
@@ -130,41 +905,288 @@ int main(int argc, char* argv[])
         input_files.push_back(arg);
     }
 
+    if (!depfile.empty()
+        && (output.empty() || output.find('%') != std::string::npos
+            || compile_only || !batch.empty() || !variants_file.empty()
+            || !cache_dir.empty() || !cfg.save_image.empty())) {
+        std::cerr << "pplua: --depfile needs the target named with -o FILE"
+                     " and cannot be combined with --batch, --variants,"
+                     " --compile, --save-image or --cache-dir\n";
+        return 1;
+    }
+
+    if (!whatis_db.empty()
+        && (compile_only || !variants_file.empty() || !cfg.save_image.empty())) {
+        std::cerr << "pplua: --whatis-db indexes what a run renders and"
+                     " cannot be combined with --variants, --compile or"
+                     " --save-image\n";
+        return 1;
+    }
+
+    if (compile_only) {
+        if (input_files.size() > 1 || !batch.empty() || !variants_file.empty()
+            || !pipe_spec.empty() || !cache_dir.empty() || !run_file.empty()
+            || !cfg.save_image.empty()) {
+            std::cerr << "pplua: --compile takes one input file and -o,"
+                         " and no other mode\n";
+            return 1;
+        }
+        const std::string path = input_files.empty() ? "-" : input_files[0];
+        std::ifstream file_in;
+        if (path != "-") {
+            file_in.open(path);
+            if (!file_in.is_open()) {
+                std::cerr << "pplua: cannot open '" << path << "'\n";
+                return 1;
+            }
+        }
+        std::ofstream file_out;
+        if (!output.empty()) {
+            file_out.open(output, std::ios::binary | std::ios::trunc);
+            if (!file_out.is_open()) {
+                std::cerr << "pplua: cannot write '" << output << "'\n";
+                return 1;
+            }
+        }
+        return pplua::compile_document(
+            cfg, file_in.is_open() ? file_in : std::cin,
+            path == "-" ? "<stdin>" : path,
+            file_out.is_open() ? file_out : std::cout);
+    }
+
+    if (!run_file.empty()) {
+        if (!input_files.empty() || !batch.empty()
+            || output.find('%') != std::string::npos) {
+            std::cerr << "pplua: --run renders one compiled document and"
+                         " takes no input files, --batch or -o with %\n";
+            return 1;
+        }
+        input_files.push_back(run_file);
+    }
+
+    if (!cfg.save_image.empty()) {
+        if (!input_files.empty() || !batch.empty() || !output.empty()
+            || !pipe_spec.empty() || !cache_dir.empty()) {
+            std::cerr << "pplua: --save-image runs the setup only and"
+                         " takes no input or output options\n";
+            return 1;
+        }
+        pplua::Preprocessor pp(cfg);
+        return pp.start() && pp.save_image() ? 0 : 1;
+    }
+
+    if (!batch.empty() && (!input_files.empty() || !cache_dir.empty())) {
+        std::cerr << "pplua: --batch takes its inputs from the manifest"
+                     " and cannot be combined with --cache-dir\n";
+        return 1;
+    }
+    if (!batch.empty() && (!pipe_spec.empty() || !output.empty())) {
+        std::cerr << "pplua: --batch names its outputs in the manifest"
+                     " and cannot be combined with --pipe or -o\n";
+        return 1;
+    }
+    if (!pipe_spec.empty() && !cache_dir.empty()) {
+        std::cerr << "pplua: --pipe cannot be combined with --cache-dir\n";
+        return 1;
+    }
+
+    std::vector<pplua::PipeStage> stages;
+    if (!pipe_spec.empty()) {
+        std::string error;
+        if (!pplua::parse_pipeline(pipe_spec, stages, error)) {
+            std::cerr << "pplua: --pipe: " << error << '\n';
+            return 1;
+        }
+        // A stage that exits early must not kill pplua; the write
+        // fails with EPIPE instead and the stage's status is reported.
+        std::signal(SIGPIPE, SIG_IGN);
+    }
+
+    if (!variants_file.empty()) {
+        if (output.empty() || output.find('%') != std::string::npos
+            || !batch.empty() || !cache_dir.empty()) {
+            std::cerr << "pplua: --variants needs -o DIR and cannot be"
+                         " combined with --batch or --cache-dir\n";
+            return 1;
+        }
+        std::vector<Variant> variants;
+        if (!read_variants(variants_file, variants))
+            return 1;
+        if (input_files.empty())
+            input_files.push_back("-");
+        std::vector<std::pair<std::string, std::string>> inputs;
+        for (auto& path : input_files) {
+            std::string text;
+            if (!slurp(path, text))
+                return 1;
+            inputs.emplace_back(path == "-" ? "<stdin>" : path,
+                                std::move(text));
+        }
+        return run_variants(cfg, inputs, variants, output, stages,
+                            !run_file.empty());
+    }
+
+    const bool fan_out = output.find('%') != std::string::npos;
+    if (fan_out) {
+        if (!cache_dir.empty() || input_files.empty()) {
+            std::cerr << "pplua: -o with % needs input files and cannot"
+                         " be combined with --cache-dir\n";
+            return 1;
+        }
+        std::vector<pplua::WhatisEntry> whatis;
+        int rc = run_fan_out(cfg, input_files, output, stages, whatis);
+        if (!whatis_db.empty() && !pplua::write_whatis(whatis_db, whatis))
+            rc = 1;
+        return rc;
+    }
+
+    // ---- open the output ----
+    std::ofstream file_out;
+    if (!output.empty() && stages.empty()) {
+        file_out.open(output, std::ios::binary | std::ios::trunc);
+        if (!file_out.is_open()) {
+            std::cerr << "pplua: cannot write '" << output << "'\n";
+            return 1;
+        }
+    }
+    std::ostream& out = file_out.is_open() ? file_out : std::cout;
+
+    // ---- consult the cache ----
+    //
+    // With --cache-dir the inputs are read up front: their bytes are
+    // part of the key, and stdin can only be read once.
+    std::vector<std::pair<std::string, std::string>> inputs;
+    std::string base_key;
+    if (!cache_dir.empty()) {
+        if (input_files.empty())
+            input_files.push_back("-");
+        for (auto& path : input_files) {
+            std::string text;
+            if (!slurp(path, text))
+                return 1;
+            inputs.emplace_back(path == "-" ? "<stdin>" : path,
+                                std::move(text));
+        }
+
+        base_key = cache_base_key(cfg, inputs);
+        std::string cached;
+        if (pplua::OutputCache(cache_dir).lookup(base_key, cached)) {
+            out << cached;
+            if (!whatis_db.empty()) {
+                pplua::WhatisIndex index;
+                index.feed(cached);
+                index.finish();
+                if (!pplua::write_whatis(whatis_db, index.take()))
+                    return 1;
+            }
+            return 0;
+        }
+    }
+
     // ---- build the preprocessor ----
     pplua::Preprocessor pp(cfg);
 
-    // Set -D globals.
-    for (auto& [name, value] : defines)
-        pp.lua()[name] = value;
-
-    // Run -e chunks.
-    for (auto& code : exec_before) {
-        auto result = pp.lua().safe_script(code,
-            sol::script_pass_on_error, "@-e");
-        if (!result.valid()) {
-            sol::error err = result;
-            std::cerr << "pplua: -e: " << err.what() << '\n';
+    // -D globals are applied whenever the Lua state comes up; -e
+    // chunks, preambles and images may have side effects, so they
+    // force it.
+    if (!cfg.exec_chunks.empty() || !cfg.preamble_files.empty()
+        || !cfg.image.empty()) {
+        if (!pp.start())
             return 1;
-        }
+    }
+
+    if (!batch.empty()) {
+        int rc = run_batch(pp, batch);
+        report_optimizer(pp.lines_flushed(), pp.lines_removed());
+        if (!whatis_db.empty() && !pplua::write_whatis(whatis_db,
+                                                       pp.take_whatis()))
+            rc = 1;
+        return rc;
     }
 
     // ---- process input ----
-    int rc = 0;
-    if (input_files.empty()) {
-        // Read from stdin.
-        rc = pp.process(std::cin, "<stdin>");
-    } else {
-        for (auto& path : input_files) {
-            if (path == "-") {
-                rc |= pp.process(std::cin, "<stdin>");
-            } else {
-                rc |= pp.process_file(path);
+    auto process_inputs = [&]() {
+        int rc = 0;
+        if (!cache_dir.empty()) {
+            for (auto& [name, text] : inputs) {
+                if (!run_file.empty()) {
+                    rc |= pp.run_compiled(text, name);
+                    continue;
+                }
+                std::istringstream in(text);
+                rc |= pp.process(in, name);
+            }
+        } else if (!run_file.empty()) {
+            std::string bytes;
+            rc = slurp(run_file, bytes) ? pp.run_compiled(bytes, run_file) : 1;
+        } else if (input_files.empty()) {
+            // Read from stdin.
+            rc = pp.process(std::cin, "<stdin>");
+        } else {
+            for (auto& path : input_files) {
+                if (path == "-") {
+                    rc |= pp.process(std::cin, "<stdin>");
+                } else {
+                    rc |= pp.process_file(path);
+                }
             }
         }
+        return rc;
+    };
+
+    // --whatis-db: the pages written out; --depfile: the inputs and
+    // everything the run read.
+    auto finish_run = [&](int rc) {
+        if (!whatis_db.empty()
+            && !pplua::write_whatis(whatis_db, pp.take_whatis()))
+            rc = 1;
+        if (depfile.empty() || rc != 0)
+            return rc;
+        std::set<std::string> deps(pp.tracker().files());
+        for (auto& path : input_files)
+            if (path != "-")
+                deps.insert(path);
+        return write_depfile(depfile, output, deps) ? 0 : 1;
+    };
+
+    // --stats: the whole run is one document.
+    const std::string run_label = input_files.empty() ? "<stdin>"
+                                : input_files.size() == 1 ? input_files[0]
+                                : "all inputs";
+
+    if (!stages.empty()) {
+        int out_fd = STDOUT_FILENO;
+        if (!output.empty() && (out_fd = open_output(output)) < 0)
+            return 1;
+        int rc = through_pipeline(pp, stages, out_fd, "pipe", std::cerr,
+                                  process_inputs);
+        if (out_fd != STDOUT_FILENO)
+            ::close(out_fd);
+        pp.report_stats(std::cerr, run_label);
+        report_optimizer(pp.lines_flushed(), pp.lines_removed());
+        return finish_run(rc);
     }
 
     // ---- emit output ----
-    pp.flush(std::cout);
+    //
+    // Without a cache to fill, output is streamed while processing.
+    if (cache_dir.empty()) {
+        pp.stream_to(&out);
+        int rc = process_inputs();
+        pp.flush(out);
+        pp.report_stats(std::cerr, run_label);
+        report_optimizer(pp.lines_flushed(), pp.lines_removed());
+        return finish_run(rc);
+    }
 
-    return rc;
+    int rc = process_inputs();
+    std::ostringstream text;
+    pp.flush(text);
+    out << text.str();
+    pp.report_stats(std::cerr, run_label);
+    report_optimizer(pp.lines_flushed(), pp.lines_removed());
+    if (rc == 0)
+        pplua::OutputCache(cache_dir).store(base_key, pp.tracker(),
+                                            text.str());
+    return finish_run(rc);
 }
@@ -0,0 +1,424 @@
+// src/peephole.cpp
+//
+// The -O peephole optimizer.
+
+#include "peephole.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+namespace pplua {
+
+namespace {
+
+// Split a control line into request name and arguments.  Returns
+// false for text lines.  `cc` receives the control character.
+bool parse_request(std::string_view line, char& cc,
+                   std::string_view& name, std::string_view& args)
+{
+    if (line.empty() || (line[0] != '.' && line[0] != '\''))
+        return false;
+    cc = line[0];
+
+    std::size_t i = line.find_first_not_of(" \t", 1);
+    if (i == std::string_view::npos) {
+        name = args = std::string_view();
+        return true;
+    }
+    std::size_t e = line.find_first_of(" \t", i);
+    name = line.substr(i, e == std::string_view::npos ? e : e - i);
+
+    args = std::string_view();
+    if (e != std::string_view::npos) {
+        std::size_t a = line.find_first_not_of(" \t", e);
+        std::size_t z = line.find_last_not_of(" \t");
+        if (a != std::string_view::npos)
+            args = line.substr(a, z - a + 1);
+    }
+    return true;
+}
+
+// First whitespace-separated word of `s`, and the rest after it.
+std::string_view first_word(std::string_view s, std::string_view* rest = nullptr)
+{
+    std::size_t e = s.find_first_of(" \t");
+    if (rest) {
+        std::size_t r = e == std::string_view::npos
+                      ? e : s.find_first_not_of(" \t", e);
+        *rest = r == std::string_view::npos ? std::string_view()
+                                            : s.substr(r);
+    }
+    return s.substr(0, e);
+}
+
+// Does the line join the next one?  Scans escapes the way groff
+// does with the default escape character: \" ends the line as a
+// comment, \# and a final backslash swallow the newline.
+bool continues(std::string_view line)
+{
+    for (std::size_t i = 0; i < line.size(); ++i) {
+        if (line[i] != '\\')
+            continue;
+        if (i + 1 == line.size() || line[i + 1] == '#')
+            return true;
+        if (line[i + 1] == '"')
+            return false;
+        ++i;
+    }
+    return false;
+}
+
+bool all_of(std::string_view s, int (*pred)(int))
+{
+    return !s.empty() && std::all_of(s.begin(), s.end(),
+        [pred](unsigned char c){ return pred(c) != 0; });
+}
+
+// Unsigned only: a sign makes .nr relative.
+bool is_integer(std::string_view s)
+{
+    return all_of(s, isdigit);
+}
+
+// A font that .ft can select by name or position ("P" aside).
+bool plain_font(std::string_view s)
+{
+    return !s.empty() && std::all_of(s.begin(), s.end(),
+        [](unsigned char c){ return std::isalnum(c) || c == '_'; });
+}
+
+// An absolute, non-zero point size with an optional scale unit.
+bool plain_size(std::string_view s)
+{
+    if (!s.empty() && std::strchr("cimnpPsuvzM", s.back()))
+        s.remove_suffix(1);
+    if (s.empty() || s.find_first_not_of("0123456789.") != s.npos
+        || std::count(s.begin(), s.end(), '.') > 1)
+        return false;
+    return s.find_first_of("123456789") != s.npos;
+}
+
+// Requests whose immediate repetition has no further effect.
+bool idempotent(std::string_view name, std::string_view args)
+{
+    if (name == "br" || name == "nf" || name == "fi"
+        || name == "na" || name == "nh")
+        return args.empty();
+    if (name == "ad")
+        return args.size() <= 1;
+    if (name == "hy")
+        return args.empty() || is_integer(args);
+    if (name == "nr") {
+        std::string_view rest;
+        first_word(args, &rest);
+        std::string_view inc;
+        std::string_view value = first_word(rest, &inc);
+        return is_integer(value) && (inc.empty() || is_integer(inc));
+    }
+    if (name == "ds" || name == "ds1")
+        return !args.empty() && args.find('\\') == args.npos;
+    return false;
+}
+
+// Requests that run the rest of their line only on a condition.
+bool conditional(std::string_view name)
+{
+    return name == "if" || name == "ie" || name == "el" || name == "while";
+}
+
+// Closing request for each preprocessor region.
+const char* region_end(std::string_view name)
+{
+    static const struct { const char* open; const char* close; } regions[] = {
+        { "TS", "TE" }, { "EQ", "EN" }, { "PS", "PE" }, { "G1", "G2" },
+        { "GS", "GE" }, { "R1", "R2" }, { "[",  "]"  }, { "cstart", "cend" },
+    };
+    for (auto& r : regions)
+        if (name == r.open)
+            return r.close;
+    return nullptr;
+}
+
+// Fold a run of .ft (.ps) operations into (current, previous).
+// -2 and -3 stand for the values before the run.
+std::pair<int, int> fold(const int* ops, std::size_t n)
+{
+    int cur = -2, prev = -3;
+    for (std::size_t i = 0; i < n; ++i) {
+        if (ops[i] < 0) std::swap(cur, prev);
+        else            { prev = cur; cur = ops[i]; }
+    }
+    return { cur, prev };
+}
+
+// The shortest sequence over the run's own operations that ends in
+// the same (current, previous) pair.  Both values matter: "\fP" and
+// a later ".ft" still see the previous one.
+std::vector<int> shortest(const std::vector<int>& ops, std::size_t nargs)
+{
+    const std::size_t max_len = 3, max_alphabet = 9;
+    if (ops.size() <= 1 || nargs + 1 > max_alphabet)
+        return ops;
+
+    auto target = fold(ops.data(), ops.size());
+    const int alphabet = static_cast<int>(nargs) + 1;   // -1 .. nargs-1
+
+    for (std::size_t len = 0; len < ops.size() && len <= max_len; ++len) {
+        std::vector<int> seq(len, -1);
+        for (;;) {
+            if (fold(seq.data(), len) == target)
+                return seq;
+            std::size_t k = 0;
+            while (k < len && ++seq[k] == alphabet - 1) {
+                seq[k] = -1;
+                ++k;
+            }
+            if (k == len)
+                break;
+        }
+    }
+    return ops;
+}
+
+int intern(std::vector<std::string>& table, std::string_view arg)
+{
+    auto it = std::find(table.begin(), table.end(), arg);
+    if (it != table.end())
+        return static_cast<int>(it - table.begin());
+    table.emplace_back(arg);
+    return static_cast<int>(table.size() - 1);
+}
+
+} // namespace
+
+// =================================================================
+//  Output and line-number bookkeeping
+// =================================================================
+
+void Peephole::put(std::string_view line, std::string& out)
+{
+    out.append(line);
+    out += '\n';
+    ++out_;
+    ++out_next_;
+}
+
+// Make the next emitted line carry groff line number `line`,
+// writing out (or folding away) a held-back .lf on the way.
+void Peephole::sync(std::int64_t line, std::string& out)
+{
+    if (lf_pending_ && !lf_file_.empty() && lf_file_ != out_file_) {
+        put(".lf " + std::to_string(line) + " " + lf_file_, out);
+        out_file_ = lf_file_;
+        out_next_ = line;
+    } else if (out_next_ != line) {
+        put(".lf " + std::to_string(line), out);
+        out_next_ = line;
+    }
+    lf_pending_ = false;
+    lf_file_.clear();
+}
+
+void Peephole::emit(std::string_view line, std::string& out)
+{
+    flush_run(out);
+    sync(src_next_, out);
+    put(line, out);
+    ++src_next_;
+    prev_.clear();
+}
+
+void Peephole::flush_run(std::string& out)
+{
+    if (run_lines_.empty())
+        return;
+
+    std::vector<int> fonts = shortest(fonts_, font_args_.size());
+    std::vector<int> sizes = shortest(sizes_, size_args_.size());
+    std::size_t kept = fonts.size() + sizes.size();
+
+    // A held-back .lf belongs before the run.  Any drift left by a
+    // shorter run is corrected at the next line that is kept, which
+    // is usually an .lf of its own.
+    if (kept && lf_pending_)
+        sync(src_next_ - static_cast<std::int64_t>(run_lines_.size()), out);
+
+    if (kept < run_lines_.size()) {
+        for (int op : fonts)
+            put(op < 0 ? ".ft" : ".ft " + font_args_[op], out);
+        for (int op : sizes)
+            put(op < 0 ? ".ps" : ".ps " + size_args_[op], out);
+    } else {
+        for (auto& l : run_lines_)
+            put(l, out);
+    }
+
+    run_lines_.clear();
+    fonts_.clear();
+    sizes_.clear();
+    font_args_.clear();
+    size_args_.clear();
+}
+
+// =================================================================
+//  feed — classify one line
+// =================================================================
+
+void Peephole::feed(std::string_view line, std::string& out)
+{
+    ++in_;
+    bool continued = cont_;
+    cont_ = continues(line);
+
+    char cc = 0;
+    std::string_view name, args;
+    bool request = !continued && parse_request(line, cc, name, args);
+
+    // Only a whole, unconditional request can be repeated: the last
+    // line of a continued one, or a body under .if, runs on
+    // conditions of its own.
+    bool complete = request && !cont_ && !conditional(name);
+
+    switch (mode_) {
+    case Mode::off:
+        put(line, out);
+        return;
+
+    case Mode::copy:
+        emit(line, out);
+        if (request && name == end_)
+            mode_ = Mode::normal;
+        return;
+
+    case Mode::region:
+        emit(line, out);
+        if (request && name == "lf" && is_integer(first_word(args))) {
+            std::string_view file;
+            src_next_ = out_next_ =
+                std::strtoll(std::string(first_word(args, &file)).c_str(),
+                             nullptr, 10);
+            if (!file.empty())
+                out_file_.assign(file);
+        }
+        if (request && name == end_)
+            mode_ = Mode::normal;
+        return;
+
+    case Mode::normal:
+        break;
+    }
+
+    if (!request) {
+        emit(line, out);
+        return;
+    }
+
+    if (cc == '.') {
+        // A blank request does nothing at all.
+        if (name.empty()) {
+            ++src_next_;
+            return;
+        }
+
+        // Font and size changes gather into a run.
+        if ((name == "ft" && (args.empty() || plain_font(args)))
+            || (name == "ps" && (args.empty() || plain_size(args))))
+        {
+            if (name == "ft")
+                fonts_.push_back(args.empty() || args == "P"
+                                 ? -1 : intern(font_args_, args));
+            else
+                sizes_.push_back(args.empty()
+                                 ? -1 : intern(size_args_, args));
+            run_lines_.emplace_back(line);
+            ++src_next_;
+            if (complete)
+                prev_.assign(line);
+            else
+                prev_.clear();
+            return;
+        }
+
+        // .lf is held back until a line that needs it is emitted.
+        if (name == "lf" && is_integer(first_word(args))) {
+            flush_run(out);
+            std::string_view file;
+            std::int64_t n = std::strtoll(
+                std::string(first_word(args, &file)).c_str(), nullptr, 10);
+            if (!lf_pending_)
+                lf_file_.clear();
+            if (!file.empty())
+                lf_file_.assign(file);
+            lf_pending_ = true;
+            src_next_ = n;
+            if (complete)
+                prev_.assign(line);
+            else
+                prev_.clear();
+            return;
+        }
+
+        if (complete && line == prev_ && idempotent(name, args)) {
+            ++src_next_;
+            return;
+        }
+
+        if (const char* close = region_end(name)) {
+            emit(line, out);
+            mode_ = Mode::region;
+            end_ = close;
+            return;
+        }
+    }
+
+    // Macro definitions and ignored blocks are read in copy mode.
+    if (name == "de" || name == "de1" || name == "am" || name == "am1"
+        || name == "ig")
+    {
+        emit(line, out);
+        std::string_view end = args;
+        if (name != "ig")
+            first_word(args, &end);
+        end = first_word(end);
+        end_ = end.empty() ? "." : std::string(end);
+        mode_ = Mode::copy;
+        return;
+    }
+
+    // Indirect definitions and changes to the escape or control
+    // characters make the rest of the stream opaque.
+    if (name == "dei" || name == "dei1" || name == "ami" || name == "ami1"
+        || name == "cc" || name == "c2" || name == "eo" || name == "ec"
+        || name == "do")
+    {
+        emit(line, out);
+        mode_ = Mode::off;
+        return;
+    }
+
+    emit(line, out);
+    if (complete)
+        prev_.assign(line);
+}
+
+void Peephole::finish(std::string& out)
+{
+    // A trailing .lf describes lines that never come.
+    flush_run(out);
+    lf_pending_ = false;
+}
+
+void Peephole::feed_text(std::string_view text, std::string& out)
+{
+    while (!text.empty()) {
+        std::size_t nl = text.find('\n');
+        feed(text.substr(0, nl), out);
+        if (nl == std::string_view::npos)
+            break;
+        text.remove_prefix(nl + 1);
+    }
+}
+
+} // namespace pplua
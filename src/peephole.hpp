@@ -0,0 +1,88 @@
+// src/peephole.hpp
+//
+// The -O pass: a line-level peephole optimizer over the emitted
+// groff stream.  It removes requests that cannot change the
+// formatted result and keeps groff's line numbers in step.
+
+#ifndef PPLUA_PEEPHOLE_HPP
+#define PPLUA_PEEPHOLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pplua {
+
+// =====================================================================
+//  Peephole — streaming optimizer for one output stream
+//
+//  What it removes:
+//    * blank requests (a line consisting of the control character);
+//    * runs of consecutive .ft / .ps requests, replaced by the
+//      shortest sequence that leaves both the current and the
+//      previous font (size) in the same state;
+//    * an identical repeat of an idempotent request (.br, .nf, .fi,
+//      .na, .nh, .nr with a constant value, .ds without escapes);
+//    * .lf requests that are overridden by the next one, that
+//      restate the line groff is already on, or that end the stream.
+//
+//  Macro bodies (.de, .am, .ig), preprocessor regions (.TS, .EQ,
+//  .PS, …) and continuation lines pass through untouched; after a
+//  request that changes the escape or control characters the rest of
+//  the stream does too.  Where removals shift groff's line count, a
+//  ".lf N" is inserted before the next line that is kept, so
+//  diagnostics still point at the right place.
+// =====================================================================
+class Peephole {
+public:
+    /// Feed one line (without its newline); results go to `out`.
+    void feed(std::string_view line, std::string& out);
+
+    /// Feed every line of `text`, including a final one without a
+    /// newline (which comes out with one).
+    void feed_text(std::string_view text, std::string& out);
+
+    /// End of stream: emit whatever is still held back.
+    void finish(std::string& out);
+
+    std::size_t lines_in()  const { return in_; }
+    std::size_t lines_out() const { return out_; }
+
+private:
+    enum class Mode { normal, copy, region, off };
+
+    Mode        mode_ = Mode::normal;
+    std::string end_;           // what ends the copy / region mode
+    bool        cont_ = false;  // previous line ended in '\'
+    std::string prev_;          // previous whole request, for repeats
+
+    // groff's number for the next input line, as the unoptimized
+    // stream would have it (src) and as the emitted one does (out).
+    std::int64_t src_next_ = 1;
+    std::int64_t out_next_ = 1;
+    std::string out_file_;      // empty until an .lf names one
+
+    // A held-back .lf (line number folded into src_next_).
+    bool        lf_pending_ = false;
+    std::string lf_file_;
+
+    // The current run of .ft / .ps requests: -1 selects the previous
+    // value, anything else indexes the run's argument table.
+    std::vector<int>         fonts_, sizes_;
+    std::vector<std::string> font_args_, size_args_;
+    std::vector<std::string> run_lines_;
+
+    std::size_t in_  = 0;
+    std::size_t out_ = 0;
+
+    void put(std::string_view line, std::string& out);
+    void sync(std::int64_t line, std::string& out);
+    void emit(std::string_view line, std::string& out);
+    void flush_run(std::string& out);
+};
+
+} // namespace pplua
+
+#endif // PPLUA_PEEPHOLE_HPP
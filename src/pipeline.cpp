@@ -0,0 +1,320 @@
+// src/pipeline.cpp
+//
+// The --pipe driver: stage parsing, process start-up, reporting.
+
+#include "pipeline.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ostream>
+#include <string_view>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+namespace pplua {
+
+// =================================================================
+//  parse_pipeline
+// =================================================================
+
+bool parse_pipeline(const std::string& spec,
+                    std::vector<PipeStage>& stages,
+                    std::string& error)
+{
+    stages.clear();
+
+    PipeStage   stage;
+    std::string word;
+    bool        in_word = false;
+    std::size_t stage_start = 0;
+
+    auto end_word = [&]() {
+        if (in_word)
+            stage.argv.push_back(std::move(word));
+        word.clear();
+        in_word = false;
+    };
+    auto end_stage = [&](std::size_t pos) -> bool {
+        end_word();
+        if (stage.argv.empty()) {
+            error = "empty stage in '" + spec + "'";
+            return false;
+        }
+        std::string text = spec.substr(stage_start, pos - stage_start);
+        auto a = text.find_first_not_of(" \t");
+        auto z = text.find_last_not_of(" \t");
+        stage.text = text.substr(a, z - a + 1);
+        stages.push_back(std::move(stage));
+        stage = PipeStage();
+        stage_start = pos + 1;
+        return true;
+    };
+
+    for (std::size_t i = 0; i < spec.size(); ++i) {
+        char c = spec[i];
+        if (c == '\'' || c == '"') {
+            // Inside "…", a backslash escapes only " \ $ and `.
+            std::size_t close = i + 1;
+            for (; close < spec.size() && spec[close] != c; ++close) {
+                if (c == '"' && spec[close] == '\\'
+                    && close + 1 < spec.size()
+                    && std::strchr("\"\\$`", spec[close + 1]))
+                    ++close;
+                word += spec[close];
+            }
+            if (close == spec.size()) {
+                error = std::string("unterminated ") + c
+                      + " in '" + spec + "'";
+                return false;
+            }
+            in_word = true;
+            i = close;
+        } else if (c == '\\' && i + 1 < spec.size()) {
+            word += spec[++i];
+            in_word = true;
+        } else if (c == '|') {
+            if (!end_stage(i))
+                return false;
+        } else if (c == ' ' || c == '\t' || c == '\n') {
+            end_word();
+        } else {
+            word += c;
+            in_word = true;
+        }
+    }
+    return end_stage(spec.size());
+}
+
+// =================================================================
+//  Pipeline
+// =================================================================
+
+namespace {
+
+// An unlinked, close-on-exec temporary file.
+int anonymous_file()
+{
+    const char* dir = std::getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp")
+                     + "/pplua-stderr-XXXXXX";
+    int fd = ::mkostemp(&path[0], O_CLOEXEC);
+    if (fd >= 0)
+        ::unlink(path.c_str());
+    return fd;
+}
+
+} // namespace
+
+Pipeline::Pipeline(std::vector<PipeStage> stages)
+    : stages_(std::move(stages))
+{}
+
+Pipeline::~Pipeline()
+{
+    wait();
+    for (auto& c : children_)
+        if (c.err_fd >= 0)
+            ::close(c.err_fd);
+}
+
+bool Pipeline::start(int out_fd)
+{
+    // Every descriptor we create is close-on-exec: with several
+    // pipelines running at once, a stray write end inherited by an
+    // unrelated child would keep a stage from ever seeing EOF.
+    int first[2];
+    if (::pipe2(first, O_CLOEXEC) != 0)
+        return false;
+    in_fd_ = first[1];
+    int prev_read = first[0];
+
+    // pplua ignores SIGPIPE while feeding; the stages must not.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t def;
+    sigemptyset(&def);
+    sigaddset(&def, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &def);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    bool any = false;
+    children_.resize(stages_.size());
+    for (std::size_t i = 0; i < stages_.size(); ++i) {
+        Child& child = children_[i];
+
+        int next[2] = { -1, -1 };
+        int stage_out = out_fd;
+        if (i + 1 < stages_.size()) {
+            if (::pipe2(next, O_CLOEXEC) != 0) {
+                child.spawn_error = std::strerror(errno);
+                ::close(prev_read);
+                prev_read = -1;
+                break;
+            }
+            stage_out = next[1];
+        }
+        child.err_fd = anonymous_file();
+
+        posix_spawn_file_actions_t fa;
+        posix_spawn_file_actions_init(&fa);
+        posix_spawn_file_actions_adddup2(&fa, prev_read, 0);
+        posix_spawn_file_actions_adddup2(&fa, stage_out, 1);
+        if (child.err_fd >= 0)
+            posix_spawn_file_actions_adddup2(&fa, child.err_fd, 2);
+
+        std::vector<char*> argv;
+        for (auto& a : stages_[i].argv)
+            argv.push_back(const_cast<char*>(a.c_str()));
+        argv.push_back(nullptr);
+
+        int rc = ::posix_spawnp(&child.pid, argv[0], &fa, &attr,
+                                argv.data(), environ);
+        posix_spawn_file_actions_destroy(&fa);
+        if (rc != 0) {
+            child.pid = -1;
+            child.spawn_error = std::strerror(rc);
+        } else {
+            any = true;
+        }
+
+        ::close(prev_read);
+        if (next[1] >= 0)
+            ::close(next[1]);
+        prev_read = next[0];
+    }
+    if (prev_read >= 0)
+        ::close(prev_read);
+    posix_spawnattr_destroy(&attr);
+    return any;
+}
+
+int Pipeline::wait()
+{
+    if (in_fd_ >= 0) {
+        ::close(in_fd_);
+        in_fd_ = -1;
+    }
+
+    int rc = 0;
+    for (auto& c : children_) {
+        if (c.pid > 0) {
+            while (::waitpid(c.pid, &c.status, 0) < 0 && errno == EINTR)
+                ;
+            c.pid = 0;
+        }
+        if (!c.spawn_error.empty()
+            || !WIFEXITED(c.status) || WEXITSTATUS(c.status) != 0)
+            rc = 1;
+    }
+    return rc;
+}
+
+void Pipeline::report(std::ostream& out, const std::string& label) const
+{
+    for (std::size_t i = 0; i < children_.size(); ++i) {
+        const Child& c = children_[i];
+        const std::string prefix = "pplua: " + label + ": "
+                                 + stages_[i].argv[0] + ": ";
+
+        if (!c.spawn_error.empty()) {
+            out << prefix << "cannot run '" << stages_[i].text << "': "
+                << c.spawn_error << '\n';
+            continue;
+        }
+
+        std::string err;
+        if (c.err_fd >= 0) {
+            char buf[4096];
+            ssize_t n;
+            for (off_t off = 0;
+                 (n = ::pread(c.err_fd, buf, sizeof buf, off)) > 0;
+                 off += n)
+                err.append(buf, static_cast<std::size_t>(n));
+        }
+
+        if (WIFSIGNALED(c.status))
+            out << prefix << "killed by signal " << WTERMSIG(c.status)
+                << " (" << ::strsignal(WTERMSIG(c.status)) << ")\n";
+        else if (WIFEXITED(c.status) && WEXITSTATUS(c.status) != 0)
+            out << prefix << "exit status " << WEXITSTATUS(c.status) << '\n';
+
+        std::size_t pos = 0;
+        while (pos < err.size()) {
+            std::size_t nl = err.find('\n', pos);
+            if (nl == std::string::npos)
+                nl = err.size();
+            out << prefix << std::string_view(err).substr(pos, nl - pos)
+                << '\n';
+            pos = nl + 1;
+        }
+    }
+}
+
+// =================================================================
+//  FdOutBuf
+// =================================================================
+
+FdOutBuf::FdOutBuf(int fd) : fd_(fd)
+{
+    setp(buf_, buf_ + sizeof buf_);
+}
+
+FdOutBuf::~FdOutBuf()
+{
+    sync();
+}
+
+bool FdOutBuf::write_all(const char* p, std::size_t n)
+{
+    while (n > 0 && !failed_) {
+        ssize_t w = ::write(fd_, p, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            failed_ = true;         // EPIPE: the reader has gone
+            break;
+        }
+        p += w;
+        n -= static_cast<std::size_t>(w);
+    }
+    return !failed_;
+}
+
+FdOutBuf::int_type FdOutBuf::overflow(int_type ch)
+{
+    if (sync() != 0)
+        return traits_type::eof();
+    if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+std::streamsize FdOutBuf::xsputn(const char* s, std::streamsize n)
+{
+    // Large writes bypass the buffer.
+    if (n > epptr() - pptr()) {
+        if (sync() != 0 || !write_all(s, static_cast<std::size_t>(n)))
+            return 0;
+        return n;
+    }
+    std::memcpy(pptr(), s, static_cast<std::size_t>(n));
+    pbump(static_cast<int>(n));
+    return n;
+}
+
+int FdOutBuf::sync()
+{
+    std::size_t n = static_cast<std::size_t>(pptr() - pbase());
+    setp(buf_, buf_ + sizeof buf_);
+    return write_all(buf_, n) ? 0 : -1;
+}
+
+} // namespace pplua
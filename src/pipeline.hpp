@@ -0,0 +1,106 @@
+// src/pipeline.hpp
+//
+// --pipe: run the downstream stages of the groff pipeline (tbl, eqn,
+// groff, …) as child processes and feed them pplua's output while it
+// is being produced.
+
+#ifndef PPLUA_PIPELINE_HPP
+#define PPLUA_PIPELINE_HPP
+
+#include <iosfwd>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+namespace pplua {
+
+// =====================================================================
+//  Pipeline specification
+// =====================================================================
+struct PipeStage {
+    std::string              text;   // as written, for reports
+    std::vector<std::string> argv;
+};
+
+/// Split a specification such as "tbl | groff -ms -Tpdf" into
+/// stages.  Words may be quoted with '…' or "…" and characters
+/// escaped with a backslash; there is no other shell syntax.
+/// Returns false and sets `error` if the specification is malformed.
+bool parse_pipeline(const std::string& spec,
+                    std::vector<PipeStage>& stages,
+                    std::string& error);
+
+// =====================================================================
+//  Pipeline — one running instance
+//
+//  Stages are started with posix_spawnp and joined by pipes, so data
+//  flows from one stage to the next without passing through pplua.
+//  Each stage's stderr goes to its own unlinked temporary file and is
+//  read back for the report.
+// =====================================================================
+class Pipeline {
+public:
+    explicit Pipeline(std::vector<PipeStage> stages);
+    ~Pipeline();
+
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    /// Start every stage, the last one writing to `out_fd`.
+    /// Returns false if no stage could be started.
+    bool start(int out_fd);
+
+    /// Write end of the first stage's stdin.
+    int input_fd() const { return in_fd_; }
+
+    /// Close the input and wait for every stage.  Returns 0 if all
+    /// of them exited with status 0.
+    int wait();
+
+    /// Append a report on every stage that failed or wrote to its
+    /// stderr, each line prefixed with "pplua: LABEL: ".
+    void report(std::ostream& out, const std::string& label) const;
+
+private:
+    struct Child {
+        pid_t       pid    = -1;
+        int         err_fd = -1;
+        int         status = 0;
+        std::string spawn_error;
+    };
+
+    std::vector<PipeStage> stages_;
+    std::vector<Child>     children_;
+    int                    in_fd_ = -1;
+};
+
+// =====================================================================
+//  FdOutBuf — a buffered std::streambuf over a file descriptor
+//
+//  A write error (EPIPE when a stage exits early) is remembered and
+//  further output is discarded.
+// =====================================================================
+class FdOutBuf : public std::streambuf {
+public:
+    explicit FdOutBuf(int fd);
+    ~FdOutBuf() override;
+
+    bool failed() const { return failed_; }
+
+protected:
+    int_type        overflow(int_type ch) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+    int             sync() override;
+
+private:
+    int  fd_;
+    bool failed_ = false;
+    char buf_[1 << 16];
+
+    bool write_all(const char* p, std::size_t n);
+};
+
+} // namespace pplua
+
+#endif // PPLUA_PIPELINE_HPP
@@ -4,13 +4,21 @@
 // inline expansion, and output assembly.
 
 #include "pplua.hpp"
+#include "compat.hpp"
+#include "compile.hpp"
+#include "peephole.hpp"
 
 #include <iostream>
 #include <fstream>
-#include <sstream>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <charconv>
 #include <regex>
+#include <cctype>
+#include <chrono>
+#include <thread>
 
 namespace pplua {
 
@@ -20,36 +28,210 @@ namespace pplua {
 
 Preprocessor::Preprocessor(const Config& cfg)
     : cfg_(cfg)
-    , lua_()
+    , gc_(cfg_.gc)
     , output_()
     , lroff_(output_)
 {
-    // Open standard Lua libraries.
-    lua_.open_libraries(
+    // The Lua state is created lazily: see start().
+
+    // Long library output (lroff.table_csv) is written out as it
+    // grows when the output is being streamed.
+    lroff_.set_flush_hook([this]{ if (sink_) drain(*sink_); });
+}
+
+Preprocessor::~Preprocessor()
+{
+    // Finalizers run while the state closes; the sentinel must not
+    // plant another one then.
+    gc_.detach();
+}
+
+// =================================================================
+//  start — bring up the Lua state in phases
+// =================================================================
+
+namespace {
+
+struct LazyLib {
+    const char*   name;
+    lua_CFunction open;
+};
+
+// Make each library appear on first access (or on require).  Its
+// global is a stub table that fills itself with the library's fields
+// the first time it is read, written or iterated.  _G keeps no
+// metatable of ours, so that a preamble may set its own (strict mode
+// and the like).
+void open_lazily(sol::state& lua, std::initializer_list<LazyLib> libs)
+{
+    lua_State* L = lua.lua_state();
+    sol::table openers = lua.create_table();
+    openers.push();
+    for (auto& lib : libs) {
+        lua_pushcfunction(L, lib.open);
+        lua_setfield(L, -2, lib.name);
+    }
+    lua_pop(L, 1);
+
+    sol::protected_function install = lua.load(R"lua(
+        local openers = ...
+        local loaded, preload = package.loaded, package.preload
+        local next, rawget, rawset, setmetatable =
+              next, rawget, rawset, setmetatable
+        local stubs = {}
+
+        local function open(name)
+            local stub = stubs[name]
+            if openers[name] then
+                local lib = openers[name](name)
+                openers[name] = nil
+                preload[name] = nil
+                setmetatable(stub, nil)
+                for k, v in next, lib do rawset(stub, k, v) end
+                loaded[name] = stub
+            end
+            return stub
+        end
+
+        for name in next, openers do
+            stubs[name] = setmetatable({}, {
+                __index = function(t, k)
+                    return rawget(open(name), k)
+                end,
+                __newindex = function(t, k, v)
+                    rawset(open(name), k, v)
+                end,
+                __pairs = function(t)
+                    return next, open(name), nil
+                end,
+            })
+            rawset(_G, name, stubs[name])
+            preload[name] = function() return open(name) end
+        end
+    )lua", "=pplua-lazy");
+    install(openers);
+}
+
+} // namespace
+
+bool Preprocessor::start()
+{
+    if (lua_)
+        return start_ok_;
+
+    open_state();
+    load_runtime();
+    start_ok_ = run_setup();
+    if (isolate_ && start_ok_)
+        snapshot_globals();
+    return start_ok_;
+}
+
+// Phase 1: the state and the libraries nearly every document uses.
+void Preprocessor::open_state()
+{
+#ifndef PPLUA_LUAJIT
+    // --stats counts the heap through our own allocator.
+    if (cfg_.gc.stats)
+        lua_ = std::make_unique<sol::state>(sol::default_at_panic,
+                                            &GcMonitor::allocate, &gc_);
+#endif
+    if (!lua_)
+        lua_ = std::make_unique<sol::state>();
+    sol::state& lua = *lua_;
+    gc_.attach(lua.lua_state());
+
+    lua.open_libraries(
         sol::lib::base,
         sol::lib::string,
         sol::lib::table,
         sol::lib::math,
-        sol::lib::io,
-        sol::lib::os,
-        sol::lib::package,
-        sol::lib::utf8
+        sol::lib::package
+#ifdef PPLUA_LUAJIT
+        , sol::lib::bit32
+        , sol::lib::jit
+#endif
     );
+#ifdef PPLUA_LUAJIT
+    open_lazily(lua, { {"io", luaopen_io}, {"os", luaopen_os} });
+#else
+    open_lazily(lua, { {"io",        luaopen_io},
+                       {"os",        luaopen_os},
+                       {"utf8",      luaopen_utf8},
+                       {"coroutine", luaopen_coroutine} });
+#endif
+    open_compat(lua);
 
     // Extend package.path if the user asked.
     if (!cfg_.lua_paths.empty()) {
-        std::string path = lua_["package"]["path"];
+        std::string path = lua["package"]["path"];
         for (auto& p : cfg_.lua_paths)
             path += ";" + p;
-        lua_["package"]["path"] = path;
+        lua["package"]["path"] = path;
+    }
+}
+
+// Phase 2: the lroff library and its (precompiled) prelude.
+void Preprocessor::load_runtime()
+{
+    lroff_.register_into(*lua_);
+    register_shell(*lua_, cfg_.shell_cache);
+    lua_->globals()["lroff"].get<sol::table>().set_function("parallel_map",
+        [this](sol::this_state s, sol::table items, const std::string& fn,
+               sol::variadic_args args) {
+            return parallel_map(s, items, fn, args);
+        });
+
+    // Dependency tracking must be in place before any user code.
+    if (cfg_.track_inputs)
+        tracker_.attach(*lua_);
+}
+
+// Phase 3: user set-up, in the documented order -D, -e, -l, after
+// the image if there is one.
+bool Preprocessor::run_setup()
+{
+    if (!cfg_.save_image.empty()) {
+        try {
+            take_image_baseline(lua_->lua_state());
+        } catch (const std::exception& e) {
+            std::cerr << "pplua: " << e.what() << '\n';
+            return false;
+        }
     }
 
-    // Register the lroff library.
-    lroff_.register_into(lua_);
+    if (!cfg_.image.empty() && !restore_image())
+        return false;
 
-    // Run preamble files.
-    for (auto& pf : cfg_.preamble_files) {
-        auto result = lua_.safe_script_file(pf,
+    return run_steps(cfg_.defines, cfg_.exec_chunks, cfg_.preamble_files);
+}
+
+bool Preprocessor::run_steps(
+    const std::vector<std::pair<std::string, std::string>>& defines,
+    const std::vector<std::string>& chunks,
+    const std::vector<std::string>& files)
+{
+    sol::state& lua = *lua_;
+
+    for (auto& [name, value] : defines) {
+        lua[name] = value;
+        ran_.defines.emplace_back(name, value);
+    }
+
+    for (auto& code : chunks) {
+        ran_.exec_chunks.push_back(code);
+        auto result = lua.safe_script(code,
+            sol::script_pass_on_error, "@-e");
+        if (!result.valid()) {
+            sol::error err = result;
+            std::cerr << "pplua: -e: " << err.what() << '\n';
+            return false;
+        }
+    }
+
+    for (auto& pf : files) {
+        ran_.preamble_files.push_back(pf);
+        auto result = lua.safe_script_file(pf,
             sol::script_pass_on_error);
         if (!result.valid()) {
             sol::error err = result;
@@ -57,27 +239,341 @@ Preprocessor::Preprocessor(const Config& cfg)
                       << pf << "': " << err.what() << '\n';
         }
     }
+    return true;
 }
 
-Preprocessor::~Preprocessor() = default;
+bool Preprocessor::restore_image()
+{
+    lua_State*  L = lua_->lua_state();
+    ImageSetup  setup;
+    ImageExtras extras;
+    std::string stale;
+    bool        current;
+
+    try {
+        current = read_image(L, cfg_.image, setup, extras, stale);
+    } catch (const std::exception& e) {
+        std::cerr << "pplua: " << e.what() << '\n';
+        return false;
+    }
+
+    // The image stands for its preambles: a cached run depends on
+    // them as much as on the image.
+    if (cfg_.track_inputs) {
+        tracker_.note_file(cfg_.image);
+        for (auto& pf : setup.preamble_files)
+            tracker_.note_file(pf);
+    }
+
+    if (!current) {
+        std::cerr << "pplua: warning: image '" << cfg_.image
+                  << "' is stale (" << stale << "); running its preambles\n";
+        return run_steps(setup.defines, setup.exec_chunks,
+                         setup.preamble_files);
+    }
+
+    sol::table requests = sol::stack::pop<sol::table>(L);
+    for (auto& [name, fn] : requests)
+        lroff_.requests()[name.as<std::string>()] =
+            fn.as<sol::protected_function>();
+
+    output_.write(extras.output);
+    auto& state = lroff_.state();
+    for (auto& [name, value] : extras.number_registers)
+        state.number_registers[name] = value;
+    for (auto& [name, value] : extras.string_registers)
+        state.string_registers[name] = value;
+
+    ran_.defines.insert(ran_.defines.end(),
+                        setup.defines.begin(), setup.defines.end());
+    ran_.exec_chunks.insert(ran_.exec_chunks.end(),
+                            setup.exec_chunks.begin(), setup.exec_chunks.end());
+    ran_.preamble_files.insert(ran_.preamble_files.end(),
+                               setup.preamble_files.begin(),
+                               setup.preamble_files.end());
+    return true;
+}
+
+bool Preprocessor::save_image()
+{
+    ensure_lua();
+    if (lroff_.has_deferred()) {
+        std::cerr << "pplua: --save-image: the setup called lroff.defer,"
+                     " which an image cannot hold\n";
+        return false;
+    }
+
+    lua_State* L = lua_->lua_state();
+    sol::table requests = lua_->create_table();
+    for (auto& [name, fn] : lroff_.requests())
+        requests[name] = fn;
+
+    auto& state = lroff_.state();
+    ImageExtras extras;
+    extras.output           = output_.contents();
+    extras.number_registers = state.number_registers;
+    extras.string_registers = state.string_registers;
+
+    requests.push();
+    try {
+        write_image(L, -1, ran_, extras, cfg_.save_image);
+    } catch (const std::exception& e) {
+        lua_pop(L, 1);
+        std::cerr << "pplua: " << e.what() << '\n';
+        return false;
+    }
+    lua_pop(L, 1);
+    return true;
+}
 
 // =================================================================
-//  exec_lua — run a Lua chunk, report errors
+//  begin_document — isolate the next document (batch mode)
 // =================================================================
 
+namespace {
+
+// Every table reachable from _G, with a copy of its entries and its
+// metatable; the function returned puts them all back, except that
+// modules a document required stay in package.loaded.  The lazily
+// opened libraries are opened first, or a document's first use of
+// one would be undone with nothing left to open it again.
+const char* const SNAPSHOT_LUA = R"lua(
+    local lazy = ...
+    for _, name in ipairs(lazy) do
+        if package.preload[name] then require(name) end
+    end
+
+    local next, type, rawget, rawset = next, type, rawget, rawset
+    local getmetatable, setmetatable, pcall = getmetatable, setmetatable, pcall
+
+    local loaded = package.loaded
+    local saved, queue, seen = {}, { _G }, { [_G] = true }
+    local function visit(x)
+        if type(x) == "table" and not seen[x] then
+            seen[x] = true
+            queue[#queue + 1] = x
+        end
+    end
+    local i = 1
+    while queue[i] do
+        local t = queue[i]
+        local copy, mt = {}, getmetatable(t)
+        for k, v in next, t do
+            copy[k] = v
+            visit(k)
+            visit(v)
+        end
+        visit(mt)
+        saved[t] = { copy, mt }
+        i = i + 1
+    end
+
+    return function()
+        for t, s in next, saved do
+            local copy, mt = s[1], s[2]
+            if t ~= loaded then
+                for k in next, t do
+                    if copy[k] == nil then rawset(t, k, nil) end
+                end
+            end
+            for k, v in next, copy do
+                if rawget(t, k) ~= v then rawset(t, k, v) end
+            end
+            if getmetatable(t) ~= mt then pcall(setmetatable, t, mt) end
+        end
+    end
+)lua";
+
+} // namespace
+
+void Preprocessor::snapshot_globals()
+{
+    sol::state& lua = *lua_;
+    sol::protected_function take = lua.load(SNAPSHOT_LUA, "=pplua-batch");
+    sol::protected_function_result r =
+        take(lua.create_table_with(1, "io", 2, "os", 3, "utf8",
+                                   4, "coroutine"));
+    if (!r.valid()) {
+        sol::error err = r;
+        std::cerr << "pplua: " << err.what() << '\n';
+        return;
+    }
+    restore_globals_ = r;
+}
+
+void Preprocessor::begin_document()
+{
+    // The environment itself is made in run_chunk() when the
+    // document first runs Lua code.
+    env_ = sol::environment();
+    isolate_ = true;
+    pure_blocks_ = 0;
+
+    // What the last document's calls into the shared globals changed
+    // is undone; a state started later is snapshot by start().
+    if (lua_ && start_ok_) {
+        if (!restore_globals_.valid()) {
+            snapshot_globals();
+        } else if (sol::protected_function_result r = restore_globals_();
+                   !r.valid()) {
+            sol::error err = r;
+            std::cerr << "pplua: " << err.what() << '\n';
+        }
+    }
+
+    output_.clear();
+    lroff_.reset();
+    gc_.begin_document();
+}
+
+sol::environment& Preprocessor::document_env()
+{
+    // A new table per document, with __index = _G: reads see the
+    // standard libraries, lroff and anything the preambles defined;
+    // writes stay in this document's table and die with it.
+    if (isolate_ && !env_.valid()) {
+        sol::state& lua = this->lua();
+        env_ = sol::environment(lua, sol::create, lua.globals());
+    }
+    return env_;
+}
+
+sol::protected_function_result
+Preprocessor::run_chunk(const std::string& code,
+                        const std::string& chunk_name)
+{
+    sol::state& lua = this->lua();
+
+    // Under --variants inline expressions share bytecode as blocks do.
+    if (cfg_.chunks) {
+        lua_State* L = lua.lua_state();
+        int status = cfg_.chunks->load(L, code, chunk_name);
+        if (status != LUA_OK)
+            return sol::protected_function_result(L, lua_absindex(L, -1),
+                1, 1, static_cast<sol::call_status>(status));
+        sol::protected_function fn(L, -1);
+        lua_pop(L, 1);
+        if (document_env().valid())
+            sol::set_environment(env_, fn);
+        return fn();
+    }
+
+    if (document_env().valid())
+        return lua.safe_script(code, env_,
+            sol::script_pass_on_error, chunk_name);
+    return lua.safe_script(code,
+        sol::script_pass_on_error, chunk_name);
+}
+
+// =================================================================
+//  exec_lua / exec_block — run a Lua chunk, report errors
+// =================================================================
+
+// The body of a .lua block, handed to lua_load one input line at a
+// time: the block is compiled as it is read and never held whole.
+struct Preprocessor::BlockSource {
+    std::istream&      in;
+    const std::string& close;
+    const std::string& file;
+    std::uint64_t&     line_no;
+    bool               check;           // Config::check_utf8
+    std::string        line;            // the line Lua is reading
+    bool               first_pending;   // `line` is code from the .lua line
+    bool               done   = false;
+    bool               closed = false;  // the closing delimiter was seen
+
+    BlockSource(std::istream& in, const std::string& close,
+                const std::string& file, std::uint64_t& line_no,
+                bool check, std::string first)
+        : in(in), close(close), file(file), line_no(line_no), check(check)
+        , line(std::move(first)), first_pending(!line.empty()) {}
+
+    static const char* read(lua_State*, void* ud, std::size_t* size)
+    {
+        auto* self = static_cast<BlockSource*>(ud);
+        if (self->first_pending) {
+            self->first_pending = false;
+        } else {
+            if (self->done)
+                return nullptr;
+            if (!std::getline(self->in, self->line)) {
+                self->done = true;
+                return nullptr;
+            }
+            ++self->line_no;
+            if (is_delimiter(self->line, self->close)) {
+                self->done = self->closed = true;
+                return nullptr;
+            }
+            if (self->check)
+                check_utf8(self->line, self->file, self->line_no);
+        }
+        self->line += '\n';
+        *size = self->line.size();
+        return self->line.data();
+    }
+
+    /// Consume what lua_load left unread (it stops at a syntax error).
+    void skip_rest()
+    {
+        std::size_t n;
+        while (read(nullptr, this, &n))
+            ;
+    }
+};
+
+sol::load_result Preprocessor::load_chunk(const std::string& code,
+                                          const std::string& chunk_name)
+{
+    if (!cfg_.chunks)
+        return lua().load(code, chunk_name);
+
+    lua_State* L = lua().lua_state();
+    int status = cfg_.chunks->load(L, code, chunk_name);
+    return sol::load_result(L, lua_absindex(L, -1), 1, 1,
+                            static_cast<sol::load_status>(status));
+}
+
 bool Preprocessor::exec_lua(const std::string& code,
                              const std::string& source_name,
-                             int source_line)
+                             std::uint64_t source_line)
 {
-    // Prefix the chunk with a line directive so that Lua error
-    // messages refer to the original source location.
-    // We use the @filename convention for chunk names.
-    std::string chunk_name = "@" + source_name + ":"
-                             + std::to_string(source_line);
+    sol::load_result chunk = load_chunk(code,
+        chunk_name_for(source_name, source_line));
+    return run_block(chunk, source_name, source_line);
+}
 
-    auto result = lua_.safe_script(code,
-        sol::script_pass_on_error, chunk_name);
+bool Preprocessor::exec_block(BlockSource& source,
+                              const std::string& source_name,
+                              std::uint64_t source_line)
+{
+    // With a shared cache the block is read whole first: its text
+    // is the key.
+    if (cfg_.chunks) {
+        std::string code;
+        const char* part;
+        std::size_t n;
+        while ((part = BlockSource::read(nullptr, &source, &n)))
+            code.append(part, n);
+        if (!source.closed)
+            return false;
+        return exec_lua(code, source_name, source_line);
+    }
+
+    sol::load_result chunk = lua().load(&BlockSource::read, &source,
+        chunk_name_for(source_name, source_line));
+    source.skip_rest();
 
+    // An unterminated block is not run; process() reports it.
+    if (!source.closed)
+        return false;
+    return run_block(chunk, source_name, source_line);
+}
+
+bool Preprocessor::finish_chunk(sol::protected_function_result& result,
+                                const std::string& source_name,
+                                std::uint64_t source_line)
+{
     if (!result.valid()) {
         sol::error err = result;
         std::cerr << "pplua: " << source_name
@@ -88,16 +584,434 @@ bool Preprocessor::exec_lua(const std::string& code,
 
     // If the chunk returned a value, and it is a string or number,
     // emit it (like LuaTeX's \directlua returning a string).
-    sol::object ret = result;
-    if (ret.is<std::string>()) {
-        output_.write(ret.as<std::string>());
-    } else if (ret.is<int>()) {
-        output_.write(std::to_string(ret.as<int>()));
-    } else if (ret.is<double>()) {
-        output_.write(std::to_string(ret.as<double>()));
+    write_chunk_value(output_, result);
+    return true;
+}
+
+// =================================================================
+//  run_block / resume — blocks that wait in lroff.await
+// =================================================================
+
+namespace {
+
+// The tasks a block passed to coroutine.yield (from lroff.await).
+std::vector<std::shared_ptr<AsyncTask>>
+yielded_tasks(const sol::protected_function_result& result)
+{
+    std::vector<std::shared_ptr<AsyncTask>> tasks;
+    for (int i = 0; i < result.return_count(); ++i)
+        if (auto t = to_async_task(result.lua_state(), result.stack_index() + i))
+            tasks.push_back(std::move(t));
+    return tasks;
+}
+
+} // namespace
+
+bool Preprocessor::run_block(sol::load_result& chunk,
+                             const std::string& source_name,
+                             std::uint64_t source_line)
+{
+    if (!chunk.valid()) {
+        sol::error err = chunk;
+        std::cerr << "pplua: " << source_name
+                  << ":" << source_line
+                  << ": lua error: " << err.what() << '\n';
+        return false;
+    }
+    sol::protected_function fn = chunk;
+    return run_function(fn, source_name, source_line);
+}
+
+bool Preprocessor::run_function(sol::protected_function& fn,
+                                const std::string& source_name,
+                                std::uint64_t source_line)
+{
+    if (document_env().valid())
+        sol::set_environment(env_, fn);
+
+    if (!spare_thread_.valid()) {
+        spare_thread_ = sol::thread::create(lua().lua_state());
+        mark_suspendable(spare_thread_.thread_state());
+    }
+    sol::coroutine co(spare_thread_.thread_state(), fn);
+    sol::protected_function_result result = co();
+
+    if (result.status() != sol::call_status::yielded) {
+        // A finished coroutine's thread can run the next block; one
+        // that failed is dead.
+        if (!result.valid())
+            spare_thread_ = sol::thread();
+        return finish_chunk(result, source_name, source_line);
+    }
+
+    Suspended s;
+    s.waiting = yielded_tasks(result);
+    s.thread  = std::move(spare_thread_);
+    s.co      = std::move(co);
+    s.before  = output_.take();
+    s.file    = source_name;
+    s.line    = source_line;
+    spare_thread_ = sol::thread();
+    suspended_.push_back(std::move(s));
+    return true;
+}
+
+void Preprocessor::resume(Suspended& s)
+{
+    // What the document wrote since belongs after the placeholder.
+    std::string after = output_.take();
+
+    sol::protected_function_result result = s.co();
+    if (result.status() == sol::call_status::yielded) {
+        s.waiting = yielded_tasks(result);
+    } else {
+        s.waiting.clear();
+        s.done = true;
+        finish_chunk(result, s.file, s.line);
+    }
+
+    s.text += output_.take();
+    // The placeholder is followed by the block's .lf.
+    if (s.done && !s.text.empty() && s.text.back() != '\n')
+        s.text += '\n';
+    output_.write(after);
+}
+
+void Preprocessor::resume_ready()
+{
+    // Pure blocks are finished in document order, so that their
+    // errors are reported as a serial run would report them.
+    bool pure_pending = false;
+    for (Suspended& s : suspended_) {
+        if (s.done)
+            continue;
+        if (s.job.valid()) {
+            if (!pure_pending && s.job.wait_for(std::chrono::seconds(0))
+                                 == std::future_status::ready)
+                finish_pure(s);
+            else
+                pure_pending = true;
+        } else if (std::all_of(s.waiting.begin(), s.waiting.end(),
+                               [](auto& t){ return t->ready(); })) {
+            resume(s);
+        }
+    }
+}
+
+void Preprocessor::settle()
+{
+    for (Suspended& s : suspended_) {
+        if (s.job.valid()) {
+            finish_pure(s);
+            continue;
+        }
+        while (!s.done) {
+            for (auto& t : s.waiting)
+                t->wait();
+            resume(s);
+        }
+    }
+}
+
+void Preprocessor::checkpoint()
+{
+    if (!suspended_.empty())
+        resume_ready();
+    if (sink_)
+        drain(*sink_);
+}
+
+// =================================================================
+//  run_pure — `.lua pure` blocks on the worker pool
+// =================================================================
+
+bool Preprocessor::run_pure(BlockSource& source,
+                            const std::vector<std::string>& pass,
+                            const std::string& source_name,
+                            std::uint64_t source_line)
+{
+    std::string code;
+    std::size_t n;
+    while (const char* p = BlockSource::read(nullptr, &source, &n))
+        code.append(p, n);
+    if (!source.closed)
+        return false;
+    return submit_pure(std::move(code), pass, source_name, source_line);
+}
+
+bool Preprocessor::submit_pure(std::string code,
+                               const std::vector<std::string>& pass,
+                               const std::string& source_name,
+                               std::uint64_t source_line)
+{
+    PureJob job;
+    job.code       = std::move(code);
+    job.chunk_name = chunk_name_for(source_name, source_line);
+    job.unique_tag = "p" + std::to_string(++pure_blocks_) + "_";
+
+    // Copies of the globals the block asks for, as they are now.
+    if (!pass.empty()) {
+        lua_State* L = lua().lua_state();
+        int top = lua_gettop(L);
+        for (auto& name : pass) {
+            if (document_env().valid())
+                env_.push();
+            else
+                lua().globals().push();
+            lua_getfield(L, -1, name.c_str());
+            try {
+                job.globals.emplace_back(name, LuaValue::copy(L, -1));
+            } catch (const std::exception& e) {
+                lua_settop(L, top);
+                std::cerr << "pplua: " << source_name
+                          << ":" << source_line
+                          << ": error: cannot pass '" << name
+                          << "' to a pure block: " << e.what() << '\n';
+                return false;
+            }
+            lua_settop(L, top);
+        }
+    }
+
+    if (!workers_) {
+        WorkerSetup setup;
+        setup.defines      = cfg_.defines;
+        setup.lua_paths    = cfg_.lua_paths;
+        setup.track_inputs = cfg_.track_inputs;
+        workers_ = std::make_unique<WorkerPool>(std::move(setup),
+                                                worker_threads());
     }
-    // nil / table / function / etc. are silently ignored.
 
+    Suspended s;
+    s.job    = workers_->submit(std::move(job));
+    s.before = output_.take();
+    s.file   = source_name;
+    s.line   = source_line;
+    suspended_.push_back(std::move(s));
+    return true;
+}
+
+void Preprocessor::finish_pure(Suspended& s)
+{
+    try {
+        PureResult r = s.job.get();
+        if (!r.error.empty())
+            std::cerr << "pplua: " << s.file
+                      << ":" << s.line
+                      << ": lua error: " << r.error << '\n';
+        s.text = std::move(r.output);
+
+        for (auto& f : r.files)
+            tracker_.note_file(f);
+        for (auto& e : r.env)
+            tracker_.note_env(e);
+        if (!r.uncacheable.empty())
+            tracker_.mark_uncacheable(r.uncacheable);
+    } catch (const std::exception& e) {
+        std::cerr << "pplua: " << s.file
+                  << ":" << s.line
+                  << ": error: pure block: " << e.what() << '\n';
+    }
+    s.done = true;
+}
+
+unsigned Preprocessor::worker_threads() const
+{
+    return cfg_.pure_jobs >= 0
+        ? static_cast<unsigned>(cfg_.pure_jobs)
+        : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// =================================================================
+//  parallel_map — lroff.parallel_map on the map pool
+// =================================================================
+
+sol::table Preprocessor::parallel_map(sol::this_state s, sol::table items,
+                                      const std::string& fn,
+                                      sol::variadic_args args)
+{
+    lua_State* L = s;
+
+    // Items and arguments are copied out here and into the workers'
+    // states there: only plain data can cross.
+    std::vector<LuaValue> values;
+    const std::size_t n = items.size();
+    values.reserve(n);
+    items.push(L);
+    for (std::size_t i = 1; i <= n; ++i) {
+        lua_rawgeti(L, -1, static_cast<lua_Integer>(i));
+        try {
+            values.push_back(LuaValue::copy(L, -1));
+        } catch (const std::exception& e) {
+            lua_pop(L, 2);
+            throw std::runtime_error("parallel_map: item "
+                                     + std::to_string(i)
+                                     + ": cannot pass " + e.what());
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    std::vector<LuaValue> extra;
+    for (auto a : args) {
+        try {
+            extra.push_back(LuaValue::copy(L, a.stack_index()));
+        } catch (const std::exception& e) {
+            throw std::runtime_error(std::string("parallel_map: cannot pass ")
+                                     + e.what());
+        }
+    }
+
+    // The workers replay the setup this state ran, so the functions
+    // the preambles define are there too.
+    if (!map_pool_) {
+        MapSetup setup;
+        setup.defines        = ran_.defines;
+        setup.exec_chunks    = ran_.exec_chunks;
+        setup.preamble_files = ran_.preamble_files;
+        setup.lua_paths      = cfg_.lua_paths;
+        setup.track_inputs   = cfg_.track_inputs;
+        setup.shell_cache    = cfg_.shell_cache;
+        map_pool_ = std::make_unique<MapPool>(std::move(setup),
+                                              worker_threads());
+    }
+    MapResult r = map_pool_->map(fn, values, extra);
+
+    for (auto& f : r.files)
+        tracker_.note_file(f);
+    for (auto& e : r.env)
+        tracker_.note_env(e);
+    if (!r.uncacheable.empty())
+        tracker_.mark_uncacheable(r.uncacheable);
+
+    if (r.failed)
+        throw std::runtime_error("parallel_map: item "
+                                 + std::to_string(r.failed) + ": " + r.error);
+
+    lua_createtable(L, static_cast<int>(r.values.size()), 0);
+    for (std::size_t i = 0; i < r.values.size(); ++i) {
+        r.values[i].push(L);
+        lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+    }
+    return sol::stack::pop<sol::table>(L);
+}
+
+// =================================================================
+//  dispatch_request — .NAME lines bound with lroff.define_request
+// =================================================================
+
+namespace {
+
+// Split request arguments the way groff does: blanks separate them,
+// and an argument that starts with " runs to the next lone ", with
+// "" standing for a literal quote.
+std::vector<std::string> split_request_args(const std::string& s)
+{
+    std::vector<std::string> args;
+    std::size_t i = 0;
+    for (;;) {
+        while (i < s.size() && (s[i] == ' ' || s[i] == '\t'))
+            ++i;
+        if (i >= s.size())
+            return args;
+
+        std::string arg;
+        if (s[i] == '"') {
+            for (++i; i < s.size(); ++i) {
+                if (s[i] == '"') {
+                    if (i + 1 < s.size() && s[i + 1] == '"') {
+                        arg += '"';
+                        ++i;
+                        continue;
+                    }
+                    ++i;
+                    break;
+                }
+                arg += s[i];
+            }
+        } else {
+            std::size_t end = s.find_first_of(" \t", i);
+            if (end == std::string::npos)
+                end = s.size();
+            arg.assign(s, i, end - i);
+            i = end;
+        }
+        args.push_back(std::move(arg));
+    }
+}
+
+// Make `env` the _ENV of the function at `index`, found by the
+// upvalue's name; false if it has none.
+bool set_env_upvalue(lua_State* L, int index, const sol::environment& env)
+{
+    index = lua_absindex(L, index);
+    for (int i = 1; const char* name = lua_getupvalue(L, index, i); ++i) {
+        lua_pop(L, 1);
+        if (std::strcmp(name, "_ENV") == 0) {
+            env.push(L);
+            lua_setupvalue(L, index, i);
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+bool Preprocessor::dispatch_request(const std::string& line)
+{
+    if (line.empty() || (line[0] != '.' && line[0] != '\''))
+        return false;
+    std::size_t name_start = line.find_first_not_of(" \t", 1);
+    if (name_start == std::string::npos)
+        return false;
+    std::size_t name_end = line.find_first_of(" \t", name_start);
+    if (name_end == std::string::npos)
+        name_end = line.size();
+
+    const sol::protected_function* bound =
+        lroff_.find_request(line.substr(name_start, name_end - name_start));
+    if (!bound)
+        return false;
+
+    // Hold our own reference: the function may rebind its own name.
+    sol::protected_function fn = *bound;
+
+    // A chunk bound as it was loaded (macro_define_lua) has an _ENV of
+    // its own: it runs in the document's, as a block would.
+    if (document_env().valid()) {
+        lua_State* L = fn.lua_state();
+        lua_Debug ar;
+        fn.push(L);
+        lua_getinfo(L, ">S", &ar);
+        if (std::strcmp(ar.what, "main") == 0) {
+            fn.push(L);
+            set_env_upvalue(L, -1, env_);
+            lua_pop(L, 1);
+        }
+    }
+    std::vector<std::string> args =
+        split_request_args(expand_inline(line.substr(name_end)));
+
+    std::size_t lines_before = output_.lines();
+    sol::protected_function_result result = fn(sol::as_args(args));
+    if (!result.valid()) {
+        sol::error err = result;
+        std::cerr << "pplua: " << current_file_
+                  << ":" << current_line_
+                  << ": lua error in ." << line.substr(name_start,
+                                                       name_end - name_start)
+                  << ": " << err.what() << '\n';
+    } else {
+        write_chunk_value(output_, result);
+    }
+
+    // The request line stands for whole lines of output.  If it did
+    // not become exactly one, tell groff where the source resumes.
+    if (!output_.at_bol())
+        output_.blank_line();
+    if (output_.lines() - lines_before != 1)
+        emit_lf(current_line_ + 1, current_file_);
     return true;
 }
 
@@ -105,7 +1019,7 @@ bool Preprocessor::exec_lua(const std::string& code,
 //  expand_inline — process \lua'…' on a single line
 // =================================================================
 
-std::string Preprocessor::expand_inline(const std::string& line)
+const std::string& Preprocessor::expand_inline(const std::string& line)
 {
     const std::string& open = cfg_.inline_open;
     const char          close = cfg_.inline_close;
@@ -115,8 +1029,8 @@ std::string Preprocessor::expand_inline(const std::string& line)
     if (line.find(open) == std::string::npos)
         return line;
 
-    std::string result;
-    result.reserve(line.size());
+    std::string& result = expanded_;
+    result.clear();
 
     std::size_t pos = 0;
     while (pos < line.size()) {
@@ -134,25 +1048,9 @@ std::string Preprocessor::expand_inline(const std::string& line)
         // Skip past the open delimiter.
         std::size_t expr_start = start + open.size();
 
-        // Find the matching close delimiter, respecting nesting
-        // of the same character for single-character delimiters.
-        // For the default case (\lua'…'), we simply find the next
-        // unescaped close character.
-        std::size_t expr_end = std::string::npos;
-        int depth = 1;
-        for (std::size_t i = expr_start; i < line.size(); ++i) {
-            if (line[i] == '\\' && i + 1 < line.size()) {
-                ++i;  // skip escaped character
-                continue;
-            }
-            if (line[i] == close) {
-                --depth;
-                if (depth == 0) {
-                    expr_end = i;
-                    break;
-                }
-            }
-        }
+        // Find the close delimiter: the next unescaped close
+        // character.
+        std::size_t expr_end = find_inline_end(line, expr_start, close);
 
         if (expr_end == std::string::npos) {
             // Unterminated inline expression — pass through verbatim.
@@ -163,18 +1061,21 @@ std::string Preprocessor::expand_inline(const std::string& line)
             break;
         }
 
-        // Extract the Lua expression.
-        std::string expr = line.substr(expr_start,
-                                        expr_end - expr_start);
+        // Wrap the expression in "return tostring(…)" so that its
+        // value is captured.
+        inline_code_.assign("return tostring(");
+        inline_code_.append(line, expr_start, expr_end - expr_start);
+        inline_code_ += ')';
 
-        // Wrap in "return (…)" so that the expression's value
-        // is captured.
-        std::string chunk = "return tostring(" + expr + ")";
+        char num[24];
+        auto nr = std::to_chars(num, num + sizeof num, current_line_);
+        inline_name_.assign("@");
+        inline_name_ += current_file_;
+        inline_name_ += ':';
+        inline_name_.append(num, nr.ptr);
+        inline_name_ += ":inline";
 
-        auto lua_result = lua_.safe_script(chunk,
-            sol::script_pass_on_error,
-            "@" + current_file_ + ":" +
-                std::to_string(current_line_) + ":inline");
+        auto lua_result = run_chunk(inline_code_, inline_name_);
 
         if (lua_result.valid()) {
             sol::object obj = lua_result;
@@ -199,7 +1100,7 @@ std::string Preprocessor::expand_inline(const std::string& line)
 //  emit_lf — keep groff line numbers in sync
 // =================================================================
 
-void Preprocessor::emit_lf(int line, const std::string& file) {
+void Preprocessor::emit_lf(std::uint64_t line, const std::string& file) {
     if (cfg_.emit_lf)
         output_.writeln(".lf " + std::to_string(line)
                         + " " + file);
@@ -223,95 +1124,67 @@ int Preprocessor::process(std::istream& in,
     current_file_ = filename;
     current_line_ = 0;
 
-    bool in_lua_block = false;
-    int  lua_block_start = 0;
-    std::ostringstream lua_buf;
-
     std::string line;
+    std::string rest;
     while (std::getline(in, line)) {
         ++current_line_;
+        if (cfg_.check_utf8)
+            check_utf8(line, filename, current_line_);
 
-        if (in_lua_block) {
-            // ---- inside a .lua … .endlua block ----
-
-            // Check for the closing delimiter.
-            // We trim leading whitespace for the comparison, but
-            // the canonical form is exactly ".endlua" at column 0.
-            std::string trimmed = line;
-            // Strip leading whitespace.
-            auto first = trimmed.find_first_not_of(" \t");
-            if (first != std::string::npos)
-                trimmed = trimmed.substr(first);
-
-            if (trimmed == cfg_.block_close
-                || trimmed.rfind(cfg_.block_close + " ", 0) == 0
-                || trimmed.rfind(cfg_.block_close + "\t", 0) == 0)
-            {
-                // End of Lua block.
-                in_lua_block = false;
-
-                std::string code = lua_buf.str();
-                lua_buf.str("");
-                lua_buf.clear();
-
-                exec_lua(code, filename, lua_block_start);
-
-                // Re-sync groff line counter.
-                emit_lf(current_line_ + 1, filename);
-            } else {
-                // Accumulate Lua source.
-                lua_buf << line << '\n';
-            }
-        } else {
-            // ---- outside a Lua block ----
-
-            // Check for block-open delimiter.
-            std::string trimmed = line;
-            auto first = trimmed.find_first_not_of(" \t");
-            if (first != std::string::npos)
-                trimmed = trimmed.substr(first);
-
-            if (trimmed == cfg_.block_open
-                || trimmed.rfind(cfg_.block_open + " ", 0) == 0
-                || trimmed.rfind(cfg_.block_open + "\t", 0) == 0)
-            {
-                // Start of a Lua block.
-                in_lua_block = true;
-                lua_block_start = current_line_ + 1;
-
-                // Anything after ".lua " on the same line is the
-                // first line of Lua code (convenience for one-liners).
-                std::string rest;
-                if (trimmed.size() > cfg_.block_open.size()) {
-                    rest = trimmed.substr(cfg_.block_open.size() + 1);
-                    // If the one-liner also contains .endlua, handle
-                    // that (unlikely but be safe):
-                    auto ec = rest.find(cfg_.block_close);
-                    if (ec != std::string::npos) {
-                        std::string code = rest.substr(0, ec);
-                        exec_lua(code, filename, current_line_);
-                        in_lua_block = false;
-                        emit_lf(current_line_ + 1, filename);
-                        continue;
-                    }
-                    lua_buf << rest << '\n';
-                }
+        if (!is_delimiter(line, cfg_.block_open, &rest)) {
+            // A request bound to a Lua function runs it directly.
+            if (lroff_.has_requests() && dispatch_request(line)) {
+                if (current_line_ % 256 == 0)
+                    checkpoint();
                 continue;
             }
 
             // Not a block delimiter — handle inline expressions
             // and pass through.
-            std::string expanded = expand_inline(line);
-            passthrough(expanded);
+            passthrough(expand_inline(line));
+
+            if (current_line_ % 256 == 0)
+                checkpoint();
+            continue;
         }
-    }
 
-    // Check for unterminated block.
-    if (in_lua_block) {
-        std::cerr << "pplua: " << filename
-                  << ":" << lua_block_start
-                  << ": error: unterminated .lua block\n";
-        return 1;
+        // ---- a .lua … .endlua block ----
+
+        // Anything after ".lua " on the same line is the first line
+        // of Lua code; if .endlua follows on it too, that is all.
+        auto ec = rest.find(cfg_.block_close);
+        if (ec != std::string::npos) {
+            exec_lua(rest.substr(0, ec), filename, current_line_);
+            gc_.after_block();
+            emit_lf(current_line_ + 1, filename);
+            checkpoint();
+            continue;
+        }
+
+        // `.lua pure NAME ...` runs on a worker, NAMEs passed in.
+        std::vector<std::string> pass;
+        const bool pure = is_pure(rest, pass);
+
+        const std::uint64_t block_start = current_line_ + 1;
+        BlockSource source(in, cfg_.block_close, filename, current_line_,
+                           cfg_.check_utf8,
+                           pure ? std::string() : std::move(rest));
+        if (pure)
+            run_pure(source, pass, filename, block_start);
+        else
+            exec_block(source, filename, block_start);
+        if (!source.closed) {
+            std::cerr << "pplua: " << filename
+                      << ":" << block_start
+                      << ": error: unterminated .lua block\n";
+            return 1;
+        }
+        gc_.after_block();
+
+        // Re-sync groff line counter.
+        emit_lf(current_line_ + 1, filename);
+
+        checkpoint();
     }
 
     return 0;
@@ -330,13 +1203,288 @@ int Preprocessor::process_file(const std::string& path) {
     return process(f, path);
 }
 
+// =================================================================
+//  run_compiled — render a document compiled ahead of time
+// =================================================================
+
+int Preprocessor::run_compiled(const std::string& bytes,
+                               const std::string& path)
+{
+    std::string filename, error;
+    std::size_t offset = 0;
+    if (!read_compiled_header(bytes, filename, offset, error)) {
+        std::cerr << "pplua: " << path << ": " << error << '\n';
+        return 1;
+    }
+
+    sol::state& lua = this->lua();
+    lua_State*  L   = lua.lua_state();
+    std::string name = "@" + filename;
+    if (luaL_loadbuffer(L, bytes.data() + offset, bytes.size() - offset,
+                        name.c_str()) != LUA_OK) {
+        std::cerr << "pplua: " << path << ": " << lua_tostring(L, -1) << '\n';
+        lua_pop(L, 1);
+        return 1;
+    }
+    if (document_env().valid() && !set_env_upvalue(L, -1, env_)) {
+        std::cerr << "pplua: " << path << ": the chunk has no _ENV\n";
+        lua_pop(L, 1);
+        return 1;
+    }
+    sol::protected_function doc(L, -1);
+    lua_pop(L, 1);
+
+    current_file_ = filename;
+    current_line_ = 0;
+
+    auto result = doc(
+        sol::make_object(lua, [this](std::uint64_t line, std::string_view text) {
+            compiled_text(line, text);
+        }),
+        sol::make_object(lua, [this](std::uint64_t line, const sol::object& raw,
+                                     sol::variadic_args parts) {
+            compiled_inline(line, raw, parts);
+        }),
+        sol::make_object(lua, [this](std::uint64_t first, std::uint64_t last,
+                                     sol::protected_function fn) {
+            compiled_block(first, last, std::move(fn));
+        }),
+        sol::make_object(lua, [this](std::uint64_t first, std::uint64_t last,
+                                     std::string code, sol::variadic_args names) {
+            compiled_pure(first, last, std::move(code), names);
+        }));
+    if (!result.valid()) {
+        sol::error err = result;
+        std::cerr << "pplua: " << current_file_ << ":" << current_line_
+                  << ": lua error: " << err.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+void Preprocessor::compiled_checkpoint(std::uint64_t from, std::uint64_t line)
+{
+    if (line / 256 > (from - 1) / 256)
+        checkpoint();
+}
+
+void Preprocessor::compiled_text(std::uint64_t line, std::string_view text)
+{
+    const std::uint64_t from = line;
+    if (!lroff_.has_requests()) {
+        // Every line of the run ends in a newline.
+        output_.write(text);
+        current_line_ = line - 1 + static_cast<std::uint64_t>(
+            std::count(text.begin(), text.end(), '\n'));
+    } else {
+        std::string one;
+        for (std::size_t pos = 0, nl; pos < text.size(); pos = nl + 1) {
+            nl = std::min(text.find('\n', pos), text.size());
+            one.assign(text.substr(pos, nl - pos));
+            current_line_ = line++;
+            if (!(lroff_.has_requests() && dispatch_request(one)))
+                passthrough(one);
+        }
+    }
+    compiled_checkpoint(from, current_line_);
+}
+
+void Preprocessor::compiled_inline(std::uint64_t line, const sol::object& raw,
+                                   sol::variadic_args parts)
+{
+    current_line_ = line;
+    if (lroff_.has_requests() && raw.is<std::string>()
+        && dispatch_request(raw.as<std::string>())) {
+        compiled_checkpoint(line, line);
+        return;
+    }
+
+    std::string& result = expanded_;
+    result.clear();
+    for (auto part : parts) {
+        if (part.get_type() == sol::type::string) {
+            result += part.as<std::string_view>();
+            continue;
+        }
+        sol::protected_function fn = part;
+        auto lua_result = fn();
+        if (lua_result.valid()) {
+            sol::object obj = lua_result;
+            if (obj.is<std::string>())
+                result += obj.as<std::string>();
+        } else {
+            sol::error err = lua_result;
+            std::cerr << "pplua: " << current_file_
+                      << ":" << current_line_
+                      << ": inline lua error: "
+                      << err.what() << '\n';
+        }
+    }
+    passthrough(result);
+    compiled_checkpoint(line, line);
+}
+
+void Preprocessor::compiled_block(std::uint64_t first, std::uint64_t last,
+                                  sol::protected_function fn)
+{
+    current_line_ = last;
+    run_function(fn, current_file_, first);
+    gc_.after_block();
+    emit_lf(last + 1, current_file_);
+    checkpoint();
+}
+
+void Preprocessor::compiled_pure(std::uint64_t first, std::uint64_t last,
+                                 std::string code, sol::variadic_args names)
+{
+    current_line_ = last;
+    std::vector<std::string> pass;
+    for (auto name : names)
+        pass.push_back(name.as<std::string>());
+    submit_pure(std::move(code), pass, current_file_, first);
+    gc_.after_block();
+    emit_lf(last + 1, current_file_);
+    checkpoint();
+}
+
 // =================================================================
 //  flush — write accumulated output to a stream
 // =================================================================
 
+void Preprocessor::drain(std::ostream& out)
+{
+    // Text after a placeholder waits for the block that owns it.
+    while (!suspended_.empty()) {
+        Suspended& s = suspended_.front();
+        release(out, s.before);
+        s.before.clear();
+        if (!s.done)
+            return;
+        release(out, s.text);
+        suspended_.pop_front();
+    }
+    output_.take_into(drained_);
+    release(out, drained_);
+}
+
+void Preprocessor::release(std::ostream& out, const std::string& text)
+{
+    if (filled_) {
+        write_out(out, fill_deferred(text, slots_));
+        return;
+    }
+    if (holding_) {
+        held_ += text;
+        return;
+    }
+    if (lroff_.has_deferred()) {
+        std::size_t slot = text.find('\0');
+        if (slot != std::string::npos) {
+            held_.assign(text, slot, std::string::npos);
+            holding_ = true;
+            write_out(out, std::string_view(text).substr(0, slot));
+            return;
+        }
+    }
+    write_out(out, text);
+}
+
+void Preprocessor::fill_slots()
+{
+    // What the functions write goes into their slots, not after
+    // whatever has not been drained yet.
+    std::string tail = output_.take();
+
+    // A deferred function may defer again, so the list can grow.
+    auto& fns = lroff_.deferred();
+    for (std::size_t i = 0; i < fns.size(); ++i) {
+        sol::protected_function fn = fns[i];
+        sol::protected_function_result result = fn();
+        if (!result.valid()) {
+            sol::error err = result;
+            std::cerr << "pplua: " << current_file_
+                      << ": lua error in lroff.defer: "
+                      << err.what() << '\n';
+        } else {
+            write_chunk_value(output_, result);
+        }
+        slots_.push_back(output_.take());
+    }
+
+    // A slot can only contain the markers of later slots.
+    for (std::size_t i = slots_.size(); i-- > 0; )
+        slots_[i] = fill_deferred(slots_[i], slots_);
+
+    output_.write(tail);
+    filled_ = true;
+}
+
+void Preprocessor::write_out(std::ostream& out, std::string_view text)
+{
+    if (!cfg_.optimize) {
+        put(out, text);
+        return;
+    }
+
+    // The peephole pass works on whole lines: hold back a partial one.
+    partial_.append(text);
+    std::size_t end = partial_.rfind('\n') + 1;  // 0 if there is none
+    optimized_.clear();
+    peephole_.feed_text(std::string_view(partial_).substr(0, end), optimized_);
+    partial_.erase(0, end);
+    put(out, optimized_);
+}
+
+void Preprocessor::put(std::ostream& out, std::string_view text, bool end)
+{
+    if (cfg_.whatis) {
+        whatis_.feed(text);
+        if (end)
+            whatis_.finish();
+    }
+    if (!cfg_.ascii_escape) {
+        out << text;
+        return;
+    }
+    escaped_.clear();
+    escaper_.feed(text, escaped_);
+    if (end)
+        escaper_.finish(escaped_);
+    out << escaped_;
+}
+
 void Preprocessor::flush(std::ostream& out) {
-    out << output_.contents();
-    output_.clear();
+    settle();
+    if (lroff_.has_deferred()) {
+        fill_slots();
+        write_out(out, fill_deferred(held_, slots_));
+        held_.clear();
+        holding_ = false;
+    }
+    drain(out);
+
+    slots_.clear();
+    filled_ = false;
+    lroff_.deferred().clear();
+    if (!cfg_.optimize) {
+        put(out, {}, true);
+        return;
+    }
+
+    std::string rest = std::move(partial_);
+    partial_.clear();
+    std::string optimized;
+    peephole_.feed_text(rest, optimized);
+    peephole_.finish(optimized);
+    // Keep a missing final newline missing.
+    if (!rest.empty() && !optimized.empty() && optimized.back() == '\n')
+        optimized.pop_back();
+    put(out, optimized, true);
+
+    lines_flushed_ += peephole_.lines_in();
+    lines_removed_ += peephole_.lines_in()
+                    - std::min(peephole_.lines_in(), peephole_.lines_out());
+    peephole_ = Peephole();
 }
 
 } // namespace pplua
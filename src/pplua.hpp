@@ -11,9 +11,22 @@
 #include <sol/sol.hpp>
 #include "output_buffer.hpp"
 #include "lroff.hpp"
+#include "cache.hpp"
+#include "peephole.hpp"
+#include "gc.hpp"
+#include "async.hpp"
+#include "workers.hpp"
+#include "utf8.hpp"
+#include "image.hpp"
+#include "whatis.hpp"
 
+#include <cstdint>
+#include <deque>
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
+#include <utility>
 #include <iosfwd>
 
 namespace pplua {
@@ -40,11 +53,60 @@ struct Config {
     // rather than processing them ourselves.
     bool pass_so = true;
 
+    // -D NAME=VALUE globals, set before any other Lua code runs.
+    std::vector<std::pair<std::string, std::string>> defines;
+
+    // -e chunks, run after the -D globals and before the preambles.
+    std::vector<std::string> exec_chunks;
+
     // Files to pre-execute before processing input (like a preamble).
     std::vector<std::string> preamble_files;
 
+    // --image: an image of the setup to restore before the -D, -e
+    // and -l above run.
+    std::string image;
+
+    // --save-image: where save_image() writes the image.  The
+    // baseline it is taken against is recorded on start-up.
+    std::string save_image;
+
+    // Where lroff.shell keeps command output (--shell-cache); empty
+    // to run every command.
+    std::string shell_cache;
+
     // Extra Lua package.path entries.
     std::vector<std::string> lua_paths;
+
+    // If true, run the emitted stream through the peephole
+    // optimizer (-O) before writing it out.
+    bool optimize = false;
+
+    // If true, record every file the run reads and every
+    // nondeterministic call it makes (for --cache-dir).
+    bool track_inputs = false;
+
+    // Collector mode, tuning and statistics (--gc*, --stats).
+    GcOptions gc;
+
+    // Worker threads for `.lua pure` blocks (--pure-jobs); -1 means
+    // one per hardware thread, 0 runs them on the main thread.
+    int pure_jobs = -1;
+
+    // If true, warn about input lines that are not well-formed UTF-8.
+    bool check_utf8 = true;
+
+    // If true, write every non-ASCII character as a groff escape,
+    // \[name] or \[uXXXX] (--ascii-escape).
+    bool ascii_escape = false;
+
+    // If true, index the .TH and NAME section of every manual page
+    // written out (--whatis-db).
+    bool whatis = false;
+
+    // Compiled blocks and inline expressions shared with other
+    // preprocessors rendering the same input (--variants); null to
+    // compile every chunk here.
+    std::shared_ptr<ChunkCache> chunks;
 };
 
 // =====================================================================
@@ -64,38 +126,290 @@ public:
     /// Process a named file.
     int process_file(const std::string& path);
 
-    /// Write all accumulated output to the given stream.
+    /// Render a document compiled with compile_document().  `bytes`
+    /// is the compiled file, `path` its name for messages.  Returns
+    /// 0 on success, non-zero on error.
+    int run_compiled(const std::string& bytes, const std::string& path);
+
+    /// Start a new, isolated document (batch mode).  Subsequent code
+    /// runs in a fresh _ENV whose reads fall back to the shared
+    /// globals, with fresh lroff document state and an empty output
+    /// buffer.  Preloaded modules and preamble definitions are shared;
+    /// the tables reachable from the globals are put back as they
+    /// were after the setup, so that changes made through them do not
+    /// outlive a document.  Local variables a preamble's functions
+    /// hold as upvalues are not put back.
+    void begin_document();
+
+    /// Write all accumulated output to the given stream, first
+    /// finishing any block still waiting in lroff.await and filling
+    /// the lroff.defer slots.  This ends the output stream (for -O,
+    /// a trailing .lf is dropped).
     void flush(std::ostream& out);
 
-    /// Access the Lua state (e.g. for running preamble scripts).
-    sol::state& lua() { return lua_; }
+    /// Write output to `out` while processing, after every Lua block
+    /// and every few hundred lines, instead of holding it all until
+    /// flush().  Pass nullptr to go back to buffering.
+    void stream_to(std::ostream* out) { sink_ = out; }
+
+    /// Bring the Lua state up now instead of on first use.
+    ///
+    /// Start-up runs in three phases: open the state and the
+    /// commonly used libraries (io, os, utf8 and coroutine are opened
+    /// on first access); register lroff and load its precompiled prelude;
+    /// then set -D globals and run -e chunks and preambles.  Input
+    /// without any Lua never gets this far unless start() is called.
+    /// Returns false if an -e chunk failed.
+    bool start();
+
+    /// Write the image of the setup to Config::save_image.  Returns
+    /// false, having reported why, if it cannot.
+    bool save_image();
+
+    /// Access the Lua state, starting it if necessary.
+    sol::state& lua() { ensure_lua(); return *lua_; }
+
+    /// Files read and determinism, when Config::track_inputs is set.
+    const InputTracker& tracker() const { return tracker_; }
+
+    /// With Config::optimize: lines flushed so far, and how many of
+    /// them the peephole pass removed.
+    std::size_t lines_flushed() const { return lines_flushed_; }
+    std::size_t lines_removed() const { return lines_removed_; }
+
+    /// With Config::whatis: the pages written out so far, leaving
+    /// none.
+    std::vector<WhatisEntry> take_whatis() { return whatis_.take(); }
+
+    /// With Config::gc.stats: write the current document's collector
+    /// statistics as one line.
+    void report_stats(std::ostream& out, const std::string& label) {
+        if (cfg_.gc.stats)
+            gc_.report(out, label);
+    }
 
 private:
     Config        cfg_;
-    sol::state    lua_;
+    GcMonitor     gc_;                  // outlives the state it watches
+    std::unique_ptr<sol::state> lua_;   // created by start()
+    bool          start_ok_ = true;
+    ImageSetup    ran_;                 // the setup run so far, for images
     OutputBuffer  output_;
     LroffLibrary  lroff_;
+    InputTracker  tracker_;
+
+    // Per-document globals in batch mode; invalid otherwise.
+    // Created on first use, so that Lua-free documents stay free.
+    sol::environment env_;
+    bool             isolate_ = false;
+    sol::protected_function restore_globals_;   // see snapshot_globals()
 
-    // Tracking for error messages.
+    // .lua blocks run as coroutines.  One that waits in lroff.await
+    // is set aside, and its place in the output held, until its
+    // tasks are done; the spare thread is reused until then.  A
+    // .lua pure block holds its place the same way until its worker
+    // is done with it.
+    struct Suspended {
+        sol::thread    thread;
+        sol::coroutine co;
+        std::vector<std::shared_ptr<AsyncTask>> waiting;
+        std::future<PureResult> job;    // valid for a pure block
+        std::string    before;          // output ahead of the placeholder
+        std::string    text;            // the block's output after it
+        std::string    file;
+        std::uint64_t  line = 0;
+        bool           done = false;
+    };
+    sol::thread           spare_thread_;
+    std::deque<Suspended> suspended_;
+
+    std::unique_ptr<WorkerPool> workers_;   // started by the first pure block
+    std::size_t                 pure_blocks_ = 0;
+    std::unique_ptr<MapPool>    map_pool_;  // started by the first parallel_map
+
+    // Progressive output (stream_to) and the -O pass over it.
+    std::ostream* sink_ = nullptr;
+    Peephole      peephole_;
+    std::string   partial_;             // -O: a line not yet complete
+    AsciiEscaper  escaper_;             // --ascii-escape
+    WhatisIndex   whatis_;              // --whatis-db
+
+    // lroff.defer: output from the first slot on is held back until
+    // the end of the document, when the slots are filled.
+    std::string              held_;
+    bool                     holding_ = false;
+    std::vector<std::string> slots_;
+    bool                     filled_  = false;
+    std::size_t   lines_flushed_ = 0;
+    std::size_t   lines_removed_ = 0;
+
+    // Scratch buffers the per-line path reuses, so that a line of
+    // plain text costs no allocation once they have grown.
+    std::string   drained_;             // drain(): output being released
+    std::string   optimized_;           // write_out(): -O output
+    std::string   escaped_;             // put(): --ascii-escape output
+    std::string   expanded_;            // expand_inline(): the line
+    std::string   inline_code_;         // expand_inline(): one chunk
+    std::string   inline_name_;         //   and its chunk name
+
+    // Tracking for error messages and .lf.
     std::string   current_file_;
-    int           current_line_ = 0;
+    std::uint64_t current_line_ = 0;
+
+    void ensure_lua() { if (!lua_) start(); }
+
+    // start() phases.
+    void open_state();
+    void load_runtime();
+    bool run_setup();
+
+    /// Set `defines`, then run `chunks` and `files`; record them in
+    /// ran_.  Returns false if a chunk failed.
+    bool run_steps(const std::vector<std::pair<std::string, std::string>>& defines,
+                   const std::vector<std::string>& chunks,
+                   const std::vector<std::string>& files);
+
+    /// Apply Config::image, or run its setup if it is stale.
+    bool restore_image();
+
+    /// lroff.parallel_map(items, fn, ...): fn called with every item
+    /// on the map pool; the results in order.
+    sol::table parallel_map(sol::this_state s, sol::table items,
+                            const std::string& fn, sol::variadic_args args);
+
+    /// Worker threads: Config::pure_jobs, or one per hardware thread.
+    unsigned worker_threads() const;
+
+    struct BlockSource;
+
+    /// Batch mode: remember the tables reachable from the globals,
+    /// for begin_document() to put back.
+    void snapshot_globals();
+
+    /// The environment code runs in: the document's own table in
+    /// batch mode (created on first use), invalid otherwise.
+    sol::environment& document_env();
+
+    /// Run a chunk in the current document's environment, compiled
+    /// through Config::chunks if there is one.
+    sol::protected_function_result run_chunk(const std::string& code,
+                                             const std::string& chunk_name);
+
+    /// Compile a chunk, through Config::chunks if there is one.
+    sol::load_result load_chunk(const std::string& code,
+                                const std::string& chunk_name);
 
     /// Execute a block of Lua code; errors are reported to stderr.
     /// Returns true on success.
     bool exec_lua(const std::string& code,
                   const std::string& source_name,
-                  int source_line);
+                  std::uint64_t source_line);
+
+    /// Execute a .lua block read straight from the input, up to and
+    /// including its closing delimiter.  An unterminated block is
+    /// compiled but not run.
+    bool exec_block(BlockSource& source,
+                    const std::string& source_name,
+                    std::uint64_t source_line);
+
+    /// Run a compiled block as a coroutine, or report why it did not
+    /// compile.  If it suspends in lroff.await, set it aside with a
+    /// placeholder in the output.
+    bool run_block(sol::load_result& chunk,
+                   const std::string& source_name,
+                   std::uint64_t source_line);
+
+    /// Run a block's function as run_block() runs a compiled chunk.
+    bool run_function(sol::protected_function& fn,
+                      const std::string& source_name,
+                      std::uint64_t source_line);
+
+    /// Hand a `.lua pure` block to a worker, with copies of the
+    /// globals `pass` names, and hold its place in the output.
+    bool run_pure(BlockSource& source,
+                  const std::vector<std::string>& pass,
+                  const std::string& source_name,
+                  std::uint64_t source_line);
+
+    /// The same, for a block already read.
+    bool submit_pure(std::string code,
+                     const std::vector<std::string>& pass,
+                     const std::string& source_name,
+                     std::uint64_t source_line);
+
+    // run_compiled(): what the chunk's __pplua_text, __pplua_inline,
+    // __pplua_block and __pplua_pure calls do, as process() does for
+    // the same lines.
+    void compiled_text(std::uint64_t line, std::string_view text);
+    void compiled_inline(std::uint64_t line, const sol::object& raw,
+                         sol::variadic_args parts);
+    void compiled_block(std::uint64_t first, std::uint64_t last,
+                        sol::protected_function fn);
+    void compiled_pure(std::uint64_t first, std::uint64_t last,
+                       std::string code, sol::variadic_args names);
+
+    /// After the lines up to `line`: checkpoint() if process() would
+    /// have passed a multiple of 256 since `from`.
+    void compiled_checkpoint(std::uint64_t from, std::uint64_t line);
+
+    /// Splice in a pure block's output and report its error.
+    void finish_pure(Suspended& s);
+
+    /// Resume a set-aside block, collecting what it writes into its
+    /// placeholder.
+    void resume(Suspended& s);
+
+    /// Resume every set-aside block whose tasks are done, and
+    /// finish the pure blocks that are, in document order.
+    void resume_ready();
+
+    /// Wait for and finish every set-aside block.
+    void settle();
+
+    /// Between blocks and every few hundred lines: resume what is
+    /// ready and, when streaming, write out what can be.
+    void checkpoint();
+
+    /// Report a chunk's error, or write its return value.
+    bool finish_chunk(sol::protected_function_result& result,
+                      const std::string& source_name,
+                      std::uint64_t source_line);
+
+    /// If `line` is a request bound with lroff.define_request, call
+    /// the function with the request's arguments and return true.
+    bool dispatch_request(const std::string& line);
 
     /// Expand inline \lua'…' expressions on a single line.
-    /// Returns the line with expressions replaced by their results.
-    std::string expand_inline(const std::string& line);
+    /// Returns the line with expressions replaced by their results:
+    /// `line` itself if it has none, otherwise a buffer that the
+    /// next call reuses.
+    const std::string& expand_inline(const std::string& line);
 
     /// Emit a .lf directive to keep groff's idea of line numbers
     /// in sync with the original source.
-    void emit_lf(int line, const std::string& file);
+    void emit_lf(std::uint64_t line, const std::string& file);
 
     /// Pass a non-Lua line through to the output.
     void passthrough(const std::string& line);
+
+    /// Write out every complete line accumulated so far, up to the
+    /// first placeholder still waiting.
+    void drain(std::ostream& out);
+
+    /// Pass `text` on to write_out(), holding it back from the first
+    /// lroff.defer slot until the slots are filled.
+    void release(std::ostream& out, const std::string& text);
+
+    /// Run the lroff.defer functions and record their slots.
+    void fill_slots();
+
+    /// Write `text` to `out`, through the -O pass if it is on.
+    void write_out(std::ostream& out, std::string_view text);
+
+    /// The last step of write_out(): escape `text` for
+    /// --ascii-escape, then write it.  `end` marks the end of the
+    /// output stream.
+    void put(std::ostream& out, std::string_view text, bool end = false);
 };
 
 } // namespace pplua
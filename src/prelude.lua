@@ -0,0 +1,78 @@
+-- src/prelude.lua
+--
+-- Pure-Lua convenience wrappers, defined on top of the C++ bindings
+-- in lroff.cpp.  Compiled to bytecode at build time (see
+-- tools/embed_bytecode.cpp) and loaded by LroffLibrary::register_into.
+
+-- formatted emit  (like C printf, uses string.format)
+function lroff.printf(fmt, ...)
+    lroff.emit(string.format(fmt, ...))
+end
+
+function lroff.printfln(fmt, ...)
+    lroff.emitln(string.format(fmt, ...))
+end
+
+-- apply fn(v) to every element; emit non-nil returns
+function lroff.map(tbl, fn)
+    for _, v in ipairs(tbl) do
+        local r = fn(v)
+        if r ~= nil then lroff.emitln(tostring(r)) end
+    end
+end
+
+-- call fn(k,v) for each pair (no output)
+function lroff.foreach(tbl, fn)
+    for k, v in pairs(tbl) do fn(k, v) end
+end
+
+-- scoped font change
+function lroff.with_font(f, fn)
+    lroff.font(f);  fn();  lroff.font_previous()
+end
+
+-- scoped size change
+function lroff.with_size(s, fn)
+    local old = lroff._state_ps or 10
+    lroff.size(s);  fn();  lroff.size(old)
+end
+
+-- emit a groff conditional:  .if cond \{ body \}
+function lroff.groff_if(cond, body)
+    lroff.emitln(".if " .. cond .. " \\{")
+    lroff.emitln(body)
+    lroff.emitln(".\\}")
+end
+
+-- emit a groff .while loop
+function lroff.groff_while(cond, body)
+    lroff.emitln(".while " .. cond .. " \\{")
+    lroff.emitln(body)
+    lroff.emitln(".\\}")
+end
+
+-- build a string from repeated calls (like table.concat)
+function lroff.concat(tbl, sep)
+    sep = sep or ""
+    local parts = {}
+    for _, v in ipairs(tbl) do parts[#parts+1] = tostring(v) end
+    return table.concat(parts, sep)
+end
+
+-- indent helper: emit .RS / block / .RE
+function lroff.indented(fn)
+    lroff.request("RS")
+    fn()
+    lroff.request("RE")
+end
+
+-- wait for lroff.async tasks and return their text, one value per
+-- argument.  In a .lua block the block is set aside until they are
+-- done, and the document goes on; elsewhere this blocks.
+function lroff.await(...)
+    local async = lroff.async
+    if async.suspendable() then
+        while not async.ready(...) do coroutine.yield(...) end
+    end
+    return async.result(...)
+end
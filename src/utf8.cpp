@@ -0,0 +1,360 @@
+// src/utf8.cpp
+//
+// UTF-8 validation and ASCII escaping.
+
+#include "utf8.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PPLUA_UTF8_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define PPLUA_UTF8_NEON 1
+#endif
+
+namespace pplua {
+
+namespace {
+
+enum class Decode { ok, truncated, invalid };
+
+// Decode the sequence at the start of `s` (non-empty, first byte
+// not ASCII) after Table 3-7 of the Unicode standard.  `len` is the
+// length of the sequence, or for an ill-formed one the bytes to skip
+// (its longest well-formed prefix, at least one).
+Decode decode(std::string_view s, std::size_t& len, char32_t& cp)
+{
+    const unsigned char c = static_cast<unsigned char>(s[0]);
+    unsigned char lo = 0x80, hi = 0xBF;     // the second byte's range
+
+    if (c >= 0xC2 && c <= 0xDF) {
+        len = 2;
+        cp  = c & 0x1F;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        len = 3;
+        cp  = c & 0x0F;
+        if (c == 0xE0) lo = 0xA0;           // overlong
+        if (c == 0xED) hi = 0x9F;           // surrogates
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        len = 4;
+        cp  = c & 0x07;
+        if (c == 0xF0) lo = 0x90;           // overlong
+        if (c == 0xF4) hi = 0x8F;           // above U+10FFFF
+    } else {
+        len = 1;
+        return Decode::invalid;
+    }
+
+    for (std::size_t i = 1; i < len; ++i) {
+        if (i == s.size())
+            return Decode::truncated;
+        const unsigned char d = static_cast<unsigned char>(s[i]);
+        if (d < lo || d > hi) {
+            len = i;
+            return Decode::invalid;
+        }
+        lo = 0x80;
+        hi = 0xBF;
+        cp = (cp << 6) | (d & 0x3F);
+    }
+    return Decode::ok;
+}
+
+// Classic groff names (groff_char(7)) for U+00A0 to U+00FF.
+const char* const LATIN1[96] = {
+    nullptr, "r!", "ct", "Po", "Cs", "Ye", "bb", "sc",      // A0
+    "ad",    "co", "Of", "Fo", "no", nullptr, "rg", "a-",   // A8
+    "de",    "+-", "S2", "S3", "aa", "mc", "ps", "pc",      // B0
+    "ac",    "S1", "Om", "Fc", "14", "12", "34", "r?",      // B8
+    "`A",    "'A", "^A", "~A", ":A", "oA", "AE", ",C",      // C0
+    "`E",    "'E", "^E", ":E", "`I", "'I", "^I", ":I",      // C8
+    "-D",    "~N", "`O", "'O", "^O", "~O", ":O", "mu",      // D0
+    "/O",    "`U", "'U", "^U", ":U", "'Y", "TP", "ss",      // D8
+    "`a",    "'a", "^a", "~a", ":a", "oa", "ae", ",c",      // E0
+    "`e",    "'e", "^e", ":e", "`i", "'i", "^i", ":i",      // E8
+    "Sd",    "~n", "`o", "'o", "^o", "~o", ":o", "di",      // F0
+    "/o",    "`u", "'u", "^u", ":u", "'y", "Tp", ":y",      // F8
+};
+
+struct Glyph {
+    char32_t    cp;
+    const char* name;
+};
+
+// Beyond Latin-1, sorted by code point.
+const Glyph GLYPHS[] = {
+    { 0x0131, ".i" }, { 0x0141, "/L" }, { 0x0142, "/l" },
+    { 0x0152, "OE" }, { 0x0153, "oe" }, { 0x0160, "vS" },
+    { 0x0161, "vs" }, { 0x0178, ":Y" }, { 0x017D, "vZ" },
+    { 0x017E, "vz" }, { 0x0192, "Fn" },
+    { 0x0391, "*A" }, { 0x0392, "*B" }, { 0x0393, "*G" },
+    { 0x0394, "*D" }, { 0x0395, "*E" }, { 0x0396, "*Z" },
+    { 0x0397, "*Y" }, { 0x0398, "*H" }, { 0x0399, "*I" },
+    { 0x039A, "*K" }, { 0x039B, "*L" }, { 0x039C, "*M" },
+    { 0x039D, "*N" }, { 0x039E, "*C" }, { 0x039F, "*O" },
+    { 0x03A0, "*P" }, { 0x03A1, "*R" }, { 0x03A3, "*S" },
+    { 0x03A4, "*T" }, { 0x03A5, "*U" }, { 0x03A6, "*F" },
+    { 0x03A7, "*X" }, { 0x03A8, "*Q" }, { 0x03A9, "*W" },
+    { 0x03B1, "*a" }, { 0x03B2, "*b" }, { 0x03B3, "*g" },
+    { 0x03B4, "*d" }, { 0x03B5, "*e" }, { 0x03B6, "*z" },
+    { 0x03B7, "*y" }, { 0x03B8, "*h" }, { 0x03B9, "*i" },
+    { 0x03BA, "*k" }, { 0x03BB, "*l" }, { 0x03BC, "*m" },
+    { 0x03BD, "*n" }, { 0x03BE, "*c" }, { 0x03BF, "*o" },
+    { 0x03C0, "*p" }, { 0x03C1, "*r" }, { 0x03C2, "ts" },
+    { 0x03C3, "*s" }, { 0x03C4, "*t" }, { 0x03C5, "*u" },
+    { 0x03C6, "*f" }, { 0x03C7, "*x" }, { 0x03C8, "*q" },
+    { 0x03C9, "*w" },
+    { 0x2010, "hy" }, { 0x2013, "en" }, { 0x2014, "em" },
+    { 0x2018, "oq" }, { 0x2019, "cq" }, { 0x201A, "bq" },
+    { 0x201C, "lq" }, { 0x201D, "rq" }, { 0x201E, "Bq" },
+    { 0x2020, "dg" }, { 0x2021, "dd" }, { 0x2022, "bu" },
+    { 0x2030, "%0" }, { 0x2032, "fm" }, { 0x2033, "sd" },
+    { 0x2039, "fo" }, { 0x203A, "fc" }, { 0x20AC, "Eu" },
+    { 0x2122, "tm" }, { 0x2190, "<-" }, { 0x2191, "ua" },
+    { 0x2192, "->" }, { 0x2193, "da" }, { 0x2194, "<>" },
+    { 0x21D0, "lA" }, { 0x21D2, "rA" }, { 0x21D4, "hA" },
+    { 0x2200, "fa" }, { 0x2202, "pd" }, { 0x2203, "te" },
+    { 0x2205, "es" }, { 0x2207, "gr" }, { 0x2208, "mo" },
+    { 0x2209, "nm" }, { 0x2212, "mi" }, { 0x2217, "**" },
+    { 0x221A, "sr" }, { 0x221D, "pt" }, { 0x221E, "if" },
+    { 0x2220, "/_" }, { 0x2227, "AN" }, { 0x2228, "OR" },
+    { 0x2229, "ca" }, { 0x222A, "cu" }, { 0x222B, "is" },
+    { 0x2234, "tf" }, { 0x223C, "ap" }, { 0x2245, "=~" },
+    { 0x2248, "~~" }, { 0x2260, "!=" }, { 0x2261, "==" },
+    { 0x2264, "<=" }, { 0x2265, ">=" }, { 0x2282, "sb" },
+    { 0x2283, "sp" }, { 0x2286, "ib" }, { 0x2287, "ip" },
+    { 0x2295, "c+" }, { 0x2297, "c*" }, { 0x22A5, "pp" },
+    { 0x25CA, "lz" }, { 0x2660, "SP" }, { 0x2663, "CL" },
+    { 0x2665, "HE" }, { 0x2666, "DI" },
+};
+
+void append_glyph(char32_t cp, std::string& out)
+{
+    const char* name = nullptr;
+    if (cp >= 0xA0 && cp <= 0xFF) {
+        name = LATIN1[cp - 0xA0];
+    } else {
+        auto it = std::lower_bound(std::begin(GLYPHS), std::end(GLYPHS), cp,
+            [](const Glyph& g, char32_t c){ return g.cp < c; });
+        if (it != std::end(GLYPHS) && it->cp == cp)
+            name = it->name;
+    }
+
+    out += "\\[";
+    if (name) {
+        out += name;
+    } else {
+        char hex[16];
+        std::snprintf(hex, sizeof hex, "u%04X",
+                      static_cast<unsigned>(cp));
+        out += hex;
+    }
+    out += ']';
+}
+
+// Columns taken by `cp`, after the East Asian Width property in
+// outline: the wide blocks, and the marks that combine with the
+// character before them.
+std::size_t char_width(char32_t cp)
+{
+    struct Range { char32_t lo, hi; };
+    static const Range ZERO[] = {
+        { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD },
+        { 0x0610, 0x061A }, { 0x064B, 0x065F }, { 0x1AB0, 0x1AFF },
+        { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x20D0, 0x20FF },
+        { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF },
+    };
+    static const Range WIDE[] = {
+        { 0x1100, 0x115F }, { 0x2E80, 0x303E }, { 0x3041, 0x33FF },
+        { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF }, { 0xA000, 0xA4CF },
+        { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF }, { 0xFE30, 0xFE4F },
+        { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x1F300, 0x1F64F },
+        { 0x1F900, 0x1F9FF }, { 0x20000, 0x3FFFD },
+    };
+    auto in = [cp](const auto& table) {
+        auto it = std::lower_bound(std::begin(table), std::end(table), cp,
+            [](const Range& r, char32_t c){ return r.hi < c; });
+        return it != std::end(table) && it->lo <= cp;
+    };
+    if (in(ZERO))
+        return 0;
+    return in(WIDE) ? 2 : 1;
+}
+
+} // namespace
+
+// =================================================================
+//  Scanning
+// =================================================================
+
+std::size_t ascii_span(const char* s, std::size_t n)
+{
+    std::size_t i = 0;
+
+#if defined(PPLUA_UTF8_SSE2)
+    // Two vectors a round; the high bit of any byte ends the run.
+    for (; i + 32 <= n; i += 32) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + 16));
+        if (_mm_movemask_epi8(_mm_or_si128(a, b)))
+            break;
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+        if (int mask = _mm_movemask_epi8(a)) {
+            while (!(mask & 1)) {
+                mask >>= 1;
+                ++i;
+            }
+            return i;
+        }
+    }
+#elif defined(PPLUA_UTF8_NEON)
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t a = vld1q_u8(reinterpret_cast<const std::uint8_t*>(s + i));
+        if (vmaxvq_u8(a) & 0x80)
+            break;
+    }
+#endif
+
+    // A word at a time, then the stragglers.
+    for (; i + 8 <= n; i += 8) {
+        std::uint64_t w;
+        std::memcpy(&w, s + i, sizeof w);
+        if (w & 0x8080808080808080ull)
+            break;
+    }
+    while (i < n && !(static_cast<unsigned char>(s[i]) & 0x80))
+        ++i;
+    return i;
+}
+
+std::size_t find_invalid_utf8(std::string_view s)
+{
+    std::size_t i = 0;
+    for (;;) {
+        i += ascii_span(s.data() + i, s.size() - i);
+        if (i == s.size())
+            return std::string_view::npos;
+        std::size_t len;
+        char32_t cp;
+        if (decode(s.substr(i), len, cp) != Decode::ok)
+            return i;
+        i += len;
+    }
+}
+
+std::size_t utf8_column(std::string_view line, std::size_t offset)
+{
+    std::size_t col = 1;
+    for (std::size_t i = 0; i < offset && i < line.size(); ++i)
+        if ((static_cast<unsigned char>(line[i]) & 0xC0) != 0x80)
+            ++col;
+    return col;
+}
+
+std::size_t utf8_width(std::string_view s)
+{
+    std::size_t width = 0;
+    std::size_t i = 0;
+    for (;;) {
+        std::size_t run = ascii_span(s.data() + i, s.size() - i);
+        width += run;
+        i += run;
+        if (i == s.size())
+            return width;
+        std::size_t len;
+        char32_t cp;
+        width += decode(s.substr(i), len, cp) == Decode::ok
+               ? char_width(cp) : 1;
+        i += std::min(len, s.size() - i);
+    }
+}
+
+std::size_t utf8_prefix(std::string_view s, std::size_t width)
+{
+    std::size_t used = 0;
+    std::size_t i = 0;
+    while (i < s.size()) {
+        std::size_t run = ascii_span(s.data() + i, s.size() - i);
+        if (used + run > width)
+            return i + (width - used);
+        used += run;
+        i += run;
+        if (i == s.size())
+            break;
+        std::size_t len;
+        char32_t cp;
+        std::size_t w = decode(s.substr(i), len, cp) == Decode::ok
+                      ? char_width(cp) : 1;
+        if (used + w > width)
+            break;
+        used += w;
+        i += std::min(len, s.size() - i);
+    }
+    return i;
+}
+
+// =================================================================
+//  AsciiEscaper
+// =================================================================
+
+std::size_t AsciiEscaper::escape_one(std::string_view s, std::string& out)
+{
+    std::size_t len;
+    char32_t cp;
+    switch (decode(s, len, cp)) {
+    case Decode::ok:        append_glyph(cp, out);   break;
+    case Decode::truncated: return 0;
+    case Decode::invalid:   out += "\\[uFFFD]";      break;
+    }
+    return len;
+}
+
+void AsciiEscaper::feed(std::string_view text, std::string& out)
+{
+    // Finish a sequence cut off by the previous piece, a byte at a
+    // time: it needs at most three more.
+    while (!pending_.empty() && !text.empty()) {
+        pending_ += text.front();
+        text.remove_prefix(1);
+        std::size_t used = escape_one(pending_, out);
+        if (used == 0)
+            continue;
+        // An ill-formed one leaves the byte just added unused.
+        std::size_t back = pending_.size() - used;
+        text = std::string_view(text.data() - back, text.size() + back);
+        pending_.clear();
+    }
+
+    out.reserve(out.size() + text.size());
+    std::size_t i = 0;
+    while (i < text.size()) {
+        std::size_t run = ascii_span(text.data() + i, text.size() - i);
+        out.append(text.data() + i, run);
+        i += run;
+        if (i == text.size())
+            break;
+        std::size_t used = escape_one(text.substr(i), out);
+        if (used == 0) {
+            pending_.assign(text.substr(i));
+            break;
+        }
+        i += used;
+    }
+}
+
+void AsciiEscaper::finish(std::string& out)
+{
+    if (!pending_.empty())
+        out += "\\[uFFFD]";
+    pending_.clear();
+}
+
+} // namespace pplua
@@ -0,0 +1,64 @@
+// src/utf8.hpp
+//
+// UTF-8 checks on the input and the --ascii-escape output mode.
+// Both skip runs of ASCII a vector at a time; only the bytes around
+// a non-ASCII character are looked at one by one.
+
+#ifndef PPLUA_UTF8_HPP
+#define PPLUA_UTF8_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace pplua {
+
+/// Length of the run of ASCII bytes at the start of [s, s + n).
+std::size_t ascii_span(const char* s, std::size_t n);
+
+/// Offset of the first byte of `s` that does not begin a well-formed
+/// UTF-8 sequence (overlong forms, surrogates, code points above
+/// U+10FFFF and sequences cut short are all ill-formed), or npos.
+std::size_t find_invalid_utf8(std::string_view s);
+
+/// The column of byte `offset` in `line`, counting characters from 1.
+std::size_t utf8_column(std::string_view line, std::size_t offset);
+
+/// The width of `s` in columns as a terminal shows it: East Asian
+/// wide characters take two, combining marks and zero-width spaces
+/// none, any other character one.  An ill-formed byte counts one.
+std::size_t utf8_width(std::string_view s);
+
+/// The length in bytes of the longest prefix of `s` that is at most
+/// `width` columns wide and does not cut a character in two.
+std::size_t utf8_prefix(std::string_view s, std::size_t width);
+
+// =====================================================================
+//  AsciiEscaper — rewrite UTF-8 text as groff input that is pure ASCII
+//
+//  Characters with a classic groff name (groff_char(7)) become
+//  \[name]: \['e], \[em], \[Eu].  Any other becomes \[uXXXX].  A byte
+//  that is not part of a well-formed sequence becomes \[uFFFD].  The
+//  text may be fed in pieces split anywhere; a sequence cut off at
+//  the end of one piece is finished from the next.
+// =====================================================================
+class AsciiEscaper {
+public:
+    /// Append the escaped form of `text` to `out`.
+    void feed(std::string_view text, std::string& out);
+
+    /// End of stream: a sequence still unfinished is ill-formed.
+    void finish(std::string& out);
+
+private:
+    std::string pending_;       // the start of a cut-off sequence
+
+    /// Escape the sequence at the start of `s` (non-empty, starting
+    /// with a non-ASCII byte).  Returns the bytes used, or 0 if `s`
+    /// ends before the sequence does.
+    std::size_t escape_one(std::string_view s, std::string& out);
+};
+
+} // namespace pplua
+
+#endif // PPLUA_UTF8_HPP
@@ -0,0 +1,336 @@
+// src/whatis.cpp
+//
+// WhatisIndex and the whatis file it is written to.
+
+#include "whatis.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <tuple>
+
+namespace pplua {
+
+namespace {
+
+bool is_blank(char c) { return c == ' ' || c == '\t'; }
+
+// A request's name and arguments, split at blanks, with double
+// quotes grouping; a \" comment ends them.
+std::vector<std::string> split_request(std::string_view line)
+{
+    std::vector<std::string> out;
+    std::size_t i = 1;
+    while (i < line.size() && is_blank(line[i]))
+        ++i;
+    while (i < line.size()) {
+        if (line.compare(i, 2, "\\\"") == 0)
+            break;
+        std::string word;
+        if (line[i] == '"') {
+            for (++i; i < line.size(); ++i) {
+                if (line[i] == '"') {
+                    if (i + 1 < line.size() && line[i + 1] == '"') {
+                        word += '"';
+                        ++i;
+                        continue;
+                    }
+                    ++i;
+                    break;
+                }
+                word += line[i];
+            }
+        } else {
+            while (i < line.size() && !is_blank(line[i])) {
+                if (line.compare(i, 2, "\\\"") == 0)
+                    break;
+                word += line[i++];
+            }
+        }
+        out.push_back(std::move(word));
+        while (i < line.size() && is_blank(line[i]))
+            ++i;
+    }
+    return out;
+}
+
+std::string join(const std::vector<std::string>& words, std::size_t from,
+                 const char* sep)
+{
+    std::string out;
+    for (std::size_t i = from; i < words.size(); ++i) {
+        if (i > from)
+            out += sep;
+        out += words[i];
+    }
+    return out;
+}
+
+// The special characters a NAME line is likely to hold.
+const char* special(std::string_view name)
+{
+    static const std::pair<const char*, const char*> table[] = {
+        {"em", "—"}, {"en", "–"}, {"hy", "-"},  {"mi", "-"},
+        {"aq", "'"},      {"dq", "\""},     {"lq", "“"},
+        {"rq", "”"}, {"oq", "‘"}, {"cq", "’"},
+        {"rs", "\\"},     {"bu", "•"}, {"co", "©"},
+    };
+    for (auto& [n, s] : table)
+        if (name == n)
+            return s;
+    return "";
+}
+
+// The name an escape takes: one character, (xx or [...].  Returns
+// the position after it.
+std::size_t escape_arg(const std::string& s, std::size_t i, std::string& name)
+{
+    if (i >= s.size())
+        return i;
+    if (s[i] == '(') {
+        name = s.substr(i + 1, 2);
+        return std::min(i + 3, s.size());
+    }
+    if (s[i] == '[') {
+        std::size_t end = s.find(']', i);
+        if (end == std::string::npos)
+            end = s.size();
+        name = s.substr(i + 1, end - i - 1);
+        return std::min(end + 1, s.size());
+    }
+    name = s.substr(i, 1);
+    return i + 1;
+}
+
+// Roff text as a reader sees it: escapes resolved or dropped and
+// blanks collapsed.
+std::string plain_text(const std::string& s)
+{
+    std::string out;
+    for (std::size_t i = 0; i < s.size();) {
+        char c = s[i];
+        if (c != '\\' || i + 1 >= s.size()) {
+            out += c;
+            ++i;
+            continue;
+        }
+        char e = s[i + 1];
+        i += 2;
+        std::string name;
+        switch (e) {
+        case '"':
+            i = s.size();                       // comment
+            break;
+        case '-': out += '-';  break;
+        case 'e': case '\\': out += '\\'; break;
+        case ' ': case '~': case '0': out += ' '; break;
+        case '&': case '%': case ':': case '/': case ',':
+        case '|': case '^': case ')':
+            break;
+        case '(': case '[':
+            i = escape_arg(s, i - 1, name);
+            out += special(name);
+            break;
+        case 'f': case 'F': case 'm': case 'M': case '*': case 'n':
+            i = escape_arg(s, i, name);         // fonts, colours, strings
+            break;
+        case 's':
+            if (i < s.size() && (s[i] == '+' || s[i] == '-'))
+                ++i;
+            if (i < s.size() && (s[i] == '(' || s[i] == '['))
+                i = escape_arg(s, i, name);
+            else
+                while (i < s.size() && std::isdigit(
+                           static_cast<unsigned char>(s[i])))
+                    ++i;
+            break;
+        default:
+            out += e;
+            break;
+        }
+    }
+
+    std::string collapsed;
+    for (char c : out) {
+        if (is_blank(c)) {
+            if (!collapsed.empty() && collapsed.back() != ' ')
+                collapsed += ' ';
+        } else {
+            collapsed += c;
+        }
+    }
+    while (!collapsed.empty() && collapsed.back() == ' ')
+        collapsed.pop_back();
+    return collapsed;
+}
+
+std::string trim(std::string_view s)
+{
+    std::size_t b = 0, e = s.size();
+    while (b < e && is_blank(s[b])) ++b;
+    while (e > b && is_blank(s[e - 1])) --e;
+    return std::string(s.substr(b, e - b));
+}
+
+} // namespace
+
+// =================================================================
+//  WhatisIndex
+// =================================================================
+
+void WhatisIndex::feed(std::string_view text)
+{
+    std::size_t pos = 0, nl;
+    while ((nl = text.find('\n', pos)) != std::string_view::npos) {
+        if (partial_.empty()) {
+            line(text.substr(pos, nl - pos));
+        } else {
+            partial_.append(text.substr(pos, nl - pos));
+            line(partial_);
+            partial_.clear();
+        }
+        pos = nl + 1;
+    }
+    partial_.append(text.substr(pos));
+}
+
+void WhatisIndex::finish()
+{
+    if (!partial_.empty()) {
+        line(partial_);
+        partial_.clear();
+    }
+    close_page();
+}
+
+std::vector<WhatisEntry> WhatisIndex::take()
+{
+    std::vector<WhatisEntry> out;
+    out.swap(entries_);
+    return out;
+}
+
+void WhatisIndex::line(std::string_view line)
+{
+    if (line.empty())
+        return;
+    const bool request = line[0] == '.' || line[0] == '\'';
+    if (!request) {
+        if (part_ == Part::name) {
+            text_ += ' ';
+            text_.append(line);
+        }
+        return;
+    }
+
+    std::vector<std::string> args = split_request(line);
+    if (args.empty())
+        return;
+    const std::string& req = args[0];
+
+    if (req == "TH" || req == "Dt") {
+        close_page();
+        part_ = Part::other;
+        section_ = args.size() > 2 ? args[2] : std::string();
+        return;
+    }
+    if (part_ == Part::none)
+        return;
+    if (req == "SH" || req == "Sh") {
+        part_ = join(args, 1, " ") == "NAME" ? Part::name : Part::other;
+        return;
+    }
+    if (req == "SS" || req == "Ss") {
+        part_ = Part::other;
+        return;
+    }
+    if (part_ != Part::name)
+        return;
+
+    if (req == "Nm") {
+        for (std::size_t i = 1; i < args.size(); ++i) {
+            std::string n = args[i];
+            while (!n.empty() && n.back() == ',')
+                n.pop_back();
+            if (!n.empty())
+                names_.push_back(plain_text(n));
+        }
+    } else if (req == "Nd") {
+        description_ = plain_text(join(args, 1, " "));
+    } else if (req == "B" || req == "I" || req == "SM" || req == "SB") {
+        text_ += ' ';
+        text_ += join(args, 1, " ");
+    } else if (req.size() == 2 && req[0] != req[1]
+               && std::string_view("BIR").find(req[0]) != std::string_view::npos
+               && std::string_view("BIR").find(req[1]) != std::string_view::npos) {
+        text_ += ' ';
+        text_ += join(args, 1, "");     // .BR and the like: no blanks
+    }
+}
+
+void WhatisIndex::close_page()
+{
+    if (part_ != Part::none && !section_.empty()) {
+        std::vector<std::string> names = std::move(names_);
+        std::string description = std::move(description_);
+
+        if (names.empty()) {
+            std::string text = plain_text(text_);
+            std::size_t dash = text.find(" - ");
+            if (dash != std::string::npos) {
+                description = trim(std::string_view(text).substr(dash + 3));
+                std::string_view list(text.data(), dash);
+                std::size_t pos = 0;
+                while (pos <= list.size()) {
+                    std::size_t comma = list.find(',', pos);
+                    if (comma == std::string_view::npos)
+                        comma = list.size();
+                    std::string n = trim(list.substr(pos, comma - pos));
+                    if (!n.empty())
+                        names.push_back(std::move(n));
+                    pos = comma + 1;
+                }
+            }
+        }
+        for (auto& n : names)
+            entries_.push_back({n, section_, description});
+    }
+
+    part_ = Part::none;
+    section_.clear();
+    text_.clear();
+    names_.clear();
+    description_.clear();
+}
+
+// =================================================================
+//  write_whatis
+// =================================================================
+
+bool write_whatis(const std::string& path, std::vector<WhatisEntry> entries)
+{
+    auto key = [](const WhatisEntry& e) {
+        return std::tie(e.name, e.section, e.description);
+    };
+    std::sort(entries.begin(), entries.end(),
+              [&](const WhatisEntry& a, const WhatisEntry& b) {
+                  return key(a) < key(b);
+              });
+    entries.erase(std::unique(entries.begin(), entries.end(),
+                              [&](const WhatisEntry& a, const WhatisEntry& b) {
+                                  return key(a) == key(b);
+                              }),
+                  entries.end());
+
+    std::ofstream f(path, std::ios::binary | std::ios::trunc);
+    for (auto& e : entries)
+        f << e.name << " (" << e.section << ") - " << e.description << '\n';
+    if (!f.flush()) {
+        std::cerr << "pplua: cannot write '" << path << "'\n";
+        return false;
+    }
+    return true;
+}
+
+} // namespace pplua
@@ -0,0 +1,67 @@
+// src/whatis.hpp
+//
+// --whatis-db: the whatis index of the manual pages a run writes,
+// gathered from the output as it goes out, so that indexing does not
+// need a second pass over the corpus.
+
+#ifndef PPLUA_WHATIS_HPP
+#define PPLUA_WHATIS_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace pplua {
+
+struct WhatisEntry {
+    std::string name;
+    std::string section;
+    std::string description;
+};
+
+// =====================================================================
+//  WhatisIndex — pages seen in one output stream
+//
+//  A page starts at .TH (man) or .Dt (mdoc), whose second argument
+//  is its section, and its NAME section gives the entries: for man,
+//  the text "name, name \- description" with font macros and escapes
+//  reduced to plain text; for mdoc, the .Nm names and the .Nd line.
+//  Every name of a page is an entry of its own.  Documents written
+//  one after another into the same stream are told apart by their
+//  .TH, so a run need not say where each starts.
+// =====================================================================
+class WhatisIndex {
+public:
+    /// Feed output text, in pieces of any size.
+    void feed(std::string_view text);
+
+    /// End of a document: complete the page being read.
+    void finish();
+
+    /// The entries so far, leaving none.
+    std::vector<WhatisEntry> take();
+
+private:
+    enum class Part { none, other, name };
+
+    std::string              partial_;      // a line not yet complete
+    Part                     part_ = Part::none;
+    std::string              section_;
+    std::string              text_;         // man: the NAME section
+    std::vector<std::string> names_;        // mdoc: .Nm
+    std::string              description_;  // mdoc: .Nd
+    std::vector<WhatisEntry> entries_;
+
+    void line(std::string_view line);
+    void close_page();
+};
+
+/// Write `entries` to `path` in the format of a whatis file, one
+/// "name (section) - description" line each, sorted by name and
+/// section without repeats.  Returns false, having said why, if it
+/// cannot.
+bool write_whatis(const std::string& path, std::vector<WhatisEntry> entries);
+
+} // namespace pplua
+
+#endif // PPLUA_WHATIS_HPP
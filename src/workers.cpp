@@ -0,0 +1,624 @@
+// src/workers.cpp
+//
+// WorkerPool and MapPool, and the LuaValue copies that carry values
+// into and out of them.
+
+#include "workers.hpp"
+#include "lroff.hpp"
+#include "cache.hpp"
+#include "compat.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace pplua {
+
+// =================================================================
+//  LuaValue
+// =================================================================
+
+namespace {
+
+LuaValue copy_value(lua_State* L, int idx, std::vector<const void*>& open)
+{
+    if (idx < 0)
+        idx = lua_gettop(L) + idx + 1;
+
+    LuaValue v;
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        break;
+    case LUA_TBOOLEAN:
+        v.type = LuaValue::Type::boolean;
+        v.boolean = lua_toboolean(L, idx) != 0;
+        break;
+    case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+        if (lua_isinteger(L, idx)) {
+            v.type = LuaValue::Type::integer;
+            v.integer = lua_tointeger(L, idx);
+            break;
+        }
+#endif
+        v.type = LuaValue::Type::number;
+        v.number = lua_tonumber(L, idx);
+        break;
+    case LUA_TSTRING: {
+        std::size_t len;
+        const char* s = lua_tolstring(L, idx, &len);
+        v.type = LuaValue::Type::string;
+        v.string.assign(s, len);
+        break;
+    }
+    case LUA_TTABLE: {
+        const void* t = lua_topointer(L, idx);
+        if (std::find(open.begin(), open.end(), t) != open.end())
+            throw std::runtime_error("a table that contains itself");
+        open.push_back(t);
+        v.type = LuaValue::Type::table;
+        luaL_checkstack(L, 3, "table too deep");
+        lua_pushnil(L);
+        while (lua_next(L, idx)) {
+            v.keys.push_back(copy_value(L, -2, open));
+            v.values.push_back(copy_value(L, -1, open));
+            lua_pop(L, 1);
+        }
+        open.pop_back();
+        break;
+    }
+    default:
+        throw std::runtime_error(std::string("a ")
+                                 + luaL_typename(L, idx));
+    }
+    return v;
+}
+
+} // namespace
+
+LuaValue LuaValue::copy(lua_State* L, int idx)
+{
+    std::vector<const void*> open;
+    return copy_value(L, idx, open);
+}
+
+void LuaValue::push(lua_State* L) const
+{
+    luaL_checkstack(L, 3, "table too deep");
+    switch (type) {
+    case Type::nil:     lua_pushnil(L);                             break;
+    case Type::boolean: lua_pushboolean(L, boolean);                break;
+    case Type::integer: lua_pushinteger(L, static_cast<lua_Integer>(integer)); break;
+    case Type::number:  lua_pushnumber(L, number);                  break;
+    case Type::string:  lua_pushlstring(L, string.data(), string.size()); break;
+    case Type::table:
+        lua_createtable(L, 0, static_cast<int>(keys.size()));
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            keys[i].push(L);
+            values[i].push(L);
+            lua_rawset(L, -3);
+        }
+        break;
+    }
+}
+
+// =================================================================
+//  Worker states
+// =================================================================
+
+namespace {
+
+// Within a worker, lroff.parallel_map runs the items one after the
+// other: a preamble function that maps may also be called there.
+const char* const SERIAL_MAP = R"lua(
+    local load, type, error = load, type, error
+    lroff.parallel_map = function(items, source, ...)
+        local chunk, err = load("return " .. source, "=fn")
+        if not chunk then chunk, err = load(source, "=fn") end
+        if not chunk then error("parallel_map: " .. err, 2) end
+        local fn = chunk()
+        if type(fn) ~= "function" then
+            error("parallel_map: the source is not a function", 2)
+        end
+        local out = {}
+        for i = 1, #items do out[i] = fn(items[i], ...) end
+        return out
+    end
+)lua";
+
+// The libraries, lroff and the -D globals, as every worker has them;
+// lroff.shell too, caching in `shell_cache`, if given (map workers).
+void open_worker_state(sol::state& lua, LroffLibrary& lroff,
+                       InputTracker& tracker, const WorkerSetup& setup,
+                       const std::string* shell_cache = nullptr)
+{
+    lua.open_libraries(
+        sol::lib::base,
+        sol::lib::string,
+        sol::lib::table,
+        sol::lib::math,
+        sol::lib::package,
+        sol::lib::io,
+        sol::lib::os,
+        sol::lib::coroutine
+#ifdef PPLUA_LUAJIT
+        , sol::lib::bit32
+        , sol::lib::jit
+#else
+        , sol::lib::utf8
+#endif
+    );
+    open_compat(lua);
+
+    if (!setup.lua_paths.empty()) {
+        std::string path = lua["package"]["path"];
+        for (auto& p : setup.lua_paths)
+            path += ";" + p;
+        lua["package"]["path"] = path;
+    }
+
+    lroff.register_into(lua);
+    lroff.allow_defer(false);
+    lua.script(SERIAL_MAP, "=parallel_map");
+    if (shell_cache)
+        register_shell(lua, *shell_cache);
+
+    // As in the document's state, tracking wraps what is installed.
+    if (setup.track_inputs)
+        tracker.attach(lua);
+
+    for (auto& [name, value] : setup.defines)
+        lua[name] = value;
+}
+
+// The message of the error on top of the stack, popping it.
+std::string pop_error(lua_State* L)
+{
+    const char* msg = lua_tostring(L, -1);
+    std::string error = msg ? msg : std::string("(error object is a ")
+                                    + luaL_typename(L, -1) + ")";
+    lua_pop(L, 1);
+    return error;
+}
+
+} // namespace
+
+// =================================================================
+//  WorkerPool::Worker — one thread's Lua state
+// =================================================================
+
+struct WorkerPool::Worker {
+    const WorkerSetup& setup;
+    sol::state         lua;
+    OutputBuffer       output;
+    LroffLibrary       lroff;
+    InputTracker       tracker;
+
+    explicit Worker(const WorkerSetup& s);
+    PureResult run(const PureJob& job);
+};
+
+WorkerPool::Worker::Worker(const WorkerSetup& s)
+    : setup(s), lroff(output)
+{
+    open_worker_state(lua, lroff, tracker, setup);
+}
+
+PureResult WorkerPool::Worker::run(const PureJob& job)
+{
+    PureResult r;
+    output.clear();
+    lroff.reset();
+    lroff.state().unique_tag = job.unique_tag;
+
+    // A fresh _ENV per block, as for batch documents.
+    sol::environment env(lua, sol::create, lua.globals());
+    lua_State* L = lua.lua_state();
+    env.push();
+    for (auto& [name, value] : job.globals) {
+        value.push(L);
+        lua_setfield(L, -2, name.c_str());
+    }
+    lua_pop(L, 1);
+
+    sol::load_result chunk = lua.load(job.code, job.chunk_name);
+    if (!chunk.valid()) {
+        sol::error err = chunk;
+        r.error = err.what();
+    } else {
+        sol::protected_function fn = chunk;
+        sol::set_environment(env, fn);
+        sol::protected_function_result result = fn();
+        if (!result.valid()) {
+            sol::error err = result;
+            r.error = err.what();
+        } else {
+            write_chunk_value(output, result);
+        }
+    }
+    r.output = output.take();
+
+    if (setup.track_inputs) {
+        r.files       = tracker.files();
+        r.env         = tracker.env();
+        r.uncacheable = tracker.reason();
+    }
+    return r;
+}
+
+// =================================================================
+//  WorkerPool
+// =================================================================
+
+WorkerPool::WorkerPool(WorkerSetup setup, unsigned threads)
+    : setup_(std::move(setup))
+{
+    for (unsigned i = 0; i < threads; ++i)
+        threads_.emplace_back([this]{ loop(); });
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& t : threads_)
+        t.join();
+}
+
+std::future<PureResult> WorkerPool::submit(PureJob job)
+{
+    std::promise<PureResult> done;
+    std::future<PureResult> result = done.get_future();
+
+    if (threads_.empty()) {
+        try {
+            if (!inline_)
+                inline_ = std::make_unique<Worker>(setup_);
+            done.set_value(inline_->run(job));
+        } catch (...) {
+            done.set_exception(std::current_exception());
+        }
+        return result;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.emplace_back(std::move(job), std::move(done));
+    }
+    wake_.notify_one();
+    return result;
+}
+
+void WorkerPool::loop()
+{
+    std::unique_ptr<Worker> worker;     // brought up on the first job
+    for (;;) {
+        Entry entry;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [this]{ return stop_ || !queue_.empty(); });
+            if (stop_)
+                return;
+            entry = std::move(queue_.front());
+            queue_.pop_front();
+        }
+
+        try {
+            if (!worker)
+                worker = std::make_unique<Worker>(setup_);
+            entry.second.set_value(worker->run(entry.first));
+        } catch (...) {
+            entry.second.set_exception(std::current_exception());
+        }
+    }
+}
+
+// =================================================================
+//  MapPool::Worker — one thread's Lua state, set up once
+// =================================================================
+
+struct MapPool::Worker {
+    sol::state         lua;
+    OutputBuffer       output;
+    LroffLibrary       lroff;
+    InputTracker       tracker;
+    std::string        broken;          // why the setup failed
+
+    explicit Worker(const MapSetup& setup);
+
+    /// Compile the function of a map; false if it cannot be.
+    bool prepare(const std::string& source, sol::protected_function& fn,
+                 std::string& error);
+
+    /// Call `fn` with one item and the map's arguments.
+    bool call(const sol::protected_function& fn, const LuaValue& item,
+              const std::vector<LuaValue>& args, LuaValue& result,
+              std::string& error);
+};
+
+MapPool::Worker::Worker(const MapSetup& setup)
+    : lroff(output)
+{
+    try {
+        open_worker_state(lua, lroff, tracker, setup, &setup.shell_cache);
+
+        // The document's state has reported any error in these.
+        for (auto& code : setup.exec_chunks) {
+            auto r = lua.safe_script(code, sol::script_pass_on_error, "@-e");
+            if (!r.valid()) {
+                sol::error err = r;
+                broken = std::string("-e: ") + err.what();
+                return;
+            }
+        }
+        for (auto& pf : setup.preamble_files)
+            lua.safe_script_file(pf, sol::script_pass_on_error);
+    } catch (const std::exception& e) {
+        broken = e.what();
+    }
+}
+
+bool MapPool::Worker::prepare(const std::string& source,
+                              sol::protected_function& fn,
+                              std::string& error)
+{
+    if (!broken.empty()) {
+        error = "worker setup: " + broken;
+        return false;
+    }
+
+    // An expression ("function(c) ... end", or a global's name) or a
+    // chunk that returns the function.
+    sol::load_result chunk = lua.load("return " + source, "=fn");
+    if (!chunk.valid())
+        chunk = lua.load(source, "=fn");
+    if (!chunk.valid()) {
+        sol::error err = chunk;
+        error = err.what();
+        return false;
+    }
+
+    sol::environment env(lua, sol::create, lua.globals());
+    sol::protected_function make = chunk;
+    sol::set_environment(env, make);
+    sol::protected_function_result r = make();
+    if (!r.valid()) {
+        sol::error err = r;
+        error = err.what();
+        return false;
+    }
+    if (r.get_type() != sol::type::function) {
+        error = "the source is not a function";
+        return false;
+    }
+    fn = r;
+    return true;
+}
+
+bool MapPool::Worker::call(const sol::protected_function& fn,
+                           const LuaValue& item,
+                           const std::vector<LuaValue>& args,
+                           LuaValue& result, std::string& error)
+{
+    output.clear();
+    lroff.reset();
+
+    lua_State* L = lua.lua_state();
+    const int top = lua_gettop(L);
+    luaL_checkstack(L, static_cast<int>(args.size()) + 2, "too many arguments");
+    fn.push(L);
+    item.push(L);
+    for (auto& a : args)
+        a.push(L);
+    if (lua_pcall(L, static_cast<int>(args.size()) + 1, 1, 0) != LUA_OK) {
+        error = pop_error(L);
+        return false;
+    }
+
+    // A function that returns nothing but emits text gives the text.
+    try {
+        if (lua_isnil(L, -1) && !output.empty()) {
+            result.type   = LuaValue::Type::string;
+            result.string = output.take();
+        } else {
+            result = LuaValue::copy(L, -1);
+        }
+    } catch (const std::exception& e) {
+        error = std::string("cannot return ") + e.what();
+        lua_settop(L, top);
+        return false;
+    }
+    lua_settop(L, top);
+    return true;
+}
+
+// =================================================================
+//  MapPool
+// =================================================================
+
+// The items one thread has still to do: [next, end).  Its owner
+// takes from the front; others steal from the back.
+struct MapPool::Range {
+    std::mutex  mutex;
+    std::size_t next = 0;
+    std::size_t end  = 0;
+};
+
+struct MapPool::Task {
+    const std::string&           fn;
+    const std::vector<LuaValue>& items;
+    const std::vector<LuaValue>& args;
+    std::vector<Range>           ranges;
+    std::vector<std::string>     errors;    // one per item
+    MapResult                    result;
+    std::mutex                   merge;     // result's input sets
+
+    Task(const std::string& f, const std::vector<LuaValue>& i,
+         const std::vector<LuaValue>& a, std::size_t threads)
+        : fn(f), items(i), args(a), ranges(threads), errors(i.size())
+    {
+        result.values.resize(i.size());
+        const std::size_t n = i.size();
+        for (std::size_t t = 0; t < threads; ++t) {
+            ranges[t].next = n * t / threads;
+            ranges[t].end  = n * (t + 1) / threads;
+        }
+    }
+
+    // The next item for thread `self`, from its own range or stolen;
+    // false when there are none left anywhere.
+    bool take(std::size_t self, std::size_t& item)
+    {
+        {
+            Range& own = ranges[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (own.next < own.end) {
+                item = own.next++;
+                return true;
+            }
+        }
+
+        for (;;) {
+            // The largest range left.  It may shrink before we come
+            // back for it, so it is checked again below.
+            std::size_t victim = ranges.size(), most = 0;
+            for (std::size_t t = 0; t < ranges.size(); ++t) {
+                if (t == self)
+                    continue;
+                std::lock_guard<std::mutex> lock(ranges[t].mutex);
+                std::size_t left = ranges[t].end - ranges[t].next;
+                if (ranges[t].next < ranges[t].end && left > most) {
+                    most = left;
+                    victim = t;
+                }
+            }
+            if (victim == ranges.size())
+                return false;
+
+            std::size_t from, to;
+            {
+                Range& r = ranges[victim];
+                std::lock_guard<std::mutex> lock(r.mutex);
+                if (r.next >= r.end)
+                    continue;               // emptied meanwhile
+                from  = r.next + (r.end - r.next) / 2;
+                to    = r.end;
+                r.end = from;
+            }
+            // Never both locks at once: a thief of ours may be
+            // waiting for this one while holding its own.
+            Range& own = ranges[self];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            item     = from;
+            own.next = from + 1;
+            own.end  = to;
+            return true;
+        }
+    }
+};
+
+MapPool::MapPool(MapSetup setup, unsigned threads)
+    : setup_(std::move(setup))
+{
+    for (unsigned i = 0; i < threads; ++i)
+        threads_.emplace_back([this, i]{ loop(i); });
+}
+
+MapPool::~MapPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& t : threads_)
+        t.join();
+}
+
+MapResult MapPool::map(const std::string& fn,
+                       const std::vector<LuaValue>& items,
+                       const std::vector<LuaValue>& args)
+{
+    Task task(fn, items, args, std::max<std::size_t>(threads_.size(), 1));
+
+    if (threads_.empty()) {
+        if (!inline_)
+            inline_ = std::make_unique<Worker>(setup_);
+        work(*inline_, task, 0);
+    } else {
+        std::unique_lock<std::mutex> lock(mutex_);
+        task_ = &task;
+        busy_ = static_cast<unsigned>(threads_.size());
+        ++generation_;
+        wake_.notify_all();
+        done_.wait(lock, [this]{ return busy_ == 0; });
+        task_ = nullptr;
+    }
+
+    for (std::size_t i = 0; i < task.errors.size(); ++i) {
+        if (!task.errors[i].empty()) {
+            task.result.failed = i + 1;
+            task.result.error  = std::move(task.errors[i]);
+            break;
+        }
+    }
+    return std::move(task.result);
+}
+
+void MapPool::loop(unsigned index)
+{
+    // Brought up at once, not on the first map: the setup runs on
+    // every thread in parallel while the document goes on.
+    Worker worker(setup_);
+
+    std::uint64_t seen = 0;
+    for (;;) {
+        Task* task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&]{ return stop_ || generation_ != seen; });
+            if (stop_)
+                return;
+            seen = generation_;
+            task = task_;
+        }
+
+        work(worker, *task, index);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--busy_ == 0)
+            done_.notify_one();
+    }
+}
+
+void MapPool::work(Worker& worker, Task& task, unsigned index)
+{
+    sol::protected_function fn;
+    std::string error;
+    const bool ready = worker.prepare(task.fn, fn, error);
+
+    std::size_t i;
+    while (task.take(index, i)) {
+        if (!ready)
+            task.errors[i] = error;
+        else if (!worker.call(fn, task.items[i], task.args,
+                              task.result.values[i], error))
+            task.errors[i] = std::move(error);
+    }
+
+    if (!worker.tracker.files().empty() || !worker.tracker.env().empty()
+        || !worker.tracker.reason().empty()) {
+        std::lock_guard<std::mutex> lock(task.merge);
+        auto& r = task.result;
+        r.files.insert(worker.tracker.files().begin(),
+                       worker.tracker.files().end());
+        r.env.insert(worker.tracker.env().begin(),
+                     worker.tracker.env().end());
+        if (r.uncacheable.empty())
+            r.uncacheable = worker.tracker.reason();
+    }
+}
+
+} // namespace pplua
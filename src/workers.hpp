@@ -0,0 +1,190 @@
+// src/workers.hpp
+//
+// WorkerPool: runs `.lua pure` blocks on worker threads, each with
+// a Lua state of its own, and hands back their output.  MapPool:
+// the same for the items of lroff.parallel_map.
+
+#ifndef PPLUA_WORKERS_HPP
+#define PPLUA_WORKERS_HPP
+
+#define SOL_ALL_SAFETIES_ON 1
+#include <sol/sol.hpp>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace pplua {
+
+// =====================================================================
+//  LuaValue — a value copied out of one Lua state into another
+//
+//  nil, booleans, numbers, strings, and tables of these.  Metatables
+//  are not copied; a table that contains itself, a function or a
+//  userdata cannot be.
+// =====================================================================
+struct LuaValue {
+    enum class Type { nil, boolean, integer, number, string, table };
+
+    Type                  type = Type::nil;
+    bool                  boolean = false;
+    long long             integer = 0;
+    double                number  = 0;
+    std::string           string;
+    std::vector<LuaValue> keys;         // a table's keys ...
+    std::vector<LuaValue> values;       // ... and their values
+
+    /// Copy the value at `idx`.  Throws std::runtime_error.
+    static LuaValue copy(lua_State* L, int idx);
+
+    /// Push a new copy onto `L`'s stack.
+    void push(lua_State* L) const;
+};
+
+// =====================================================================
+//  Pure blocks
+// =====================================================================
+
+/// What a worker state starts from: the -D globals and -I paths.
+struct WorkerSetup {
+    std::vector<std::pair<std::string, std::string>> defines;
+    std::vector<std::string>                         lua_paths;
+    bool                                             track_inputs = false;
+};
+
+struct PureJob {
+    std::string code;
+    std::string chunk_name;
+    std::string unique_tag;             // for lroff.unique
+    std::vector<std::pair<std::string, LuaValue>> globals;   // passed in
+};
+
+struct PureResult {
+    std::string output;
+    std::string error;                  // empty on success
+
+    // With WorkerSetup::track_inputs: what the worker has read.
+    std::set<std::string> files;
+    std::set<std::string> env;
+    std::string           uncacheable;
+};
+
+// =====================================================================
+//  WorkerPool
+//
+//  A fixed set of threads taking jobs in submission order.  Each
+//  thread brings up its Lua state on its first job: the standard
+//  libraries, lroff and the -D globals, but no -e chunks or
+//  preambles.  Every job runs in a fresh _ENV, so nothing one block
+//  sets is seen by the next, and its output depends only on its code
+//  and what was passed in.  With no threads, submit() runs the job
+//  at once on the calling thread.
+// =====================================================================
+class WorkerPool {
+public:
+    WorkerPool(WorkerSetup setup, unsigned threads);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    std::future<PureResult> submit(PureJob job);
+
+private:
+    struct Worker;
+    using Entry = std::pair<PureJob, std::promise<PureResult>>;
+
+    WorkerSetup              setup_;
+    std::vector<std::thread> threads_;
+    std::unique_ptr<Worker>  inline_;   // with no threads
+
+    std::mutex               mutex_;
+    std::condition_variable  wake_;
+    std::deque<Entry>        queue_;
+    bool                     stop_ = false;
+
+    void loop();
+};
+
+// =====================================================================
+//  lroff.parallel_map
+// =====================================================================
+
+/// What a map worker starts from: a pure worker's setup and then the
+/// rest of what the document's own state ran — its -e chunks and
+/// preambles — so that the functions they define can be called.
+struct MapSetup : WorkerSetup {
+    std::vector<std::string> exec_chunks;
+    std::vector<std::string> preamble_files;
+    std::string              shell_cache;   // for lroff.shell
+};
+
+struct MapResult {
+    std::vector<LuaValue> values;       // in the order of the items
+    std::size_t           failed = 0;   // the first item that failed
+    std::string           error;        //   (from 1), and why
+
+    // With WorkerSetup::track_inputs: what the workers have read.
+    std::set<std::string> files;
+    std::set<std::string> env;
+    std::string           uncacheable;
+};
+
+// =====================================================================
+//  MapPool
+//
+//  A fixed set of threads, each of which brings up its Lua state as
+//  soon as it starts and keeps it for every map.  A map deals its
+//  items out in equal ranges, one per thread, and each thread works
+//  through its own from the front.  One that runs out takes the back
+//  half of the largest range left, so items of uneven cost still
+//  keep every thread busy to the end.  The function is compiled
+//  once per thread and map, in a fresh _ENV.  With no threads, map()
+//  runs on the calling thread; it must not be called from two
+//  threads at once.
+// =====================================================================
+class MapPool {
+public:
+    MapPool(MapSetup setup, unsigned threads);
+    ~MapPool();
+
+    MapPool(const MapPool&) = delete;
+    MapPool& operator=(const MapPool&) = delete;
+
+    /// Call the function `fn` evaluates to with every item, and
+    /// `args` after it.
+    MapResult map(const std::string& fn, const std::vector<LuaValue>& items,
+                  const std::vector<LuaValue>& args);
+
+private:
+    struct Worker;
+    struct Range;
+    struct Task;
+
+    MapSetup                 setup_;
+    std::vector<std::thread> threads_;
+    std::unique_ptr<Worker>  inline_;   // with no threads
+
+    std::mutex               mutex_;
+    std::condition_variable  wake_;
+    std::condition_variable  done_;
+    Task*                    task_ = nullptr;
+    std::uint64_t            generation_ = 0;
+    unsigned                 busy_ = 0;
+    bool                     stop_ = false;
+
+    void loop(unsigned index);
+    static void work(Worker& worker, Task& task, unsigned index);
+};
+
+} // namespace pplua
+
+#endif // PPLUA_WORKERS_HPP
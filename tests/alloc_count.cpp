@@ -0,0 +1,146 @@
+// tests/alloc_count.cpp
+//
+// A line without Lua costs no heap allocation on its way through the
+// engine once its buffers have grown.  operator new is replaced by
+// one that counts; the lines of the examples outside Lua blocks are
+// run through a Preprocessor a few times over and ten times as many,
+// and the longer run may not allocate more.
+
+#include "pplua.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace {
+
+bool          counting = false;
+std::size_t   allocations = 0;
+
+// Output nobody reads.
+class NullBuf : public std::streambuf {
+protected:
+    int_type overflow(int_type c) override { return traits_type::not_eof(c); }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+// The lines of `path` that go straight through: all but Lua blocks
+// and lines with inline expressions.
+std::string plain_lines(const std::string& path)
+{
+    std::ifstream in(path);
+    std::string text, line;
+    bool block = false;
+    while (std::getline(in, line)) {
+        if (line.rfind(".endlua", 0) == 0) {
+            block = false;
+            continue;
+        }
+        if (line.rfind(".lua", 0) == 0) {
+            block = true;
+            continue;
+        }
+        if (block || line.find("\\lua") != std::string::npos)
+            continue;
+        text += line;
+        text += '\n';
+    }
+    return text;
+}
+
+std::string repeat(const std::string& text, std::size_t times)
+{
+    std::string doc;
+    for (std::size_t i = 0; i < times; ++i)
+        doc += text;
+    return doc;
+}
+
+// Allocations made by processing `doc`.
+std::size_t count(pplua::Preprocessor& pp, const std::string& doc,
+                  const std::string& name)
+{
+    std::istringstream in(doc);
+    allocations = 0;
+    counting = true;
+    pp.process(in, name);
+    counting = false;
+    return allocations;
+}
+
+} // namespace
+
+void* operator new(std::size_t n)
+{
+    if (counting)
+        ++allocations;
+    if (void* p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t n) { return ::operator new(n); }
+void  operator delete(void* p) noexcept { std::free(p); }
+void  operator delete[](void* p) noexcept { std::free(p); }
+void  operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void  operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        std::cerr << "usage: alloc_count EXAMPLES-DIR\n";
+        return 2;
+    }
+
+    std::vector<std::string> files;
+    for (auto& e : std::filesystem::directory_iterator(argv[1]))
+        if (e.path().extension() == ".lroff")
+            files.push_back(e.path().string());
+    std::sort(files.begin(), files.end());
+    if (files.empty()) {
+        std::cerr << "alloc_count: no examples in " << argv[1] << '\n';
+        return 2;
+    }
+
+    int rc = 0;
+    for (auto& f : files) {
+        std::string text = plain_lines(f);
+        std::size_t lines = static_cast<std::size_t>(
+            std::count(text.begin(), text.end(), '\n'));
+        if (lines == 0)
+            continue;
+
+        // Output is held between checkpoints, every 256 lines: even
+        // the shorter run must span several.
+        const std::size_t few  = (2048 + lines - 1) / lines;
+        const std::size_t many = 10 * few;
+
+        NullBuf null;
+        std::ostream out(&null);
+        pplua::Preprocessor pp;
+        pp.stream_to(&out);
+
+        // A first run of the longer document lets the buffers grow.
+        const std::string short_doc = repeat(text, few);
+        const std::string long_doc  = repeat(text, many);
+        count(pp, long_doc, f);
+        std::size_t a = count(pp, short_doc, f);
+        std::size_t b = count(pp, long_doc, f);
+        std::printf("%s: %zu lines: %zu allocations, %zu lines: %zu\n",
+                    f.c_str(), lines * few, a, lines * many, b);
+        if (b > a) {
+            std::printf("FAIL: %zu allocations for %zu more lines\n",
+                        b - a, lines * (many - few));
+            rc = 1;
+        }
+    }
+    return rc;
+}
@@ -0,0 +1,32 @@
+# --batch: what a document changes through a preamble's functions
+# and shared tables is gone by the next document, and an input that
+# cannot be opened leaves no output file.
+. "$(dirname "$0")/lib.sh"
+
+cat > pre.lua <<'LUA'
+shared = { n = 0 }
+function bump()
+    shared.n = shared.n + 1
+    shared[#shared + 1] = "x"
+    leaked = (leaked or 0) + 1
+    string.leaked = true
+end
+LUA
+
+cat > doc.lroff <<'LROFF'
+.lua
+bump()
+lroff.emitln(shared.n .. " " .. #shared .. " " .. leaked
+             .. " " .. tostring(string.leaked))
+.endlua
+LROFF
+cp doc.lroff doc2.lroff
+
+printf '%s\n' 'doc.lroff' 'missing.lroff' 'doc2.lroff' > manifest
+if "$PPLUA" -n -l pre.lua --batch manifest 2> err; then
+    fail "a missing input should fail the batch"
+fi
+expect_eq "$(cat doc)" "1 1 1 true" "first document"
+expect_eq "$(cat doc2)" "1 1 1 true" "second document"
+expect_grep "cannot open 'missing.lroff'" err "missing input"
+[[ ! -e missing ]] || fail "an output was written for a missing input"
@@ -0,0 +1,22 @@
+# --batch: a request defined with lroff.macro_define_lua runs in the
+# environment of the document that uses it, as it does in a run of
+# one document.
+. "$(dirname "$0")/lib.sh"
+
+for n in 1 2; do
+    cat > doc$n.lroff <<LROFF
+.lua
+WHO = "doc$n"
+lroff.macro_define_lua("HI", 'return "hi " .. tostring(WHO) .. " there"')
+.endlua
+.HI
+LROFF
+done
+
+"$PPLUA" -n doc1.lroff > single
+expect_eq "$(cat single)" "hi doc1 there" "single document"
+
+printf '%s\n' doc1.lroff doc2.lroff > manifest
+"$PPLUA" -n --batch manifest
+expect_eq "$(cat doc1)" "hi doc1 there" "first document"
+expect_eq "$(cat doc2)" "hi doc2 there" "second document"
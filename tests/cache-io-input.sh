@@ -0,0 +1,22 @@
+# io.input(path) is an input of the run: a changed file misses the
+# cache, and --depfile lists it.
+. "$(dirname "$0")/lib.sh"
+
+cat > doc.lroff <<'LROFF'
+.lua
+io.input("data.txt")
+lroff.emitln(io.read("l"))
+io.input(io.stdin)
+.endlua
+LROFF
+
+echo one > data.txt
+"$PPLUA" -n --cache-dir cache doc.lroff > out
+expect_eq "$(cat out)" one "first run"
+
+echo two > data.txt
+"$PPLUA" -n --cache-dir cache doc.lroff > out
+expect_eq "$(cat out)" two "after data.txt changed"
+
+"$PPLUA" -n --depfile doc.d -o doc.out doc.lroff
+expect_grep '^ data.txt' doc.d "depfile"
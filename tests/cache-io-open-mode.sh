@@ -0,0 +1,14 @@
+# Under --cache-dir io.open is wrapped; a mode that is not a string
+# is io.open's own bad argument, not an error in the wrapper.
+. "$(dirname "$0")/lib.sh"
+
+cat > doc.lroff <<'LROFF'
+.lua
+local ok, err = pcall(io.open, "data.txt", 1)
+lroff.emitln(tostring(err))
+.endlua
+LROFF
+
+echo one > data.txt
+"$PPLUA" -n --cache-dir cache doc.lroff > out
+expect_grep "bad argument #2 .*(invalid mode)" out "io.open error"
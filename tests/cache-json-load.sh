@@ -0,0 +1,20 @@
+# lroff.json.load(path) is an input of the run: a changed file misses
+# the cache, and --depfile lists it.
+. "$(dirname "$0")/lib.sh"
+
+cat > doc.lroff <<'LROFF'
+.lua
+lroff.emitln(lroff.json.load("data.json").name)
+.endlua
+LROFF
+
+echo '{"name": "one"}' > data.json
+"$PPLUA" -n --cache-dir cache doc.lroff > out
+expect_eq "$(cat out)" one "first run"
+
+echo '{"name": "two"}' > data.json
+"$PPLUA" -n --cache-dir cache doc.lroff > out
+expect_eq "$(cat out)" two "after data.json changed"
+
+"$PPLUA" -n --depfile doc.d -o doc.out doc.lroff
+expect_grep '^ data.json' doc.d "depfile"
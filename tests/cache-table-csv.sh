@@ -0,0 +1,20 @@
+# lroff.table_csv(path) is an input of the run: a changed file misses
+# the cache, and --depfile lists it.
+. "$(dirname "$0")/lib.sh"
+
+cat > doc.lroff <<'LROFF'
+.lua
+lroff.table_csv("data.csv")
+.endlua
+LROFF
+
+printf 'name,n\none,1\n' > data.csv
+"$PPLUA" -n --cache-dir cache doc.lroff > out
+expect_grep '^one' out "first run"
+
+printf 'name,n\ntwo,2\n' > data.csv
+"$PPLUA" -n --cache-dir cache doc.lroff > out
+expect_grep '^two' out "after data.csv changed"
+
+"$PPLUA" -n --depfile doc.d -o doc.out doc.lroff
+expect_grep '^ data.csv' doc.d "depfile"
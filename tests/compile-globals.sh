@@ -0,0 +1,23 @@
+# A compiled document may use any global name: one that sets T, X,
+# B and P renders under --run as it does when processed.
+. "$(dirname "$0")/lib.sh"
+
+cat > doc.lroff <<'LROFF'
+.lua
+T, X, B, P = 1, 2, 3, 4
+.endlua
+Text after the block.
+Sum \lua'T + X + B + P'.
+.lua
+lroff.emitln(tostring(T * X * B * P))
+.endlua
+.lua pure T
+return "pure " .. tostring(T)
+.endlua
+LROFF
+
+"$PPLUA" -n doc.lroff > expected
+"$PPLUA" --compile doc.lroff -o doc.luac
+"$PPLUA" -n --run doc.luac > out 2> err
+expect_same out expected "compiled output"
+[[ ! -s err ]] || fail "compiled run: $(cat err)"
@@ -0,0 +1,18 @@
+# What lroff.shell declares inside a parallel_map function is an input
+# of the run, as it is in a block: --depfile lists it.
+. "$(dirname "$0")/lib.sh"
+
+cat > doc.lroff <<'LROFF'
+.lua
+local out = lroff.parallel_map({ "dep1.txt", "dep2.txt" },
+    "function(f) return (lroff.shell('cat ' .. f, { deps = f })) end")
+lroff.emit(table.concat(out))
+.endlua
+LROFF
+
+echo one > dep1.txt
+echo two > dep2.txt
+"$PPLUA" -n --pure-jobs 2 --depfile doc.d -o doc.out doc.lroff
+expect_eq "$(cat doc.out)" "$(printf 'one\ntwo')" "output"
+expect_grep '^ dep1.txt' doc.d "depfile"
+expect_grep '^ dep2.txt' doc.d "depfile"
@@ -0,0 +1,36 @@
+# A grammar rule with lookbehind: matched in a PCRE2 build
+# (PPLUA_TEST_PCRE2 set), otherwise reported as the grammar is loaded,
+# before any highlighting, and skipped.
+. "$(dirname "$0")/lib.sh"
+
+cat > t.sublime-syntax <<'YAML'
+%YAML 1.2
+---
+name: T
+file_extensions: [t]
+scope: source.t
+contexts:
+  main:
+    - match: '(?<=x)y'
+      scope: keyword.t
+    - match: 'z'
+      scope: keyword.t
+YAML
+
+cat > doc.lroff <<'LROFF'
+.lua
+lroff.syntax("t.sublime-syntax")
+.endlua
+.lua
+lroff.highlight("xy z\n", "t")
+.endlua
+LROFF
+
+"$PPLUA" -n doc.lroff > out 2> err
+if [[ -n "${PPLUA_TEST_PCRE2:-}" ]]; then
+    expect_eq "$(cat out)" 'x\f[B]y\f[P] \f[B]z\f[P]' "highlighted"
+    [[ ! -s err ]] || fail "PCRE2 build: $(cat err)"
+else
+    expect_eq "$(cat out)" 'xy \f[B]z\f[P]' "highlighted"
+    expect_grep "cannot use pattern '(?<=x)y' (lookbehind" err "warning"
+fi
@@ -0,0 +1,29 @@
+# lroff.highlight with the contrib grammar: requests, escapes,
+# numbers and strings come out with the fonts and colours of the
+# default theme, whichever matcher runs their patterns.
+. "$(dirname "$0")/lib.sh"
+
+cat > listing.txt <<'LISTING'
+.TH PPLUA 1 "2024-01-01"
+.nr idx +1.5i \" a comment
+Some \fBbold\fP text, \*[str], \n+[reg] and \s-2small\s+2.
+.ds title \f(CWcode\fP \(em done
+Inline \lua'lroff.nr_get("x")' here.
+LISTING
+
+cat > doc.lroff <<LROFF
+.lua
+lroff.syntax("$TESTS/../contrib/lroff.sublime-syntax")
+lroff.highlight(io.open("listing.txt"):read("a"), "lroff")
+.endlua
+LROFF
+
+"$PPLUA" -n doc.lroff > out
+cat > expected <<'EXPECTED'
+\f[B]\m[blue].TH\m[]\f[P] PPLUA \m[magenta]1\m[] \m[red]"2024-01-01"\m[]
+\f[B]\m[blue].nr\m[]\f[P] idx \m[magenta]+1.5i\m[] \f[I]\e" a comment\f[P]
+Some \f[B]\m[blue]\efB\m[]\f[P]bold\f[B]\m[blue]\efP\m[]\f[P] text, \m[magenta]\e*[str]\m[], \m[magenta]\en+[reg]\m[] and \m[magenta]\es-2\m[]small\m[magenta]\es+2\m[].
+\f[B]\m[blue].ds\m[]\f[P] title \f[B]\m[blue]\ef(CW\m[]\f[P]code\f[B]\m[blue]\efP\m[]\f[P] \m[magenta]\e(em\m[] done
+Inline \m[magenta]\el\m[]ua'lroff.nr_get("x")' here.
+EXPECTED
+expect_same out expected "highlighted listing"
@@ -0,0 +1,37 @@
+# tests/lib.sh — sourced by every test script.
+#
+# A test runs as `bash tests/NAME.sh PPLUA`, in a scratch directory
+# of its own that is removed afterwards, and fails with a message
+# and a non-zero status.
+
+set -euo pipefail
+
+PPLUA="$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"
+TESTS="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+WORK="$(mktemp -d)"
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK"
+
+# Nothing from the user's environment.
+unset PPLUA_PATH PPLUA_INIT
+export PPLUA_SHELL_CACHE="$WORK/shell-cache"
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# expect_eq ACTUAL EXPECTED WHAT
+expect_eq() {
+    [[ "$1" == "$2" ]] || fail "$3: expected '$2', got '$1'"
+}
+
+# expect_same FILE FILE WHAT
+expect_same() {
+    diff -u "$1" "$2" >&2 || fail "$3: $1 and $2 differ"
+}
+
+# expect_grep PATTERN FILE WHAT
+expect_grep() {
+    grep -q -- "$1" "$2" || fail "$3: no '$1' in $2"
+}
@@ -0,0 +1,15 @@
+# -O: a .br that ends a conditional continued over two lines does not
+# stand for an unconditional .br after it.
+. "$(dirname "$0")/lib.sh"
+
+cat > doc.lroff <<'LROFF'
+text
+.if n \
+.br
+.br
+.br
+LROFF
+
+"$PPLUA" -n -O doc.lroff > out
+printf '%s\n' text '.if n \' .br .br > expected
+expect_same out expected "optimized output"
@@ -0,0 +1,10 @@
+# --pipe: a pipeline none of whose stages can be run is reported,
+# and the run fails instead of writing into nothing.
+. "$(dirname "$0")/lib.sh"
+
+echo text > doc.lroff
+if "$PPLUA" -n --pipe "pplua-no-such-stage" doc.lroff > out 2> err; then
+    fail "a pipeline that cannot start should fail the run"
+fi
+expect_grep "cannot start the pipeline" err "report"
+expect_grep "cannot run 'pplua-no-such-stage'" err "stage report"
@@ -0,0 +1,29 @@
+# A preamble may put its own metatable on _G: the libraries opened on
+# first use (io, os, ...) still appear, and are complete.
+. "$(dirname "$0")/lib.sh"
+
+cat > strict.lua <<'LUA'
+setmetatable(_G, {
+    __index = function(_, name)
+        error("undeclared global '" .. tostring(name) .. "'", 2)
+    end,
+})
+LUA
+
+cat > doc.lroff <<'LROFF'
+.lua
+local n = 0
+for _ in pairs(os) do n = n + 1 end
+lroff.emitln(type(os.time()) .. " " .. tostring(n > 5) .. " "
+             .. tostring(io.write == require("io").write))
+.endlua
+LROFF
+
+"$PPLUA" -n -l strict.lua doc.lroff > out
+expect_eq "$(cat out)" "number true true" "libraries under strict mode"
+
+echo '.lua' > bad.lroff
+echo 'lroff.emitln(undeclared)' >> bad.lroff
+echo '.endlua' >> bad.lroff
+"$PPLUA" -n -l strict.lua bad.lroff > /dev/null 2> err || true
+expect_grep "undeclared global 'undeclared'" err "strict mode"
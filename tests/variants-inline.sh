@@ -0,0 +1,21 @@
+# Under --variants inline expressions load from the shared cache of
+# compiled chunks: each variant still sees its own globals, and an
+# expression that does not compile is reported in every variant.
+. "$(dirname "$0")/lib.sh"
+
+cat > doc.lroff <<'LROFF'
+.lua
+COUNT = (COUNT or 0) + 1
+.endlua
+Hello \lua'LANG', \lua'COUNT'.
+Broken \lua'1 +'.
+LROFF
+
+printf 'fr LANG=fr\nde LANG=de\nja LANG=ja\n' > langs.txt
+"$PPLUA" -n --variants langs.txt -o out doc.lroff 2> err
+
+for v in fr de ja; do
+    "$PPLUA" -n -D LANG=$v doc.lroff > $v.expected 2> /dev/null
+    expect_same out/$v $v.expected "variant $v"
+done
+expect_eq "$(grep -c 'inline lua error' err)" 3 "errors reported"
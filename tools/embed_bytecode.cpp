@@ -0,0 +1,73 @@
+// tools/embed_bytecode.cpp
+//
+// Build-time helper: compile a Lua source file with the same Lua
+// that pplua links against and write its bytecode out as a C++
+// array, so that pplua can load the lroff prelude at start-up
+// without parsing it.
+//
+// Usage: embed_bytecode INPUT.lua OUTPUT.hpp SYMBOL
+
+#include <lua.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+static int collect(lua_State*, const void* p, size_t sz, void* ud) {
+    static_cast<std::string*>(ud)->append(static_cast<const char*>(p), sz);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc != 4) {
+        std::cerr << "usage: " << argv[0]
+                  << " INPUT.lua OUTPUT.hpp SYMBOL\n";
+        return 1;
+    }
+    const std::string symbol = argv[3];
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in.is_open()) {
+        std::cerr << argv[0] << ": cannot open '" << argv[1] << "'\n";
+        return 1;
+    }
+    std::ostringstream src;
+    src << in.rdbuf();
+    const std::string text = src.str();
+
+    lua_State* L = luaL_newstate();
+    if (luaL_loadbuffer(L, text.data(), text.size(), "=lroff-prelude")) {
+        std::cerr << argv[0] << ": " << lua_tostring(L, -1) << '\n';
+        lua_close(L);
+        return 1;
+    }
+
+    // Keep debug information: errors raised inside the prelude
+    // should still carry line numbers.
+    std::string bc;
+    lua_dump(L, collect, &bc, 0);
+    lua_close(L);
+
+    std::ofstream out(argv[2], std::ios::binary | std::ios::trunc);
+    out << "// Generated by embed_bytecode from " << argv[1]
+        << " -- do not edit.\n"
+        << "#pragma once\n\n"
+        << "static const unsigned char " << symbol << "[] = {";
+    for (std::size_t i = 0; i < bc.size(); ++i) {
+        if (i % 12 == 0) out << "\n   ";
+        char hex[8];
+        std::snprintf(hex, sizeof hex, " 0x%02x,",
+                      static_cast<unsigned char>(bc[i]));
+        out << hex;
+    }
+    out << "\n};\n";
+
+    if (!out.good()) {
+        std::cerr << argv[0] << ": cannot write '" << argv[2] << "'\n";
+        return 1;
+    }
+    return 0;
+}